@@ -0,0 +1,235 @@
+// 解析経路の各段のマイクロベンチマーク。コーパスの各ファイルに対して
+// 1段ずつ呼び出し、処理時間・スループット・割り当て回数を出す
+
+#include "analyzer.hpp"
+#include "bench_common.hpp"
+#include "comment_extractor.hpp"
+#include "corpus.hpp"
+#include "grammar_checker.hpp"
+#include "incremental_analyzer.hpp"
+#include "lsp.hpp"
+#include "text_processor.hpp"
+#include "utf16.hpp"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+namespace {
+
+const CorpusFile *findFile(const std::vector<CorpusFile> &corpus,
+                           const char *uri) {
+  for (const auto &file : corpus) {
+    if (file.uri == uri) {
+      return &file;
+    }
+  }
+  return nullptr;
+}
+
+std::string label(const char *stage, const CorpusFile &file) {
+  const size_t slash = file.uri.rfind('/');
+  return std::string(stage) + " " + file.uri.substr(slash + 1);
+}
+
+void runTextStages(const std::vector<CorpusFile> &corpus, int iterations) {
+  for (const auto &file : corpus) {
+    report(label("sanitizeUTF8", file).c_str(),
+           measure(iterations,
+                   [&] {
+                     return MoZuku::text::TextProcessor::sanitizeUTF8(
+                                file.text)
+                         .size();
+                   }),
+           iterations);
+  }
+
+  // 不正なバイト列を含むと修復経路を通る
+  const CorpusFile &prose = corpus.front();
+  std::string broken = prose.text;
+  for (size_t pos = 1000; pos < broken.size(); pos += 4096) {
+    broken[pos] = static_cast<char>(0xFF);
+  }
+  report("sanitizeUTF8 prose (invalid bytes)",
+         measure(iterations,
+                 [&] {
+                   return MoZuku::text::TextProcessor::sanitizeUTF8(broken)
+                       .size();
+                 }),
+         iterations);
+
+  for (const auto &file : corpus) {
+    if (file.languageId != "japanese") {
+      continue;
+    }
+    report(label("splitIntoSentences", file).c_str(),
+           measure(iterations,
+                   [&] {
+                     MoZuku::text::TextProcessor::splitIntoSentences(
+                         file.text);
+                     return file.text.size();
+                   }),
+           iterations);
+  }
+
+  // 文書全体に散らばった位置を昇順に変換する
+  const std::vector<size_t> lineStarts = computeLineStarts(prose.text);
+  std::vector<size_t> offsets;
+  Random random(7);
+  for (int i = 0; i < 20000; ++i) {
+    size_t offset = random.below(prose.text.size());
+    // 文字の途中を指さないよう先頭バイトまで戻す
+    while (offset > 0 &&
+           (static_cast<unsigned char>(prose.text[offset]) & 0xC0) == 0x80) {
+      --offset;
+    }
+    offsets.push_back(offset);
+  }
+  report("byteOffsetToPosition x20000",
+         measure(iterations,
+                 [&] {
+                   size_t sum = 0;
+                   for (size_t offset : offsets) {
+                     sum += static_cast<size_t>(
+                         byteOffsetToPosition(prose.text, lineStarts, offset)
+                             .character);
+                   }
+                   return sum > 0 ? prose.text.size() : 0;
+                 }),
+         iterations);
+}
+
+void runSyntaxStages(const std::vector<CorpusFile> &corpus, int iterations,
+                     double minJapaneseRatio) {
+  for (const auto &file : corpus) {
+    if (!MoZuku::comments::isLanguageSupported(file.languageId)) {
+      continue;
+    }
+    report(label("extractComments", file).c_str(),
+           measure(iterations,
+                   [&] {
+                     MoZuku::comments::extractComments(file.languageId,
+                                                       file.text);
+                     return file.text.size();
+                   }),
+           iterations);
+  }
+
+  for (const auto &file : corpus) {
+    if (file.languageId == "japanese") {
+      continue;
+    }
+    report(label("prepareAnalysisText", file).c_str(),
+           measure(iterations,
+                   [&] {
+                     return LSPServer::prepareAnalysisText(
+                                file.languageId, file.text, nullptr,
+                                minJapaneseRatio)
+                         .text.size();
+                   }),
+           iterations);
+  }
+}
+
+// 全文の解析し直し (didSave など) と、表示範囲の暫定結果から全文への
+// 引き継ぎが、最初の解析と同じ数の文とトークンになることを確かめる
+void checkFullReanalysis(MoZuku::Analyzer &analyzer,
+                         const std::vector<CorpusFile> &corpus,
+                         const MoZukuConfig &config) {
+  for (const char *uri :
+       {"file:///corpus/prose.ja.txt", "file:///corpus/manual.ja.md"}) {
+    const CorpusFile *file = findFile(corpus, uri);
+    if (!file) {
+      continue;
+    }
+    MoZuku::incremental::IncrementalAnalyzer initial;
+    initial.update(analyzer, file->text, &config);
+    const size_t sentences = initial.sentences().size();
+    const size_t tokens = initial.tokenCount();
+
+    MoZuku::incremental::IncrementalAnalyzer saved;
+    saved.update(analyzer, file->text, &config);
+    MoZuku::incremental::PendingUpdate update;
+    saved.prepare(analyzer, file->text, nullptr, &config, true, nullptr,
+                  update);
+    saved.commit(std::move(update), &config);
+
+    // 先頭の 1/8 だけを暫定で解析してから全文を解析する
+    MoZuku::incremental::IncrementalAnalyzer handoff;
+    const std::vector<ByteRange> viewport{{0, file->text.size() / 8}};
+    handoff.prepare(analyzer, file->text, &viewport, &config, true, nullptr,
+                    update);
+    update.partial = true;
+    handoff.commit(std::move(update), &config);
+    handoff.prepare(analyzer, file->text, nullptr, &config, true, nullptr,
+                    update);
+    handoff.commit(std::move(update), &config);
+
+    const bool ok = saved.sentences().size() == sentences &&
+                    saved.tokenCount() == tokens &&
+                    handoff.sentences().size() == sentences &&
+                    handoff.tokenCount() == tokens && handoff.complete();
+    std::printf("%-40s %s (%zu sentences, %zu tokens)\n",
+                label("full reanalysis", *file).c_str(),
+                ok ? "ok" : "MISMATCH", sentences, tokens);
+  }
+}
+
+void runAnalyzerStages(const std::vector<CorpusFile> &corpus, int iterations,
+                       const MoZukuConfig &config) {
+  MoZuku::Analyzer analyzer;
+  if (!analyzer.initialize(config)) {
+    std::printf("MeCab を初期化できないため形態素解析の計測を省略します\n");
+    return;
+  }
+
+  for (const char *uri :
+       {"file:///corpus/prose.ja.txt", "file:///corpus/manual.ja.md"}) {
+    const CorpusFile *file = findFile(corpus, uri);
+    if (!file) {
+      continue;
+    }
+    report(label("Analyzer::analyze", *file).c_str(),
+           measure(iterations,
+                   [&] {
+                     analyzer.analyze(file->text);
+                     return file->text.size();
+                   }),
+           iterations);
+
+    // 規則の評価だけを測るため、形態素解析は1度だけ行う
+    const AnalysisResult result = analyzer.analyze(file->text);
+    report(label("GrammarChecker::checkGrammar", *file).c_str(),
+           measure(iterations,
+                   [&] {
+                     std::vector<Diagnostic> diagnostics;
+                     MoZuku::grammar::GrammarChecker::checkGrammar(
+                         result, diagnostics, &config);
+                     return file->text.size();
+                   }),
+           iterations);
+  }
+
+  checkFullReanalysis(analyzer, corpus, config);
+}
+
+} // namespace
+
+void runAnalysisBench(size_t scale) {
+  const std::vector<CorpusFile> corpus = makeCorpus(scale);
+  size_t totalBytes = 0;
+  for (const auto &file : corpus) {
+    totalBytes += file.text.size();
+  }
+  std::printf("analysis: %zu files, %zu bytes\n", corpus.size(), totalBytes);
+
+  MoZukuConfig config;
+  const int iterations = 5;
+  runTextStages(corpus, iterations);
+  runSyntaxStages(corpus, iterations, config.analysis.minJapaneseRatio);
+  runAnalyzerStages(corpus, iterations, config);
+}
+
+} // namespace bench
@@ -0,0 +1,83 @@
+#include "bench_common.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+std::atomic<size_t> gAllocations{0};
+thread_local bool tUncounted = false;
+
+} // namespace
+
+// 割り当て回数を数えるため、全体の operator new を置き換える
+void *operator new(std::size_t size) {
+  if (!tUncounted) {
+    gAllocations.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (void *ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+// GCC は置き換えた new/delete の組を malloc/free と見なして誤検知する
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace bench {
+
+size_t allocationCount() { return gAllocations.load(); }
+
+UncountedScope::UncountedScope() : previous_(tUncounted) { tUncounted = true; }
+
+UncountedScope::~UncountedScope() { tUncounted = previous_; }
+
+long peakRssKiB() {
+#if defined(_WIN32)
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#if defined(__APPLE__)
+  return usage.ru_maxrss / 1024; // macOS はバイト単位
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+void report(const char *name, const Sample &sample, int iterations) {
+  std::printf("%-40s %9.3f ms/iter %9.1f MB/s %10.1f allocs/iter\n", name,
+              sample.seconds * 1000.0 / iterations,
+              sample.bytes / sample.seconds / (1024.0 * 1024.0),
+              static_cast<double>(sample.allocations) / iterations);
+}
+
+double percentile(std::vector<double> values, double p) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  const size_t rank = std::min(
+      values.size() - 1, static_cast<size_t>(p * (values.size() - 1) + 0.5));
+  std::nth_element(values.begin(), values.begin() + rank, values.end());
+  return values[rank];
+}
+
+} // namespace bench
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+// 置き換えた operator new が数えた割り当て回数 (除外中のスレッドの分を除く)
+size_t allocationCount();
+
+// 生存中はこのスレッドの割り当てを数えない (計測用の処理に使う)
+class UncountedScope {
+public:
+  UncountedScope();
+  ~UncountedScope();
+
+  UncountedScope(const UncountedScope &) = delete;
+  UncountedScope &operator=(const UncountedScope &) = delete;
+
+private:
+  bool previous_;
+};
+
+// プロセスの最大常駐メモリ (KiB)。取れない環境では 0
+long peakRssKiB();
+
+struct Sample {
+  double seconds;
+  size_t allocations;
+  size_t bytes;
+};
+
+// fn は1回ぶんの処理で、扱ったバイト数を返す
+template <typename Fn> Sample measure(int iterations, Fn &&fn) {
+  const size_t allocationsBefore = allocationCount();
+  const auto start = std::chrono::steady_clock::now();
+  size_t bytes = 0;
+  for (int i = 0; i < iterations; ++i) {
+    bytes += fn();
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return {std::chrono::duration<double>(end - start).count(),
+          allocationCount() - allocationsBefore, bytes};
+}
+
+void report(const char *name, const Sample &sample, int iterations);
+
+// values の p 分位点 (0 <= p <= 1)。空なら 0
+double percentile(std::vector<double> values, double p);
+
+// 各ベンチマーク。scale はコーパスや入力の大きさの倍率
+void runJsonRpcBench(size_t scale);
+void runAnalysisBench(size_t scale);
+// sessionPath が空でなければ、記録済みのセッション (1行1メッセージ) を流す
+void runReplayBench(size_t scale, const std::string &sessionPath);
+
+} // namespace bench
@@ -0,0 +1,36 @@
+// mozuku-bench [json|analysis|replay|all] [scale] [session.jsonl]
+
+#include "bench_common.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+int main(int argc, char **argv) {
+  const std::string suite = argc > 1 ? argv[1] : "all";
+  const size_t scale =
+      argc > 2 ? std::strtoul(argv[2], nullptr, 10) : static_cast<size_t>(1);
+  const std::string sessionPath = argc > 3 ? argv[3] : "";
+
+  if (scale == 0 || (suite != "json" && suite != "analysis" &&
+                     suite != "replay" && suite != "all")) {
+    std::fprintf(stderr,
+                 "usage: %s [json|analysis|replay|all] [scale] "
+                 "[session.jsonl]\n",
+                 argv[0]);
+    return 2;
+  }
+
+  if (suite == "json" || suite == "all") {
+    bench::runJsonRpcBench(scale);
+  }
+  if (suite == "analysis" || suite == "all") {
+    bench::runAnalysisBench(scale);
+  }
+  if (suite == "replay" || suite == "all") {
+    bench::runReplayBench(scale, sessionPath);
+  }
+
+  std::printf("peak RSS: %ld KiB\n", bench::peakRssKiB());
+  return 0;
+}
@@ -0,0 +1,230 @@
+#include "corpus.hpp"
+
+#include <string>
+
+namespace bench {
+
+namespace {
+
+template <size_t N>
+const char *pick(Random &random, const char *const (&words)[N]) {
+  return words[random.below(N)];
+}
+
+const char *const kSubjects[] = {"私", "彼", "彼女", "学生", "先生", "会社",
+                                 "この機能", "利用者", "開発者", "東京"};
+const char *const kObjects[] = {"本", "資料", "コード", "設定", "文書",
+                                "結果", "問題", "手順", "画面", "辞書"};
+const char *const kVerbs[] = {"読む", "書いた", "確認する", "修正した",
+                              "公開する", "見れる", "来れる", "食べれる",
+                              "整理した", "説明する"};
+const char *const kAdverbs[] = {"すぐに", "かなり", "少し", "必ず",
+                                "もう一度", "ゆっくり", "きちんと"};
+const char *const kConjunctions[] = {"しかし", "また", "そして", "ただし",
+                                     "つまり"};
+const char *const kEndings[] = {"。", "。", "。", "！", "？"};
+
+// コード側の識別子など (日本語を含まない)
+const char *const kIdentifiers[] = {"buffer", "index", "result", "config",
+                                    "value", "count", "offset", "token"};
+
+void appendParagraphs(Random &random, size_t sentences, size_t perParagraph,
+                      std::string &out) {
+  for (size_t i = 0; i < sentences; ++i) {
+    out += makeSentence(random);
+    if ((i + 1) % perParagraph == 0) {
+      out += "\n\n";
+    }
+  }
+  out += '\n';
+}
+
+std::string makeProse(Random &random, size_t scale) {
+  std::string text;
+  appendParagraphs(random, 1500 * scale, 5, text);
+  return text;
+}
+
+std::string makeMarkdown(Random &random, size_t scale) {
+  std::string text;
+  for (size_t block = 0; block < 400 * scale; ++block) {
+    switch (block % 5) {
+    case 0:
+      text += "## ";
+      text += pick(random, kObjects);
+      text += "の";
+      text += pick(random, kObjects);
+      text += "\n\n";
+      break;
+    case 1:
+      for (int item = 0; item < 3; ++item) {
+        text += "- ";
+        text += makeSentence(random);
+        text += '\n';
+      }
+      text += '\n';
+      break;
+    case 2:
+      text += "```cpp\nauto ";
+      text += pick(random, kIdentifiers);
+      text += " = load(\"path/to/file\");\n```\n\n";
+      break;
+    case 3:
+      text += "| 項目 | 説明 |\n|---|---|\n| ";
+      text += pick(random, kObjects);
+      text += " | ";
+      text += makeSentence(random);
+      text += " |\n\n";
+      break;
+    default:
+      appendParagraphs(random, 3, 3, text);
+      text += "[詳細](https://example.com/docs) を参照してください。\n\n";
+      break;
+    }
+  }
+  return text;
+}
+
+std::string makeCpp(Random &random, size_t scale) {
+  std::string text = "#include <string>\n#include <vector>\n\n";
+  for (size_t fn = 0; fn < 300 * scale; ++fn) {
+    const char *name = pick(random, kIdentifiers);
+    text += "/*\n * ";
+    text += makeSentence(random);
+    text += "\n * ";
+    text += makeSentence(random);
+    text += "\n */\nint ";
+    text += name;
+    text += std::to_string(fn);
+    text += "(std::vector<int> &values) {\n  // ";
+    text += makeSentence(random);
+    text += "\n  int total = 0;\n  for (int v : values) {\n    total += v; // ";
+    text += pick(random, kAdverbs);
+    text += "足す\n  }\n  const char *label = \"";
+    text += pick(random, kObjects);
+    text += "\";\n  return total;\n}\n\n";
+  }
+  return text;
+}
+
+std::string makeTypeScript(Random &random, size_t scale) {
+  std::string text = "import { readFile } from 'fs/promises';\n\n";
+  for (size_t fn = 0; fn < 300 * scale; ++fn) {
+    text += "/**\n * ";
+    text += makeSentence(random);
+    text += "\n * @param ";
+    text += pick(random, kIdentifiers);
+    text += " ";
+    text += makeSentence(random);
+    text += "\n */\nexport async function load";
+    text += std::to_string(fn);
+    text += "(path: string): Promise<string> {\n  // ";
+    text += makeSentence(random);
+    text += "\n  const text = await readFile(path, 'utf8');\n"
+            "  return text.trim(); // ";
+    text += pick(random, kAdverbs);
+    text += "整える\n}\n\n";
+  }
+  return text;
+}
+
+std::string makeHtml(Random &random, size_t scale) {
+  std::string text = "<!DOCTYPE html>\n<html lang=\"ja\">\n<head>\n"
+                     "<meta charset=\"utf-8\">\n<title>資料</title>\n"
+                     "</head>\n<body>\n";
+  for (size_t section = 0; section < 300 * scale; ++section) {
+    text += "<!-- ";
+    text += makeSentence(random);
+    text += " -->\n<section class=\"";
+    text += pick(random, kIdentifiers);
+    text += "\">\n  <h2>";
+    text += pick(random, kObjects);
+    text += "</h2>\n  <p>";
+    text += makeSentence(random);
+    text += makeSentence(random);
+    text += "</p>\n  <ul><li>";
+    text += makeSentence(random);
+    text += "</li><li><a href=\"/docs\">";
+    text += pick(random, kObjects);
+    text += "</a></li></ul>\n</section>\n";
+  }
+  text += "</body>\n</html>\n";
+  return text;
+}
+
+std::string makeLatex(Random &random, size_t scale) {
+  std::string text = "\\documentclass{jarticle}\n\\begin{document}\n";
+  for (size_t section = 0; section < 300 * scale; ++section) {
+    text += "\\section{";
+    text += pick(random, kObjects);
+    text += "}\n% ";
+    text += makeSentence(random);
+    text += '\n';
+    text += makeSentence(random);
+    text += "式 $x_";
+    text += std::to_string(section % 10);
+    text += " = \\frac{a}{b}$ を用いる。";
+    text += makeSentence(random);
+    text += "\n\\begin{equation}\n  E = mc^2\n\\end{equation}\n";
+    text += makeSentence(random);
+    text += "\\cite{ref";
+    text += std::to_string(section);
+    text += "}\n\n";
+  }
+  text += "\\end{document}\n";
+  return text;
+}
+
+} // namespace
+
+uint64_t Random::next() {
+  // splitmix64
+  uint64_t z = (state_ += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+std::string makeSentence(Random &random) {
+  std::string sentence;
+  if (random.below(4) == 0) {
+    sentence += pick(random, kConjunctions);
+    sentence += "、";
+  }
+  sentence += pick(random, kSubjects);
+  sentence += random.below(2) ? "は" : "が";
+  // 読点の多用と逆接の「が」の重複をときどき混ぜる
+  const size_t clauses = random.below(5) == 0 ? 4 : 1 + random.below(2);
+  for (size_t i = 0; i < clauses; ++i) {
+    sentence += pick(random, kAdverbs);
+    sentence += pick(random, kObjects);
+    sentence += random.below(8) == 0 ? "をを" : "を";
+    sentence += pick(random, kVerbs);
+    if (i + 1 < clauses) {
+      sentence += random.below(3) == 0 ? "が、" : "し、";
+    }
+  }
+  sentence += pick(random, kEndings);
+  return sentence;
+}
+
+std::vector<CorpusFile> makeCorpus(size_t scale) {
+  Random random(20240601);
+  std::vector<CorpusFile> corpus;
+  // .ja.txt / .ja.md は拡張機能が japanese として開く
+  corpus.push_back(
+      {"file:///corpus/prose.ja.txt", "japanese", makeProse(random, scale)});
+  corpus.push_back({"file:///corpus/manual.ja.md", "japanese",
+                    makeMarkdown(random, scale)});
+  corpus.push_back(
+      {"file:///corpus/sample.cpp", "cpp", makeCpp(random, scale)});
+  corpus.push_back({"file:///corpus/sample.ts", "typescript",
+                    makeTypeScript(random, scale)});
+  corpus.push_back(
+      {"file:///corpus/page.html", "html", makeHtml(random, scale)});
+  corpus.push_back(
+      {"file:///corpus/paper.tex", "latex", makeLatex(random, scale)});
+  return corpus;
+}
+
+} // namespace bench
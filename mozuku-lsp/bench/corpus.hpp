@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+struct CorpusFile {
+  std::string uri;
+  std::string languageId;
+  std::string text;
+};
+
+// 固定の種から生成するので、同じ scale なら環境によらず同じ内容になる。
+// 日本語の文章、長い Markdown、日本語コメント付きの C++/TypeScript/HTML/LaTeX
+std::vector<CorpusFile> makeCorpus(size_t scale);
+
+// 標準ライブラリの分布クラスは実装ごとに結果が違うので使わない
+class Random {
+public:
+  explicit Random(uint64_t seed) : state_(seed) {}
+
+  uint64_t next();
+  size_t below(size_t bound) { return static_cast<size_t>(next() % bound); }
+
+private:
+  uint64_t state_;
+};
+
+// 規則違反 (ら抜き、助詞の連続、読点の多用など) を一定の割合で含む日本語の文
+std::string makeSentence(Random &random);
+
+} // namespace bench
@@ -0,0 +1,183 @@
+// JSON-RPC の入出力経路のベンチマーク。
+// nlohmann::json の DOM を組み立てて dump する従来の経路と、
+// JsonWriter / Transport による経路の処理時間と割り当て回数を比べる
+
+#include "bench_common.hpp"
+#include "json_rpc.hpp"
+
+#include <cstdio>
+#include <nlohmann/json.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Token {
+  int line;
+  int startChar;
+  int endChar;
+  const char *type;
+  unsigned modifiers;
+};
+
+std::vector<Token> makeTokens(size_t count) {
+  static const char *const kTypes[] = {"noun", "verb", "particle", "aux"};
+  std::vector<Token> tokens;
+  tokens.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    const int line = static_cast<int>(i / 20);
+    const int column = static_cast<int>(i % 20) * 2;
+    tokens.push_back({line, column, column + 2, kTypes[i % 4],
+                      static_cast<unsigned>(i % 3)});
+  }
+  return tokens;
+}
+
+std::string encodeWithDom(const std::vector<Token> &tokens) {
+  nlohmann::json entries = nlohmann::json::array();
+  for (const auto &token : tokens) {
+    entries.push_back(
+        {{"range",
+          {{"start", {{"line", token.line}, {"character", token.startChar}}},
+           {"end", {{"line", token.line}, {"character", token.endChar}}}}},
+         {"type", token.type},
+         {"modifiers", token.modifiers}});
+  }
+  nlohmann::json msg = {
+      {"jsonrpc", "2.0"},
+      {"method", "mozuku/semanticHighlights"},
+      {"params", {{"uri", "file:///a.cpp"}, {"tokens", entries}}}};
+  return msg.dump();
+}
+
+void encodeWithWriter(const std::vector<Token> &tokens, std::string &body) {
+  body.clear();
+  MoZuku::rpc::JsonWriter writer(body);
+  auto position = [&](int line, int character) {
+    writer.beginObject();
+    writer.key("character");
+    writer.value(character);
+    writer.key("line");
+    writer.value(line);
+    writer.endObject();
+  };
+  writer.beginObject();
+  writer.key("jsonrpc");
+  writer.value("2.0");
+  writer.key("method");
+  writer.value("mozuku/semanticHighlights");
+  writer.key("params");
+  writer.beginObject();
+  writer.key("tokens");
+  writer.beginArray();
+  for (const auto &token : tokens) {
+    writer.beginObject();
+    writer.key("modifiers");
+    writer.value(token.modifiers);
+    writer.key("range");
+    writer.beginObject();
+    writer.key("end");
+    position(token.line, token.endChar);
+    writer.key("start");
+    position(token.line, token.startChar);
+    writer.endObject();
+    writer.key("type");
+    writer.value(token.type);
+    writer.endObject();
+  }
+  writer.endArray();
+  writer.key("uri");
+  writer.value("file:///a.cpp");
+  writer.endObject();
+  writer.endObject();
+}
+
+// 以前の LSPServer::readMessage と同じ読み方
+bool readWithGetline(std::istream &in, std::string &payload) {
+  std::string line;
+  size_t contentLength = 0;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.rfind("Content-Length:", 0) == 0) {
+      contentLength = static_cast<size_t>(std::stoul(line.substr(15)));
+    }
+    if (line.empty())
+      break;
+  }
+  if (!contentLength || !in.good())
+    return false;
+  payload.resize(contentLength);
+  in.read(&payload[0], static_cast<std::streamsize>(contentLength));
+  return in.gcount() == static_cast<std::streamsize>(contentLength);
+}
+
+std::string makeStream(size_t messages) {
+  std::string text(2000, 'x');
+  std::string stream;
+  for (size_t i = 0; i < messages; ++i) {
+    std::string body =
+        nlohmann::json{{"jsonrpc", "2.0"},
+                       {"method", "textDocument/didChange"},
+                       {"params", {{"text", text}, {"version", i}}}}
+            .dump();
+    stream += "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n";
+    stream += body;
+  }
+  return stream;
+}
+
+} // namespace
+
+namespace bench {
+
+void runJsonRpcBench(size_t scale) {
+  const size_t tokenCount = 20000 * scale;
+  const int iterations = 20;
+  const std::vector<Token> tokens = makeTokens(tokenCount);
+
+  std::printf("semanticHighlights: %zu tokens\n", tokenCount);
+  report("encode: json DOM + dump",
+         measure(iterations, [&] { return encodeWithDom(tokens).size(); }),
+         iterations);
+  std::string body;
+  report("encode: JsonWriter",
+         measure(iterations,
+                 [&] {
+                   encodeWithWriter(tokens, body);
+                   return body.size();
+                 }),
+         iterations);
+
+  const size_t messageCount = 2000;
+  const std::string stream = makeStream(messageCount);
+  std::printf("read: %zu framed messages\n", messageCount);
+  std::string payload;
+  report("read: getline + read",
+         measure(iterations,
+                 [&] {
+                   std::istringstream in(stream);
+                   size_t bytes = 0;
+                   while (readWithGetline(in, payload)) {
+                     bytes += payload.size();
+                   }
+                   return bytes;
+                 }),
+         iterations);
+  report("read: Transport",
+         measure(iterations,
+                 [&] {
+                   std::istringstream in(stream);
+                   std::ostringstream out;
+                   MoZuku::rpc::Transport transport(in, out);
+                   size_t bytes = 0;
+                   while (transport.readMessage(payload)) {
+                     bytes += payload.size();
+                   }
+                   return bytes;
+                 }),
+         iterations);
+}
+
+} // namespace bench
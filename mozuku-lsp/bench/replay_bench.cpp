@@ -0,0 +1,503 @@
+// LSP セッションの再生。メモリ上のストリームで LSPServer を動かし、
+// 要求から応答まで・編集から診断配信までの遅延を分位点で出す。
+// 記録したセッション (1行1メッセージの JSON) を渡すとそれを流し、
+// なければコーパスから打鍵を模したセッションを組み立てる
+
+#include "bench_common.hpp"
+#include "corpus.hpp"
+#include "lsp.hpp"
+#include "utf16.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace bench {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// 駆動側が書き込み、サーバーの受信スレッドが読むパイプ
+class PipeBuffer : public std::streambuf {
+public:
+  void push(std::string_view data) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.append(data.data(), data.size());
+    }
+    cv_.notify_one();
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    cv_.notify_one();
+  }
+
+protected:
+  int_type underflow() override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !pending_.empty() || closed_; });
+    if (pending_.empty()) {
+      return traits_type::eof();
+    }
+    // 読み終えた領域と入れ替える (読み取り位置は常に current_ の中)
+    current_.swap(pending_);
+    pending_.clear();
+    setg(&current_[0], &current_[0], &current_[0] + current_.size());
+    return traits_type::to_int_type(current_[0]);
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::string pending_;
+  std::string current_;
+  bool closed_{false};
+};
+
+// サーバーの出力をメッセージ単位に切り出して handler に渡す。
+// Transport が 1メッセージごとに flush するので sync で区切る
+class CaptureBuffer : public std::streambuf {
+public:
+  template <typename Handler>
+  explicit CaptureBuffer(Handler handler) : handler_(std::move(handler)) {}
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      buffer_.push_back(traits_type::to_char_type(ch));
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  std::streamsize xsputn(const char *data, std::streamsize size) override {
+    buffer_.append(data, static_cast<size_t>(size));
+    return size;
+  }
+
+  int sync() override {
+    size_t pos = 0;
+    while (true) {
+      const size_t headerEnd = buffer_.find("\r\n\r\n", pos);
+      if (headerEnd == std::string::npos) {
+        break;
+      }
+      const size_t length = std::strtoul(
+          buffer_.c_str() + pos + std::string_view("Content-Length: ").size(),
+          nullptr, 10);
+      const size_t bodyStart = headerEnd + 4;
+      if (buffer_.size() < bodyStart + length) {
+        break;
+      }
+      handler_(std::string_view(buffer_).substr(bodyStart, length));
+      pos = bodyStart + length;
+    }
+    buffer_.erase(0, pos);
+    return 0;
+  }
+
+private:
+  std::function<void(std::string_view)> handler_;
+  std::string buffer_;
+};
+
+struct Step {
+  enum class Kind { Send, Pause, AwaitDiagnostics };
+  Kind kind{Kind::Send};
+  std::string body;
+  std::string idKey;    // 要求なら id を直列化したもの (応答を待つ)
+  std::string category; // 遅延の集計先
+  std::string uri;      // didOpen/didChange の対象
+  int version{-1};
+  int pauseMs{0};
+};
+
+Step makeStep(const nlohmann::json &message) {
+  Step step;
+  step.body = message.dump();
+  const std::string method = message.value("method", "");
+  if (message.contains("id")) {
+    step.idKey = message["id"].dump();
+    step.category = method;
+  } else if (method == "textDocument/didOpen" ||
+             method == "textDocument/didChange") {
+    const auto &document = message["params"]["textDocument"];
+    step.uri = document.value("uri", "");
+    step.version = document.value("version", -1);
+    step.category = method == "textDocument/didOpen"
+                        ? "diagnostics after didOpen"
+                        : "diagnostics after didChange";
+  }
+  return step;
+}
+
+Step pause(int ms) {
+  Step step;
+  step.kind = Step::Kind::Pause;
+  step.pauseMs = ms;
+  return step;
+}
+
+Step awaitDiagnostics() {
+  Step step;
+  step.kind = Step::Kind::AwaitDiagnostics;
+  return step;
+}
+
+nlohmann::json position(const std::string &text, size_t offset) {
+  const Position pos =
+      byteOffsetToPosition(text, computeLineStarts(text), offset);
+  return {{"line", pos.line}, {"character", pos.character}};
+}
+
+size_t utf8Length(const std::string &text, size_t pos) {
+  const unsigned char lead = static_cast<unsigned char>(text[pos]);
+  return lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+}
+
+// 打鍵を入れる位置。コードでは行コメントの末尾、それ以外は空でない行の末尾
+size_t pickTypingOffset(const CorpusFile &file, const std::string &text,
+                        Random &random) {
+  const std::string marker = file.languageId == "latex"  ? "% "
+                             : file.languageId == "html" ? " -->"
+                                                         : "";
+  const std::string comment =
+      (file.languageId == "cpp" || file.languageId == "typescript") ? "// "
+                                                                     : marker;
+  for (int attempt = 0; attempt < 64; ++attempt) {
+    const size_t start = random.below(text.size());
+    const size_t lineEnd = text.find('\n', start);
+    if (lineEnd == std::string::npos || lineEnd == 0) {
+      continue;
+    }
+    const size_t lineStart = text.rfind('\n', lineEnd - 1);
+    const size_t from = lineStart == std::string::npos ? 0 : lineStart + 1;
+    const std::string_view line(text.data() + from, lineEnd - from);
+    if (line.empty()) {
+      continue;
+    }
+    if (comment.empty()) {
+      return lineEnd;
+    }
+    const size_t found = line.find(comment);
+    if (found != std::string_view::npos) {
+      // HTML はコメントの閉じの手前に入れる
+      return comment == " -->" ? from + found : lineEnd;
+    }
+  }
+  return text.size();
+}
+
+// コーパスから打鍵のまとまり・hover・セマンティックトークン要求を組み立てる
+std::vector<Step> makeSyntheticSession(const std::vector<CorpusFile> &corpus,
+                                       size_t scale) {
+  std::vector<Step> steps;
+  int nextId = 1;
+  auto request = [&](const char *method, nlohmann::json params) {
+    steps.push_back(makeStep({{"jsonrpc", "2.0"},
+                              {"id", nextId++},
+                              {"method", method},
+                              {"params", std::move(params)}}));
+  };
+
+  request("initialize",
+          {{"capabilities", nlohmann::json::object()},
+           {"initializationOptions", nlohmann::json::object()}});
+  steps.push_back(makeStep({{"jsonrpc", "2.0"},
+                            {"method", "initialized"},
+                            {"params", nlohmann::json::object()}}));
+
+  Random random(42);
+  for (const auto &file : corpus) {
+    std::string text = file.text;
+    int version = 1;
+    steps.push_back(makeStep(
+        {{"jsonrpc", "2.0"},
+         {"method", "textDocument/didOpen"},
+         {"params",
+          {{"textDocument",
+            {{"uri", file.uri},
+             {"languageId", file.languageId},
+             {"version", version},
+             {"text", text}}}}}}));
+    steps.push_back(awaitDiagnostics());
+
+    const bool japanese = file.languageId == "japanese";
+    const size_t bursts = (japanese ? 6 : 3) * scale;
+    for (size_t burst = 0; burst < bursts; ++burst) {
+      // 1文を1文字ずつ入力する
+      size_t offset = pickTypingOffset(file, text, random);
+      const std::string typed = makeSentence(random);
+      for (size_t pos = 0; pos < typed.size();) {
+        const size_t length = utf8Length(typed, pos);
+        const std::string character = typed.substr(pos, length);
+        const nlohmann::json at = position(text, offset);
+        steps.push_back(makeStep(
+            {{"jsonrpc", "2.0"},
+             {"method", "textDocument/didChange"},
+             {"params",
+              {{"textDocument", {{"uri", file.uri}, {"version", ++version}}},
+               {"contentChanges",
+                nlohmann::json::array(
+                    {{{"range", {{"start", at}, {"end", at}}},
+                      {"text", character}}})}}}}));
+        steps.push_back(pause(15));
+        text.insert(offset, character);
+        offset += length;
+        pos += length;
+      }
+      steps.push_back(awaitDiagnostics());
+
+      for (int i = 0; i < 4; ++i) {
+        size_t hoverOffset = random.below(text.size());
+        while (hoverOffset > 0 &&
+               (static_cast<unsigned char>(text[hoverOffset]) & 0xC0) == 0x80) {
+          --hoverOffset;
+        }
+        request("textDocument/hover",
+                {{"textDocument", {{"uri", file.uri}}},
+                 {"position", position(text, hoverOffset)}});
+      }
+      if (japanese) {
+        request("textDocument/semanticTokens/full",
+                {{"textDocument", {{"uri", file.uri}}}});
+        const nlohmann::json start = position(text, offset);
+        nlohmann::json end = start;
+        end["line"] = start["line"].get<int>() + 60;
+        end["character"] = 0;
+        request("textDocument/semanticTokens/range",
+                {{"textDocument", {{"uri", file.uri}}},
+                 {"range", {{"start", start}, {"end", end}}}});
+      }
+    }
+  }
+  return steps;
+}
+
+std::vector<Step> loadSession(const std::string &path) {
+  std::vector<Step> steps;
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    const nlohmann::json message = nlohmann::json::parse(line, nullptr, false);
+    if (message.is_discarded()) {
+      std::fprintf(stderr, "skip malformed line: %.40s\n", line.c_str());
+      continue;
+    }
+    // exit はプロセスを終了させるので流さない
+    if (message.value("method", "") == "exit") {
+      continue;
+    }
+    steps.push_back(makeStep(message));
+  }
+  steps.push_back(awaitDiagnostics());
+  return steps;
+}
+
+// 送信時刻を覚え、応答・診断が届いたら遅延を記録する
+class Recorder {
+public:
+  void sent(const Step &step) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Clock::time_point now = Clock::now();
+    if (!step.idKey.empty()) {
+      requests_[step.idKey] = {step.category, now};
+    } else if (!step.uri.empty()) {
+      versions_[step.uri][step.version] = {step.category, now};
+      lastSent_[step.uri] = step.version;
+    }
+  }
+
+  void received(std::string_view body) {
+    UncountedScope uncounted;
+    const nlohmann::json message = nlohmann::json::parse(body, nullptr, false);
+    if (message.is_discarded()) {
+      return;
+    }
+    const Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (message.contains("id") && !message.contains("method")) {
+      auto it = requests_.find(message["id"].dump());
+      if (it != requests_.end()) {
+        record(it->second, now);
+        requests_.erase(it);
+      }
+    } else if (message.value("method", "") ==
+               "textDocument/publishDiagnostics") {
+      const auto &params = message["params"];
+      const std::string uri = params.value("uri", "");
+      const int version = params.value("version", -1);
+      auto &sent = versions_[uri];
+      auto it = sent.find(version);
+      if (it != sent.end()) {
+        record(it->second, now);
+      }
+      // それより前の版はまとめて解析され、個別の診断は来ない
+      auto end = sent.upper_bound(version);
+      for (auto older = sent.begin(); older != end; ++older) {
+        if (older->first != version) {
+          ++coalesced_;
+        }
+      }
+      sent.erase(sent.begin(), end);
+      published_[uri] = version;
+    }
+    cv_.notify_all();
+  }
+
+  bool awaitResponse(const std::string &idKey) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, std::chrono::seconds(30), [&] {
+      return requests_.find(idKey) == requests_.end();
+    });
+  }
+
+  // 最後に送った版の診断が全文書で届くまで待つ
+  bool awaitDiagnostics() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, std::chrono::seconds(30), [&] {
+      for (const auto &entry : lastSent_) {
+        auto it = published_.find(entry.first);
+        if (it == published_.end() || it->second < entry.second) {
+          return false;
+        }
+      }
+      return true;
+    });
+  }
+
+  void print() const {
+    std::printf("%-32s %7s %10s %10s %10s\n", "category", "count", "p50 ms",
+                "p99 ms", "max ms");
+    for (const auto &entry : latencies_) {
+      const auto &values = entry.second;
+      std::printf("%-32s %7zu %10.3f %10.3f %10.3f\n", entry.first.c_str(),
+                  values.size(), percentile(values, 0.5),
+                  percentile(values, 0.99),
+                  *std::max_element(values.begin(), values.end()));
+    }
+    std::printf("coalesced edits (no own diagnostics): %zu\n", coalesced_);
+  }
+
+private:
+  using Sent = std::pair<std::string, Clock::time_point>;
+
+  void record(const Sent &sent, Clock::time_point now) {
+    latencies_[sent.first].push_back(
+        std::chrono::duration<double, std::milli>(now - sent.second).count());
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_map<std::string, Sent> requests_;
+  std::unordered_map<std::string, std::map<int, Sent>> versions_;
+  std::unordered_map<std::string, int> lastSent_;
+  std::unordered_map<std::string, int> published_;
+  std::map<std::string, std::vector<double>> latencies_;
+  size_t coalesced_{0};
+};
+
+} // namespace
+
+void runReplayBench(size_t scale, const std::string &sessionPath) {
+  std::vector<Step> steps;
+  if (sessionPath.empty()) {
+    steps = makeSyntheticSession(makeCorpus(scale), scale);
+  } else {
+    steps = loadSession(sessionPath);
+  }
+  size_t messages = 0;
+  for (const auto &step : steps) {
+    messages += step.kind == Step::Kind::Send;
+  }
+  std::printf("replay: %zu messages%s%s\n", messages,
+              sessionPath.empty() ? "" : " from ", sessionPath.c_str());
+
+  Recorder recorder;
+  PipeBuffer input;
+  CaptureBuffer output(
+      [&recorder](std::string_view body) { recorder.received(body); });
+  std::istream in(&input);
+  std::ostream out(&output);
+
+  const size_t allocationsBefore = allocationCount();
+  const Clock::time_point start = Clock::now();
+  size_t timeouts = 0;
+  {
+    LSPServer server(in, out);
+    std::thread serverThread([&server] { server.run(); });
+
+    {
+      // 駆動側の割り当ては数えない
+      UncountedScope uncounted;
+      std::string frame;
+      auto send = [&](const Step &step) {
+        frame = "Content-Length: " + std::to_string(step.body.size()) +
+                "\r\n\r\n" + step.body;
+        recorder.sent(step);
+        input.push(frame);
+      };
+
+      for (const auto &step : steps) {
+        switch (step.kind) {
+        case Step::Kind::Send:
+          send(step);
+          if (!step.idKey.empty() && !recorder.awaitResponse(step.idKey)) {
+            ++timeouts;
+          }
+          break;
+        case Step::Kind::Pause:
+          std::this_thread::sleep_for(std::chrono::milliseconds(step.pauseMs));
+          break;
+        case Step::Kind::AwaitDiagnostics:
+          if (!recorder.awaitDiagnostics()) {
+            ++timeouts;
+          }
+          break;
+        }
+      }
+
+      Step shutdown = makeStep(
+          {{"jsonrpc", "2.0"}, {"id", "shutdown"}, {"method", "shutdown"}});
+      send(shutdown);
+      recorder.awaitResponse(shutdown.idKey);
+      input.close();
+    }
+    serverThread.join();
+  }
+  const double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  const size_t allocations = allocationCount() - allocationsBefore;
+
+  recorder.print();
+  std::printf("wall %.3f s, server allocations %zu (%.1f/message)", seconds,
+              allocations,
+              messages ? static_cast<double>(allocations) / messages : 0.0);
+  if (timeouts) {
+    std::printf(", %zu timeouts", timeouts);
+  }
+  std::printf("\n");
+}
+
+} // namespace bench
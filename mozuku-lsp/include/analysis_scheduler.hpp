@@ -0,0 +1,72 @@
+#pragma once
+
+#include "document_buffer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace MoZuku {
+namespace scheduling {
+
+// 1文書ぶんの解析依頼。テキストは依頼時点のスナップショット
+struct AnalysisJob {
+  std::string uri;
+  int version{-1};
+  std::string languageId;
+  text::DocumentSnapshot text; // ワーカーで連続したテキストにする
+  bool fullReanalysis{false}; // 差分を使わず全文を解析し直す
+  bool close{false}; // 解析せずに文書の状態を破棄する (didClose)
+  // 解析の前に文書の状態を破棄する (未処理の close を置き換えた依頼)
+  bool releaseFirst{false};
+  // 優先度の低い依頼。他の依頼が来たら譲り、あとで最初からやり直す
+  bool background{false};
+  // 文書ではなく workspace/diagnostic の処理を進める (uri は識別用の名前)
+  bool workspaceDiagnostic{false};
+  std::chrono::steady_clock::time_point due;
+  std::shared_ptr<std::atomic<bool>> cancelled;
+};
+
+// 文書ごとに最新の依頼だけを保持し、バックグラウンドの1スレッドで順に処理する。
+// 新しい依頼が来ると未処理の依頼は置き換え、実行中の依頼には中断を要求する。
+// background の依頼は期限の来た通常の依頼がないときだけ実行する
+class AnalysisScheduler {
+public:
+  using Handler = std::function<void(const AnalysisJob &)>;
+
+  explicit AnalysisScheduler(Handler handler);
+  ~AnalysisScheduler();
+
+  AnalysisScheduler(const AnalysisScheduler &) = delete;
+  AnalysisScheduler &operator=(const AnalysisScheduler &) = delete;
+
+  // delay 経過後に解析する。連続した編集は最後の1回にまとめられる。
+  // background の依頼は、同じ文書の未処理の依頼があれば捨てる。
+  // 未処理の close を置き換えた依頼は releaseFirst を引き継ぐ
+  void schedule(AnalysisJob job, std::chrono::milliseconds delay);
+  // 未処理・実行中の依頼を取り消す
+  void cancel(const std::string &uri);
+  // ワーカーを停止する (実行中の依頼には中断を要求して待つ)
+  void stop();
+
+private:
+  void workerLoop();
+
+  Handler handler_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unordered_map<std::string, AnalysisJob> pending_;
+  std::unordered_map<std::string, std::shared_ptr<std::atomic<bool>>> running_;
+  std::string runningBackground_; // 実行中の background の依頼の uri
+  bool stopping_{false};
+  std::thread worker_;
+};
+
+} // namespace scheduling
+} // namespace MoZuku
@@ -1,28 +1,15 @@
 #pragma once
 
+#include "token_store.hpp"
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <vector>
 
-struct TokenData;
 struct Diagnostic;
 
-struct DetailedPOS {
-  std::string mainPOS;       // 主品詞 (名詞, 動詞, 助詞...)
-  std::string subPOS1;       // 品詞細分類1 (格助詞, 副助詞, 係助詞...)
-  std::string subPOS2;       // 品詞細分類2
-  std::string subPOS3;       // 品詞細分類3
-  std::string inflection;    // 活用型
-  std::string conjugation;   // 活用形
-  std::string baseForm;      // 原形
-  std::string reading;       // 読み
-  std::string pronunciation; // 発音
-
-  bool isParticle() const { return mainPOS == "助詞"; }
-  bool isVerb() const { return mainPOS == "動詞"; }
-  bool isNoun() const { return mainPOS == "名詞"; }
-};
-
 // Information about a particle (助詞) token
 struct ParticleInfo {
   std::string surface;  // 表層形
@@ -47,6 +34,19 @@ struct DependencyInfo {
   int headId;       // 係り先チャンクID
   double score;     // 係り受けスコア
   std::string text; // チャンクのテキスト
+  size_t tokenBegin{0}; // チャンクの先頭トークン (文の先頭トークンからの位置)
+  size_t tokenCount{0};
+};
+
+// Result of a single tokenization pass over a document
+struct AnalysisResult {
+  std::string text;                       // sanitize 済みの解析対象テキスト
+  std::vector<size_t> lineStarts;         // text の各行の開始バイト
+  MoZuku::tokens::TokenStore tokens; // 形態素 (text 上のバイト範囲と文書座標)
+  std::vector<SentenceBoundary> sentences;
+  std::vector<Diagnostic> diagnostics;
+  // CaboCha 有効時のみ。文ごとに求め、チャンクIDは文書内で通し番号にする
+  std::vector<DependencyInfo> dependencies;
 };
 
 // Configuration structures (shared between LSP server and analyzer)
@@ -60,6 +60,17 @@ struct AnalysisConfig {
   bool grammarCheck = true;  // Enable grammar diagnostics
   double minJapaneseRatio =
       0.1; // Minimum Japanese character ratio for analysis
+  int debounceMs = 200; // didChange から再解析までの待ち時間 (ミリ秒)
+  int workerThreads = 0; // 文の並列解析に使うスレッド数 (0 = 自動)
+  // 解析結果を保持するメモリの予算 (MiB, 0 = 無制限)。超えた分は
+  // 最も長く使われていない文書から破棄し、必要になったら解析し直す
+  int memoryBudgetMB = 256;
+  // 文の内容をキーにした解析結果のキャッシュ (MiB, 0 = 無効)。文書間で共有し、
+  // persistSentenceCache なら cacheDir に保存して再起動後も使う
+  int sentenceCacheMB = 64;
+  bool persistSentenceCache = true;
+  // workspace/diagnostic で開いていないファイルも裏で解析する
+  bool workspaceDiagnostics = false;
 
   struct RuleToggles {
     bool commaLimit = true;
@@ -92,15 +103,9 @@ struct AnalysisConfig {
 struct MoZukuConfig {
   MeCabConfig mecab;
   AnalysisConfig analysis;
+  std::string cacheDir; // 検出結果などの保存先 (空なら保存しない)
 };
 
-void analyzeText(const std::string &text, std::vector<TokenData> &tokens,
-                 std::vector<Diagnostic> &diags,
-                 const MoZukuConfig *config = nullptr);
-
-void performGrammarDiagnostics(const std::string &text,
-                               std::vector<Diagnostic> &diags);
-
 size_t computeByteOffset(const std::string &text, int line, int character);
 
 namespace MoZukuModifiers {
@@ -115,6 +120,12 @@ namespace MoZuku {
 namespace mecab {
 class MeCabManager;
 }
+namespace cache {
+struct CachedDependencies;
+}
+namespace concurrency {
+class WorkStealingPool;
+}
 
 class Analyzer {
 public:
@@ -123,18 +134,52 @@ public:
 
   bool initialize(const MoZukuConfig &config);
 
-  std::vector<TokenData> analyzeText(const std::string &text);
+  // 1回のトークン化でトークン・文境界・診断 (CaboCha 有効時は係り受けも) を得る
+  AnalysisResult analyze(const std::string &text);
+
+  // sanitize 済みテキストの [start, end) のみを解析し、tokens に追加する。
+  // トークンは cleanText 上のバイト範囲と文書座標を持つ
+  void analyzeSpan(const std::string &cleanText,
+                   const std::vector<size_t> &lineStarts, size_t start,
+                   size_t end, tokens::TokenStore &tokens);
   std::vector<Diagnostic> checkGrammar(const std::string &text);
   std::vector<DependencyInfo> analyzeDependencies(const std::string &text);
 
+  // 解析済みの1文の係り受けを求める。sentence は text 上で sentenceStart から
+  // 始まる文、tokens の [begin, begin + count) がその文のトークン。
+  // MeCab のトークンをそのまま CaboCha に渡すので再トークン化はせず、結果は
+  // 文の内容をキーにキャッシュする。CaboCha を使わない設定なら nullptr
+  std::shared_ptr<const cache::CachedDependencies>
+  sentenceDependencies(std::string_view sentence, size_t sentenceStart,
+                       const tokens::TokenStore &tokens, size_t begin,
+                       size_t count);
+
+  // fn(0) .. fn(count - 1) をスレッドプールで並列に実行する。
+  // fn 内から analyzeSpan を呼んでよい (ラティスはスレッドごとに借りる)
+  void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
   bool isInitialized() const;
   std::string getSystemCharset() const;
   bool isCaboChaAvailable() const;
+  // 使っている辞書を識別する文字列 (解析結果のキャッシュの指紋に使う)
+  std::string dictionaryId() const;
 
 private:
+  AnalysisResult tokenize(const std::string &text);
+  // result の文ごとに係り受けを求めて result.dependencies へ通し番号で並べる。
+  // structure を渡すと係り受けを使う文構造のルールの診断も加える
+  void collectDependencies(AnalysisResult &result,
+                           std::vector<Diagnostic> *structure);
+  std::vector<DependencyInfo> parseDependencies(std::string_view sentence,
+                                                size_t sentenceStart,
+                                                const tokens::TokenStore &tokens,
+                                                size_t begin, size_t count);
+
   std::unique_ptr<mecab::MeCabManager> mecab_manager_;
+  std::unique_ptr<concurrency::WorkStealingPool> pool_;
   MoZukuConfig config_;
   std::string system_charset_;
+  std::mutex cabocha_mutex_; // CaboCha のパーサはスレッド間で共有できない
 };
 
 } // namespace MoZuku
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace MoZuku {
+namespace batch {
+
+// mozuku-lsp --check [options] <paths...>
+// LSP を介さずにファイルを並列に検査し、診断を JSON Lines か SARIF で
+// 標準出力へ流す。args は --check より後ろの引数。
+// 戻り値は終了コード (0: 診断なし, 1: 診断あり, 2: 引数・初期化の誤り)
+int runCheck(const std::vector<std::string> &args);
+
+struct InputFile {
+  std::string path;
+  std::string languageId;
+};
+
+// paths のファイルと、ディレクトリ以下の対応する言語のファイルを集める。
+// 隠しディレクトリと node_modules は辿らない
+std::vector<InputFile> collectInputs(const std::vector<std::string> &paths);
+
+} // namespace batch
+} // namespace MoZuku
@@ -5,14 +5,26 @@
 #include <vector>
 
 struct TSLanguage;
+struct TSTree;
+struct TSQueryCursor;
 
 namespace MoZuku {
 namespace comments {
 
+// 文書上のコメントの範囲。テキストは複製せず、必要なときに
+// restoreSanitized で文書から書き出す
 struct CommentSegment {
   size_t startByte{0};
   size_t endByte{0};
-  std::string sanitized;
+  const char *nodeType{nullptr}; // tree-sitter のノード種別 (言語が保持する)
+};
+
+// HTML の text ノード。node* はノード全体、start/end は前後の空白を除いた範囲
+struct TextSegment {
+  size_t nodeStartByte{0};
+  size_t nodeEndByte{0};
+  size_t startByte{0};
+  size_t endByte{0};
 };
 
 // サポート対象の言語IDか確認
@@ -22,8 +34,68 @@ bool isLanguageSupported(const std::string &languageId);
 std::vector<CommentSegment> extractComments(const std::string &languageId,
                                             const std::string &text);
 
+// text 上の segment をコメント記号を空白にした形で out の同じ位置へ書き込む
+// (out は text と同じ長さのマスク済みテキスト)
+void restoreSanitized(const std::string &text, const CommentSegment &segment,
+                      std::string &out);
+
 // tree-sitter言語ハンドルを取得 (未対応の場合はnullptr)
 const TSLanguage *resolveLanguage(const std::string &languageId);
 
+// ファイル名の拡張子から言語IDを推定する (--check 用)。
+// Markdown・テキストは japanese、判別できなければ空文字列
+std::string languageIdForPath(const std::string &path);
+
+// 文書ごとに保持する構文木。前回のテキストとの差分を ts_tree_edit で反映して
+// 古い木から再パースし、構文が変化した範囲のコメントだけを抽出し直す
+class SyntaxDocument {
+public:
+  explicit SyntaxDocument(const std::string &languageId);
+  ~SyntaxDocument();
+
+  SyntaxDocument(const SyntaxDocument &) = delete;
+  SyntaxDocument &operator=(const SyntaxDocument &) = delete;
+
+  bool isSupported() const { return language_ != nullptr; }
+  const std::string &languageId() const { return languageId_; }
+
+  // text を取り込む。パースに失敗した場合は false を返し、結果は空になる
+  bool update(const std::string &text);
+
+  // 文書順に並んだコメント
+  const std::vector<CommentSegment> &comments() const { return comments_; }
+  // 文書順に並んだ text ノード (HTML のみ)
+  const std::vector<TextSegment> &textNodes() const { return textNodes_; }
+
+  // 保持しているテキストと抽出結果の概算バイト数。構文木は tree-sitter の
+  // 内部にあり大きさが取れないので、元テキストと同程度と見積もる
+  size_t approximateBytes() const;
+
+private:
+  struct Window {
+    size_t start;
+    size_t end;
+  };
+
+  // 範囲 [start, end] が windows (開始位置順・重なりなし) のいずれかに触れるか
+  static bool intersects(const std::vector<Window> &windows, size_t start,
+                         size_t end);
+
+  void reset();
+  // windows に触れるコメント・text ノードをクエリで集める (空なら文書全体)
+  void collect(const std::vector<Window> &windows,
+               std::vector<CommentSegment> &comments,
+               std::vector<TextSegment> &textNodes) const;
+
+  std::string languageId_;
+  const TSLanguage *language_{nullptr};
+  bool collectText_{false};
+  TSTree *tree_{nullptr};
+  mutable TSQueryCursor *cursor_{nullptr};
+  std::string text_; // tree_ のパース元
+  std::vector<CommentSegment> comments_;
+  std::vector<TextSegment> textNodes_;
+};
+
 } // namespace comments
 } // namespace MoZuku
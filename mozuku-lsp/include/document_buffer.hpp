@@ -0,0 +1,77 @@
+#pragma once
+
+#include "line_index.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace MoZuku {
+namespace text {
+
+// DocumentBuffer のある時点の内容。チャンクを共有するので作るのは軽く、
+// 元のバッファがその後編集されても変わらない。別スレッドへ渡してよい
+class DocumentSnapshot {
+public:
+  size_t size() const { return size_; }
+
+  // 連続したテキストとして取り出す
+  std::string str() const;
+
+private:
+  friend class DocumentBuffer;
+
+  std::vector<std::shared_ptr<const std::string>> chunks_;
+  size_t size_{0};
+};
+
+// 編集中の文書テキスト。行の区切りで分けたチャンクの列として持ち、
+// 範囲編集では触れたチャンクだけを作り直す。1行が複数のチャンクに
+// またがることはないので、位置の変換はチャンク内の行インデックスで済む。
+// スレッドセーフではない
+class DocumentBuffer {
+public:
+  DocumentBuffer() { reset(std::string_view()); }
+  explicit DocumentBuffer(std::string_view text) { reset(text); }
+
+  void reset(std::string_view text);
+
+  size_t size() const { return size_; }
+  size_t lineCount() const;
+
+  // LSP の位置 (行, UTF-16 列) をバイト位置へ変換する。
+  // 丸め方は LineIndex::toByteOffset と同じ
+  size_t toByteOffset(int line, int character) const;
+
+  // [startByte, endByte) を replacement で置き換える
+  void replace(size_t startByte, size_t endByte, std::string_view replacement);
+
+  DocumentSnapshot snapshot() const;
+  std::string str() const;
+
+private:
+  struct Chunk {
+    explicit Chunk(std::string content);
+
+    std::shared_ptr<const std::string> text;
+    LineIndex lines; // チャンク内の行頭 (チェックポイントは必要時に作る)
+  };
+
+  // 行の区切りでおおよそ kChunkBytes ごとに分けて out に追加する
+  static void split(std::string_view text, std::vector<Chunk> &out);
+  size_t chunkAtByte(size_t offset) const;
+  size_t chunkAtLine(size_t line) const;
+  // from 番目以降のチャンクの開始バイト・開始行を数え直す
+  void reindex(size_t from);
+
+  // 末尾以外のチャンクは必ず改行で終わる
+  std::vector<Chunk> chunks_;
+  std::vector<size_t> chunkBytes_; // 各チャンクの開始バイト
+  std::vector<size_t> chunkLines_; // 各チャンクの開始行
+  size_t size_{0};
+};
+
+} // namespace text
+} // namespace MoZuku
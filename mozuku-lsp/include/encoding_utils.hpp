@@ -1,10 +1,45 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace MoZuku {
 namespace encoding {
 
+// iconv の変換器。iconv_t を開いたまま使い回す。スレッドセーフではない
+class Converter {
+public:
+  Converter(const std::string &fromCharset, const std::string &toCharset);
+  ~Converter();
+
+  Converter(const Converter &) = delete;
+  Converter &operator=(const Converter &) = delete;
+
+  bool valid() const;
+
+  // out を変換結果で置き換える。失敗時は false で、out の内容は不定
+  bool convert(const char *data, size_t size, std::string &out);
+
+  // シフト状態を初期状態に戻す
+  void reset();
+  // 状態を引き継いで out の末尾に追記する。失敗時は何も追記しない
+  bool append(const char *data, size_t size, std::string &out);
+  // 変換できないバイト列の手前までを out の末尾に追記し、
+  // 変換した入力のバイト数を返す
+  size_t appendPrefix(const char *data, size_t size, std::string &out);
+  // 初期状態に戻すためのバイト列があれば追記する
+  void finish(std::string &out);
+
+private:
+  void *cd_; // iconv_t
+};
+
+// 呼び出しスレッド専用の変換器を返す (変換の向きごとに1つ作って保持する)
+Converter &threadConverter(const std::string &fromCharset,
+                           const std::string &toCharset);
+
 std::string convertEncoding(const std::string &input,
                             const std::string &fromCharset,
                             const std::string &toCharset = "UTF-8");
@@ -15,5 +50,15 @@ std::string systemToUtf8(const std::string &input,
 std::string utf8ToSystem(const std::string &input,
                          const std::string &systemCharset);
 
+// UTF-8 テキストを systemCharset へ一括で変換し、変換後の各バイト位置から
+// 元のテキストのバイト位置への対応表 (systemText.size() + 1 要素) を作る。
+// EUC-JP と Shift_JIS は変換後の文字の長さを先頭バイトから求め、変換できない
+// 文字の間の区間ごとに1回で変換する。それ以外は1文字ずつ変換する。
+// 変換できない文字は空白1つに置き換える
+bool utf8ToSystemMapped(const std::string &utf8,
+                        const std::string &systemCharset,
+                        std::string &systemText,
+                        std::vector<uint32_t> &utf8Offsets);
+
 } // namespace encoding
 } // namespace MoZuku
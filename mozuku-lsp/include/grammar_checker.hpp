@@ -2,19 +2,56 @@
 
 #include "analyzer.hpp"
 #include "lsp.hpp"
+#include "token_store.hpp"
 #include <string>
 #include <vector>
 
 namespace MoZuku {
 namespace grammar {
 
+// 文書単位のルールに渡す1文ぶんのトークン列
+struct SentenceTokens {
+  const tokens::TokenStore *tokens{nullptr};
+  size_t begin{0}; // tokens 内でこの文が始まるインデックス
+  size_t count{0};
+  // 接続詞トークンの begin からの相対インデックス
+  // (nullptr の場合はトークン列を走査する)
+  const std::vector<size_t> *conjunctions{nullptr};
+};
+
 class GrammarChecker {
 public:
-  static void checkGrammar(const std::string &text,
-                           const std::vector<TokenData> &tokens,
-                           const std::vector<SentenceBoundary> &sentences,
+  // 解析結果に含まれる行頭位置・トークンのバイト位置をそのまま利用する
+  static void checkGrammar(const AnalysisResult &analysis,
                            std::vector<Diagnostic> &diags,
                            const MoZukuConfig *config);
+
+  // 1文の中で完結するルールのみを評価する
+  static void checkSentence(const std::string &text,
+                            const std::vector<size_t> &lineStarts,
+                            const SentenceBoundary &sentence,
+                            const tokens::TokenStore &tokens,
+                            std::vector<Diagnostic> &diags,
+                            const MoZukuConfig *config);
+
+  // 文をまたいで評価するルール (接続詞の連続など) を文単位の結果から評価する
+  static void checkDocument(const std::string &text,
+                            const std::vector<size_t> &lineStarts,
+                            const std::vector<SentenceTokens> &sentences,
+                            std::vector<Diagnostic> &diags,
+                            const MoZukuConfig *config);
+
+  // 係り受けを使う文構造のルール (warnings.sentenceStructure)。
+  // dependencies は1文ぶんで、文節のトークン位置は tokens の begin からの相対値
+  static void checkStructure(const std::string &text,
+                             const std::vector<size_t> &lineStarts,
+                             const tokens::TokenStore &tokens, size_t begin,
+                             const std::vector<DependencyInfo> &dependencies,
+                             std::vector<Diagnostic> &diags,
+                             const MoZukuConfig *config);
+
+  static std::vector<size_t>
+  findConjunctions(const tokens::TokenStore &tokens);
 };
 
 } // namespace grammar
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace MoZuku {
+namespace highlights {
+
+// ハイライトの集合。要素は stride 個の整数の組で、先頭2つが (行, 開始列)。
+// 範囲は (行, 開始列, 行数, 終了列)、トークンは
+// (行, 開始列, 長さ, 種別, 修飾子) の組にする
+struct HighlightSet {
+  size_t stride{4};
+  std::vector<uint32_t> values; // 組の辞書順に並べる
+
+  size_t size() const { return values.size() / stride; }
+  void sort();
+  bool operator==(const HighlightSet &other) const {
+    return stride == other.stride && values == other.values;
+  }
+};
+
+// 同じ行で空白だけを挟んで続く範囲を1つにまとめる。
+// ranges はバイト範囲の (開始, 終了) の並びで、開始位置の順に並んでいること
+void mergeAdjacent(const std::string &text,
+                   std::vector<std::pair<size_t, size_t>> &ranges);
+
+// previous から next への差分 (どちらも sort 済み)
+struct HighlightDelta {
+  std::vector<uint32_t> removed;
+  std::vector<uint32_t> inserted;
+};
+HighlightDelta diff(const HighlightSet &previous, const HighlightSet &next);
+
+// LSP のセマンティックトークンと同じく、行と開始列を直前の組からの差にする
+// (行が変われば開始列はそのまま)。残りの値はそのまま並べる
+std::vector<uint32_t> encodeRelative(const std::vector<uint32_t> &values,
+                                     size_t stride);
+
+// 文書ごとに最後に送った集合と版。版 0 は空の集合 (クライアントの初期状態)
+struct HighlightChannel {
+  uint32_t version{0};
+  HighlightSet sent;
+};
+
+} // namespace highlights
+} // namespace MoZuku
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "analyzer.hpp"
+#include "lsp.hpp"
+#include "token_store.hpp"
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace MoZuku {
+namespace incremental {
+
+// 1文ぶんの解析結果 (位置はすべて文書座標)
+struct SentenceResult {
+  SentenceBoundary boundary;
+  tokens::TokenStore tokens; // 表層形は解析対象テキスト上のバイト範囲
+  std::vector<size_t> conjunctions; // 文書単位ルール用の接続詞インデックス
+  std::vector<Diagnostic> diagnostics; // 文単位ルールの診断
+};
+
+struct UpdateStats {
+  size_t reusedSentences{0};
+  size_t analyzedSentences{0};
+};
+
+// prepare で解析した未反映の更新内容。commit で文書状態へ反映する
+struct PendingUpdate {
+  std::string text; // sanitize 済みの新しいテキスト
+  std::vector<size_t> lineStarts;
+  // 現在の解析結果との差分で作った更新か。false なら keep と reuseFrom は
+  // 使わず、旧文はすべて捨てる
+  bool reused{false};
+  size_t keep{0};      // 先頭から再利用する旧文の数
+  size_t reuseFrom{0}; // 末尾側で位置をずらして再利用する旧文の開始インデックス
+  std::vector<SentenceResult> analyzed; // 再解析した文
+  Position oldAnchor;                   // 編集後も内容が変わらない最初の位置
+  Position newAnchor;
+  std::ptrdiff_t byteDelta{0};
+  UpdateStats stats;
+  // 表示範囲だけを先に解析した暫定の結果 (次の prepare は全文を解析する)
+  bool partial{false};
+};
+
+// 文書ごとに文単位の解析結果を保持し、編集された文だけを再解析する
+class IncrementalAnalyzer {
+public:
+  // 前回のテキストとの差分から影響する文を求めて再解析し、
+  // 以降の文は位置だけをずらして再利用する
+  UpdateStats update(Analyzer &analyzer, const std::string &text,
+                     const MoZukuConfig *config);
+
+  // 現在の状態を変更せずに再解析だけを行う。
+  // full なら全文を、cancel が立てば文の区切りで中断して false を返す。
+  // ranges を渡すと、その外側 (空白と改行のみ) は走査せずに読み飛ばす
+  bool prepare(Analyzer &analyzer, const std::string &text,
+               const std::vector<ByteRange> *ranges,
+               const MoZukuConfig *config, bool full,
+               const std::atomic<bool> *cancel, PendingUpdate &update) const;
+  // prepare の結果を反映し、文書単位ルールを実行する
+  void commit(PendingUpdate &&update, const MoZukuConfig *config);
+
+  // キャッシュを破棄し、次回の update で全文を解析させる
+  void reset();
+
+  // 文書全体の解析結果を持っている (暫定の結果でない)
+  bool complete() const { return valid_ && !partial_; }
+  const std::vector<SentenceResult> &sentences() const { return sentences_; }
+  // トークンのバイト範囲の基準となる sanitize 済みテキスト
+  const std::string &text() const { return text_; }
+  const std::vector<size_t> &lineStarts() const { return lineStarts_; }
+  const std::vector<Diagnostic> &documentDiagnostics() const {
+    return documentDiagnostics_;
+  }
+
+  // 位置 (行, UTF-16 列) を含むトークンを二分探索で探す。見つかれば
+  // sentence に文の番号、index にその文の tokens 内の位置を入れて true を返す
+  bool findToken(int line, int character, size_t &sentence,
+                 size_t &index) const;
+  // 位置 (行, UTF-16 列) を text() のバイト位置に変換する
+  size_t byteOffsetOf(int line, int character) const;
+
+  // 文単位と文書単位の診断をまとめて返す
+  std::vector<Diagnostic> collectDiagnostics() const;
+  size_t tokenCount() const;
+  // 保持している解析結果の概算バイト数 (メモリ予算の計上用)
+  size_t approximateBytes() const;
+
+private:
+  static SentenceResult analyzeSentence(Analyzer &analyzer,
+                                        const std::string &text,
+                                        const std::vector<size_t> &lineStarts,
+                                        SentenceBoundary boundary,
+                                        const MoZukuConfig *config);
+  void runDocumentRules(const MoZukuConfig *config);
+  void indexSentences();
+
+  // トークンを持つ文の先頭トークンの位置 (文書順)。findToken で使う
+  struct SentenceStart {
+    int line;
+    int character;
+    size_t sentence;
+  };
+
+  bool valid_{false};
+  bool partial_{false};
+  std::string text_; // sanitize 済みの解析対象テキスト
+  std::vector<size_t> lineStarts_;
+  std::vector<SentenceResult> sentences_;
+  std::vector<Diagnostic> documentDiagnostics_;
+  std::vector<SentenceStart> sentenceStarts_;
+};
+
+} // namespace incremental
+} // namespace MoZuku
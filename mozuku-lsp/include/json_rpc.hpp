@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace MoZuku {
+namespace rpc {
+
+// LSP のメッセージ枠 (Content-Length ヘッダー + 本文) の読み書き。
+// 入力はストリームバッファから直接読み、本文は呼び出し側のバッファに入れる
+class Transport {
+public:
+  Transport(std::istream &in, std::ostream &out);
+
+  // 次のメッセージの本文を payload に読み込む。入力が尽きたら false
+  bool readMessage(std::string &payload);
+
+  // body に Content-Length ヘッダーを付けて送る。複数スレッドから呼べる
+  void writeMessage(std::string_view body);
+
+private:
+  bool readHeaderLine(std::string &line);
+
+  std::streambuf *in_;
+  std::ostream &out_;
+  std::mutex outMutex_;
+  std::string headerLine_;
+};
+
+// JSON を文字列バッファへ直接書き出す。カンマは自動で補う。
+// 値の並び (キーの有無や入れ子の対応) は呼び出し側が正しく守る
+class JsonWriter {
+public:
+  explicit JsonWriter(std::string &out) : out_(out) {}
+
+  void beginObject();
+  void endObject();
+  void beginArray();
+  void endArray();
+  void key(std::string_view name);
+
+  void value(std::string_view text);
+  void value(const char *text) { value(std::string_view(text)); }
+  void value(bool flag);
+  void null();
+  template <typename T,
+            std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>,
+                             int> = 0>
+  void value(T number) {
+    if constexpr (std::is_signed_v<T>) {
+      integer(static_cast<int64_t>(number));
+    } else {
+      unsignedInteger(static_cast<uint64_t>(number));
+    }
+  }
+
+  // 直列化済みの JSON をそのまま値として書く
+  void raw(std::string_view json);
+
+private:
+  void separate();
+  void integer(int64_t number);
+  void unsignedInteger(uint64_t number);
+
+  std::string &out_;
+  bool needComma_{false};
+};
+
+// JSON 文字列の中身として text をエスケープして out に追加する
+void appendEscaped(std::string &out, std::string_view text);
+
+} // namespace rpc
+} // namespace MoZuku
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct Position;
+
+namespace MoZuku {
+namespace text {
+
+// 文書の行頭バイト位置を保持し、LSP の位置 (行, UTF-16 列) とバイト位置を
+// 相互に変換する。長い行には一定間隔で (バイト, UTF-16 列) の
+// チェックポイントを作り、行頭から走査し直さずに済ませる。スレッドセーフではない
+class LineIndex {
+public:
+  LineIndex() = default;
+  explicit LineIndex(const std::string &text) { reset(text); }
+
+  void reset(const std::string &text);
+  // 行頭のバイト位置 (computeLineStarts と同じ形) が分かっていれば、
+  // テキストを走査せずにそれを使う
+  void adoptLineStarts(std::vector<size_t> lineStarts);
+
+  size_t lineCount() const { return lineStarts_.size(); }
+  const std::vector<size_t> &lineStarts() const { return lineStarts_; }
+
+  // text はこのインデックスに対応する現在のテキスト
+  size_t toByteOffset(const std::string &text, int line, int character) const;
+  Position toPosition(const std::string &text, size_t offset) const;
+
+private:
+  struct Checkpoint {
+    uint32_t byte;   // 行頭からのバイト数
+    uint32_t column; // 行頭からの UTF-16 コードユニット数
+  };
+  using Checkpoints = std::vector<Checkpoint>;
+
+  size_t lineOf(size_t offset) const;
+  size_t lineEnd(const std::string &text, size_t line) const;
+  // 未作成なら作る。短い行では空
+  const Checkpoints &checkpoints(const std::string &text, size_t line) const;
+
+  std::vector<size_t> lineStarts_{0};
+  // lineStarts_ と同じ並び。nullptr はまだ作っていない行
+  mutable std::vector<std::unique_ptr<Checkpoints>> checkpoints_{1};
+};
+
+} // namespace text
+} // namespace MoZuku
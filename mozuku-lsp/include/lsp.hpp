@@ -1,17 +1,41 @@
 #pragma once
 
 #include "analyzer.hpp"
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <istream>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <ostream>
 #include <set>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "comment_extractor.hpp"
+#include "document_buffer.hpp"
+#include "highlight_delta.hpp"
+#include "json_rpc.hpp"
+#include "line_index.hpp"
+
+namespace MoZuku {
+namespace incremental {
+class IncrementalAnalyzer;
+}
+namespace scheduling {
+class AnalysisScheduler;
+struct AnalysisJob;
+} // namespace scheduling
+} // namespace MoZuku
 
 using json = nlohmann::json;
 
@@ -31,98 +55,283 @@ struct Diagnostic {
   std::string message;
 };
 
-struct TokenData {
-  int line{0};
-  int startChar{0};
-  int endChar{0};
-  std::string tokenType; // e.g. "noun", "verb" ...
-  unsigned int tokenModifiers{0};
-
-  std::string surface; // 表層形
-  std::string
-      feature; // 品詞,品詞細分類1,品詞細分類2,品詞細分類3,活用型,活用形,原形,読み,発音
-  std::string baseForm;      // 原形
-  std::string reading;       // 読み
-  std::string pronunciation; // 発音
+struct ByteRange {
+  size_t startByte{0};
+  size_t endByte{0};
 };
 
-struct AnalyzerResult {
-  std::vector<TokenData> tokens;
-  std::vector<Diagnostic> diags;
+// 最後に返したセマンティックトークン (full/delta 要求の差分元)
+struct SemanticTokensResult {
+  std::string resultId;
+  std::vector<uint32_t> data;
 };
 
-struct ByteRange {
-  size_t startByte{0};
-  size_t endByte{0};
+// 解析完了を待っているセマンティックトークン要求 (range なら行範囲だけ返す)
+struct PendingTokenRequest {
+  json id;
+  bool range{false};
+  int startLine{0};
+  int endLine{-1};
+};
+
+// 文書の診断と、その内容から決まる resultId (pull 型の診断で使う)
+struct DiagnosticReport {
+  std::string resultId;
+  int version{-1};
+  bool complete{false}; // 表示範囲だけの暫定の結果なら false
+  std::vector<Diagnostic> diagnostics;
+};
+
+// 解析完了を待っている textDocument/diagnostic 要求
+struct PendingDiagnosticRequest {
+  json id;
+  std::string previousResultId;
+  int version{-1}; // この版以降の解析結果で応答する
+};
+
+// ワークスペースの開いていないファイルの診断 (更新日時と大きさが同じなら再利用)
+struct WorkspaceFileReport {
+  int64_t modified{0};
+  uintmax_t size{0};
+  std::string resultId;
+  std::vector<Diagnostic> diagnostics;
+};
+
+// 行の閉区間 [startLine, endLine]
+struct LineRange {
+  int startLine{0};
+  int endLine{-1};
+};
+
+// 解析用にマスクしたテキストと、ハイライト・hover 判定に使う範囲
+struct PreparedText {
+  std::string text;
+  std::vector<MoZuku::comments::CommentSegment> commentSegments;
+  std::vector<ByteRange> contentRanges; // HTML/LaTeX のみ
+  // segmented なら text のうち解析するのは analysisRanges (昇順・重複なし)
+  // だけで、残りは空白と改行になっている
+  bool segmented{false};
+  std::vector<ByteRange> analysisRanges;
 };
 
 class LSPServer {
 public:
   LSPServer(std::istream &in, std::ostream &out);
+  ~LSPServer();
   void run();
 
+  // 言語に応じて解析対象だけを残したテキストを作る (ベンチマークからも使う)。
+  // syntax は文書ごとに保持する構文木 (nullptr なら毎回パースする)
+  static PreparedText
+  prepareAnalysisText(const std::string &languageId, const std::string &text,
+                      MoZuku::comments::SyntaxDocument *syntax,
+                      double minJapaneseRatio);
+
 private:
-  std::istream &in_;
-  std::ostream &out_;
+  // メッセージ枠の読み書き (出力は内部で直列化する)
+  MoZuku::rpc::Transport transport_;
 
-  // インメモリテキストストア: uri -> 全テキスト
-  std::unordered_map<std::string, std::string> docs_;
+  // 以下3つは受信スレッドのみが触る
+  // インメモリテキストストア: uri -> 文書 (編集は触れたチャンクだけを更新する)
+  std::unordered_map<std::string, MoZuku::text::DocumentBuffer> docs_;
   // ドキュメントの言語ID: uri -> languageId
   std::unordered_map<std::string, std::string> docLanguages_;
-  // hover用トークン情報: uri -> トークンデータ
-  std::unordered_map<std::string, std::vector<TokenData>> docTokens_;
-  // 行ベースの診断キャッシュ: uri -> 行番号 -> 診断情報
+  // クライアントが通知したバージョン: uri -> version
+  std::unordered_map<std::string, int> docVersions_;
+
+  // 解析ワーカーのみが触る: uri -> コメント抽出用の構文木
+  std::unordered_map<std::string,
+                     std::unique_ptr<MoZuku::comments::SyntaxDocument>>
+      docSyntax_;
+
+  // 以下は解析ワーカーが更新し、stateMutex_ で保護する
+  std::mutex stateMutex_;
+  // 最後に完了した文単位の解析結果 (hover/セマンティックトークン用)
   std::unordered_map<std::string,
-                     std::unordered_map<int, std::vector<Diagnostic>>>
-      docDiagnostics_;
-  // コメント解析に使用するセグメント
-  std::unordered_map<std::string, std::vector<MoZuku::comments::CommentSegment>>
-      docCommentSegments_;
-  // HTML/LaTeX 本文ハイライト用の範囲
-  std::unordered_map<std::string, std::vector<ByteRange>>
-      docContentHighlightRanges_;
+                     std::unique_ptr<MoZuku::incremental::IncrementalAnalyzer>>
+      docAnalyses_;
+  // 最後に解析した診断: uri -> 診断と resultId
+  std::unordered_map<std::string, DiagnosticReport> docDiagnostics_;
+  std::unordered_map<std::string, std::vector<PendingDiagnosticRequest>>
+      pendingDiagnosticRequests_;
+  // 実行中の workspace/diagnostic 要求 (ワーカーが少しずつ進める)
+  struct WorkspaceDiagnosticRun;
+  std::shared_ptr<WorkspaceDiagnosticRun> workspaceRun_;
+  // japanese 以外の文書で hover を表示する範囲 (コメントと HTML/LaTeX の本文)。
+  // 解析の完了時に並べて重なりをまとめておき、二分探索で引く
+  std::unordered_map<std::string, std::vector<ByteRange>> docHoverRanges_;
+  // 解析完了を待っているセマンティックトークン要求
+  std::unordered_map<std::string, std::vector<PendingTokenRequest>>
+      pendingTokenRequests_;
+  // 未解析の文書で先に解析する表示範囲 (range 要求や hover の位置)
+  std::unordered_map<std::string, LineRange> docViewports_;
+  std::unordered_map<std::string, SemanticTokensResult> docSemanticTokens_;
+  uint64_t nextResultId_{0};
+  // 解析結果を保持している文書の概算バイト数と使用順 (先頭が最近)
+  struct ResidentDocument {
+    std::list<std::string>::iterator order;
+    size_t bytes{0};
+  };
+  std::list<std::string> residentOrder_;
+  std::unordered_map<std::string, ResidentDocument> residentDocuments_;
+  size_t residentBytes_{0};
+  // メモリ予算を超えて解析結果を破棄した文書 (要求が来たら解析し直す)
+  std::unordered_set<std::string> evictedDocuments_;
+
+  // 解析ワーカーのみが触る: 文書ごとに最後に送った独自ハイライト
+  struct DocumentHighlights {
+    MoZuku::highlights::HighlightChannel comments;
+    MoZuku::highlights::HighlightChannel contents;
+    MoZuku::highlights::HighlightChannel semantic;
+    size_t approximateBytes() const;
+  };
+  std::unordered_map<std::string, DocumentHighlights> docHighlights_;
+  // クライアントが取り直しを求めた文書 (stateMutex_ で保護する)
+  std::unordered_set<std::string> highlightResyncs_;
+  // 解析ワーカーのみが触る: ワークスペースのファイルの診断
+  std::unordered_map<std::string, WorkspaceFileReport> workspaceFiles_;
+  // workspace/diagnostic で辿るディレクトリ (initialize で受け取る)
+  std::vector<std::string> workspaceFolders_;
+
   std::vector<std::string> tokenTypes_;
   std::vector<std::string> tokenModifiers_;
 
   MoZukuConfig config_;
 
+  // 起動フェーズの計測起点
+  const std::chrono::steady_clock::time_point startTime_{
+      std::chrono::steady_clock::now()};
+  std::atomic<bool> firstPublished_{false};
+
   std::unique_ptr<MoZuku::Analyzer> analyzer_;
+  // MeCab/CaboCha の初期化は onInitialize の後に裏で行う
+  std::once_flag analyzerInitOnce_;
+  std::thread analyzerInitThread_;
+  std::shared_future<bool> analyzerInit_;
+  std::atomic<bool> analyzerReady_{false}; // 初期化が (成否を問わず) 終わった
+  // 準備中に断ったセマンティックトークン要求があれば、準備後に再要求させる
+  bool semanticTokensRefreshSupport_{false};
+  std::atomic<bool> semanticTokensRejected_{false};
+  // サーバーから送る要求の id の連番
+  std::atomic<uint64_t> serverRequestSequence_{1};
+  // クライアントが pull 型の診断に対応していれば publishDiagnostics は送らない
+  bool pullDiagnosticsSupport_{false};
+  // 独自ハイライトを版付きの差分で送る (initializationOptions で有効化)
+  bool highlightDeltas_{false};
+  // 解析ワーカー (他のメンバーを参照するため最後に破棄する)
+  std::unique_ptr<MoZuku::scheduling::AnalysisScheduler> scheduler_;
 
-  bool readMessage(std::string &jsonPayload);
   void reply(const json &msg);
   void notify(const std::string &method, const json &params);
+  // 大きな結果・通知は DOM を作らずに直列化する
+  void replyStreamed(
+      const json &id,
+      const std::function<void(MoZuku::rpc::JsonWriter &)> &writeResult);
+  void notifyStreamed(
+      std::string_view method,
+      const std::function<void(MoZuku::rpc::JsonWriter &)> &writeParams);
 
-  void handle(const json &req);
+  // 大きな text フィールドはコピーせずに取り出すため req を書き換える
+  void handle(json &req);
 
   json onInitialize(const json &id, const json &params);
   void onInitialized();
-  void onDidOpen(const json &params);
-  void onDidChange(const json &params);
+  void onDidOpen(json &params);
+  void onDidChange(json &params);
   void onDidSave(const json &params);
+  void onDidClose(const json &params);
   json onSemanticTokensFull(const json &id, const json &params);
+  json onSemanticTokensDelta(const json &id, const json &params);
   json onSemanticTokensRange(const json &id, const json &params);
   json onHover(const json &id, const json &params);
+  json onDocumentDiagnostic(const json &id, const json &params);
+  json onWorkspaceDiagnostic(const json &id, const json &params);
+  // mozuku/stats: 処理段・文書ごとの所要時間と回数 (params.reset で消去)
+  json onStats(const json &id, const json &params);
+  void onCancelRequest(const json &params);
+  // mozuku/highlightsResync: 差分を適用できなかった文書を全体で送り直す
+  void onHighlightsResync(const json &params);
 
-  void analyzeAndPublish(const std::string &uri, const std::string &text);
-  void analyzeChangedLines(const std::string &uri, const std::string &newText,
-                           const std::string &oldText);
-  std::string prepareAnalysisText(const std::string &uri,
-                                  const std::string &text);
+  // 初回だけ初期化スレッドを起動する (どのスレッドから呼んでもよい)
+  void startAnalyzerInit();
+  double millisecondsSinceStart() const;
+
+  void analyzeAndPublish(const std::string &uri,
+                         const MoZuku::text::DocumentBuffer &document);
+  void analyzeChangedLines(const std::string &uri,
+                           const MoZuku::text::DocumentBuffer &document);
+  void scheduleAnalysis(const std::string &uri,
+                        const MoZuku::text::DocumentBuffer &document,
+                        bool fullReanalysis, int delayMs);
+  void runAnalysisJob(const MoZuku::scheduling::AnalysisJob &job);
+  // 表示範囲の文だけを先に解析して応答し、残りを background で解析させる。
+  // 範囲が文書全体なら何もせず false を返す
+  bool analyzeViewport(const MoZuku::scheduling::AnalysisJob &job,
+                       const std::string &text, const PreparedText &prepared,
+                       const LineRange &viewport);
+  // 待っていた要求に analysis から応答する
+  void replyPendingTokens(
+      const std::string &uri,
+      const MoZuku::incremental::IncrementalAnalyzer &analysis,
+      const std::vector<PendingTokenRequest> &requests);
+  void requestSemanticTokensRefresh();
+  // 開いていないファイルを数件ずつ解析し、workspace/diagnostic の結果を
+  // 送る。残りがあれば自身を background の依頼として積み直す
+  void runWorkspaceDiagnosticStep(const MoZuku::scheduling::AnalysisJob &job);
+  void replyPendingDiagnostics(
+      const std::vector<PendingDiagnosticRequest> &requests,
+      const DiagnosticReport &report);
+  void publishDiagnostics(const std::string &uri, int version,
+                          const std::vector<Diagnostic> &diags);
+  // 閉じた文書の状態を破棄し、診断を消す (解析ワーカー上)
+  void releaseDocument(const std::string &uri);
+
+  // 以下は stateMutex_ 下で呼ぶ
+  // 解析結果の大きさを計上し直し、最近使った文書にする (解析ワーカー上)
+  void accountDocument(const std::string &uri, size_t syntaxBytes);
+  // 予算を超えている間、keep 以外の最も長く使われていない文書の解析結果を
+  // 破棄する (解析ワーカー上)
+  void evictDocuments(const std::string &keep);
+  void forgetDocument(const std::string &uri);
+  void touchDocument(const std::string &uri);
+  // 破棄済みの文書なら全文の解析を依頼する (受信スレッド上)
+  void reanalyzeEvicted(const std::string &uri);
+  // 未解析の文書でこの範囲を先に解析させる (受信スレッド上)
+  void prioritizeViewport(const std::string &uri, int startLine, int endLine);
+  void publishAnalysis(const std::string &uri, const std::string &text,
+                       const std::string &languageId,
+                       const MoZuku::incremental::IncrementalAnalyzer &analysis,
+                       const PreparedText &prepared);
   void sendCommentHighlights(
       const std::string &uri, const std::string &text,
-      const std::vector<MoZuku::comments::CommentSegment> &segments);
-  void sendSemanticHighlights(const std::string &uri,
-                              const std::vector<TokenData> &tokens);
+      const MoZuku::text::LineIndex &lineIndex,
+      const std::vector<MoZuku::comments::CommentSegment> &segments,
+      MoZuku::highlights::HighlightChannel &channel, bool resync);
+  void sendSemanticHighlights(
+      const std::string &uri, const std::string &languageId,
+      const MoZuku::incremental::IncrementalAnalyzer &analysis,
+      MoZuku::highlights::HighlightChannel &channel, bool resync);
   void sendContentHighlights(const std::string &uri, const std::string &text,
-                             const std::vector<ByteRange> &ranges);
-  json buildSemanticTokens(const std::string &uri);
-  json buildSemanticTokensFromTokens(const std::vector<TokenData> &tokens);
-
-  void cacheDiagnostics(const std::string &uri,
-                        const std::vector<Diagnostic> &diags);
-  void removeDiagnosticsForLines(const std::string &uri,
-                                 const std::set<int> &lines);
-  std::vector<Diagnostic> getAllDiagnostics(const std::string &uri) const;
-  std::set<int> findChangedLines(const std::string &oldText,
-                                 const std::string &newText) const;
+                             const MoZuku::text::LineIndex &lineIndex,
+                             const std::vector<ByteRange> &ranges,
+                             MoZuku::highlights::HighlightChannel &channel,
+                             bool resync);
+  // 前回送った集合から変わっていれば送る。差分の方が小さければ差分だけを送り、
+  // 差分に対応しないクライアントには従来の形式で全体を送る
+  void sendHighlights(std::string_view method, const std::string &uri,
+                      MoZuku::highlights::HighlightChannel &channel,
+                      MoZuku::highlights::HighlightSet next, bool resync);
+  // [startLine, endLine] の行にあるトークンを LSP の相対形式で並べる
+  static std::vector<uint32_t>
+  encodeSemanticTokens(const MoZuku::incremental::IncrementalAnalyzer &analysis,
+                       int startLine = 0, int endLine = -1);
+  // 新しい resultId を振って uri の最新結果として保持する (stateMutex_ 下)
+  const SemanticTokensResult &storeSemanticTokens(const std::string &uri,
+                                                  std::vector<uint32_t> data);
+  void replySemanticTokens(const json &id, const SemanticTokensResult &result);
+
+  // 診断を resultId とともに保持する (stateMutex_ 下)。
+  // 前回と内容が変わったら true
+  bool cacheDiagnostics(const std::string &uri, int version, bool complete,
+                        std::vector<Diagnostic> diags);
 };
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace MoZuku {
+namespace io {
+
+// 読み取り専用でファイルを写像する (Windows では読み込む)。
+// sequential なら先読みを、そうでなければランダムアクセスを想定させる
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path, bool sequential = true);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool ok() const { return ok_; }
+  std::string_view view() const { return {data_, size_}; }
+
+private:
+  const char *data_{nullptr};
+  size_t size_{0};
+  bool ok_{false};
+#ifdef _WIN32
+  std::string buffer_;
+#else
+  void *mapping_{nullptr};
+#endif
+};
+
+} // namespace io
+} // namespace MoZuku
@@ -1,11 +1,15 @@
 #pragma once
 
+#include <mutex>
 #include <string>
+#include <vector>
 
 // Forward declarations
 namespace MeCab {
+class Model;
 class Tagger;
-}
+class Lattice;
+} // namespace MeCab
 typedef struct cabocha_t cabocha_t;
 
 namespace MoZuku {
@@ -27,32 +31,75 @@ public:
   MeCabManager(const MeCabManager &) = delete;
   MeCabManager &operator=(const MeCabManager &) = delete;
 
+  // cacheDir が空でなければ、システム検出の結果をそこに保存し、
+  // 次回以降は mecab-config / cabocha-config の呼び出しを省く
   bool initialize(const std::string &mecabDicPath = "",
-                  const std::string &mecabCharset = "");
+                  const std::string &mecabCharset = "",
+                  const std::string &cacheDir = "");
 
+  // Model から作ったタガー。ラティスを渡す parse はスレッド間で共有できる
   MeCab::Tagger *getMeCabTagger() const { return mecab_tagger_; }
 
+  // 同じ Model を共有するラティスを借りる (空きがなければ作る)。
+  // 使い終わったら releaseLattice で返す
+  MeCab::Lattice *acquireLattice();
+  void releaseLattice(MeCab::Lattice *lattice);
+
   cabocha_t *getCaboChaParser() const { return cabocha_parser_; }
 
   bool isCaboChaAvailable() const { return cabocha_available_; }
 
   std::string getSystemCharset() const { return system_charset_; }
+  // -d で渡した辞書ディレクトリ (既定の辞書なら空)
+  const std::string &getDictionaryPath() const { return dictionary_path_; }
 
   static SystemLibInfo detectSystemMeCab();
 
-  static SystemLibInfo detectSystemCaboCha();
+  // mecabInfo を渡すと charset はそこから取り、MeCab を検出し直さない
+  static SystemLibInfo
+  detectSystemCaboCha(const SystemLibInfo *mecabInfo = nullptr);
 
 private:
+  // 検出結果をキャッシュから読むか、なければ検出して保存する
+  void detectWithCache(const std::string &cacheDir, SystemLibInfo &mecabInfo,
+                       bool &cabochaAvailable);
+
   std::string testMeCabCharset(MeCab::Tagger *tagger,
                                const std::string &originalCharset);
 
   // Member variables
+  MeCab::Model *mecab_model_;
   MeCab::Tagger *mecab_tagger_;
+  std::mutex lattice_mutex_;
+  std::vector<MeCab::Lattice *> lattices_;      // 作成済みの全ラティス
+  std::vector<MeCab::Lattice *> free_lattices_; // 貸出可能なラティス
   cabocha_t *cabocha_parser_;
   std::string system_charset_;
+  std::string dictionary_path_;
   bool cabocha_available_;
   bool enable_cabocha_;
 };
 
+// スコープを抜けるとラティスを返却する
+class LatticeLease {
+public:
+  explicit LatticeLease(MeCabManager &manager)
+      : manager_(manager), lattice_(manager.acquireLattice()) {}
+  ~LatticeLease() {
+    if (lattice_) {
+      manager_.releaseLattice(lattice_);
+    }
+  }
+
+  LatticeLease(const LatticeLease &) = delete;
+  LatticeLease &operator=(const LatticeLease &) = delete;
+
+  MeCab::Lattice *get() const { return lattice_; }
+
+private:
+  MeCabManager &manager_;
+  MeCab::Lattice *lattice_;
+};
+
 } // namespace mecab
 } // namespace MoZuku
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "analyzer.hpp"
+#include "token_store.hpp"
 #include <string>
 #include <vector>
 
@@ -11,21 +12,13 @@ class POSAnalyzer {
 public:
   static std::string mapPosToType(const char *feature);
 
-  static void parseFeatureDetails(const char *feature, std::string &baseForm,
-                                  std::string &reading,
-                                  std::string &pronunciation,
-                                  const std::string &systemCharset,
-                                  bool skipConversion = false);
-
-  static DetailedPOS parseDetailedPOS(const char *feature,
-                                      const std::string &systemCharset);
-
   static unsigned computeModifiers(const std::string &text, size_t start,
                                    size_t length, const char *feature);
 
-private:
-  static std::vector<std::string> splitFeature(const std::string &feature);
+  // entry.feature を1度だけ分割し、原形・読み・品詞区分などを埋める
+  static void parseFeatureEntry(tokens::FeatureEntry &entry);
 
+private:
   static void analyzeCharacterTypes(const std::string &text, size_t start,
                                     size_t length, bool &hasKana,
                                     bool &hasKanji, bool &hasNumber);
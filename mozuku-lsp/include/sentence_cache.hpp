@@ -0,0 +1,128 @@
+#pragma once
+
+#include "analyzer.hpp"
+#include "lsp.hpp"
+#include "token_store.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace MoZuku {
+namespace cache {
+
+// 1文ぶんの解析結果。座標は文の先頭を原点とする相対値で、
+// 先頭行のトークンと診断だけ文字位置も文頭からの差になる
+struct CachedSentence {
+  std::string text; // ハッシュの衝突を見分けるための文の内容
+  tokens::TokenStore tokens;
+  std::vector<size_t> conjunctions;
+  std::vector<Diagnostic> diagnostics;
+};
+
+// 高速な 64bit ハッシュ (暗号用途ではない)
+uint64_t hashBytes(std::string_view data, uint64_t seed = 0);
+
+// 解析結果を左右する辞書と設定の指紋。dictionary は辞書を識別する文字列
+uint64_t fingerprintOf(const MoZukuConfig &config,
+                       const std::string &dictionary);
+
+// sanitize 済みの文の内容をキーにした解析結果のキャッシュ。文書をまたいで
+// 共有し、容量を超えたら最も使われていない記録から捨てる。
+// openStore したディレクトリのファイルをメモリマップして再起動後も使う
+class SentenceCache {
+public:
+  static SentenceCache &getInstance();
+
+  // maxBytes が 0 なら無効。fingerprint が変われば保持している記録を捨てる
+  void configure(size_t maxBytes, uint64_t fingerprint);
+  bool enabled() const;
+
+  // 見つからなければ nullptr。返した記録は以後変更されない
+  std::shared_ptr<const CachedSentence> find(std::string_view sentence);
+  void insert(std::shared_ptr<const CachedSentence> entry);
+  void clear();
+  size_t size() const;
+  size_t bytes() const;
+
+  // directory 内の保存ファイルを読み込み用にマップする。指紋が違う
+  // ファイルは使わない。開けなければ false (メモリ上のキャッシュは使える)
+  bool openStore(const std::string &directory);
+  // 保持している記録 (とまだ読まれていない保存済みの記録) を書き出す
+  bool saveStore();
+
+private:
+  using LruList =
+      std::list<std::pair<uint64_t, std::shared_ptr<const CachedSentence>>>;
+  struct Shard {
+    mutable std::mutex mutex;
+    LruList lru; // 先頭ほど最近使った
+    std::unordered_map<uint64_t, LruList::iterator> index;
+    size_t bytes{0};
+  };
+  static constexpr size_t kShardCount = 16;
+
+  // 保存ファイルのマップと、記録の位置の索引
+  struct Store;
+
+  SentenceCache();
+  ~SentenceCache();
+  Shard &shardFor(uint64_t key);
+  void insertKeyed(uint64_t key, std::shared_ptr<const CachedSentence> entry);
+  std::shared_ptr<const CachedSentence>
+  loadFromStore(uint64_t key, std::string_view sentence);
+
+  std::array<Shard, kShardCount> shards_;
+  std::atomic<size_t> max_bytes_{0};
+  std::atomic<uint64_t> fingerprint_{0};
+  std::atomic<bool> dirty_{false}; // 保存後に記録が増えた
+  std::mutex store_mutex_;
+  std::unique_ptr<Store> store_;
+};
+
+// 1文ぶんの係り受け。文節のトークン位置は文の先頭トークンからの相対値
+struct CachedDependencies {
+  std::string text; // ハッシュの衝突を見分けるための文の内容
+  std::vector<DependencyInfo> chunks;
+};
+
+// 文の内容をキーにした係り受けの結果のキャッシュ。CaboCha は必要になった
+// 文にだけ呼ぶので、編集で再解析した文や hover した文の結果をここで使い回す。
+// 容量を超えたら最も使われていない記録から捨てる (保存はしない)
+class DependencyCache {
+public:
+  static DependencyCache &getInstance();
+
+  // maxBytes が 0 なら無効。fingerprint が変われば保持している記録を捨てる
+  void configure(size_t maxBytes, uint64_t fingerprint);
+
+  // 見つからなければ nullptr。返した記録は以後変更されない
+  std::shared_ptr<const CachedDependencies> find(std::string_view sentence);
+  void insert(std::shared_ptr<const CachedDependencies> entry);
+  void clear();
+  size_t bytes() const;
+
+private:
+  using LruList =
+      std::list<std::pair<uint64_t, std::shared_ptr<const CachedDependencies>>>;
+
+  DependencyCache() = default;
+
+  mutable std::mutex mutex_;
+  LruList lru_; // 先頭ほど最近使った
+  std::unordered_map<uint64_t, LruList::iterator> index_;
+  size_t bytes_{0};
+  size_t max_bytes_{0};
+  uint64_t fingerprint_{0};
+};
+
+} // namespace cache
+} // namespace MoZuku
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace MoZuku {
+namespace simd {
+
+// テキスト走査のカーネル群。起動時に CPU を判定し、
+// AVX2 / SSE2 / NEON / スカラーのうち使える実装に振り分ける
+
+// 先頭から何バイトが修復不要か (妥当な UTF-8 で、除去対象の制御文字を
+// 含まない) を返す。返り値は常に文字境界。全体が妥当なら size
+size_t cleanPrefixLength(const char *data, size_t size);
+
+// data 内の '\n' ごとに base + (改行の次の位置) を out に追加する
+void appendLineStarts(const char *data, size_t size, size_t base,
+                      std::vector<size_t> &out);
+
+// 妥当な UTF-8 の UTF-16 コードユニット数
+size_t utf16Length(const char *data, size_t size);
+
+// 選ばれた実装の名前 (デバッグ出力用)
+const char *kernelName();
+
+} // namespace simd
+} // namespace MoZuku
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <string>
+
+namespace MoZuku {
+namespace stats {
+
+// 処理段ごとの所要時間と回数の集計。無効な間の計測点は atomic の読み出し
+// 1回だけで、時刻も取らない。集計はスレッドごとに持ち、取得時にまとめる
+
+using Clock = std::chrono::steady_clock;
+
+// 環境変数 MOZUKU_DEBUG が設定されていれば true。各モジュールのデバッグ出力に使う
+bool debugEnabled();
+
+extern std::atomic<bool> gEnabled;
+
+inline bool enabled() { return gEnabled.load(std::memory_order_relaxed); }
+
+// 集計を有効にする。traceFile が空でなければ各区間を Chrome の
+// トレースイベント形式 (JSON 配列) で書き出す
+void configure(bool enable, const std::string &traceFile);
+
+// phase / counter は文字列リテラル (ポインタを保持する)
+void record(const char *phase, Clock::time_point start, Clock::time_point end);
+void add(const char *counter, uint64_t delta);
+
+inline void count(const char *counter, uint64_t delta = 1) {
+  if (enabled()) {
+    add(counter, delta);
+  }
+}
+
+class ScopedTimer {
+public:
+  explicit ScopedTimer(const char *phase)
+      : phase_(enabled() ? phase : nullptr) {
+    if (phase_) {
+      start_ = Clock::now();
+    }
+  }
+  ~ScopedTimer() {
+    if (phase_) {
+      record(phase_, start_, Clock::now());
+    }
+  }
+
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+  const char *phase_;
+  Clock::time_point start_;
+};
+
+// 生存中はこのスレッドの計測を uri の文書にも振り分ける。
+// 並列解析のタスクへは current() を渡して引き継ぐ
+class DocumentScope {
+public:
+  explicit DocumentScope(const std::string *uri);
+  ~DocumentScope();
+
+  DocumentScope(const DocumentScope &) = delete;
+  DocumentScope &operator=(const DocumentScope &) = delete;
+
+  static const std::string *current();
+
+private:
+  const std::string *previous_;
+};
+
+// mozuku/stats の結果。reset なら取得した分を捨てる
+nlohmann::json snapshot(bool reset);
+
+// 書き出し待ちのトレースイベントをファイルへ送る
+void flushTrace();
+
+} // namespace stats
+} // namespace MoZuku
@@ -10,14 +10,27 @@ namespace text {
 class TextProcessor {
 public:
   static std::string sanitizeUTF8(const std::string &input);
+  // 不正な UTF-8 と制御文字をその場で取り除く。妥当なテキストには手を
+  // 加えず false を返す
+  static bool sanitizeUTF8InPlace(std::string &text);
 
   static std::vector<SentenceBoundary>
   splitIntoSentences(const std::string &text);
 
+  // start から1文を切り出して sentence に格納し、次の文の走査開始位置を返す。
+  // 空白のみの区間の場合 sentence.text は空になる
+  static size_t scanSentence(const std::string &text, size_t start,
+                             SentenceBoundary &sentence);
+
   static bool isJapanesePunctuation(const std::string &text, size_t pos);
 
   static size_t skipWhitespace(const std::string &text, size_t pos);
 
+  // [start, end) の文字に占める日本語 (かな・漢字・全角文字) の割合。
+  // 空白と ASCII 記号は数えず、数える文字がなければ 0 を返す
+  static double japaneseRatio(const std::string &text, size_t start,
+                              size_t end);
+
 private:
   static bool isValidUtf8Sequence(const std::string &input, size_t pos,
                                   size_t seqLen);
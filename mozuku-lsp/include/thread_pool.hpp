@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace MoZuku {
+namespace concurrency {
+
+// ワーカーごとに両端キューを持ち、自分のキューが空になったら
+// 他のワーカーの末尾から仕事を盗むスレッドプール
+class WorkStealingPool {
+public:
+  // threads = 0 ならハードウェアスレッド数 - 1 (呼び出し側も処理に加わる)
+  explicit WorkStealingPool(size_t threads = 0);
+  ~WorkStealingPool();
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  size_t workerCount() const { return workers_.size(); }
+
+  // fn(0) .. fn(count - 1) を並列に実行し、全て終わるまで待つ。
+  // 結果は呼び出し側がインデックスで書き込むため、順序は保たれる
+  void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+private:
+  struct Batch {
+    std::atomic<size_t> remaining{0};
+    std::mutex mutex;
+    std::condition_variable done;
+    std::exception_ptr error;
+  };
+
+  struct Task {
+    const std::function<void(size_t)> *fn{nullptr};
+    size_t index{0};
+    std::shared_ptr<Batch> batch;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  bool popLocal(size_t queue, Task &task);
+  bool steal(size_t thief, Task &task);
+  static void runTask(Task &task);
+  void workerLoop(size_t queue);
+
+  // queues_[i] は workers_[i] 用、末尾は呼び出しスレッド用
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::mutex wakeMutex_;
+  std::condition_variable wakeCv_;
+  std::atomic<size_t> queued_{0};
+  bool stopping_{false};
+};
+
+} // namespace concurrency
+} // namespace MoZuku
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace MoZuku {
+namespace tokens {
+
+// セマンティックトークンの凡例と同じ順序に並べる
+enum class TokenType : uint8_t {
+  Noun,
+  Verb,
+  Adjective,
+  Adverb,
+  Particle,
+  Aux,
+  Conjunction,
+  Symbol,
+  Interj,
+  Prefix,
+  Suffix,
+  Unknown,
+};
+
+constexpr size_t kTokenTypeCount = static_cast<size_t>(TokenType::Unknown) + 1;
+
+const char *tokenTypeName(TokenType type);
+TokenType tokenTypeFromName(const std::string &name);
+
+// 主品詞 (素性の第1フィールドとの完全一致で判定する)
+enum class PartOfSpeech : uint8_t {
+  Other,
+  Noun,         // 名詞
+  Verb,         // 動詞
+  Adjective,    // 形容詞
+  Adverb,       // 副詞
+  Particle,     // 助詞
+  AuxVerb,      // 助動詞
+  Conjunction,  // 接続詞
+  Symbol,       // 記号
+  Interjection, // 感動詞
+  Prefix,       // 接頭詞
+  Adnominal,    // 連体詞
+  Filler,       // フィラー
+};
+
+// 品詞細分類・活用のフラグ (FeatureEntry::posFlags)
+enum POSFlag : uint16_t {
+  kSubIndependent = 0x0001,         // 品詞細分類1 = 自立
+  kSubNonIndependent = 0x0002,      // 品詞細分類1 = 非自立
+  kSubSuffix = 0x0004,              // 品詞細分類1 = 接尾
+  kSubCaseParticle = 0x0008,        // 品詞細分類1 = 格助詞
+  kSubConjunctiveParticle = 0x0010, // 品詞細分類1 = 接続助詞
+  kSubBindingParticle = 0x0020,     // 品詞細分類1 = 係助詞
+  kSubAdverbialParticle = 0x0040,   // 品詞細分類1 = 副助詞
+  kSubProperNoun = 0x0080,          // 品詞細分類1〜3 のいずれかが固有名詞
+  kInflectionIchidan = 0x0100,      // 活用型 = 一段
+  kConjugationMizen = 0x0200,       // 活用形 = 未然形
+};
+
+// 素性文字列ごとに1度だけ作られる不変の記録。トークン間・文書間で共有する
+struct FeatureEntry {
+  std::string feature; // 品詞,品詞細分類1,...,原形,読み,発音 (UTF-8)
+  std::string baseForm;
+  std::string reading;
+  std::string pronunciation;
+  TokenType type{TokenType::Unknown};
+  PartOfSpeech pos{PartOfSpeech::Other};
+  uint16_t posFlags{0};
+  uint8_t modifiers{0}; // 素性だけで決まる修飾子ビット
+  // 「品詞,品詞細分類1」ごとの番号。同じ番号なら同じ分類
+  uint32_t posKey{0};
+
+  bool is(PartOfSpeech p) const { return pos == p; }
+  bool has(uint16_t flags) const { return (posFlags & flags) == flags; }
+};
+
+// 素性文字列の intern テーブル。登録した記録は解放しないため、
+// 返したポインタはロックなしで参照し続けられる
+class FeatureTable {
+public:
+  static FeatureTable &getInstance();
+
+  const FeatureEntry *intern(std::string_view feature);
+  size_t size() const;
+
+private:
+  FeatureTable() = default;
+
+  mutable std::shared_mutex mutex_;
+  // キーは各記録の feature を指す
+  std::unordered_map<std::string_view, std::unique_ptr<FeatureEntry>> entries_;
+  std::unordered_map<std::string, uint32_t> posKeys_;
+};
+
+class TokenView;
+
+// 1文 (または1文書) ぶんのトークンを列ごとに保持する。
+// 表層形は持たず、文書テキスト上のバイト範囲で表す
+class TokenStore {
+public:
+  size_t size() const { return byteStart_.size(); }
+  bool empty() const { return byteStart_.empty(); }
+  void reserve(size_t count);
+  void clear();
+  // 確保済みの列の概算バイト数 (素性は FeatureTable 側なので含めない)
+  size_t approximateBytes() const;
+
+  void append(size_t byteStart, size_t byteLength, int line, int startChar,
+              int endChar, const FeatureEntry *feature, unsigned modifiers);
+
+  size_t byteStart(size_t i) const { return byteStart_[i]; }
+  size_t byteLength(size_t i) const { return byteLength_[i]; }
+  size_t byteEnd(size_t i) const { return byteStart_[i] + byteLength_[i]; }
+  int line(size_t i) const { return line_[i]; }
+  int startChar(size_t i) const { return startChar_[i]; }
+  int endChar(size_t i) const { return endChar_[i]; }
+  const FeatureEntry &feature(size_t i) const { return *features_[i]; }
+  TokenType type(size_t i) const { return features_[i]->type; }
+  unsigned modifiers(size_t i) const { return modifiers_[i]; }
+
+  // text は byteStart の基準となる文書テキスト
+  TokenView view(size_t i, std::string_view text) const;
+
+  // 編集位置より後ろの文を再利用するとき、文書座標をまとめてずらす。
+  // anchorLine 上のトークンだけ文字位置も charDelta だけずらす
+  void shift(int anchorLine, int charDelta, int lineDelta,
+             std::ptrdiff_t byteDelta);
+
+private:
+  std::vector<uint32_t> byteStart_;
+  std::vector<uint32_t> byteLength_;
+  std::vector<int32_t> line_;
+  std::vector<int32_t> startChar_;
+  std::vector<int32_t> endChar_;
+  std::vector<const FeatureEntry *> features_;
+  std::vector<uint8_t> modifiers_;
+};
+
+// TokenStore の1要素への軽量な参照
+class TokenView {
+public:
+  TokenView(const TokenStore &store, size_t index, std::string_view text)
+      : store_(&store), index_(index), text_(text) {}
+
+  std::string_view surface() const {
+    return text_.substr(store_->byteStart(index_), store_->byteLength(index_));
+  }
+  const FeatureEntry &entry() const { return store_->feature(index_); }
+  const std::string &feature() const { return entry().feature; }
+  const std::string &baseForm() const { return entry().baseForm; }
+  const std::string &reading() const { return entry().reading; }
+  const std::string &pronunciation() const { return entry().pronunciation; }
+  TokenType type() const { return entry().type; }
+  const char *typeName() const { return tokenTypeName(type()); }
+  unsigned modifiers() const { return store_->modifiers(index_); }
+
+  int line() const { return store_->line(index_); }
+  int startChar() const { return store_->startChar(index_); }
+  int endChar() const { return store_->endChar(index_); }
+  size_t byteStart() const { return store_->byteStart(index_); }
+  size_t byteEnd() const { return store_->byteEnd(index_); }
+
+private:
+  const TokenStore *store_;
+  size_t index_;
+  std::string_view text_;
+};
+
+inline TokenView TokenStore::view(size_t i, std::string_view text) const {
+  return TokenView(*this, i, text);
+}
+
+} // namespace tokens
+} // namespace MoZuku
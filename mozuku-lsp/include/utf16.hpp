@@ -1,6 +1,7 @@
 #pragma once
 
 #include "lsp.hpp"
+#include <string_view>
 
 std::vector<size_t> computeLineStarts(const std::string &text);
 
@@ -8,4 +9,22 @@ Position byteOffsetToPosition(const std::string &text,
                               const std::vector<size_t> &lineStarts,
                               size_t offset);
 
-size_t utf8ToUtf16Length(const std::string &utf8Str);
+size_t utf8ToUtf16Length(std::string_view utf8Str);
+
+// 昇順に与えられるバイト位置を LSP の位置へ変換する。
+// 同じ行の中では前の位置から数え進め、行頭から数え直さない
+class Utf16Cursor {
+public:
+  Utf16Cursor(const std::string &text, const std::vector<size_t> &lineStarts,
+              size_t start = 0);
+
+  // offset が前回より小さい場合は行頭から数え直す
+  Position advance(size_t offset);
+
+private:
+  const std::string &text_;
+  const std::vector<size_t> &lineStarts_;
+  size_t line_{0};
+  size_t byte_{0};
+  size_t column_{0};
+};
@@ -1,10 +1,18 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <curl/curl.h>
+#include <deque>
+#include <fstream>
 #include <future>
+#include <list>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 namespace wikipedia {
 struct FetchResult {
@@ -20,29 +28,89 @@ struct CacheEntry {
   long response_code;
   std::string content;
   bool is_error;
+  int64_t fetched_at; // 取得時刻 (UNIX 秒)
 
-  CacheEntry() : response_code(0), content(""), is_error(false) {}
-  CacheEntry(long code, const std::string &data, bool error = false)
-      : response_code(code), content(data), is_error(error) {}
+  CacheEntry() : response_code(0), content(""), is_error(false), fetched_at(0) {}
+  CacheEntry(long code, const std::string &data, bool error = false,
+             int64_t fetched = 0)
+      : response_code(code), content(data), is_error(error),
+        fetched_at(fetched) {}
 };
 
+// 容量上限つきの LRU キャッシュ。見出し語のハッシュでシャードに分け、
+// シャードごとに排他する。成功・該当なし・通信エラーで有効期限を変える
 class WikipediaCache {
 public:
   static WikipediaCache &getInstance();
 
-  std::unique_ptr<CacheEntry> getEntry(const std::string &query);
+  // 期限切れの記録は返さない。返した記録は以後変更されない
+  std::shared_ptr<const CacheEntry> getEntry(const std::string &query);
   void setEntry(const std::string &query, long response_code,
                 const std::string &content, bool is_error = false);
   void clear();
   size_t size() const;
 
+  // directory 内の追記専用ファイルから記録を読み込み、以後の成功・該当なしの
+  // 記録をそこへ書き足す。開けなければ false (メモリ上のキャッシュは使える)
+  bool openStore(const std::string &directory);
+
 private:
+  using LruList =
+      std::list<std::pair<std::string, std::shared_ptr<const CacheEntry>>>;
+  struct Shard {
+    mutable std::mutex mutex;
+    LruList lru; // 先頭ほど最近使った
+    std::unordered_map<std::string, LruList::iterator> index;
+    size_t bytes{0};
+  };
+  static constexpr size_t kShardCount = 8;
+
   WikipediaCache() = default;
-  mutable std::mutex cache_mutex_;
-  std::unordered_map<std::string, CacheEntry> cache_;
+  Shard &shardFor(const std::string &query);
+  void insert(const std::string &query,
+              std::shared_ptr<const CacheEntry> entry);
+  void appendToStore(const std::string &query, const CacheEntry &entry);
+
+  std::array<Shard, kShardCount> shards_;
+  std::mutex store_mutex_;
+  std::ofstream store_;
+};
+
+// ja.wikipedia.org への取得を1本のスレッドと1つの curl multi ハンドルで
+// 処理する。同じ見出し語の取得は1回の転送を共有し、待っている見出し語は
+// titles=A|B|C の1リクエストにまとめて問い合わせる
+class WikipediaFetcher {
+public:
+  static WikipediaFetcher &getInstance();
+  ~WikipediaFetcher();
+
+  WikipediaFetcher(const WikipediaFetcher &) = delete;
+  WikipediaFetcher &operator=(const WikipediaFetcher &) = delete;
+
+  // 結果はキャッシュにも登録する
+  std::shared_future<FetchResult> fetch(const std::string &query);
+
+private:
+  struct InFlight {
+    std::promise<FetchResult> promise;
+    std::shared_future<FetchResult> future;
+  };
+
+  WikipediaFetcher() = default;
+  bool ensureStarted();
+  void run();
+  void complete(const std::vector<std::string> &titles, long response_code,
+                const std::string &body);
+
+  std::mutex mutex_;
+  std::thread thread_;
+  CURLM *multi_{nullptr};
+  bool stop_{false};
+  std::deque<std::string> pending_; // まだ転送に載せていない見出し語
+  std::unordered_map<std::string, InFlight> inFlight_;
 };
 
-std::future<FetchResult> fetchSummary(const std::string &query);
+std::shared_future<FetchResult> fetchSummary(const std::string &query);
 
 std::string getJapaneseErrorMessage(long response_code);
 
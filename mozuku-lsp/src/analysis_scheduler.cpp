@@ -0,0 +1,154 @@
+#include "analysis_scheduler.hpp"
+#include "stats.hpp"
+
+#include <exception>
+#include <iostream>
+
+namespace MoZuku {
+namespace scheduling {
+
+AnalysisScheduler::AnalysisScheduler(Handler handler)
+    : handler_(std::move(handler)) {
+  worker_ = std::thread([this]() { workerLoop(); });
+}
+
+AnalysisScheduler::~AnalysisScheduler() { stop(); }
+
+void AnalysisScheduler::schedule(AnalysisJob job,
+                                 std::chrono::milliseconds delay) {
+  job.due = std::chrono::steady_clock::now() + delay;
+  job.cancelled = std::make_shared<std::atomic<bool>>(false);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto pendingIt = pending_.find(job.uri);
+    if (pendingIt != pending_.end()) {
+      if (job.background) {
+        return;
+      }
+      // 未処理の依頼が全文解析なら、置き換え後もそれを引き継ぐ
+      job.fullReanalysis =
+          job.fullReanalysis || pendingIt->second.fullReanalysis;
+      // 閉じてすぐ開き直された文書は、解析の前に閉じた分の状態を破棄する
+      if (!job.close) {
+        job.releaseFirst = job.releaseFirst || pendingIt->second.close ||
+                           pendingIt->second.releaseFirst;
+      }
+      pendingIt->second = std::move(job);
+    } else {
+      if (!job.background) {
+        auto runningIt = running_.find(job.uri);
+        if (runningIt != running_.end()) {
+          runningIt->second->store(true);
+        }
+        // 実行中の background の依頼には譲らせる (終わったら入れ直す)
+        if (!runningBackground_.empty()) {
+          auto backgroundIt = running_.find(runningBackground_);
+          if (backgroundIt != running_.end()) {
+            backgroundIt->second->store(true);
+          }
+        }
+      }
+      pending_.emplace(job.uri, std::move(job));
+    }
+  }
+  cv_.notify_one();
+}
+
+void AnalysisScheduler::cancel(const std::string &uri) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.erase(uri);
+  if (runningBackground_ == uri) {
+    runningBackground_.clear();
+  }
+  auto runningIt = running_.find(uri);
+  if (runningIt != running_.end()) {
+    runningIt->second->store(true);
+  }
+}
+
+void AnalysisScheduler::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    pending_.clear();
+    for (auto &entry : running_) {
+      entry.second->store(true);
+    }
+  }
+  cv_.notify_all();
+  if (worker_.joinable() && worker_.get_id() != std::this_thread::get_id()) {
+    worker_.join();
+  }
+}
+
+void AnalysisScheduler::workerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    if (pending_.empty()) {
+      cv_.wait(lock);
+      continue;
+    }
+
+    // 期限の来た通常の依頼、期限の来た background の依頼の順に、
+    // 期限が最も早いものを選ぶ。どれも期限前なら次の変更か期限まで待つ
+    const auto now = std::chrono::steady_clock::now();
+    auto next = pending_.end();
+    auto earliest = pending_.begin();
+    for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+      if (it->second.due < earliest->second.due) {
+        earliest = it;
+      }
+      if (it->second.due > now) {
+        continue;
+      }
+      if (next == pending_.end() ||
+          (next->second.background && !it->second.background) ||
+          (next->second.background == it->second.background &&
+           it->second.due < next->second.due)) {
+        next = it;
+      }
+    }
+    if (next == pending_.end()) {
+      cv_.wait_until(lock, earliest->second.due);
+      continue;
+    }
+
+    AnalysisJob job = std::move(next->second);
+    pending_.erase(next);
+    running_[job.uri] = job.cancelled;
+    if (job.background) {
+      runningBackground_ = job.uri;
+    }
+
+    lock.unlock();
+    try {
+      handler_(job);
+    } catch (const std::exception &e) {
+      std::cerr << "[ERROR] Analysis failed for " << job.uri << ": "
+                << e.what() << std::endl;
+    }
+    if (stats::debugEnabled() && job.cancelled->load()) {
+      std::cerr << "[DEBUG] Analysis superseded: " << job.uri
+                << " (version " << job.version << ")" << std::endl;
+    }
+    lock.lock();
+
+    running_.erase(job.uri);
+    if (job.background) {
+      // 他の文書に譲って中断したなら入れ直す。同じ文書の依頼が来ているか、
+      // cancel で取り消されたなら不要
+      const bool yielded = runningBackground_ == job.uri;
+      runningBackground_.clear();
+      if (yielded && job.cancelled->load() && !stopping_ &&
+          pending_.find(job.uri) == pending_.end()) {
+        job.cancelled = std::make_shared<std::atomic<bool>>(false);
+        job.due = std::chrono::steady_clock::now();
+        pending_.emplace(job.uri, std::move(job));
+      }
+    }
+  }
+}
+
+} // namespace scheduling
+} // namespace MoZuku
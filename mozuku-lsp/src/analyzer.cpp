@@ -1,32 +1,28 @@
 #include "analyzer.hpp"
 #include "encoding_utils.hpp"
 #include "grammar_checker.hpp"
+#include "line_index.hpp"
 #include "mecab_manager.hpp"
 #include "pos_analyzer.hpp"
+#include "sentence_cache.hpp"
+#include "stats.hpp"
 #include "text_processor.hpp"
+#include "thread_pool.hpp"
 #include "utf16.hpp"
 
+#include <algorithm>
 #include <cabocha.h>
-#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
 #include <mecab.h>
 
 namespace MoZuku {
 
-static bool isDebugEnabled() {
-  static bool initialized = false;
-  static bool debug = false;
-  if (!initialized) {
-    debug = (std::getenv("MOZUKU_DEBUG") != nullptr);
-    initialized = true;
-  }
-  return debug;
-}
-
 Analyzer::Analyzer()
     : mecab_manager_(std::make_unique<mecab::MeCabManager>(true)) {
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] Analyzer created" << std::endl;
   }
 }
@@ -36,7 +32,7 @@ Analyzer::~Analyzer() = default;
 bool Analyzer::initialize(const MoZukuConfig &config) {
   config_ = config;
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] Initializing analyzer with config" << std::endl;
   }
 
@@ -45,14 +41,18 @@ bool Analyzer::initialize(const MoZukuConfig &config) {
   std::string mecabCharset =
       config.mecab.charset.empty() ? "UTF-8" : config.mecab.charset;
 
-  if (!mecab_manager_->initialize(mecabDicPath, mecabCharset)) {
+  if (!mecab_manager_->initialize(mecabDicPath, mecabCharset,
+                                  config.cacheDir)) {
     std::cerr << "[ERROR] Failed to initialize MeCab" << std::endl;
     return false;
   }
 
   system_charset_ = mecab_manager_->getSystemCharset();
 
-  if (isDebugEnabled()) {
+  pool_ = std::make_unique<concurrency::WorkStealingPool>(
+      static_cast<size_t>(std::max(0, config.analysis.workerThreads)));
+
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] Analyzer initialized successfully with charset: "
               << system_charset_ << std::endl;
   }
@@ -60,90 +60,153 @@ bool Analyzer::initialize(const MoZukuConfig &config) {
   return true;
 }
 
-std::vector<TokenData> Analyzer::analyzeText(const std::string &text) {
-  std::vector<TokenData> tokens;
+AnalysisResult Analyzer::analyze(const std::string &text) {
+  AnalysisResult result = tokenize(text);
+
+  if (config_.analysis.grammarCheck) {
+    grammar::GrammarChecker::checkGrammar(result, result.diagnostics,
+                                          &config_);
+  }
+
+  if (config_.analysis.enableCaboCha && isCaboChaAvailable()) {
+    collectDependencies(result, config_.analysis.warnings.sentenceStructure
+                                    ? &result.diagnostics
+                                    : nullptr);
+  }
+
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Analysis completed: " << result.tokens.size()
+              << " tokens, " << result.sentences.size() << " sentences, "
+              << result.diagnostics.size() << " diagnostics" << std::endl;
+  }
+
+  return result;
+}
+
+AnalysisResult Analyzer::tokenize(const std::string &text) {
+  AnalysisResult result;
 
   if (text.empty()) {
-    return tokens;
+    return result;
   }
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] Analyzing text of length: " << text.size()
               << std::endl;
   }
 
-  std::string cleanText = text::TextProcessor::sanitizeUTF8(text);
+  result.text = text;
+  text::TextProcessor::sanitizeUTF8InPlace(result.text);
+  result.lineStarts = computeLineStarts(result.text);
+  analyzeSpan(result.text, result.lineStarts, 0, result.text.size(),
+              result.tokens);
+  result.sentences = text::TextProcessor::splitIntoSentences(result.text);
+
+  return result;
+}
+
+void Analyzer::analyzeSpan(const std::string &cleanText,
+                           const std::vector<size_t> &lineStarts, size_t start,
+                           size_t end, tokens::TokenStore &tokens) {
+  end = std::min(end, cleanText.size());
+  if (start >= end) {
+    return;
+  }
 
-  std::string systemText = encoding::utf8ToSystem(cleanText, system_charset_);
+  // UTF-8 以外の辞書では区間を一括で変換し、変換後のバイト位置から
+  // 元の位置への対応表でトークンを戻す。変換器が使えなければ UTF-8 のまま渡す
+  std::string systemText;
+  std::vector<uint32_t> utf8Offsets;
+  bool mapped = false;
+  if (system_charset_ != "UTF-8") {
+    stats::ScopedTimer timer("iconv.toSystem");
+    mapped = encoding::utf8ToSystemMapped(cleanText.substr(start, end - start),
+                                          system_charset_, systemText,
+                                          utf8Offsets);
+  }
 
   MeCab::Tagger *tagger = mecab_manager_->getMeCabTagger();
   if (!tagger) {
     std::cerr << "[ERROR] MeCab tagger not available" << std::endl;
-    return tokens;
+    return;
   }
 
-  const MeCab::Node *node = tagger->parseToNode(systemText.c_str());
-  if (!node) {
-    std::cerr << "[ERROR] MeCab parsing failed" << std::endl;
-    return tokens;
+  // タガーは共有し、解析状態はスレッドごとに借りたラティスに持たせる
+  mecab::LatticeLease lattice(*mecab_manager_);
+  if (!lattice.get()) {
+    std::cerr << "[ERROR] MeCab lattice not available" << std::endl;
+    return;
   }
 
-  std::vector<size_t> lineStarts = computeLineStarts(cleanText);
-
-  size_t currentBytePos = 0;
+  // UTF-8 ならテキストの区間をそのまま渡す
+  if (mapped) {
+    lattice.get()->set_sentence(systemText.data(), systemText.size());
+  } else {
+    lattice.get()->set_sentence(cleanText.data() + start, end - start);
+  }
+  {
+    stats::ScopedTimer timer("mecab.parse");
+    stats::count("mecab.bytes", end - start);
+    if (!tagger->parse(lattice.get())) {
+      std::cerr << "[ERROR] MeCab parsing failed: " << lattice.get()->what()
+                << std::endl;
+      return;
+    }
+  }
+  // 素性の変換 (UTF-8 以外の辞書) もここに含む
+  stats::ScopedTimer timer("mecab.tokens");
+  const MeCab::Node *node = lattice.get()->bos_node();
+  const char *sentence = lattice.get()->sentence();
+
+  auto &features = tokens::FeatureTable::getInstance();
+  encoding::Converter *featureConverter =
+      mapped ? &encoding::threadConverter(system_charset_, "UTF-8") : nullptr;
+  std::string convertedFeature;
+  // トークンは昇順に並ぶので、列は行ごとに前のトークンから数え進める
+  Utf16Cursor cursor(cleanText, lineStarts, start);
+  const size_t systemSize = mapped ? systemText.size() : end - start;
 
   for (const MeCab::Node *n = node; n; n = n->next) {
     if (n->stat == MECAB_BOS_NODE || n->stat == MECAB_EOS_NODE) {
       continue;
     }
 
-    TokenData token;
-
-    size_t surfaceLen = static_cast<size_t>(n->length);
-    std::string systemSurface(n->surface, surfaceLen);
-    token.surface = encoding::systemToUtf8(systemSurface, system_charset_);
-
-    if (token.surface.empty())
+    // 位置は入力バッファ上のポインタから求め、表層形の照合はしない
+    size_t systemStart = static_cast<size_t>(n->surface - sentence);
+    size_t systemEnd = systemStart + n->length;
+    if (systemStart > systemSize || systemEnd > systemSize) {
+      continue;
+    }
+    size_t relativeStart = mapped ? utf8Offsets[systemStart] : systemStart;
+    size_t relativeEnd = mapped ? utf8Offsets[systemEnd] : systemEnd;
+    if (relativeEnd <= relativeStart) {
       continue;
-
-    while (currentBytePos < cleanText.size()) {
-      size_t remainingBytes = cleanText.size() - currentBytePos;
-      if (remainingBytes >= token.surface.size() &&
-          cleanText.substr(currentBytePos, token.surface.size()) ==
-              token.surface) {
-        break;
-      }
-      currentBytePos++;
     }
 
-    Position pos = byteOffsetToPosition(cleanText, lineStarts, currentBytePos);
-    token.line = pos.line;
-    token.startChar = pos.character;
-    token.endChar = pos.character + utf8ToUtf16Length(token.surface);
-
-    std::string systemFeature = n->feature ? std::string(n->feature) : "";
-    token.feature = encoding::systemToUtf8(systemFeature, system_charset_);
-
-    pos::POSAnalyzer::parseFeatureDetails(token.feature.c_str(), token.baseForm,
-                                          token.reading, token.pronunciation,
-                                          "UTF-8", // Already converted to UTF-8
-                                          true     // Skip conversion
-    );
-
-    token.tokenType = pos::POSAnalyzer::mapPosToType(token.feature.c_str());
-    token.tokenModifiers = pos::POSAnalyzer::computeModifiers(
-        cleanText, currentBytePos, token.surface.size(), token.feature.c_str());
-
-    tokens.push_back(token);
-    currentBytePos += token.surface.size();
-  }
-
-  if (isDebugEnabled()) {
-    std::cerr << "[DEBUG] Analysis completed: " << tokens.size()
-              << " tokens generated" << std::endl;
+    const size_t currentBytePos = start + relativeStart;
+    std::string_view surface(cleanText.data() + currentBytePos,
+                             relativeEnd - relativeStart);
+
+    const char *rawFeature = n->feature ? n->feature : "";
+    const tokens::FeatureEntry *feature =
+        featureConverter && featureConverter->convert(
+                                rawFeature, std::strlen(rawFeature),
+                                convertedFeature)
+            ? features.intern(convertedFeature)
+            : features.intern(rawFeature);
+
+    Position pos = cursor.advance(currentBytePos);
+    int endChar = pos.character + static_cast<int>(utf8ToUtf16Length(surface));
+
+    // 文字種による修飾子はトークンごと、品詞による修飾子は素性の記録から得る
+    unsigned modifiers =
+        pos::POSAnalyzer::computeModifiers(cleanText, currentBytePos,
+                                           surface.size(), nullptr) |
+        feature->modifiers;
+
+    tokens.append(currentBytePos, surface.size(), pos.line, pos.character,
+                  endChar, feature, modifiers);
   }
-
-  return tokens;
 }
 
 std::vector<Diagnostic> Analyzer::checkGrammar(const std::string &text) {
@@ -153,19 +216,14 @@ std::vector<Diagnostic> Analyzer::checkGrammar(const std::string &text) {
     return diagnostics;
   }
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] Starting grammar check" << std::endl;
   }
 
-  std::vector<TokenData> tokens = analyzeText(text);
-
-  std::vector<SentenceBoundary> sentences =
-      text::TextProcessor::splitIntoSentences(text);
+  AnalysisResult result = tokenize(text);
+  grammar::GrammarChecker::checkGrammar(result, diagnostics, &config_);
 
-  grammar::GrammarChecker::checkGrammar(text, tokens, sentences, diagnostics,
-                                        &config_);
-
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] Grammar check completed: " << diagnostics.size()
               << " diagnostics generated" << std::endl;
   }
@@ -175,68 +233,154 @@ std::vector<Diagnostic> Analyzer::checkGrammar(const std::string &text) {
 
 std::vector<DependencyInfo>
 Analyzer::analyzeDependencies(const std::string &text) {
-  std::vector<DependencyInfo> dependencies;
-
   if (!mecab_manager_->isCaboChaAvailable()) {
-    if (isDebugEnabled()) {
+    if (stats::debugEnabled()) {
       std::cerr << "[DEBUG] CaboCha not available for dependency analysis"
                 << std::endl;
     }
-    return dependencies;
+    return {};
+  }
+
+  AnalysisResult result = tokenize(text);
+  collectDependencies(result, nullptr);
+  return std::move(result.dependencies);
+}
+
+void Analyzer::collectDependencies(AnalysisResult &result,
+                                   std::vector<Diagnostic> *structure) {
+  const auto &tokens = result.tokens;
+  const size_t tokenCount = tokens.size();
+  size_t index = 0;
+  int chunkBase = 0;
+  for (const auto &sentence : result.sentences) {
+    while (index < tokenCount && tokens.byteStart(index) < sentence.start)
+      ++index;
+    const size_t begin = index;
+    while (index < tokenCount && tokens.byteStart(index) < sentence.end)
+      ++index;
+
+    const std::string_view sentenceText(result.text.data() + sentence.start,
+                                        sentence.end - sentence.start);
+    const auto parsed = sentenceDependencies(sentenceText, sentence.start,
+                                             tokens, begin, index - begin);
+    if (!parsed) {
+      continue;
+    }
+    if (structure) {
+      grammar::GrammarChecker::checkStructure(result.text, result.lineStarts,
+                                              tokens, begin, parsed->chunks,
+                                              *structure, &config_);
+    }
+    for (DependencyInfo dep : parsed->chunks) {
+      dep.chunkId += chunkBase;
+      if (dep.headId >= 0) {
+        dep.headId += chunkBase;
+      }
+      dep.tokenBegin += begin;
+      result.dependencies.push_back(std::move(dep));
+    }
+    chunkBase += static_cast<int>(parsed->chunks.size());
   }
+}
 
-  if (isDebugEnabled()) {
-    std::cerr << "[DEBUG] Starting dependency analysis" << std::endl;
+std::shared_ptr<const cache::CachedDependencies>
+Analyzer::sentenceDependencies(std::string_view sentence, size_t sentenceStart,
+                               const tokens::TokenStore &tokens, size_t begin,
+                               size_t count) {
+  if (!config_.analysis.enableCaboCha || !isCaboChaAvailable()) {
+    return nullptr;
   }
 
-  std::string cleanText = text::TextProcessor::sanitizeUTF8(text);
-  std::string systemText = encoding::utf8ToSystem(cleanText, system_charset_);
+  auto &cache = cache::DependencyCache::getInstance();
+  if (auto cached = cache.find(sentence)) {
+    return cached;
+  }
 
-  cabocha_t *parser = mecab_manager_->getCaboChaParser();
-  if (!parser) {
+  auto entry = std::make_shared<cache::CachedDependencies>();
+  entry->text.assign(sentence.data(), sentence.size());
+  entry->chunks =
+      parseDependencies(sentence, sentenceStart, tokens, begin, count);
+  cache.insert(entry);
+  return entry;
+}
+
+std::vector<DependencyInfo>
+Analyzer::parseDependencies(std::string_view sentence, size_t sentenceStart,
+                            const tokens::TokenStore &tokens, size_t begin,
+                            size_t count) {
+  std::vector<DependencyInfo> dependencies;
+  if (count == 0) {
     return dependencies;
   }
+  stats::ScopedTimer timer("cabocha.parse");
+  stats::count("cabocha.sentences");
+
+  // MeCab の出力形式 (表層形 TAB 素性) で文のトークン列を組み立て、
+  // 辞書の文字コードへは文ごとに1度だけ変換する
+  std::string input;
+  for (size_t i = begin; i < begin + count; ++i) {
+    input.append(sentence.substr(tokens.byteStart(i) - sentenceStart,
+                                 tokens.byteLength(i)));
+    input += '\t';
+    input += tokens.feature(i).feature;
+    input += '\n';
+  }
+  input += "EOS\n";
+  if (system_charset_ != "UTF-8") {
+    stats::ScopedTimer iconvTimer("iconv.toSystem");
+    input = encoding::utf8ToSystem(input, system_charset_);
+  }
 
-  const cabocha_tree_t *tree =
-      cabocha_sparse_totree(parser, systemText.c_str());
-  if (!tree) {
+  std::unique_ptr<cabocha_tree_t, void (*)(cabocha_tree_t *)> tree(
+      cabocha_tree_new(), cabocha_tree_destroy);
+  if (!tree ||
+      !cabocha_tree_read(tree.get(), input.data(), input.size(),
+                         CABOCHA_INPUT_POS)) {
     return dependencies;
   }
+  {
+    std::lock_guard<std::mutex> lock(cabocha_mutex_);
+    cabocha_t *parser = mecab_manager_->getCaboChaParser();
+    if (!parser || !cabocha_parse_tree(parser, tree.get())) {
+      return dependencies;
+    }
+  }
 
-  for (size_t i = 0;
-       i < cabocha_tree_chunk_size(const_cast<cabocha_tree_t *>(tree)); ++i) {
-    const cabocha_chunk_t *chunk =
-        cabocha_tree_chunk(const_cast<cabocha_tree_t *>(tree), i);
-    if (!chunk)
-      continue;
+  // 渡したトークンがそのまま木のトークンになるので、文節の範囲は
+  // トークンのバイト位置から求め、表層形を変換し直さない
+  if (cabocha_tree_token_size(tree.get()) != count) {
+    if (stats::debugEnabled()) {
+      std::cerr << "[DEBUG] CaboCha token count mismatch: "
+                << cabocha_tree_token_size(tree.get()) << " != " << count
+                << std::endl;
+    }
+    return dependencies;
+  }
+  const size_t chunkCount = cabocha_tree_chunk_size(tree.get());
+  dependencies.reserve(chunkCount);
+  for (size_t i = 0; i < chunkCount; ++i) {
+    const cabocha_chunk_t *chunk = cabocha_tree_chunk(tree.get(), i);
+    // 係り先はチャンクの番号で引くので、1つでも壊れていれば使わない
+    if (!chunk || chunk->token_size == 0 ||
+        chunk->token_pos + chunk->token_size > count) {
+      return {};
+    }
 
     DependencyInfo dep;
     dep.chunkId = static_cast<int>(i);
     dep.headId = chunk->link;
     dep.score = chunk->score;
-
-    size_t startToken = chunk->token_pos;
-    size_t endToken = startToken + chunk->token_size;
-
-    std::string chunkText;
-    for (size_t j = startToken;
-         j < endToken &&
-         j < cabocha_tree_token_size(const_cast<cabocha_tree_t *>(tree));
-         ++j) {
-      const cabocha_token_t *token =
-          cabocha_tree_token(const_cast<cabocha_tree_t *>(tree), j);
-      if (token && token->surface) {
-        std::string surface = encoding::systemToUtf8(
-            std::string(token->surface), system_charset_);
-        chunkText += surface;
-      }
-    }
-    dep.text = chunkText;
-
-    dependencies.push_back(dep);
+    dep.tokenBegin = chunk->token_pos;
+    dep.tokenCount = chunk->token_size;
+    const size_t first = begin + dep.tokenBegin;
+    const size_t last = first + dep.tokenCount - 1;
+    dep.text = std::string(sentence.substr(
+        tokens.byteStart(first) - sentenceStart,
+        tokens.byteEnd(last) - tokens.byteStart(first)));
+    dependencies.push_back(std::move(dep));
   }
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] Dependency analysis completed: "
               << dependencies.size() << " chunks found" << std::endl;
   }
@@ -244,6 +388,22 @@ Analyzer::analyzeDependencies(const std::string &text) {
   return dependencies;
 }
 
+void Analyzer::parallelFor(size_t count,
+                           const std::function<void(size_t)> &fn) {
+  if (!pool_) {
+    for (size_t i = 0; i < count; ++i) {
+      fn(i);
+    }
+    return;
+  }
+  // 計測の振り分け先をプールのスレッドへ引き継ぐ
+  const std::string *document = stats::DocumentScope::current();
+  pool_->parallelFor(count, [&](size_t i) {
+    stats::DocumentScope scope(document);
+    fn(i);
+  });
+}
+
 bool Analyzer::isInitialized() const {
   return mecab_manager_ && mecab_manager_->getMeCabTagger() != nullptr;
 }
@@ -254,25 +414,28 @@ bool Analyzer::isCaboChaAvailable() const {
   return mecab_manager_ && mecab_manager_->isCaboChaAvailable();
 }
 
-} // namespace MoZuku
-
-size_t computeByteOffset(const std::string &text, int line, int character) {
-  std::vector<size_t> lineStarts = computeLineStarts(text);
-  if (line >= static_cast<int>(lineStarts.size())) {
-    return text.size();
+std::string Analyzer::dictionaryId() const {
+  const std::string &path = mecab_manager_->getDictionaryPath();
+  std::string id = path + "|" + system_charset_;
+  if (path.empty()) {
+    return id;
   }
-
-  size_t lineStart = lineStarts[line];
-  size_t bytePos = lineStart;
-  int utf16Pos = 0;
-
-  while (bytePos < text.size() && utf16Pos < character &&
-         text[bytePos] != '\n') {
-    unsigned char c = static_cast<unsigned char>(text[bytePos]);
-    int seqLen = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
-    bytePos += seqLen;
-    utf16Pos += (seqLen == 4) ? 2 : 1;
+  // 同じ場所の辞書が差し替えられたら別の辞書とみなす
+  std::error_code ec;
+  const std::filesystem::path sysdic = std::filesystem::path(path) / "sys.dic";
+  const auto size = std::filesystem::file_size(sysdic, ec);
+  if (!ec) {
+    id += "|" + std::to_string(size);
+    const auto written = std::filesystem::last_write_time(sysdic, ec);
+    if (!ec) {
+      id += "|" + std::to_string(written.time_since_epoch().count());
+    }
   }
+  return id;
+}
 
-  return bytePos;
+} // namespace MoZuku
+
+size_t computeByteOffset(const std::string &text, int line, int character) {
+  return MoZuku::text::LineIndex(text).toByteOffset(text, line, character);
 }
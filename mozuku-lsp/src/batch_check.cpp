@@ -0,0 +1,443 @@
+#include "batch_check.hpp"
+#include "analyzer.hpp"
+#include "comment_extractor.hpp"
+#include "incremental_analyzer.hpp"
+#include "json_rpc.hpp"
+#include "lsp.hpp"
+#include "mapped_file.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace MoZuku {
+namespace batch {
+
+namespace {
+
+namespace fs = std::filesystem;
+
+const char *const kUsage =
+    "usage: mozuku-lsp --check [options] <files or directories...>\n"
+    "  --format jsonl|sarif      出力形式 (既定: jsonl)\n"
+    "  --jobs N                  並列に検査するファイル数 (既定: CPU コア数)\n"
+    "  --dicdir DIR              MeCab の辞書ディレクトリ\n"
+    "  --charset CHARSET         辞書の文字コード (既定: UTF-8)\n"
+    "  --min-japanese-ratio R    コメント・本文を解析する日本語の最小比率\n"
+    "  --stats                   処理段ごとの所要時間を標準エラーへ出す\n"
+    "診断はファイルの検査が終わった順に出す。行・列は 1 始まり (列は UTF-16 単位)\n";
+
+enum class Format { JsonLines, Sarif };
+
+struct Options {
+  Format format{Format::JsonLines};
+  size_t jobs{0};
+  bool stats{false};
+  MoZukuConfig config;
+  std::vector<std::string> paths;
+};
+
+bool parseOptions(const std::vector<std::string> &args, Options &options,
+                  std::string &error) {
+  for (size_t i = 0; i < args.size(); ++i) {
+    const std::string &arg = args[i];
+    auto takeValue = [&](std::string &value) {
+      if (i + 1 >= args.size()) {
+        error = arg + " には値が必要です";
+        return false;
+      }
+      value = args[++i];
+      return true;
+    };
+
+    std::string value;
+    if (arg == "--format") {
+      if (!takeValue(value)) {
+        return false;
+      }
+      if (value == "jsonl") {
+        options.format = Format::JsonLines;
+      } else if (value == "sarif") {
+        options.format = Format::Sarif;
+      } else {
+        error = "未知の出力形式: " + value;
+        return false;
+      }
+    } else if (arg == "--jobs") {
+      if (!takeValue(value)) {
+        return false;
+      }
+      options.jobs = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (arg == "--dicdir") {
+      if (!takeValue(options.config.mecab.dicPath)) {
+        return false;
+      }
+    } else if (arg == "--charset") {
+      if (!takeValue(options.config.mecab.charset)) {
+        return false;
+      }
+    } else if (arg == "--min-japanese-ratio") {
+      if (!takeValue(value)) {
+        return false;
+      }
+      options.config.analysis.minJapaneseRatio =
+          std::strtod(value.c_str(), nullptr);
+    } else if (arg == "--stats") {
+      options.stats = true;
+    } else if (arg == "--help" || arg == "-h") {
+      return false;
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      error = "未知のオプション: " + arg;
+      return false;
+    } else {
+      options.paths.push_back(arg);
+    }
+  }
+  if (options.paths.empty()) {
+    error = "検査するファイルを指定してください";
+    return false;
+  }
+  return true;
+}
+
+// 隠しディレクトリと依存パッケージの置き場は辿らない
+bool isSkippedDirectory(const fs::path &path) {
+  const std::string name = path.filename().string();
+  return (name.size() > 1 && name[0] == '.') || name == "node_modules";
+}
+
+// LSP と同じ前処理をし、エディタと同じく解析範囲だけを文単位で解析する
+std::vector<Diagnostic> checkText(Analyzer &analyzer, const InputFile &input,
+                                  const std::string &text,
+                                  const MoZukuConfig &config) {
+  PreparedText prepared = LSPServer::prepareAnalysisText(
+      input.languageId, text, nullptr, config.analysis.minJapaneseRatio);
+  if (prepared.segmented && prepared.analysisRanges.empty()) {
+    return {};
+  }
+  incremental::IncrementalAnalyzer analysis;
+  incremental::PendingUpdate update;
+  analysis.prepare(analyzer, prepared.text,
+                   prepared.segmented ? &prepared.analysisRanges : nullptr,
+                   &config, true, nullptr, update);
+  analysis.commit(std::move(update), &config);
+  return analysis.collectDiagnostics();
+}
+
+const char *severityName(int severity) {
+  switch (severity) {
+  case 1:
+    return "error";
+  case 2:
+    return "warning";
+  case 3:
+    return "information";
+  default:
+    return "hint";
+  }
+}
+
+const char *sarifLevel(int severity) {
+  return severity == 1 ? "error" : severity == 2 ? "warning" : "note";
+}
+
+// SARIF の artifactLocation.uri 用 (相対パスのまま、予約文字だけ符号化する)
+std::string encodeUri(const std::string &path) {
+  static const char kHex[] = "0123456789ABCDEF";
+  std::string encoded;
+  encoded.reserve(path.size());
+  for (unsigned char c : path) {
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+        (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+        c == '~' || c == '/' || c == ':') {
+      encoded += static_cast<char>(c);
+    } else {
+      encoded += '%';
+      encoded += kHex[c >> 4];
+      encoded += kHex[c & 0x0F];
+    }
+  }
+  return encoded;
+}
+
+// ファイルごとにまとめて書き、ファイルの間でだけ出力を排他する
+class DiagnosticSink {
+public:
+  DiagnosticSink(std::ostream &out, Format format)
+      : out_(out), format_(format) {}
+
+  void begin() {
+    if (format_ == Format::Sarif) {
+      out_ << "{\"$schema\":\"https://json.schemastore.org/sarif-2.1.0.json\","
+              "\"version\":\"2.1.0\",\"runs\":[{\"tool\":{\"driver\":{"
+              "\"name\":\"MoZuku\",\"informationUri\":"
+              "\"https://github.com/yuimarudev/MoZuku\"}},"
+              "\"columnKind\":\"utf16CodeUnits\",\"results\":[\n";
+    }
+  }
+
+  void write(const InputFile &input,
+             const std::vector<Diagnostic> &diagnostics) {
+    if (diagnostics.empty()) {
+      return;
+    }
+    thread_local std::string buffer;
+    buffer.clear();
+    const std::string uri =
+        format_ == Format::Sarif ? encodeUri(input.path) : std::string();
+    for (size_t i = 0; i < diagnostics.size(); ++i) {
+      if (format_ == Format::Sarif && i > 0) {
+        buffer += ",\n";
+      }
+      if (format_ == Format::Sarif) {
+        writeSarifResult(buffer, uri, diagnostics[i]);
+      } else {
+        writeJsonLine(buffer, input, diagnostics[i]);
+        buffer += '\n';
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (format_ == Format::Sarif && wroteResult_) {
+      out_ << ",\n";
+    }
+    out_.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    wroteResult_ = true;
+  }
+
+  void end() {
+    if (format_ == Format::Sarif) {
+      out_ << "\n]}]}\n";
+    }
+    out_.flush();
+  }
+
+private:
+  static void writeJsonLine(std::string &out, const InputFile &input,
+                            const Diagnostic &diag) {
+    rpc::JsonWriter writer(out);
+    writer.beginObject();
+    writer.key("path");
+    writer.value(input.path);
+    writer.key("language");
+    writer.value(input.languageId);
+    writer.key("line");
+    writer.value(diag.range.start.line + 1);
+    writer.key("column");
+    writer.value(diag.range.start.character + 1);
+    writer.key("endLine");
+    writer.value(diag.range.end.line + 1);
+    writer.key("endColumn");
+    writer.value(diag.range.end.character + 1);
+    writer.key("severity");
+    writer.value(severityName(diag.severity));
+    writer.key("message");
+    writer.value(diag.message);
+    writer.endObject();
+  }
+
+  static void writeSarifResult(std::string &out, const std::string &uri,
+                               const Diagnostic &diag) {
+    rpc::JsonWriter writer(out);
+    writer.beginObject();
+    writer.key("level");
+    writer.value(sarifLevel(diag.severity));
+    writer.key("message");
+    writer.beginObject();
+    writer.key("text");
+    writer.value(diag.message);
+    writer.endObject();
+    writer.key("locations");
+    writer.beginArray();
+    writer.beginObject();
+    writer.key("physicalLocation");
+    writer.beginObject();
+    writer.key("artifactLocation");
+    writer.beginObject();
+    writer.key("uri");
+    writer.value(uri);
+    writer.endObject();
+    writer.key("region");
+    writer.beginObject();
+    writer.key("startLine");
+    writer.value(diag.range.start.line + 1);
+    writer.key("startColumn");
+    writer.value(diag.range.start.character + 1);
+    writer.key("endLine");
+    writer.value(diag.range.end.line + 1);
+    writer.key("endColumn");
+    writer.value(diag.range.end.character + 1);
+    writer.endObject();
+    writer.endObject();
+    writer.endObject();
+    writer.endArray();
+    writer.endObject();
+  }
+
+  std::ostream &out_;
+  const Format format_;
+  std::mutex mutex_;
+  bool wroteResult_{false};
+};
+
+} // namespace
+
+std::vector<InputFile> collectInputs(const std::vector<std::string> &paths) {
+  std::vector<InputFile> inputs;
+  for (const auto &path : paths) {
+    std::error_code ec;
+    if (fs::is_directory(path, ec)) {
+      fs::recursive_directory_iterator it(
+          path, fs::directory_options::skip_permission_denied, ec);
+      for (; !ec && it != fs::recursive_directory_iterator();
+           it.increment(ec)) {
+        if (it->is_directory(ec)) {
+          if (isSkippedDirectory(it->path())) {
+            it.disable_recursion_pending();
+          }
+          continue;
+        }
+        if (!it->is_regular_file(ec)) {
+          continue;
+        }
+        std::string file = it->path().generic_string();
+        std::string languageId = comments::languageIdForPath(file);
+        if (!languageId.empty()) {
+          inputs.push_back({std::move(file), std::move(languageId)});
+        }
+      }
+      if (ec) {
+        std::cerr << "[ERROR] Failed to read directory: " << path << " ("
+                  << ec.message() << ")" << std::endl;
+      }
+      continue;
+    }
+
+    std::string languageId = comments::languageIdForPath(path);
+    if (languageId.empty()) {
+      std::cerr << "[ERROR] Unknown file type, skipped: " << path << std::endl;
+      continue;
+    }
+    inputs.push_back({path, std::move(languageId)});
+  }
+  return inputs;
+}
+
+int runCheck(const std::vector<std::string> &args) {
+  Options options;
+  std::string error;
+  if (!parseOptions(args, options, error)) {
+    if (!error.empty()) {
+      std::cerr << "[ERROR] " << error << std::endl;
+    }
+    std::cerr << kUsage;
+    return 2;
+  }
+
+  const std::vector<InputFile> inputs = collectInputs(options.paths);
+  if (inputs.empty()) {
+    std::cerr << "[ERROR] No files to check" << std::endl;
+    return 2;
+  }
+
+  if (options.stats) {
+    stats::configure(true, "");
+  }
+
+  // 診断に係り受けは使わない。並列化は主にファイル単位で行うため、
+  // 文単位の並列解析に使うスレッドは1つに抑える
+  options.config.analysis.enableCaboCha = false;
+  options.config.analysis.workerThreads = 1;
+
+  const auto start = std::chrono::steady_clock::now();
+  // 辞書は1度だけ読み込み、各スレッドはラティスを借りて共有のタガーで解析する
+  Analyzer analyzer;
+  if (!analyzer.initialize(options.config)) {
+    std::cerr << "[ERROR] Failed to initialize MeCab" << std::endl;
+    return 2;
+  }
+
+  size_t jobs = options.jobs;
+  if (jobs == 0) {
+    jobs = std::max(1u, std::thread::hardware_concurrency());
+  }
+  jobs = std::min(jobs, inputs.size());
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Checking " << inputs.size() << " files with " << jobs
+              << " jobs" << std::endl;
+  }
+
+  DiagnosticSink sink(std::cout, options.format);
+  sink.begin();
+
+  std::atomic<size_t> diagnosticCount{0};
+  std::atomic<size_t> totalBytes{0};
+  std::atomic<size_t> failures{0};
+  auto checkFile = [&](size_t index) {
+    const InputFile &input = inputs[index];
+    stats::ScopedTimer timer("check.file");
+    try {
+      io::MappedFile file(input.path);
+      if (!file.ok()) {
+        std::cerr << "[ERROR] Failed to read: " << input.path << std::endl;
+        ++failures;
+        return;
+      }
+      const std::string text(file.view());
+      totalBytes += text.size();
+      const std::vector<Diagnostic> diagnostics =
+          checkText(analyzer, input, text, options.config);
+      diagnosticCount += diagnostics.size();
+      sink.write(input, diagnostics);
+    } catch (const std::exception &e) {
+      std::cerr << "[ERROR] Failed to check " << input.path << ": " << e.what()
+                << std::endl;
+      ++failures;
+    }
+  };
+
+  if (jobs > 1) {
+    // 呼び出しスレッドも処理に加わる
+    concurrency::WorkStealingPool pool(jobs - 1);
+    pool.parallelFor(inputs.size(), checkFile);
+  } else {
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      checkFile(i);
+    }
+  }
+  sink.end();
+
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  char summary[160];
+  std::snprintf(summary, sizeof(summary),
+                "MoZuku: %zu files, %zu diagnostics, %.1f MiB in %.2f s "
+                "(%zu jobs)",
+                inputs.size(), diagnosticCount.load(),
+                totalBytes.load() / (1024.0 * 1024.0), seconds, jobs);
+  std::cerr << summary << std::endl;
+
+  if (options.stats) {
+    std::cerr << stats::snapshot(false).dump(2) << std::endl;
+  }
+  if (failures.load() > 0) {
+    return 2;
+  }
+  return diagnosticCount.load() > 0 ? 1 : 0;
+}
+
+} // namespace batch
+} // namespace MoZuku
@@ -1,8 +1,15 @@
 #include "comment_extractor.hpp"
+#include "stats.hpp"
 
 #include <algorithm>
 #include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -58,8 +65,7 @@ inline void setSpace(char &c) {
   }
 }
 
-void sanitizeLineComment(std::string &segment) {
-  const size_t len = segment.size();
+void sanitizeLineComment(char *segment, size_t len) {
   if (len == 0)
     return;
 
@@ -101,8 +107,7 @@ void sanitizeLineComment(std::string &segment) {
   }
 }
 
-void sanitizeBlockComment(std::string &segment) {
-  const size_t len = segment.size();
+void sanitizeBlockComment(char *segment, size_t len) {
   if (len == 0)
     return;
 
@@ -166,10 +171,11 @@ void sanitizeBlockComment(std::string &segment) {
   size_t pos = 0;
   while (pos < len) {
     size_t lineStart = pos;
-    size_t lineEnd = segment.find('\n', pos);
-    if (lineEnd == std::string::npos) {
-      lineEnd = len;
-    }
+    const void *newline = std::memchr(segment + pos, '\n', len - pos);
+    size_t lineEnd =
+        newline ? static_cast<size_t>(static_cast<const char *>(newline) -
+                                      segment)
+                : len;
 
     size_t idx = lineStart;
     while (idx < lineEnd && (segment[idx] == ' ' || segment[idx] == '\t' ||
@@ -190,24 +196,189 @@ void sanitizeBlockComment(std::string &segment) {
   }
 }
 
-void sanitizeComment(std::string &segment, const char *nodeType) {
+void sanitizeComment(char *segment, size_t len, const char *nodeType) {
   std::string_view type =
       nodeType ? std::string_view(nodeType) : std::string_view();
 
-  bool isBlock =
-      type.find("block") != std::string_view::npos ||
-      (segment.size() >= 2 && segment[0] == '/' && segment[1] == '*') ||
-      (segment.size() >= 4 && segment[0] == '<' && segment[1] == '!' &&
-       segment[2] == '-' && segment[3] == '-');
+  bool isBlock = type.find("block") != std::string_view::npos ||
+                 (len >= 2 && segment[0] == '/' && segment[1] == '*') ||
+                 (len >= 4 && segment[0] == '<' && segment[1] == '!' &&
+                  segment[2] == '-' && segment[3] == '-');
   bool isLine = type.find("line") != std::string_view::npos ||
-                (!segment.empty() && (segment[0] == '#')) ||
-                (segment.size() >= 2 && segment[0] == '/' && segment[1] == '/');
+                (len > 0 && (segment[0] == '#')) ||
+                (len >= 2 && segment[0] == '/' && segment[1] == '/');
 
   if (isBlock && !isLine) {
-    sanitizeBlockComment(segment);
+    sanitizeBlockComment(segment, len);
   } else {
-    sanitizeLineComment(segment);
+    sanitizeLineComment(segment, len);
+  }
+}
+
+// 言語ごとにパーサーを使い回す
+class ParserPool {
+public:
+  static ParserPool &getInstance() {
+    static ParserPool instance;
+    return instance;
+  }
+
+  ~ParserPool() {
+    for (auto &entry : parsers_) {
+      for (TSParser *parser : entry.second) {
+        ts_parser_delete(parser);
+      }
+    }
+  }
+
+  TSParser *acquire(const TSLanguage *language) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto &free = parsers_[language];
+      if (!free.empty()) {
+        TSParser *parser = free.back();
+        free.pop_back();
+        return parser;
+      }
+    }
+
+    TSParser *parser = ts_parser_new();
+    if (parser && !ts_parser_set_language(parser, language)) {
+      ts_parser_delete(parser);
+      return nullptr;
+    }
+    return parser;
+  }
+
+  void release(const TSLanguage *language, TSParser *parser) {
+    if (!parser) {
+      return;
+    }
+    ts_parser_reset(parser);
+    std::lock_guard<std::mutex> lock(mutex_);
+    parsers_[language].push_back(parser);
+  }
+
+private:
+  ParserPool() = default;
+
+  std::mutex mutex_;
+  std::unordered_map<const TSLanguage *, std::vector<TSParser *>> parsers_;
+};
+
+class ParserLease {
+public:
+  explicit ParserLease(const TSLanguage *language)
+      : language_(language),
+        parser_(ParserPool::getInstance().acquire(language)) {}
+  ~ParserLease() { ParserPool::getInstance().release(language_, parser_); }
+
+  ParserLease(const ParserLease &) = delete;
+  ParserLease &operator=(const ParserLease &) = delete;
+
+  TSParser *get() const { return parser_; }
+
+private:
+  const TSLanguage *language_;
+  TSParser *parser_;
+};
+
+// 言語ごとにコンパイル済みのクエリ。コメントは種別名に "comment" を含む
+// 名前付きノード、HTML ではさらに text ノードを捕捉する
+struct CompiledQuery {
+  TSQuery *query{nullptr};
+  uint32_t commentCapture{0};
+
+  ~CompiledQuery() {
+    if (query) {
+      ts_query_delete(query);
+    }
+  }
+};
+
+const CompiledQuery *compiledQuery(const TSLanguage *language,
+                                   bool includeText) {
+  static std::mutex mutex;
+  static std::map<std::pair<const TSLanguage *, bool>,
+                  std::unique_ptr<CompiledQuery>>
+      cache;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto key = std::make_pair(language, includeText);
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    return it->second->query ? it->second.get() : nullptr;
+  }
+
+  std::string source;
+  std::set<std::string> seen;
+  bool hasText = false;
+  const uint32_t symbolCount = ts_language_symbol_count(language);
+  for (uint32_t i = 0; i < symbolCount; ++i) {
+    TSSymbol symbol = static_cast<TSSymbol>(i);
+    if (ts_language_symbol_type(language, symbol) != TSSymbolTypeRegular) {
+      continue;
+    }
+    const char *name = ts_language_symbol_name(language, symbol);
+    if (!name || name[0] == '_') {
+      continue;
+    }
+    std::string_view nodeType(name);
+    if (nodeType == "text") {
+      hasText = true;
+    }
+    if (nodeType.find("comment") != std::string_view::npos &&
+        seen.insert(std::string(nodeType)).second) {
+      source += "(" + std::string(nodeType) + ") @comment\n";
+    }
+  }
+  if (includeText && hasText) {
+    source += "(text) @text\n";
+  }
+
+  auto compiled = std::make_unique<CompiledQuery>();
+  if (!source.empty()) {
+    uint32_t errorOffset = 0;
+    TSQueryError errorType = TSQueryErrorNone;
+    compiled->query =
+        ts_query_new(language, source.c_str(),
+                     static_cast<uint32_t>(source.size()), &errorOffset,
+                     &errorType);
+    if (!compiled->query) {
+      std::cerr << "[ERROR] Failed to compile comment query (error "
+                << errorType << " at " << errorOffset << ")" << std::endl;
+    } else {
+      const uint32_t captureCount = ts_query_capture_count(compiled->query);
+      for (uint32_t i = 0; i < captureCount; ++i) {
+        uint32_t length = 0;
+        const char *name =
+            ts_query_capture_name_for_id(compiled->query, i, &length);
+        if (name && std::string_view(name, length) == "comment") {
+          compiled->commentCapture = i;
+          break;
+        }
+      }
+    }
   }
+
+  const CompiledQuery *result = compiled->query ? compiled.get() : nullptr;
+  cache.emplace(key, std::move(compiled));
+  return result;
+}
+
+// text[from, to) を走査し、from の位置 origin から to の位置を求める
+TSPoint pointAt(const std::string &text, size_t from, TSPoint origin,
+                size_t to) {
+  TSPoint point = origin;
+  for (size_t i = from; i < to; ++i) {
+    if (text[i] == '\n') {
+      ++point.row;
+      point.column = 0;
+    } else {
+      ++point.column;
+    }
+  }
+  return point;
 }
 
 } // namespace
@@ -224,6 +395,30 @@ const TSLanguage *resolveLanguage(const std::string &languageId) {
   return it->second();
 }
 
+std::string languageIdForPath(const std::string &path) {
+  static const std::unordered_map<std::string, std::string> extensions = {
+      {"md", "japanese"},         {"markdown", "japanese"},
+      {"txt", "japanese"},        {"c", "c"},
+      {"h", "c"},                 {"cpp", "cpp"},
+      {"cc", "cpp"},              {"cxx", "cpp"},
+      {"hpp", "cpp"},             {"hh", "cpp"},
+      {"hxx", "cpp"},             {"js", "javascript"},
+      {"mjs", "javascript"},      {"cjs", "javascript"},
+      {"jsx", "javascriptreact"}, {"ts", "typescript"},
+      {"mts", "typescript"},      {"cts", "typescript"},
+      {"tsx", "typescriptreact"}, {"py", "python"},
+      {"rs", "rust"},             {"html", "html"},
+      {"htm", "html"},            {"tex", "latex"}};
+
+  const size_t slash = path.find_last_of("/\\");
+  const size_t dot = path.rfind('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    return "";
+  }
+  auto it = extensions.find(toLower(path.substr(dot + 1)));
+  return it == extensions.end() ? "" : it->second;
+}
+
 bool isLanguageSupported(const std::string &languageId) {
   const auto &map = languageMap();
   return map.find(toLower(languageId)) != map.end();
@@ -231,79 +426,296 @@ bool isLanguageSupported(const std::string &languageId) {
 
 std::vector<CommentSegment> extractComments(const std::string &languageId,
                                             const std::string &text) {
-  std::vector<CommentSegment> segments;
+  SyntaxDocument document(languageId);
+  if (!document.update(text)) {
+    return {};
+  }
+  return document.comments();
+}
 
-  const TSLanguage *language = resolveLanguage(languageId);
-  if (!language) {
-    return segments;
+SyntaxDocument::SyntaxDocument(const std::string &languageId)
+    : languageId_(languageId), language_(resolveLanguage(languageId)),
+      collectText_(toLower(languageId) == "html") {}
+
+SyntaxDocument::~SyntaxDocument() {
+  reset();
+  if (cursor_) {
+    ts_query_cursor_delete(cursor_);
   }
+}
+
+size_t SyntaxDocument::approximateBytes() const {
+  return sizeof(*this) + text_.capacity() * (tree_ ? 2 : 1) +
+         comments_.capacity() * sizeof(CommentSegment) +
+         textNodes_.capacity() * sizeof(TextSegment);
+}
 
-  TSParser *parser = ts_parser_new();
-  if (!parser) {
-    return segments;
+bool SyntaxDocument::intersects(const std::vector<Window> &windows,
+                                size_t start, size_t end) {
+  auto it = std::lower_bound(
+      windows.begin(), windows.end(), start,
+      [](const Window &window, size_t value) { return window.end < value; });
+  return it != windows.end() && it->start <= end;
+}
+
+void SyntaxDocument::reset() {
+  if (tree_) {
+    ts_tree_delete(tree_);
+    tree_ = nullptr;
   }
+  text_.clear();
+  comments_.clear();
+  textNodes_.clear();
+}
 
-  std::unique_ptr<TSParser, decltype(&ts_parser_delete)> parserGuard(
-      parser, &ts_parser_delete);
+bool SyntaxDocument::update(const std::string &text) {
+  if (!language_) {
+    return false;
+  }
+  if (tree_ && text == text_) {
+    return true;
+  }
+
+  // 構文解析とコメント・本文ノードの抽出
+  stats::ScopedTimer timer("treesitter.update");
+  stats::count(tree_ ? "treesitter.incrementalParses" : "treesitter.fullParses");
+  ParserLease parser(language_);
+  if (!parser.get()) {
+    reset();
+    return false;
+  }
+
+  if (!tree_) {
+    TSTree *tree = ts_parser_parse_string(parser.get(), nullptr, text.c_str(),
+                                          static_cast<uint32_t>(text.size()));
+    if (!tree) {
+      reset();
+      return false;
+    }
+    tree_ = tree;
+    text_ = text;
+    comments_.clear();
+    textNodes_.clear();
+    collect({}, comments_, textNodes_);
+    return true;
+  }
 
-  if (!ts_parser_set_language(parser, language)) {
-    return segments;
+  // 前回のテキストとの共通接頭辞・接尾辞から1つの編集範囲を求める
+  const std::string &oldText = text_;
+  size_t prefix = 0;
+  const size_t maxPrefix = std::min(oldText.size(), text.size());
+  while (prefix < maxPrefix && oldText[prefix] == text[prefix]) {
+    ++prefix;
+  }
+  size_t suffix = 0;
+  const size_t maxSuffix = maxPrefix - prefix;
+  while (suffix < maxSuffix &&
+         oldText[oldText.size() - 1 - suffix] == text[text.size() - 1 - suffix]) {
+    ++suffix;
   }
 
-  TSTree *tree =
-      ts_parser_parse_string(parser, nullptr, text.c_str(), text.size());
+  const size_t start = prefix;
+  const size_t oldEnd = oldText.size() - suffix;
+  const size_t newEnd = text.size() - suffix;
+
+  TSInputEdit edit;
+  edit.start_byte = static_cast<uint32_t>(start);
+  edit.old_end_byte = static_cast<uint32_t>(oldEnd);
+  edit.new_end_byte = static_cast<uint32_t>(newEnd);
+  edit.start_point = pointAt(text, 0, {0, 0}, start);
+  edit.old_end_point = pointAt(oldText, start, edit.start_point, oldEnd);
+  edit.new_end_point = pointAt(text, start, edit.start_point, newEnd);
+  ts_tree_edit(tree_, &edit);
+
+  TSTree *tree = ts_parser_parse_string(parser.get(), tree_, text.c_str(),
+                                        static_cast<uint32_t>(text.size()));
   if (!tree) {
-    return segments;
+    reset();
+    return false;
   }
 
-  std::unique_ptr<TSTree, decltype(&ts_tree_delete)> treeGuard(tree,
-                                                               &ts_tree_delete);
+  // 構文が変わった範囲と編集範囲に触れるノードだけを抽出し直す
+  std::vector<Window> windows;
+  windows.push_back({start, newEnd});
+  uint32_t changedCount = 0;
+  TSRange *changed = ts_tree_get_changed_ranges(tree_, tree, &changedCount);
+  for (uint32_t i = 0; i < changedCount; ++i) {
+    windows.push_back({changed[i].start_byte, changed[i].end_byte});
+  }
+  free(changed);
+  std::sort(windows.begin(), windows.end(),
+            [](const Window &a, const Window &b) { return a.start < b.start; });
+  std::vector<Window> merged;
+  for (const auto &window : windows) {
+    if (!merged.empty() && window.start <= merged.back().end) {
+      merged.back().end = std::max(merged.back().end, window.end);
+    } else {
+      merged.push_back(window);
+    }
+  }
 
-  TSNode root = ts_tree_root_node(tree);
-  if (ts_node_is_null(root)) {
-    return segments;
+  ts_tree_delete(tree_);
+  tree_ = tree;
+
+  // 編集より後ろの結果はバイト位置だけずらして再利用する
+  const std::ptrdiff_t delta = static_cast<std::ptrdiff_t>(newEnd) -
+                               static_cast<std::ptrdiff_t>(oldEnd);
+  auto remap = [&](size_t &begin, size_t &end) {
+    if (end <= start) {
+      return !intersects(merged, begin, end);
+    }
+    if (begin < oldEnd) {
+      return false;
+    }
+    begin = static_cast<size_t>(static_cast<std::ptrdiff_t>(begin) + delta);
+    end = static_cast<size_t>(static_cast<std::ptrdiff_t>(end) + delta);
+    return !intersects(merged, begin, end);
+  };
+
+  std::vector<CommentSegment> comments;
+  comments.reserve(comments_.size());
+  for (auto &segment : comments_) {
+    if (remap(segment.startByte, segment.endByte)) {
+      comments.push_back(std::move(segment));
+    }
+  }
+  std::vector<TextSegment> textNodes;
+  textNodes.reserve(textNodes_.size());
+  for (auto segment : textNodes_) {
+    size_t trimmedOffset = segment.startByte - segment.nodeStartByte;
+    size_t trimmedLength = segment.endByte - segment.startByte;
+    if (remap(segment.nodeStartByte, segment.nodeEndByte)) {
+      segment.startByte = segment.nodeStartByte + trimmedOffset;
+      segment.endByte = segment.startByte + trimmedLength;
+      textNodes.push_back(segment);
+    }
   }
-  std::vector<TSNode> stack;
-  stack.push_back(root);
 
-  while (!stack.empty()) {
-    TSNode node = stack.back();
-    stack.pop_back();
+  text_ = text;
+  collect(merged, comments, textNodes);
+  std::sort(comments.begin(), comments.end(),
+            [](const CommentSegment &a, const CommentSegment &b) {
+              return a.startByte < b.startByte;
+            });
+  std::sort(textNodes.begin(), textNodes.end(),
+            [](const TextSegment &a, const TextSegment &b) {
+              return a.nodeStartByte < b.nodeStartByte;
+            });
+  comments_ = std::move(comments);
+  textNodes_ = std::move(textNodes);
+
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Syntax tree reparsed: edit [" << start << ", "
+              << oldEnd << ") -> [" << start << ", " << newEnd << "), "
+              << merged.size() << " windows, " << comments_.size()
+              << " comments" << std::endl;
+  }
+  return true;
+}
 
-    if (ts_node_is_null(node)) {
-      continue;
+void SyntaxDocument::collect(const std::vector<Window> &windows,
+                             std::vector<CommentSegment> &comments,
+                             std::vector<TextSegment> &textNodes) const {
+  const CompiledQuery *query = compiledQuery(language_, collectText_);
+  if (!query) {
+    return;
+  }
+  TSNode root = ts_tree_root_node(tree_);
+  if (ts_node_is_null(root)) {
+    return;
+  }
+  if (!cursor_) {
+    cursor_ = ts_query_cursor_new();
+    if (!cursor_) {
+      return;
     }
+  }
 
-    const char *type = ts_node_type(node);
-    if (type) {
-      std::string_view nodeType(type);
-      if (nodeType.find("comment") != std::string_view::npos) {
-        size_t start = ts_node_start_byte(node);
-        size_t end = ts_node_end_byte(node);
-        if (start < end && end <= text.size()) {
-          std::string segmentText = text.substr(start, end - start);
-          sanitizeComment(segmentText, type);
-
-          CommentSegment segment;
-          segment.startByte = start;
-          segment.endByte = end;
-          segment.sanitized = std::move(segmentText);
-          segments.push_back(std::move(segment));
-        }
+  const std::string &text = text_;
+  // 直前に取り出したノード。その内側のノード (ネストしたコメントなど) は除く
+  bool hasLast = false;
+  bool lastIsComment = false;
+  size_t lastStart = 0;
+  size_t lastEnd = 0;
+
+  auto run = [&](uint32_t rangeStart, uint32_t rangeEnd) {
+    ts_query_cursor_set_byte_range(cursor_, rangeStart, rangeEnd);
+    ts_query_cursor_exec(cursor_, query->query, root);
+
+    TSQueryMatch match;
+    uint32_t captureIndex = 0;
+    while (ts_query_cursor_next_capture(cursor_, &match, &captureIndex)) {
+      const TSQueryCapture &capture = match.captures[captureIndex];
+      size_t start = ts_node_start_byte(capture.node);
+      size_t end = ts_node_end_byte(capture.node);
+      if (start >= end || end > text.size()) {
         continue;
       }
-    }
+      if (!windows.empty() && !intersects(windows, start, end)) {
+        continue;
+      }
+
+      const bool isComment = capture.index == query->commentCapture;
+      if (hasLast && start < lastEnd) {
+        // 同じ位置から始まる外側のノードが後から来た場合は置き換える
+        if (start != lastStart || end <= lastEnd) {
+          continue;
+        }
+        if (lastIsComment) {
+          comments.pop_back();
+        } else {
+          textNodes.pop_back();
+        }
+        hasLast = false;
+      }
 
-    uint32_t childCount = ts_node_child_count(node);
-    for (uint32_t i = 0; i < childCount; ++i) {
-      TSNode child = ts_node_child(node, i);
-      if (!ts_node_is_null(child)) {
-        stack.push_back(child);
+      if (isComment) {
+        comments.push_back({start, end, ts_node_type(capture.node)});
+      } else {
+        size_t trimmedStart = start;
+        while (trimmedStart < end &&
+               std::isspace(static_cast<unsigned char>(text[trimmedStart]))) {
+          ++trimmedStart;
+        }
+        size_t trimmedEnd = end;
+        while (trimmedEnd > trimmedStart &&
+               std::isspace(static_cast<unsigned char>(text[trimmedEnd - 1]))) {
+          --trimmedEnd;
+        }
+        if (trimmedEnd <= trimmedStart) {
+          continue;
+        }
+        textNodes.push_back({start, end, trimmedStart, trimmedEnd});
       }
+
+      hasLast = true;
+      lastIsComment = isComment;
+      lastStart = start;
+      lastEnd = end;
     }
+  };
+
+  if (windows.empty()) {
+    run(0, UINT32_MAX);
+    return;
+  }
+  // 範囲の端に接するノードも拾えるよう、1バイトずつ広げて実行する
+  for (const auto &window : windows) {
+    uint32_t rangeStart =
+        window.start > 0 ? static_cast<uint32_t>(window.start - 1) : 0;
+    run(rangeStart, static_cast<uint32_t>(window.end + 1));
   }
+}
 
-  return segments;
+void restoreSanitized(const std::string &text, const CommentSegment &segment,
+                      std::string &out) {
+  const size_t docSize = std::min(text.size(), out.size());
+  if (segment.startByte >= docSize) {
+    return;
+  }
+  size_t len = std::min(segment.endByte, docSize) - segment.startByte;
+  std::memcpy(&out[segment.startByte], text.data() + segment.startByte, len);
+  sanitizeComment(&out[segment.startByte], len, segment.nodeType);
 }
 
 } // namespace comments
@@ -0,0 +1,155 @@
+#include "document_buffer.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+namespace MoZuku {
+namespace text {
+
+namespace {
+
+// チャンクの目安の大きさ。これの2倍を超えたら分ける
+constexpr size_t kChunkBytes = 8 * 1024;
+// 編集でこれより小さくなったチャンクは次のチャンクとまとめる
+constexpr size_t kMinChunkBytes = kChunkBytes / 4;
+
+} // namespace
+
+std::string DocumentSnapshot::str() const {
+  std::string text;
+  text.reserve(size_);
+  for (const auto &chunk : chunks_) {
+    text += *chunk;
+  }
+  return text;
+}
+
+DocumentBuffer::Chunk::Chunk(std::string content)
+    : text(std::make_shared<const std::string>(std::move(content))),
+      lines(*text) {}
+
+void DocumentBuffer::split(std::string_view text, std::vector<Chunk> &out) {
+  size_t pos = 0;
+  while (text.size() - pos > 2 * kChunkBytes) {
+    // 目安の位置より後ろの最初の改行で切る。改行がなければ残りは1チャンク
+    const size_t newline = text.find('\n', pos + kChunkBytes);
+    if (newline == std::string_view::npos || newline + 1 == text.size()) {
+      break;
+    }
+    out.emplace_back(std::string(text.substr(pos, newline + 1 - pos)));
+    pos = newline + 1;
+  }
+  if (pos < text.size()) {
+    out.emplace_back(std::string(text.substr(pos)));
+  }
+}
+
+void DocumentBuffer::reset(std::string_view text) {
+  chunks_.clear();
+  split(text, chunks_);
+  if (chunks_.empty()) {
+    chunks_.emplace_back(std::string());
+  }
+  reindex(0);
+}
+
+void DocumentBuffer::reindex(size_t from) {
+  chunkBytes_.resize(chunks_.size());
+  chunkLines_.resize(chunks_.size());
+  size_t byte = from == 0 ? 0 : chunkBytes_[from - 1];
+  size_t line = from == 0 ? 0 : chunkLines_[from - 1];
+  if (from > 0) {
+    // 末尾以外のチャンクの最後の「行」は次のチャンクの先頭行
+    byte += chunks_[from - 1].text->size();
+    line += chunks_[from - 1].lines.lineCount() - 1;
+  }
+  for (size_t i = from; i < chunks_.size(); ++i) {
+    chunkBytes_[i] = byte;
+    chunkLines_[i] = line;
+    byte += chunks_[i].text->size();
+    line += chunks_[i].lines.lineCount() - 1;
+  }
+  size_ = byte;
+}
+
+size_t DocumentBuffer::lineCount() const {
+  return chunkLines_.back() + chunks_.back().lines.lineCount();
+}
+
+size_t DocumentBuffer::chunkAtByte(size_t offset) const {
+  auto it = std::upper_bound(chunkBytes_.begin(), chunkBytes_.end(), offset);
+  return static_cast<size_t>(it - chunkBytes_.begin()) - 1;
+}
+
+size_t DocumentBuffer::chunkAtLine(size_t line) const {
+  auto it = std::upper_bound(chunkLines_.begin(), chunkLines_.end(), line);
+  return static_cast<size_t>(it - chunkLines_.begin()) - 1;
+}
+
+size_t DocumentBuffer::toByteOffset(int line, int character) const {
+  if (line < 0 || static_cast<size_t>(line) >= lineCount()) {
+    return size_;
+  }
+  const size_t index = chunkAtLine(static_cast<size_t>(line));
+  const Chunk &chunk = chunks_[index];
+  return chunkBytes_[index] +
+         chunk.lines.toByteOffset(*chunk.text,
+                                  line - static_cast<int>(chunkLines_[index]),
+                                  character);
+}
+
+void DocumentBuffer::replace(size_t startByte, size_t endByte,
+                             std::string_view replacement) {
+  startByte = std::min(startByte, size_);
+  endByte = std::min(std::max(endByte, startByte), size_);
+
+  size_t first = chunkAtByte(startByte);
+  size_t last = chunkAtByte(endByte);
+
+  // 触れたチャンクだけを1つの文字列にまとめて置き換える
+  const std::string &head = *chunks_[first].text;
+  const std::string &tail = *chunks_[last].text;
+  std::string combined;
+  combined.reserve((startByte - chunkBytes_[first]) + replacement.size() +
+                   (chunkBytes_[last] + tail.size() - endByte));
+  combined.append(head, 0, startByte - chunkBytes_[first]);
+  combined.append(replacement.data(), replacement.size());
+  combined.append(tail, endByte - chunkBytes_[last], std::string::npos);
+
+  // 改行で終わらないか小さすぎるなら次のチャンクまで含める
+  while (last + 1 < chunks_.size() &&
+         (combined.empty() || combined.back() != '\n' ||
+          combined.size() < kMinChunkBytes)) {
+    ++last;
+    combined += *chunks_[last].text;
+  }
+
+  std::vector<Chunk> pieces;
+  split(combined, pieces);
+  if (pieces.empty() && chunks_.size() == last - first + 1) {
+    pieces.emplace_back(std::string());
+  }
+
+  auto eraseBegin = chunks_.begin() + static_cast<std::ptrdiff_t>(first);
+  chunks_.erase(eraseBegin,
+                chunks_.begin() + static_cast<std::ptrdiff_t>(last + 1));
+  chunks_.insert(chunks_.begin() + static_cast<std::ptrdiff_t>(first),
+                 std::make_move_iterator(pieces.begin()),
+                 std::make_move_iterator(pieces.end()));
+  reindex(std::min(first, chunks_.size() - 1));
+}
+
+DocumentSnapshot DocumentBuffer::snapshot() const {
+  DocumentSnapshot snapshot;
+  snapshot.chunks_.reserve(chunks_.size());
+  for (const auto &chunk : chunks_) {
+    snapshot.chunks_.push_back(chunk.text);
+  }
+  snapshot.size_ = size_;
+  return snapshot;
+}
+
+std::string DocumentBuffer::str() const { return snapshot().str(); }
+
+} // namespace text
+} // namespace MoZuku
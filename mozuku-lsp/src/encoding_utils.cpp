@@ -1,38 +1,172 @@
 #include "encoding_utils.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <cstring>
 #include <iconv.h>
+#include <memory>
 
 namespace MoZuku {
 namespace encoding {
 
-std::string convertEncoding(const std::string &input,
-                            const std::string &fromCharset,
-                            const std::string &toCharset) {
-  if (input.empty())
-    return input;
+namespace {
 
-  iconv_t cd = iconv_open(toCharset.c_str(), fromCharset.c_str());
-  if (cd == (iconv_t)-1) {
-    return input;
+const iconv_t kInvalid = reinterpret_cast<iconv_t>(-1);
+
+inline iconv_t handle(void *cd) { return static_cast<iconv_t>(cd); }
+
+inline size_t utf8SeqLen(unsigned char c) {
+  return (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+}
+
+// 変換後の文字コードで、先頭バイトから1文字のバイト数を求める
+using LeadLength = size_t (*)(unsigned char);
+
+size_t eucJpLeadLength(unsigned char c) {
+  if (c == 0x8F) {
+    return 3; // JIS X 0212
+  }
+  return (c == 0x8E || c >= 0xA1) ? 2 : 1;
+}
+
+size_t shiftJisLeadLength(unsigned char c) {
+  return ((c >= 0x81 && c <= 0x9F) || (c >= 0xE0 && c <= 0xFC)) ? 2 : 1;
+}
+
+// 文字の長さを先頭バイトで決められる文字コードなら、その関数を返す
+LeadLength leadLengthFor(const std::string &charset) {
+  std::string name;
+  for (char c : charset) {
+    if (c != '-' && c != '_') {
+      name.push_back(
+          static_cast<char>(std::toupper(static_cast<unsigned char>(c))));
+    }
   }
+  if (name == "EUCJP" || name == "EUCJPMS" || name == "CP51932") {
+    return eucJpLeadLength;
+  }
+  if (name == "SHIFTJIS" || name == "SJIS" || name == "CP932" ||
+      name == "WINDOWS31J" || name == "MSKANJI") {
+    return shiftJisLeadLength;
+  }
+  return nullptr;
+}
 
-  size_t inBytesLeft = input.size();
-  size_t outBytesLeft = input.size() * 4; // Conservative estimate
+struct CachedConverter {
+  std::string from;
+  std::string to;
+  std::unique_ptr<Converter> converter;
+};
 
-  std::string result(outBytesLeft, '\0');
+} // namespace
 
-  char *inBuf = const_cast<char *>(input.data());
-  char *outBuf = &result[0];
+Converter::Converter(const std::string &fromCharset,
+                     const std::string &toCharset)
+    : cd_(iconv_open(toCharset.c_str(), fromCharset.c_str())) {}
 
-  if (iconv(cd, &inBuf, &inBytesLeft, &outBuf, &outBytesLeft) == (size_t)-1) {
-    iconv_close(cd);
-    return input;
+Converter::~Converter() {
+  if (valid()) {
+    iconv_close(handle(cd_));
+  }
+}
+
+bool Converter::valid() const { return handle(cd_) != kInvalid; }
+
+bool Converter::convert(const char *data, size_t size, std::string &out) {
+  out.clear();
+  if (!valid()) {
+    return false;
   }
+  reset();
+  if (!append(data, size, out)) {
+    return false;
+  }
+  finish(out);
+  return true;
+}
+
+void Converter::reset() {
+  if (valid()) {
+    iconv(handle(cd_), nullptr, nullptr, nullptr, nullptr);
+  }
+}
 
-  iconv_close(cd);
+bool Converter::append(const char *data, size_t size, std::string &out) {
+  const size_t base = out.size();
+  if (appendPrefix(data, size, out) != size) {
+    out.resize(base);
+    reset();
+    return false;
+  }
+  return true;
+}
 
-  // Resize result to actual converted size
-  result.resize(result.size() - outBytesLeft);
+size_t Converter::appendPrefix(const char *data, size_t size,
+                               std::string &out) {
+  if (!valid()) {
+    return 0;
+  }
+
+  const size_t base = out.size();
+  // 日本語の文字コード間ならほぼ収まる大きさから始め、足りなければ広げる
+  size_t capacity = size + size / 2 + 8;
+  size_t produced = 0;
+  char *inBuf = const_cast<char *>(data);
+  size_t inBytesLeft = size;
+
+  while (true) {
+    out.resize(base + capacity);
+    char *outBuf = &out[base + produced];
+    size_t outBytesLeft = capacity - produced;
+    size_t rc = iconv(handle(cd_), &inBuf, &inBytesLeft, &outBuf, &outBytesLeft);
+    produced = capacity - outBytesLeft;
+    if (rc != static_cast<size_t>(-1) || errno != E2BIG) {
+      break;
+    }
+    capacity *= 2;
+  }
+
+  out.resize(base + produced);
+  return size - inBytesLeft;
+}
+
+void Converter::finish(std::string &out) {
+  if (!valid()) {
+    return;
+  }
+  char flushBuf[16];
+  char *outBuf = flushBuf;
+  size_t outBytesLeft = sizeof(flushBuf);
+  iconv(handle(cd_), nullptr, nullptr, &outBuf, &outBytesLeft);
+  out.append(flushBuf, sizeof(flushBuf) - outBytesLeft);
+}
+
+Converter &threadConverter(const std::string &fromCharset,
+                           const std::string &toCharset) {
+  // 向きの種類はごく少ないので線形探索で足りる
+  thread_local std::vector<CachedConverter> cache;
+  for (auto &entry : cache) {
+    if (entry.from == fromCharset && entry.to == toCharset) {
+      return *entry.converter;
+    }
+  }
+  cache.push_back(CachedConverter{
+      fromCharset, toCharset,
+      std::make_unique<Converter>(fromCharset, toCharset)});
+  return *cache.back().converter;
+}
+
+std::string convertEncoding(const std::string &input,
+                            const std::string &fromCharset,
+                            const std::string &toCharset) {
+  if (input.empty())
+    return input;
+
+  std::string result;
+  if (!threadConverter(fromCharset, toCharset)
+           .convert(input.data(), input.size(), result)) {
+    return input;
+  }
   return result;
 }
 
@@ -52,5 +186,82 @@ std::string utf8ToSystem(const std::string &input,
   return convertEncoding(input, "UTF-8", systemCharset);
 }
 
+bool utf8ToSystemMapped(const std::string &utf8,
+                        const std::string &systemCharset,
+                        std::string &systemText,
+                        std::vector<uint32_t> &utf8Offsets) {
+  systemText.clear();
+  utf8Offsets.clear();
+
+  Converter &converter = threadConverter("UTF-8", systemCharset);
+  if (!converter.valid()) {
+    return false;
+  }
+  converter.reset();
+
+  systemText.reserve(utf8.size());
+  utf8Offsets.reserve(utf8.size() + 1);
+
+  // [begin, end) を1文字ずつ変換する。変換できない文字は空白にする
+  const auto appendEach = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end;) {
+      const size_t len =
+          std::min(utf8SeqLen(static_cast<unsigned char>(utf8[i])), end - i);
+      if (!converter.append(utf8.data() + i, len, systemText)) {
+        systemText.push_back(' ');
+      }
+      utf8Offsets.resize(systemText.size(), static_cast<uint32_t>(i));
+      i += len;
+    }
+  };
+
+  const LeadLength leadLength = leadLengthFor(systemCharset);
+  size_t i = 0;
+  if (!leadLength) {
+    appendEach(0, utf8.size());
+    i = utf8.size();
+  }
+  while (i < utf8.size()) {
+    // 変換できない文字の手前までを1回で変換し、両側を1文字ずつ突き合わせる
+    const size_t outBase = systemText.size();
+    const size_t consumed =
+        converter.appendPrefix(utf8.data() + i, utf8.size() - i, systemText);
+    const size_t runEnd = i + consumed;
+    size_t in = i;
+    size_t out = outBase;
+    while (in < runEnd && out < systemText.size()) {
+      const size_t outLen =
+          std::min(leadLength(static_cast<unsigned char>(systemText[out])),
+                   systemText.size() - out);
+      utf8Offsets.resize(out + outLen, static_cast<uint32_t>(in));
+      in += std::min(utf8SeqLen(static_cast<unsigned char>(utf8[in])),
+                     runEnd - in);
+      out += outLen;
+    }
+    if (in != runEnd || out != systemText.size()) {
+      // 1文字が1文字に写らなかった区間は1文字ずつ変換し直す
+      systemText.resize(outBase);
+      utf8Offsets.resize(outBase);
+      converter.reset();
+      appendEach(i, runEnd);
+    }
+    i = runEnd;
+
+    if (i < utf8.size()) {
+      converter.reset();
+      const size_t len = std::min(
+          utf8SeqLen(static_cast<unsigned char>(utf8[i])), utf8.size() - i);
+      systemText.push_back(' ');
+      utf8Offsets.push_back(static_cast<uint32_t>(i));
+      i += len;
+    }
+  }
+
+  converter.finish(systemText);
+  utf8Offsets.resize(systemText.size() + 1,
+                     static_cast<uint32_t>(utf8.size()));
+  return true;
+}
+
 } // namespace encoding
 } // namespace MoZuku
@@ -1,7 +1,8 @@
 #include "grammar_checker.hpp"
-#include "pos_analyzer.hpp"
+#include "stats.hpp"
 #include "utf16.hpp"
-#include <cstdlib>
+#include <algorithm>
+#include <memory>
 #include <iostream>
 
 namespace MoZuku {
@@ -9,124 +10,70 @@ namespace grammar {
 
 namespace {
 
+using tokens::FeatureEntry;
+using tokens::PartOfSpeech;
+
 struct RuleContext {
   const std::string &text;
-  const std::vector<TokenData> &tokens;
-  const std::vector<SentenceBoundary> &sentences;
   const std::vector<size_t> &lineStarts;
-  const std::vector<size_t> &tokenBytePositions;
   int severity{2};
 };
 
-bool isAdversativeGa(const std::string &feature) {
-  // MeCab: 品詞,品詞細分類1,品詞細分類2,品詞細分類3,活用型,活用形,原形,...
-  // 逆接の接続助詞「が」: 助詞,接続助詞,*,*,*,*,が,ガ,ガ
-  int fieldIndex = 0;
-  size_t start = 0;
-  size_t end = 0;
-
-  std::string pos, sub1, base;
-  while (end != std::string::npos) {
-    end = feature.find(',', start);
-    std::string part = feature.substr(
-        start, end == std::string::npos ? std::string::npos : end - start);
-    if (fieldIndex == 0)
-      pos = part;
-    else if (fieldIndex == 1)
-      sub1 = part;
-    else if (fieldIndex == 6)
-      base = part;
-
-    if (end == std::string::npos)
-      break;
-    start = end + 1;
-    ++fieldIndex;
-    if (fieldIndex > 6 && !base.empty()) {
-      break;
-    }
-  }
-
-  return pos == "助詞" && sub1 == "接続助詞" && base == "が";
-}
+struct TokenRef {
+  const tokens::TokenStore *tokens;
+  size_t index;
 
-bool isConjunction(const std::string &feature) {
-  size_t comma = feature.find(',');
-  std::string pos =
-      (comma == std::string::npos) ? feature : feature.substr(0, comma);
-  return pos == "接続詞";
-}
+  size_t byteStart() const { return tokens->byteStart(index); }
+  size_t byteEnd() const { return tokens->byteEnd(index); }
+  const FeatureEntry &feature() const { return tokens->feature(index); }
+};
 
-bool isParticle(const std::string &feature) {
-  size_t comma = feature.find(',');
-  std::string pos =
-      (comma == std::string::npos) ? feature : feature.substr(0, comma);
-  return pos == "助詞";
-}
+// 1文ぶんのトークン列 (tokens の [begin, begin + count))
+struct SentenceSpan {
+  const SentenceBoundary &sentence;
+  const tokens::TokenStore &tokens;
+  size_t begin;
+  size_t count;
 
-std::string particleKey(const std::string &feature) {
-  // "助詞,格助詞,一般,..." -> "助詞,格助詞"
-  size_t firstComma = feature.find(',');
-  if (firstComma == std::string::npos) {
-    return feature;
-  }
-  size_t secondComma = feature.find(',', firstComma + 1);
-  if (secondComma == std::string::npos) {
-    return feature.substr(0, firstComma);
+  size_t index(size_t i) const { return begin + i; }
+  const FeatureEntry &feature(size_t i) const {
+    return tokens.feature(begin + i);
   }
-  return feature.substr(0, secondComma);
-}
-
-DetailedPOS parsePos(const std::string &feature) {
-  return MoZuku::pos::POSAnalyzer::parseDetailedPOS(feature.c_str(), "UTF-8");
-}
+};
 
-bool isTargetVerb(const DetailedPOS &pos) {
-  return pos.mainPOS == "動詞" && pos.subPOS1 == "自立" &&
-         pos.inflection == "一段" && pos.conjugation == "未然形";
+std::string_view surfaceOf(const std::string &text,
+                           const tokens::TokenStore &tokens, size_t index) {
+  return std::string_view(text).substr(tokens.byteStart(index),
+                                       tokens.byteLength(index));
 }
 
-bool isRaWord(const DetailedPOS &pos) {
-  return pos.mainPOS == "動詞" && pos.subPOS1 == "接尾" &&
-         pos.baseForm == "れる";
+// 逆接の接続助詞「が」: 助詞,接続助詞,*,*,*,*,が,ガ,ガ
+bool isAdversativeGa(const FeatureEntry &e) {
+  return e.is(PartOfSpeech::Particle) &&
+         e.has(tokens::kSubConjunctiveParticle) && e.baseForm == "が";
 }
 
-bool isSpecialRaCase(const DetailedPOS &pos) {
-  return pos.mainPOS == "動詞" &&
-         (pos.baseForm == "来れる" || pos.baseForm == "見れる");
+bool isConjunction(const FeatureEntry &e) {
+  return e.is(PartOfSpeech::Conjunction);
 }
 
-// UTF-16ベースのトークン位置をUTF-8バイトオフセットに変換
-size_t toByteOffset(const TokenData &token, const std::string &text,
-                    const std::vector<size_t> &lineStarts) {
-  if (token.line >= static_cast<int>(lineStarts.size())) {
-    return text.size();
-  }
-
-  size_t lineStart = lineStarts[token.line];
-  size_t bytePos = lineStart;
-  int utf16Pos = 0;
+bool isParticle(const FeatureEntry &e) { return e.is(PartOfSpeech::Particle); }
 
-  while (bytePos < text.size() && utf16Pos < token.startChar &&
-         text[bytePos] != '\n') {
-    unsigned char c = static_cast<unsigned char>(text[bytePos]);
-    int seqLen = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
-    bytePos += seqLen;
-    utf16Pos += (seqLen == 4) ? 2 : 1;
-  }
+// 動詞,自立,*,*,一段,未然形
+bool isTargetVerb(const FeatureEntry &e) {
+  return e.is(PartOfSpeech::Verb) &&
+         e.has(tokens::kSubIndependent | tokens::kInflectionIchidan |
+               tokens::kConjugationMizen);
+}
 
-  return bytePos;
+bool isRaWord(const FeatureEntry &e) {
+  return e.is(PartOfSpeech::Verb) && e.has(tokens::kSubSuffix) &&
+         e.baseForm == "れる";
 }
 
-std::vector<size_t>
-computeTokenBytePositions(const std::vector<TokenData> &tokens,
-                          const std::string &text,
-                          const std::vector<size_t> &lineStarts) {
-  std::vector<size_t> positions;
-  positions.reserve(tokens.size());
-  for (const auto &token : tokens) {
-    positions.push_back(toByteOffset(token, text, lineStarts));
-  }
-  return positions;
+bool isSpecialRaCase(const FeatureEntry &e) {
+  return e.is(PartOfSpeech::Verb) &&
+         (e.baseForm == "来れる" || e.baseForm == "見れる");
 }
 
 Range makeRange(const RuleContext &ctx, size_t startByte, size_t endByte) {
@@ -136,10 +83,6 @@ Range makeRange(const RuleContext &ctx, size_t startByte, size_t endByte) {
   return range;
 }
 
-bool inSentence(size_t bytePos, const SentenceBoundary &sentence) {
-  return bytePos >= sentence.start && bytePos < sentence.end;
-}
-
 // 文中の読点「、」の出現回数を数える
 size_t countCommas(const std::string &text) {
   size_t count = 0;
@@ -159,339 +102,584 @@ size_t countCommas(const std::string &text) {
 
 } // namespace
 
-static bool isDebugEnabled() {
-  static bool initialized = false;
-  static bool debug = false;
-  if (!initialized) {
-    debug = (std::getenv("MOZUKU_DEBUG") != nullptr);
-    initialized = true;
+// 文書全体で同じ接続詞の連続を検出する (改行をまたぐ場合は対象外)
+void checkConjunctionRepeats(const RuleContext &ctx,
+                             const std::vector<TokenRef> &conjunctions,
+                             std::vector<Diagnostic> &diags, int maxRepeat) {
+  if (maxRepeat <= 0)
+    return;
+
+  bool hasLast = false;
+  std::string_view lastSurface;
+  size_t lastStartByte = 0;
+  size_t lastEndByte = 0;
+  int streak = 1;
+
+  for (const auto &ref : conjunctions) {
+    std::string_view surface = surfaceOf(ctx.text, *ref.tokens, ref.index);
+    size_t currentStart = ref.byteStart();
+    size_t currentEnd = ref.byteEnd();
+
+    bool separatedByNewline = false;
+    if (hasLast && lastEndByte < currentStart) {
+      size_t newline = ctx.text.find('\n', lastEndByte);
+      separatedByNewline = newline != std::string::npos && newline < currentStart;
+    }
+
+    if (hasLast && surface == lastSurface && !separatedByNewline) {
+      ++streak;
+      if (streak > maxRepeat) {
+        Diagnostic diag;
+        diag.range = makeRange(ctx, lastStartByte, currentEnd);
+        diag.severity = ctx.severity;
+        diag.message =
+            "同じ接続詞「" + std::string(surface) + "」が連続しています";
+
+        if (stats::debugEnabled()) {
+          std::cerr << "[DEBUG] Duplicate conjunction '" << surface
+                    << "' detected across punctuation\n";
+        }
+
+        diags.push_back(std::move(diag));
+      }
+    } else {
+      streak = 1;
+    }
+
+    hasLast = true;
+    lastSurface = surface;
+    lastStartByte = currentStart;
+    lastEndByte = currentEnd;
   }
-  return debug;
 }
 
-void checkCommaLimit(const RuleContext &ctx, std::vector<Diagnostic> &diags,
-                     int limit) {
-  if (limit <= 0)
-    return;
+const std::string kMessageRa = "ら抜き言葉を使用しています";
+
+void reportRaDropping(const RuleContext &ctx, const TokenRef &prev,
+                      const TokenRef &current,
+                      std::vector<Diagnostic> &diags) {
+  size_t startByte = prev.byteStart();
+  size_t endByte = current.byteEnd();
+  Diagnostic diag;
+  diag.range = makeRange(ctx, startByte, endByte);
+  diag.severity = ctx.severity;
+  diag.message = kMessageRa;
+  diags.push_back(std::move(diag));
+
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Ra-dropping detected between tokens '"
+              << surfaceOf(ctx.text, *prev.tokens, prev.index) << "' + '"
+              << surfaceOf(ctx.text, *current.tokens, current.index)
+              << "'\n";
+  }
+}
+
+bool isRaDroppingPair(const FeatureEntry &prev, const FeatureEntry &current) {
+  return isTargetVerb(prev) && isRaWord(current);
+}
+
+namespace {
+
+// 1文のトークン列を1度だけ走査するルールの共通インターフェース。
+// 各ルールは自分の状態だけを持ち、トークンごと・文末ごとに呼ばれる
+class SentenceRule {
+public:
+  virtual ~SentenceRule() = default;
+
+  // 文の先頭で状態を初期化する
+  virtual void beginSentence() {}
+  // span の i 番目のトークンを受け取る
+  virtual void onToken(const RuleContext &, const SentenceSpan &, size_t) {}
+  // 文末で、その文について見つけた診断を diags へ出す
+  virtual void endSentence(const RuleContext &ctx, const SentenceSpan &span,
+                           std::vector<Diagnostic> &diags) = 0;
+};
+
+// 一文中の読点「、」の数を制限する
+class CommaLimitRule : public SentenceRule {
+public:
+  explicit CommaLimitRule(int limit) : limit_(limit) {}
 
-  for (const auto &sentence : ctx.sentences) {
+  void endSentence(const RuleContext &ctx, const SentenceSpan &span,
+                   std::vector<Diagnostic> &diags) override {
+    const SentenceBoundary &sentence = span.sentence;
     size_t commaCount = countCommas(sentence.text);
-    if (commaCount <= static_cast<size_t>(limit)) {
-      continue;
+    if (commaCount <= static_cast<size_t>(limit_)) {
+      return;
     }
 
     Diagnostic diag;
     diag.range = makeRange(ctx, sentence.start, sentence.end);
     diag.severity = ctx.severity;
-    diag.message = "一文に使用できる読点「、」は最大" + std::to_string(limit) +
+    diag.message = "一文に使用できる読点「、」は最大" + std::to_string(limit_) +
                    "個までです (現在" + std::to_string(commaCount) + "個) ";
 
-    if (isDebugEnabled()) {
+    if (stats::debugEnabled()) {
       std::cerr << "[DEBUG] Comma limit exceeded in sentence "
                 << sentence.sentenceId << ": count=" << commaCount << "\n";
     }
 
     diags.push_back(std::move(diag));
   }
-}
 
-void checkAdversativeGa(const RuleContext &ctx, std::vector<Diagnostic> &diags,
-                        int maxCount) {
-  if (maxCount <= 0)
-    return;
+private:
+  int limit_;
+};
 
-  for (const auto &sentence : ctx.sentences) {
-    size_t count = 0;
-    for (size_t i = 0; i < ctx.tokens.size(); ++i) {
-      if (!isAdversativeGa(ctx.tokens[i].feature)) {
-        continue;
-      }
-      size_t bytePos = ctx.tokenBytePositions[i];
-      if (inSentence(bytePos, sentence)) {
-        ++count;
-      }
+// 逆接の接続助詞「が」の同一文内での使用回数を制限する
+class AdversativeGaRule : public SentenceRule {
+public:
+  explicit AdversativeGaRule(int maxCount) : maxCount_(maxCount) {}
+
+  void beginSentence() override { count_ = 0; }
+
+  void onToken(const RuleContext &, const SentenceSpan &span,
+               size_t i) override {
+    if (isAdversativeGa(span.feature(i))) {
+      ++count_;
     }
+  }
 
-    if (count <= static_cast<size_t>(maxCount)) {
-      continue;
+  void endSentence(const RuleContext &ctx, const SentenceSpan &span,
+                   std::vector<Diagnostic> &diags) override {
+    if (count_ <= static_cast<size_t>(maxCount_)) {
+      return;
     }
 
+    const SentenceBoundary &sentence = span.sentence;
     Diagnostic diag;
     diag.range = makeRange(ctx, sentence.start, sentence.end);
     diag.severity = ctx.severity;
     diag.message = "逆接の接続助詞「が」が同一文で" +
-                   std::to_string(maxCount + 1) + "回以上使われています (" +
-                   std::to_string(count) + "回) ";
+                   std::to_string(maxCount_ + 1) + "回以上使われています (" +
+                   std::to_string(count_) + "回) ";
 
-    if (isDebugEnabled()) {
+    if (stats::debugEnabled()) {
       std::cerr << "[DEBUG] Adversative 'が' exceeded in sentence "
-                << sentence.sentenceId << ": count=" << count << "\n";
+                << sentence.sentenceId << ": count=" << count_ << "\n";
     }
 
     diags.push_back(std::move(diag));
   }
-}
 
-void checkDuplicateParticleSurface(const RuleContext &ctx,
-                                   std::vector<Diagnostic> &diags,
-                                   int maxRepeat) {
-  if (maxRepeat <= 0)
-    return;
+private:
+  int maxCount_;
+  size_t count_{0};
+};
 
-  for (const auto &sentence : ctx.sentences) {
-    std::string lastSurface;
-    std::string lastKey;
-    size_t lastStartByte = 0;
-    int streak = 1;
-    bool hasLast = false;
-
-    for (size_t i = 0; i < ctx.tokens.size(); ++i) {
-      const auto &token = ctx.tokens[i];
-      size_t bytePos = ctx.tokenBytePositions[i];
-      if (!inSentence(bytePos, sentence)) {
-        continue;
-      }
+// 文末でまとめて出すルール向けに、見つけた診断を溜めておく基底
+class BufferedRule : public SentenceRule {
+public:
+  void endSentence(const RuleContext &, const SentenceSpan &,
+                   std::vector<Diagnostic> &diags) override {
+    for (auto &diag : pending_) {
+      diags.push_back(std::move(diag));
+    }
+    pending_.clear();
+  }
 
-      if (!isParticle(token.feature)) {
-        continue;
-      }
+protected:
+  void report(const RuleContext &ctx, size_t startByte, size_t endByte,
+              std::string message) {
+    Diagnostic diag;
+    diag.range = makeRange(ctx, startByte, endByte);
+    diag.severity = ctx.severity;
+    diag.message = std::move(message);
+    pending_.push_back(std::move(diag));
+  }
+
+private:
+  std::vector<Diagnostic> pending_;
+};
 
-      std::string currentKey = particleKey(token.feature);
+// 間に他のトークンを挟んでも、同じ表層・同じ分類の助詞が続くものを検出する
+class DuplicateParticleSurfaceRule : public BufferedRule {
+public:
+  explicit DuplicateParticleSurfaceRule(int maxRepeat)
+      : maxRepeat_(maxRepeat) {}
+
+  void beginSentence() override {
+    lastSurface_ = std::string_view();
+    lastKey_ = 0;
+    lastStartByte_ = 0;
+    streak_ = 1;
+    hasLast_ = false;
+  }
+
+  void onToken(const RuleContext &ctx, const SentenceSpan &span,
+               size_t i) override {
+    const FeatureEntry &feature = span.feature(i);
+    if (!isParticle(feature)) {
+      return;
+    }
 
-      if (hasLast && token.surface == lastSurface && currentKey == lastKey) {
-        ++streak;
-        if (streak > maxRepeat) {
-          size_t currentEnd = bytePos + token.surface.size();
-          Diagnostic diag;
-          diag.range = makeRange(ctx, lastStartByte, currentEnd);
-          diag.severity = ctx.severity;
-          diag.message = "同じ助詞「" + token.surface + "」が連続しています";
+    size_t index = span.index(i);
+    size_t bytePos = span.tokens.byteStart(index);
+    std::string_view surface = surfaceOf(ctx.text, span.tokens, index);
+    uint32_t currentKey = feature.posKey;
 
-          if (isDebugEnabled()) {
-            std::cerr << "[DEBUG] Duplicate particle '" << token.surface
-                      << "' in sentence " << sentence.sentenceId << "\n";
-          }
+    if (hasLast_ && surface == lastSurface_ && currentKey == lastKey_) {
+      ++streak_;
+      if (streak_ > maxRepeat_) {
+        report(ctx, lastStartByte_, span.tokens.byteEnd(index),
+               "同じ助詞「" + std::string(surface) + "」が連続しています");
 
-          diags.push_back(std::move(diag));
+        if (stats::debugEnabled()) {
+          std::cerr << "[DEBUG] Duplicate particle '" << surface
+                    << "' in sentence " << span.sentence.sentenceId << "\n";
         }
-      } else {
-        streak = 1;
-        lastStartByte = bytePos;
       }
-
-      lastSurface = token.surface;
-      lastKey = currentKey;
-      hasLast = true;
+    } else {
+      streak_ = 1;
+      lastStartByte_ = bytePos;
     }
+
+    lastSurface_ = surface;
+    lastKey_ = currentKey;
+    hasLast_ = true;
   }
-}
 
-void checkAdjacentParticles(const RuleContext &ctx,
-                            std::vector<Diagnostic> &diags, int maxRepeat) {
-  if (maxRepeat <= 0)
-    return;
+private:
+  int maxRepeat_;
+  std::string_view lastSurface_;
+  uint32_t lastKey_{0};
+  size_t lastStartByte_{0};
+  int streak_{1};
+  bool hasLast_{false};
+};
 
-  for (const auto &sentence : ctx.sentences) {
-    bool prevIsParticle = false;
-    std::string prevKey;
-    TokenData prevToken;
-    size_t prevStartByte = 0;
-    int streak = 1;
-
-    for (size_t i = 0; i < ctx.tokens.size(); ++i) {
-      const auto &token = ctx.tokens[i];
-      size_t bytePos = ctx.tokenBytePositions[i];
-      if (!inSentence(bytePos, sentence)) {
-        continue;
-      }
+// 隣接する同じ分類の助詞の連続を検出する
+class AdjacentParticlesRule : public BufferedRule {
+public:
+  explicit AdjacentParticlesRule(int maxRepeat) : maxRepeat_(maxRepeat) {}
+
+  void beginSentence() override {
+    prevIsParticle_ = false;
+    prevKey_ = 0;
+    prevIndex_ = 0;
+    prevStartByte_ = 0;
+    streak_ = 1;
+  }
 
-      bool currentIsParticle = isParticle(token.feature);
-      std::string currentKey = particleKey(token.feature);
-      if (currentIsParticle && prevIsParticle && currentKey == prevKey &&
-          bytePos == prevStartByte + prevToken.surface.size()) {
-        ++streak;
-        if (streak > maxRepeat) {
-          size_t currentEnd = bytePos + token.surface.size();
-          Diagnostic diag;
-          diag.range = makeRange(ctx, prevStartByte, currentEnd);
-          diag.severity = ctx.severity;
-          diag.message = "助詞が連続して使われています";
-
-          if (isDebugEnabled()) {
-            std::cerr << "[DEBUG] Consecutive particles '" << prevToken.surface
-                      << "' -> '" << token.surface << "' in sentence "
-                      << sentence.sentenceId << "\n";
-          }
-
-          diags.push_back(std::move(diag));
-        }
-      } else {
-        streak = 1;
-        if (currentIsParticle) {
-          prevStartByte = bytePos;
+  void onToken(const RuleContext &ctx, const SentenceSpan &span,
+               size_t i) override {
+    size_t index = span.index(i);
+    size_t bytePos = span.tokens.byteStart(index);
+    const FeatureEntry &feature = span.feature(i);
+
+    bool currentIsParticle = isParticle(feature);
+    uint32_t currentKey = feature.posKey;
+    if (currentIsParticle && prevIsParticle_ && currentKey == prevKey_ &&
+        bytePos == span.tokens.byteEnd(prevIndex_)) {
+      ++streak_;
+      if (streak_ > maxRepeat_) {
+        report(ctx, prevStartByte_, span.tokens.byteEnd(index),
+               "助詞が連続して使われています");
+
+        if (stats::debugEnabled()) {
+          std::cerr << "[DEBUG] Consecutive particles '"
+                    << surfaceOf(ctx.text, span.tokens, prevIndex_) << "' -> '"
+                    << surfaceOf(ctx.text, span.tokens, index)
+                    << "' in sentence " << span.sentence.sentenceId << "\n";
         }
       }
-
-      prevIsParticle = currentIsParticle;
+    } else {
+      streak_ = 1;
       if (currentIsParticle) {
-        prevToken = token;
-        prevStartByte = bytePos;
-        prevKey = currentKey;
+        prevStartByte_ = bytePos;
       }
     }
-  }
-}
-
-void checkConjunctionRepeats(const RuleContext &ctx,
-                             std::vector<Diagnostic> &diags, int maxRepeat) {
-  if (maxRepeat <= 0)
-    return;
 
-  std::string lastSurface;
-  size_t lastStartByte = 0;
-  size_t lastEndByte = 0;
-  int streak = 1;
-  bool hasLast = false;
-
-  for (size_t i = 0; i < ctx.tokens.size(); ++i) {
-    const auto &token = ctx.tokens[i];
-    if (!isConjunction(token.feature)) {
-      continue;
+    prevIsParticle_ = currentIsParticle;
+    if (currentIsParticle) {
+      prevIndex_ = index;
+      prevStartByte_ = bytePos;
+      prevKey_ = currentKey;
     }
+  }
 
-    size_t currentStart = ctx.tokenBytePositions[i];
-    size_t currentEnd = currentStart + token.surface.size();
-
-    bool separatedByNewline =
-        hasLast && ctx.text.find('\n', lastEndByte) != std::string::npos &&
-        ctx.text.find('\n', lastEndByte) < currentStart;
+private:
+  int maxRepeat_;
+  bool prevIsParticle_{false};
+  uint32_t prevKey_{0};
+  size_t prevIndex_{0};
+  size_t prevStartByte_{0};
+  int streak_{1};
+};
 
-    if (hasLast && token.surface == lastSurface && !separatedByNewline) {
-      ++streak;
-      if (streak > maxRepeat) {
-        Diagnostic diag;
-        diag.range = makeRange(ctx, lastStartByte, currentEnd);
-        diag.severity = ctx.severity;
-        diag.message = "同じ接続詞「" + token.surface + "」が連続しています";
+// ら抜き言葉。単体の特殊ケースを先に、2トークンの組み合わせを後に報告する
+class RaDroppingRule : public SentenceRule {
+public:
+  void onToken(const RuleContext &ctx, const SentenceSpan &span,
+               size_t i) override {
+    size_t index = span.index(i);
 
-        if (isDebugEnabled()) {
-          std::cerr << "[DEBUG] Duplicate conjunction '" << token.surface
-                    << "' detected across punctuation\n";
-        }
+    // 特殊ケース (単体で「来れる」「見れる」)
+    if (isSpecialRaCase(span.feature(i))) {
+      Diagnostic diag;
+      diag.range = makeRange(ctx, span.tokens.byteStart(index),
+                             span.tokens.byteEnd(index));
+      diag.severity = ctx.severity;
+      diag.message = kMessageRa;
+      specialCases_.push_back(std::move(diag));
 
-        diags.push_back(std::move(diag));
+      if (stats::debugEnabled()) {
+        std::cerr << "[DEBUG] Ra-dropping special case detected: "
+                  << surfaceOf(ctx.text, span.tokens, index) << "\n";
       }
-    } else {
-      streak = 1;
-      lastStartByte = currentStart;
     }
 
-    lastSurface = token.surface;
-    lastStartByte = currentStart;
-    lastEndByte = currentEnd;
-    hasLast = true;
+    // 2トークン組み合わせ (動詞一段未然形 + 接尾「れる」)
+    if (i > 0 && isRaDroppingPair(span.feature(i - 1), span.feature(i))) {
+      reportRaDropping(ctx, {&span.tokens, span.index(i - 1)},
+                       {&span.tokens, index}, pairs_);
+    }
   }
-}
-
-void checkRaDropping(const RuleContext &ctx, std::vector<Diagnostic> &diags) {
-  const std::string messageRa = "ら抜き言葉を使用しています";
 
-  // 特殊ケース (単体で「来れる」「見れる」)
-  for (size_t i = 0; i < ctx.tokens.size(); ++i) {
-    const auto &token = ctx.tokens[i];
-    DetailedPOS pos = parsePos(token.feature);
-    if (!isSpecialRaCase(pos)) {
-      continue;
+  void endSentence(const RuleContext &, const SentenceSpan &,
+                   std::vector<Diagnostic> &diags) override {
+    for (auto &diag : specialCases_) {
+      diags.push_back(std::move(diag));
+    }
+    for (auto &diag : pairs_) {
+      diags.push_back(std::move(diag));
     }
+    specialCases_.clear();
+    pairs_.clear();
+  }
 
-    size_t startByte = ctx.tokenBytePositions[i];
-    size_t endByte = startByte + token.surface.size();
-    Diagnostic diag;
-    diag.range = makeRange(ctx, startByte, endByte);
-    diag.severity = ctx.severity;
-    diag.message = messageRa;
-    diags.push_back(std::move(diag));
+private:
+  std::vector<Diagnostic> specialCases_;
+  std::vector<Diagnostic> pairs_;
+};
 
-    if (isDebugEnabled()) {
-      std::cerr << "[DEBUG] Ra-dropping special case detected: "
-                << token.surface << "\n";
+// 有効なルールを1度ずつ登録し、文ごとにトークンを1回だけ走査して各ルールへ配る。
+// 診断は登録順 (= 従来のルール実行順) に文末でまとめて出す
+class RuleEngine {
+public:
+  explicit RuleEngine(const AnalysisConfig &config) {
+    const auto &rules = config.rules;
+    if (rules.commaLimit && rules.commaLimitMax > 0) {
+      add(std::make_unique<CommaLimitRule>(rules.commaLimitMax));
+    }
+    if (rules.adversativeGa && rules.adversativeGaMax > 0) {
+      add(std::make_unique<AdversativeGaRule>(rules.adversativeGaMax));
+    }
+    if (rules.duplicateParticleSurface &&
+        rules.duplicateParticleSurfaceMaxRepeat > 0) {
+      add(std::make_unique<DuplicateParticleSurfaceRule>(
+          rules.duplicateParticleSurfaceMaxRepeat));
+    }
+    if (rules.adjacentParticles && rules.adjacentParticlesMaxRepeat > 0) {
+      add(std::make_unique<AdjacentParticlesRule>(
+          rules.adjacentParticlesMaxRepeat));
+    }
+    if (rules.raDropping) {
+      add(std::make_unique<RaDroppingRule>());
     }
+    // WarningLevels (config.warnings) の実験的チェックもここで登録する
   }
 
-  // 2トークン組み合わせ (動詞一段未然形 + 接尾「れる」)
-  DetailedPOS prevPos;
-  TokenData prevToken;
-  bool hasPrev = false;
-
-  for (size_t i = 0; i < ctx.tokens.size(); ++i) {
-    const auto &token = ctx.tokens[i];
-    DetailedPOS pos = parsePos(token.feature);
+  void add(std::unique_ptr<SentenceRule> rule) {
+    rules_.push_back(std::move(rule));
+  }
 
-    if (hasPrev && isTargetVerb(prevPos) && isRaWord(pos)) {
-      size_t startByte = ctx.tokenBytePositions[i - 1];
-      size_t endByte = ctx.tokenBytePositions[i] + token.surface.size();
-      Diagnostic diag;
-      diag.range = makeRange(ctx, startByte, endByte);
-      diag.severity = ctx.severity;
-      diag.message = messageRa;
-      diags.push_back(std::move(diag));
+  bool empty() const { return rules_.empty(); }
 
-      if (isDebugEnabled()) {
-        std::cerr << "[DEBUG] Ra-dropping detected between tokens '"
-                  << prevToken.surface << "' + '" << token.surface << "'\n";
+  void run(const RuleContext &ctx, const SentenceSpan &span,
+           std::vector<Diagnostic> &diags) {
+    for (auto &rule : rules_) {
+      rule->beginSentence();
+    }
+    for (size_t i = 0; i < span.count; ++i) {
+      for (auto &rule : rules_) {
+        rule->onToken(ctx, span, i);
       }
     }
+    for (auto &rule : rules_) {
+      rule->endSentence(ctx, span, diags);
+    }
+  }
+
+private:
+  std::vector<std::unique_ptr<SentenceRule>> rules_;
+};
 
-    prevPos = pos;
-    prevToken = token;
-    hasPrev = true;
+} // namespace
+
+// 共通設定から報告時の重要度を決める。報告不要なら false を返す
+bool resolveSeverity(const MoZukuConfig *config, int &severity) {
+  if (!config || !config->analysis.grammarCheck) {
+    return false;
   }
+
+  // ルール共通設定 (現状は警告レベル固定)
+  severity = 2; // Warning
+  const int minSeverity = config->analysis.warningMinSeverity;
+  // 現在の最小レベルより軽い場合は何も報告しない
+  return severity >= minSeverity;
 }
 
-void GrammarChecker::checkGrammar(
-    const std::string &text, const std::vector<TokenData> &tokens,
-    const std::vector<SentenceBoundary> &sentences,
-    std::vector<Diagnostic> &diags, const MoZukuConfig *config) {
-  if (!config || !config->analysis.grammarCheck) {
+void GrammarChecker::checkGrammar(const AnalysisResult &analysis,
+                                  std::vector<Diagnostic> &diags,
+                                  const MoZukuConfig *config) {
+  int severity = 2;
+  if (!resolveSeverity(config, severity)) {
     return;
   }
+  stats::ScopedTimer timer("grammar.check");
+
+  const auto &tokens = analysis.tokens;
+  const size_t tokenCount = tokens.size();
+
+  RuleContext ctx{analysis.text, analysis.lineStarts, severity};
+  RuleEngine engine(config->analysis);
+
+  // トークンは文書順に並んでいるため、文の境界とトークンを並行して1度だけ走査する
+  std::vector<SentenceTokens> views;
+  views.reserve(analysis.sentences.size());
+  size_t index = 0;
+  for (const auto &sentence : analysis.sentences) {
+    while (index < tokenCount && tokens.byteStart(index) < sentence.start)
+      ++index;
+    size_t begin = index;
+    while (index < tokenCount && tokens.byteStart(index) < sentence.end)
+      ++index;
+
+    SentenceSpan span{sentence, tokens, begin, index - begin};
+    engine.run(ctx, span, diags);
+
+    SentenceTokens view;
+    view.tokens = &tokens;
+    view.begin = begin;
+    view.count = span.count;
+    views.push_back(view);
+  }
 
-  std::vector<size_t> lineStarts = computeLineStarts(text);
-  std::vector<size_t> tokenBytePositions =
-      computeTokenBytePositions(tokens, text, lineStarts);
+  checkDocument(analysis.text, analysis.lineStarts, views, diags, config);
+}
 
-  // ルール共通設定 (現状は警告レベル固定)
-  const int severity = 2; // Warning
-  const int minSeverity = config->analysis.warningMinSeverity;
-  if (severity < minSeverity) {
-    // 現在の最小レベルより軽い場合は何も報告しない
+void GrammarChecker::checkSentence(const std::string &text,
+                                   const std::vector<size_t> &lineStarts,
+                                   const SentenceBoundary &sentence,
+                                   const tokens::TokenStore &tokens,
+                                   std::vector<Diagnostic> &diags,
+                                   const MoZukuConfig *config) {
+  int severity = 2;
+  if (!resolveSeverity(config, severity)) {
     return;
   }
+  stats::ScopedTimer timer("grammar.sentence");
 
-  RuleContext ctx{text,    tokens, sentences, lineStarts, tokenBytePositions,
-                  severity};
+  RuleContext ctx{text, lineStarts, severity};
+  SentenceSpan span{sentence, tokens, 0, tokens.size()};
+  RuleEngine(config->analysis).run(ctx, span, diags);
+}
 
-  if (config && config->analysis.rules.commaLimit) {
-    checkCommaLimit(ctx, diags, config->analysis.rules.commaLimitMax);
+void GrammarChecker::checkDocument(const std::string &text,
+                                   const std::vector<size_t> &lineStarts,
+                                   const std::vector<SentenceTokens> &sentences,
+                                   std::vector<Diagnostic> &diags,
+                                   const MoZukuConfig *config) {
+  int severity = 2;
+  if (!resolveSeverity(config, severity)) {
+    return;
   }
-  if (config && config->analysis.rules.adversativeGa) {
-    checkAdversativeGa(ctx, diags, config->analysis.rules.adversativeGaMax);
+  stats::ScopedTimer timer("grammar.document");
+
+  RuleContext ctx{text, lineStarts, severity};
+  const auto &rules = config->analysis.rules;
+
+  if (rules.conjunctionRepeat) {
+    std::vector<TokenRef> conjunctions;
+    for (const auto &view : sentences) {
+      if (view.conjunctions) {
+        for (size_t i : *view.conjunctions) {
+          conjunctions.push_back({view.tokens, view.begin + i});
+        }
+        continue;
+      }
+      for (size_t i = 0; i < view.count; ++i) {
+        if (isConjunction(view.tokens->feature(view.begin + i))) {
+          conjunctions.push_back({view.tokens, view.begin + i});
+        }
+      }
+    }
+    checkConjunctionRepeats(ctx, conjunctions, diags,
+                            rules.conjunctionRepeatMax);
   }
-  if (config && config->analysis.rules.duplicateParticleSurface) {
-    checkDuplicateParticleSurface(
-        ctx, diags, config->analysis.rules.duplicateParticleSurfaceMaxRepeat);
+
+  // 文の境界をまたぐら抜き (前の文の末尾トークン + 次の文の先頭トークン)
+  if (rules.raDropping) {
+    TokenRef prev{nullptr, 0};
+    for (const auto &view : sentences) {
+      if (view.count == 0) {
+        continue;
+      }
+      TokenRef first{view.tokens, view.begin};
+      if (prev.tokens && isRaDroppingPair(prev.feature(), first.feature())) {
+        reportRaDropping(ctx, prev, first, diags);
+      }
+      prev = {view.tokens, view.begin + view.count - 1};
+    }
   }
-  if (config && config->analysis.rules.adjacentParticles) {
-    checkAdjacentParticles(ctx, diags,
-                           config->analysis.rules.adjacentParticlesMaxRepeat);
+}
+
+// 文末の述語以外へ係る文節が、これより多くの文節を挟んで離れていたら報告する
+// (主題や主語が文末の述語へ遠くから係るのは普通なので対象外)
+constexpr int kMaxModifierDistance = 4;
+
+void GrammarChecker::checkStructure(
+    const std::string &text, const std::vector<size_t> &lineStarts,
+    const tokens::TokenStore &tokens, size_t begin,
+    const std::vector<DependencyInfo> &dependencies,
+    std::vector<Diagnostic> &diags, const MoZukuConfig *config) {
+  int severity = 2;
+  if (!resolveSeverity(config, severity) ||
+      !config->analysis.warnings.sentenceStructure) {
+    return;
   }
-  if (config && config->analysis.rules.conjunctionRepeat) {
-    checkConjunctionRepeats(ctx, diags,
-                            config->analysis.rules.conjunctionRepeatMax);
+  stats::ScopedTimer timer("grammar.structure");
+
+  RuleContext ctx{text, lineStarts, severity};
+  const int chunkCount = static_cast<int>(dependencies.size());
+  for (const auto &chunk : dependencies) {
+    const int head = chunk.headId;
+    if (head < 0 || head >= chunkCount - 1 || chunk.tokenCount == 0) {
+      continue;
+    }
+    const int distance = head - chunk.chunkId - 1;
+    if (distance <= kMaxModifierDistance) {
+      continue;
+    }
+
+    const size_t first = begin + chunk.tokenBegin;
+    const size_t last = first + chunk.tokenCount - 1;
+    Diagnostic diag;
+    diag.range = makeRange(ctx, tokens.byteStart(first), tokens.byteEnd(last));
+    diag.severity = ctx.severity;
+    diag.message = "係り先の「" + dependencies[head].text + "」との間に" +
+                   std::to_string(distance) +
+                   "個の文節が挟まっています。語順を見直してください";
+
+    if (stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Distant modifier detected: chunk " << chunk.chunkId
+                << " -> " << head << "\n";
+    }
+
+    diags.push_back(std::move(diag));
   }
-  if (config && config->analysis.rules.raDropping) {
-    checkRaDropping(ctx, diags);
+}
+
+std::vector<size_t>
+GrammarChecker::findConjunctions(const tokens::TokenStore &tokens) {
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (isConjunction(tokens.feature(i))) {
+      indices.push_back(i);
+    }
   }
+  return indices;
 }
 
 } // namespace grammar
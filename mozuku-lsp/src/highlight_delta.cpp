@@ -0,0 +1,103 @@
+#include "highlight_delta.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+namespace MoZuku {
+namespace highlights {
+
+namespace {
+
+bool tupleLess(const uint32_t *a, const uint32_t *b, size_t stride) {
+  return std::lexicographical_compare(a, a + stride, b, b + stride);
+}
+
+} // namespace
+
+void HighlightSet::sort() {
+  const size_t count = size();
+  // ほとんどの場合は発生順のまま並んでいる
+  bool sorted = true;
+  for (size_t i = 1; i < count && sorted; ++i) {
+    sorted = !tupleLess(&values[i * stride], &values[(i - 1) * stride], stride);
+  }
+  if (sorted) {
+    return;
+  }
+
+  std::vector<size_t> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return tupleLess(&values[a * stride], &values[b * stride], stride);
+  });
+  std::vector<uint32_t> result;
+  result.reserve(values.size());
+  for (size_t index : order) {
+    result.insert(result.end(), values.begin() + index * stride,
+                  values.begin() + (index + 1) * stride);
+  }
+  values = std::move(result);
+}
+
+void mergeAdjacent(const std::string &text,
+                   std::vector<std::pair<size_t, size_t>> &ranges) {
+  size_t out = 0;
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    if (out > 0) {
+      auto &last = ranges[out - 1];
+      const size_t gapEnd = std::min(ranges[i].first, text.size());
+      size_t pos = std::min(last.second, gapEnd);
+      while (pos < gapEnd && (text[pos] == ' ' || text[pos] == '\t')) {
+        ++pos;
+      }
+      if (pos == gapEnd && ranges[i].first >= last.first) {
+        last.second = std::max(last.second, ranges[i].second);
+        continue;
+      }
+    }
+    ranges[out++] = ranges[i];
+  }
+  ranges.resize(out);
+}
+
+HighlightDelta diff(const HighlightSet &previous, const HighlightSet &next) {
+  HighlightDelta delta;
+  const size_t stride = next.stride;
+  const uint32_t *a = previous.values.data();
+  const uint32_t *b = next.values.data();
+  const uint32_t *aEnd = a + previous.values.size();
+  const uint32_t *bEnd = b + next.values.size();
+  while (a < aEnd || b < bEnd) {
+    if (b == bEnd || (a < aEnd && tupleLess(a, b, stride))) {
+      delta.removed.insert(delta.removed.end(), a, a + stride);
+      a += stride;
+    } else if (a == aEnd || tupleLess(b, a, stride)) {
+      delta.inserted.insert(delta.inserted.end(), b, b + stride);
+      b += stride;
+    } else {
+      a += stride;
+      b += stride;
+    }
+  }
+  return delta;
+}
+
+std::vector<uint32_t> encodeRelative(const std::vector<uint32_t> &values,
+                                     size_t stride) {
+  std::vector<uint32_t> data(values.size());
+  uint32_t prevLine = 0, prevChar = 0;
+  for (size_t i = 0; i + stride <= values.size(); i += stride) {
+    const uint32_t line = values[i];
+    const uint32_t startChar = values[i + 1];
+    data[i] = line - prevLine;
+    data[i + 1] = line == prevLine ? startChar - prevChar : startChar;
+    std::copy(values.begin() + i + 2, values.begin() + i + stride,
+              data.begin() + i + 2);
+    prevLine = line;
+    prevChar = startChar;
+  }
+  return data;
+}
+
+} // namespace highlights
+} // namespace MoZuku
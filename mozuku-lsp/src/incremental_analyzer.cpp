@@ -0,0 +1,457 @@
+#include "incremental_analyzer.hpp"
+#include "grammar_checker.hpp"
+#include "sentence_cache.hpp"
+#include "stats.hpp"
+#include "text_processor.hpp"
+#include "utf16.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+
+namespace MoZuku {
+namespace incremental {
+
+namespace {
+
+// 編集位置より後ろの座標を新しいテキスト基準へずらす。
+// oldAnchor / newAnchor は編集後も内容が変わらない最初の位置
+struct PositionShift {
+  Position oldAnchor;
+  Position newAnchor;
+
+  void apply(Position &pos) const {
+    if (pos.line == oldAnchor.line) {
+      pos.character += newAnchor.character - oldAnchor.character;
+    }
+    pos.line += newAnchor.line - oldAnchor.line;
+  }
+
+  void apply(tokens::TokenStore &tokens, std::ptrdiff_t byteDelta) const {
+    tokens.shift(oldAnchor.line, newAnchor.character - oldAnchor.character,
+                 newAnchor.line - oldAnchor.line, byteDelta);
+  }
+};
+
+void shiftSentence(SentenceResult &sentence, const PositionShift &shift,
+                   std::ptrdiff_t byteDelta) {
+  sentence.boundary.start += byteDelta;
+  sentence.boundary.end += byteDelta;
+  shift.apply(sentence.tokens, byteDelta);
+  for (auto &diag : sentence.diagnostics) {
+    shift.apply(diag.range.start);
+    shift.apply(diag.range.end);
+  }
+}
+
+// 解析範囲の外は空白と改行だけで、そこからは空の文しかできない。
+// 次の範囲を含む行の先頭まで進めても、文の分割結果は変わらない
+size_t skipToRange(const std::string &text,
+                   const std::vector<size_t> &lineStarts,
+                   const std::vector<ByteRange> &ranges, size_t &index,
+                   size_t pos) {
+  while (index < ranges.size() && ranges[index].endByte <= pos) {
+    ++index;
+  }
+  if (index == ranges.size()) {
+    return text.size();
+  }
+  const size_t rangeStart = ranges[index].startByte;
+  if (rangeStart <= pos) {
+    return pos;
+  }
+  auto it = std::upper_bound(lineStarts.begin(), lineStarts.end(), rangeStart);
+  const size_t lineStart = it == lineStarts.begin() ? 0 : *(it - 1);
+  if (lineStart <= pos) {
+    return pos;
+  }
+  return text::TextProcessor::skipWhitespace(text, lineStart);
+}
+
+} // namespace
+
+void IncrementalAnalyzer::reset() {
+  valid_ = false;
+  partial_ = false;
+  text_.clear();
+  lineStarts_.clear();
+  sentences_.clear();
+  documentDiagnostics_.clear();
+  sentenceStarts_.clear();
+}
+
+UpdateStats IncrementalAnalyzer::update(Analyzer &analyzer,
+                                        const std::string &text,
+                                        const MoZukuConfig *config) {
+  PendingUpdate pending;
+  prepare(analyzer, text, nullptr, config, false, nullptr, pending);
+  UpdateStats stats = pending.stats;
+  commit(std::move(pending), config);
+  return stats;
+}
+
+bool IncrementalAnalyzer::prepare(Analyzer &analyzer, const std::string &text,
+                                  const std::vector<ByteRange> *ranges,
+                                  const MoZukuConfig *config, bool full,
+                                  const std::atomic<bool> *cancel,
+                                  PendingUpdate &update) const {
+  stats::ScopedTimer timer("incremental.prepare");
+  update = PendingUpdate{};
+  update.text = text;
+  // sanitize でバイトが除かれると範囲の座標がずれるので使わない
+  if (text::TextProcessor::sanitizeUTF8InPlace(update.text)) {
+    ranges = nullptr;
+  }
+  update.lineStarts = computeLineStarts(update.text);
+
+  static const std::string kEmptyText;
+  static const std::vector<SentenceResult> kNoSentences;
+  // 暫定の結果には解析していない文があるので差分の元にしない
+  const bool reuse = valid_ && !partial_ && !full;
+  update.reused = reuse;
+  const std::string &oldText = reuse ? text_ : kEmptyText;
+  const std::vector<SentenceResult> &oldSentences =
+      reuse ? sentences_ : kNoSentences;
+  const std::string &newText = update.text;
+
+  const size_t oldSize = oldText.size();
+  const size_t newSize = newText.size();
+
+  // 前後の共通部分を除いた区間が編集範囲
+  const size_t limit = std::min(oldSize, newSize);
+  size_t prefix = static_cast<size_t>(
+      std::mismatch(oldText.begin(), oldText.begin() + limit, newText.begin())
+          .first -
+      oldText.begin());
+  size_t suffix = static_cast<size_t>(
+      std::mismatch(oldText.rbegin(), oldText.rbegin() + (limit - prefix),
+                    newText.rbegin())
+          .first -
+      oldText.rbegin());
+
+  const size_t oldChangeEnd = oldSize - suffix;
+  const size_t newChangeEnd = newSize - suffix;
+  update.byteDelta = static_cast<std::ptrdiff_t>(newSize) -
+                     static_cast<std::ptrdiff_t>(oldSize);
+
+  // 編集範囲より前で完結している文はそのまま再利用する。
+  // テキスト末尾で打ち切られた文は追記で伸びる可能性があるため対象外
+  size_t keep = 0;
+  while (keep < oldSentences.size() &&
+         oldSentences[keep].boundary.end <= prefix &&
+         oldSentences[keep].boundary.end < oldSize) {
+    ++keep;
+  }
+  update.keep = keep;
+
+  size_t pos = keep > 0 ? text::TextProcessor::skipWhitespace(
+                              newText, oldSentences[keep - 1].boundary.end)
+                        : 0;
+
+  // 編集範囲以降で旧テキストの文の開始位置と一致したら、
+  // そこから先の分割結果は旧テキストと同じになる
+  update.reuseFrom = oldSentences.size();
+  std::vector<SentenceBoundary> boundaries;
+  size_t candidate = keep;
+  size_t rangeIndex = 0;
+  while (pos < newSize) {
+    if (ranges) {
+      pos = skipToRange(newText, update.lineStarts, *ranges, rangeIndex, pos);
+      if (pos >= newSize) {
+        break;
+      }
+    }
+    if (pos >= newChangeEnd) {
+      size_t oldPos = static_cast<size_t>(static_cast<std::ptrdiff_t>(pos) -
+                                          update.byteDelta);
+      while (candidate < oldSentences.size() &&
+             oldSentences[candidate].boundary.start < oldPos) {
+        ++candidate;
+      }
+      if (candidate < oldSentences.size() &&
+          oldSentences[candidate].boundary.start == oldPos) {
+        update.reuseFrom = candidate;
+        break;
+      }
+    }
+
+    SentenceBoundary boundary;
+    size_t next = text::TextProcessor::scanSentence(newText, pos, boundary);
+    if (!boundary.text.empty()) {
+      boundary.sentenceId = static_cast<int>(keep + boundaries.size());
+      boundaries.push_back(std::move(boundary));
+    }
+    pos = next;
+  }
+
+  // 再解析する文はスレッドプールに分配し、文書順のスロットへ書き戻す。
+  // 新しい版の解析が予約されたら未着手の文は飛ばして打ち切る
+  update.analyzed.resize(boundaries.size());
+  analyzer.parallelFor(boundaries.size(), [&](size_t i) {
+    if (cancel && cancel->load(std::memory_order_relaxed)) {
+      return;
+    }
+    update.analyzed[i] =
+        analyzeSentence(analyzer, newText, update.lineStarts,
+                        std::move(boundaries[i]), config);
+  });
+  if (cancel && cancel->load()) {
+    if (stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Incremental update cancelled ("
+                << boundaries.size() << " sentences pending)" << std::endl;
+    }
+    return false;
+  }
+
+  if (update.reuseFrom < oldSentences.size()) {
+    update.oldAnchor = byteOffsetToPosition(oldText, lineStarts_, oldChangeEnd);
+    update.newAnchor =
+        byteOffsetToPosition(newText, update.lineStarts, newChangeEnd);
+  }
+
+  update.stats.analyzedSentences = update.analyzed.size();
+  update.stats.reusedSentences = keep + (oldSentences.size() - update.reuseFrom);
+  stats::count("incremental.analyzedSentences",
+               update.stats.analyzedSentences);
+  stats::count("incremental.reusedSentences", update.stats.reusedSentences);
+
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Incremental update: edit=[" << prefix << ", "
+              << oldChangeEnd << ") -> [" << prefix << ", " << newChangeEnd
+              << "), analyzed=" << update.stats.analyzedSentences
+              << ", reused=" << update.stats.reusedSentences << std::endl;
+  }
+
+  return true;
+}
+
+void IncrementalAnalyzer::commit(PendingUpdate &&update,
+                                 const MoZukuConfig *config) {
+  std::vector<SentenceResult> oldSentences;
+  if (valid_ && update.reused) {
+    oldSentences = std::move(sentences_);
+  }
+  const size_t keep = std::min(update.keep, oldSentences.size());
+  const size_t reuseFrom = std::min(update.reuseFrom, oldSentences.size());
+
+  sentences_.clear();
+  sentences_.reserve(keep + update.analyzed.size() +
+                     (oldSentences.size() - reuseFrom));
+  for (size_t i = 0; i < keep; ++i) {
+    sentences_.push_back(std::move(oldSentences[i]));
+  }
+  for (auto &sentence : update.analyzed) {
+    sentences_.push_back(std::move(sentence));
+  }
+
+  PositionShift shift{update.oldAnchor, update.newAnchor};
+  for (size_t i = reuseFrom; i < oldSentences.size(); ++i) {
+    shiftSentence(oldSentences[i], shift, update.byteDelta);
+    sentences_.push_back(std::move(oldSentences[i]));
+  }
+
+  for (size_t i = 0; i < sentences_.size(); ++i) {
+    sentences_[i].boundary.sentenceId = static_cast<int>(i);
+  }
+
+  text_ = std::move(update.text);
+  lineStarts_ = std::move(update.lineStarts);
+  valid_ = true;
+  partial_ = update.partial;
+
+  indexSentences();
+  runDocumentRules(config);
+}
+
+void IncrementalAnalyzer::indexSentences() {
+  sentenceStarts_.clear();
+  sentenceStarts_.reserve(sentences_.size());
+  for (size_t i = 0; i < sentences_.size(); ++i) {
+    const auto &tokens = sentences_[i].tokens;
+    if (!tokens.empty()) {
+      sentenceStarts_.push_back({tokens.line(0), tokens.startChar(0), i});
+    }
+  }
+}
+
+size_t IncrementalAnalyzer::byteOffsetOf(int line, int character) const {
+  if (line < 0 || static_cast<size_t>(line) >= lineStarts_.size()) {
+    return text_.size();
+  }
+  size_t pos = lineStarts_[line];
+  int column = 0;
+  while (pos < text_.size() && column < character && text_[pos] != '\n') {
+    const unsigned char c = static_cast<unsigned char>(text_[pos]);
+    const size_t len = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+    pos += len;
+    column += len == 4 ? 2 : 1;
+  }
+  return std::min(pos, text_.size());
+}
+
+bool IncrementalAnalyzer::findToken(int line, int character, size_t &sentence,
+                                    size_t &index) const {
+  // トークンは文書全体で位置の順に並び、重ならない。位置より前で始まる
+  // 最後の文の、さらに位置より前で始まる最後のトークンだけが候補になる
+  const auto startsBefore = [line, character](int tokenLine, int tokenChar) {
+    return tokenLine < line || (tokenLine == line && tokenChar <= character);
+  };
+  const auto it = std::partition_point(
+      sentenceStarts_.begin(), sentenceStarts_.end(),
+      [&](const SentenceStart &start) {
+        return startsBefore(start.line, start.character);
+      });
+  if (it == sentenceStarts_.begin()) {
+    return false;
+  }
+
+  const size_t candidate = std::prev(it)->sentence;
+  const auto &tokens = sentences_[candidate].tokens;
+  size_t lo = 0;
+  size_t hi = tokens.size();
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (startsBefore(tokens.line(mid), tokens.startChar(mid))) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || tokens.line(lo - 1) != line ||
+      character >= tokens.endChar(lo - 1)) {
+    return false;
+  }
+  sentence = candidate;
+  index = lo - 1;
+  return true;
+}
+
+SentenceResult IncrementalAnalyzer::analyzeSentence(
+    Analyzer &analyzer, const std::string &text,
+    const std::vector<size_t> &lineStarts, SentenceBoundary boundary,
+    const MoZukuConfig *config) {
+  SentenceResult result;
+
+  // 同じ内容の文は文書や位置が違っても同じ結果になるので、文頭からの
+  // 相対座標で共有のキャッシュに置き、見つかれば文頭の位置へずらして使う
+  auto &cache = cache::SentenceCache::getInstance();
+  const bool cacheable = cache.enabled();
+  const std::string_view sentence(text.data() + boundary.start,
+                                  boundary.end - boundary.start);
+  Position origin;
+  if (cacheable) {
+    origin = byteOffsetToPosition(text, lineStarts, boundary.start);
+    if (auto cached = cache.find(sentence)) {
+      const PositionShift toDocument{Position{}, origin};
+      result.tokens = cached->tokens;
+      toDocument.apply(result.tokens,
+                       static_cast<std::ptrdiff_t>(boundary.start));
+      result.conjunctions = cached->conjunctions;
+      result.diagnostics = cached->diagnostics;
+      for (auto &diag : result.diagnostics) {
+        toDocument.apply(diag.range.start);
+        toDocument.apply(diag.range.end);
+      }
+      result.boundary = std::move(boundary);
+      return result;
+    }
+  }
+
+  analyzer.analyzeSpan(text, lineStarts, boundary.start, boundary.end,
+                       result.tokens);
+  result.conjunctions =
+      grammar::GrammarChecker::findConjunctions(result.tokens);
+  grammar::GrammarChecker::checkSentence(text, lineStarts, boundary,
+                                         result.tokens, result.diagnostics,
+                                         config);
+  // 係り受けは文構造のルールが有効なときだけ、再解析する文について求める
+  // (再利用する文の診断は前回の結果にすでに含まれている)
+  if (config && config->analysis.grammarCheck &&
+      config->analysis.warnings.sentenceStructure) {
+    if (auto dependencies = analyzer.sentenceDependencies(
+            sentence, boundary.start, result.tokens, 0, result.tokens.size())) {
+      grammar::GrammarChecker::checkStructure(
+          text, lineStarts, result.tokens, 0, dependencies->chunks,
+          result.diagnostics, config);
+    }
+  }
+
+  if (cacheable) {
+    const PositionShift toRelative{origin, Position{}};
+    auto entry = std::make_shared<cache::CachedSentence>();
+    entry->text.assign(sentence.data(), sentence.size());
+    entry->tokens = result.tokens;
+    toRelative.apply(entry->tokens,
+                     -static_cast<std::ptrdiff_t>(boundary.start));
+    entry->conjunctions = result.conjunctions;
+    entry->diagnostics = result.diagnostics;
+    for (auto &diag : entry->diagnostics) {
+      toRelative.apply(diag.range.start);
+      toRelative.apply(diag.range.end);
+    }
+    cache.insert(std::move(entry));
+  }
+
+  result.boundary = std::move(boundary);
+  return result;
+}
+
+void IncrementalAnalyzer::runDocumentRules(const MoZukuConfig *config) {
+  std::vector<grammar::SentenceTokens> views;
+  views.reserve(sentences_.size());
+  for (const auto &sentence : sentences_) {
+    grammar::SentenceTokens view;
+    view.tokens = &sentence.tokens;
+    view.count = sentence.tokens.size();
+    view.conjunctions = &sentence.conjunctions;
+    views.push_back(view);
+  }
+
+  documentDiagnostics_.clear();
+  grammar::GrammarChecker::checkDocument(text_, lineStarts_, views,
+                                         documentDiagnostics_, config);
+}
+
+std::vector<Diagnostic> IncrementalAnalyzer::collectDiagnostics() const {
+  std::vector<Diagnostic> diags;
+  for (const auto &sentence : sentences_) {
+    diags.insert(diags.end(), sentence.diagnostics.begin(),
+                 sentence.diagnostics.end());
+  }
+  diags.insert(diags.end(), documentDiagnostics_.begin(),
+               documentDiagnostics_.end());
+  return diags;
+}
+
+size_t IncrementalAnalyzer::tokenCount() const {
+  size_t count = 0;
+  for (const auto &sentence : sentences_) {
+    count += sentence.tokens.size();
+  }
+  return count;
+}
+
+static size_t diagnosticsBytes(const std::vector<Diagnostic> &diags) {
+  size_t bytes = diags.capacity() * sizeof(Diagnostic);
+  for (const auto &diag : diags) {
+    bytes += diag.message.capacity();
+  }
+  return bytes;
+}
+
+size_t IncrementalAnalyzer::approximateBytes() const {
+  size_t bytes = sizeof(*this) + text_.capacity() +
+                 lineStarts_.capacity() * sizeof(size_t) +
+                 sentences_.capacity() * sizeof(SentenceResult) +
+                 sentenceStarts_.capacity() * sizeof(SentenceStart) +
+                 diagnosticsBytes(documentDiagnostics_);
+  for (const auto &sentence : sentences_) {
+    bytes += sentence.tokens.approximateBytes() +
+             sentence.conjunctions.capacity() * sizeof(size_t) +
+             diagnosticsBytes(sentence.diagnostics);
+  }
+  return bytes;
+}
+
+} // namespace incremental
+} // namespace MoZuku
@@ -0,0 +1,196 @@
+#include "json_rpc.hpp"
+
+#include <charconv>
+#include <cstdlib>
+
+namespace MoZuku {
+namespace rpc {
+
+Transport::Transport(std::istream &in, std::ostream &out)
+    : in_(in.rdbuf()), out_(out) {}
+
+bool Transport::readHeaderLine(std::string &line) {
+  line.clear();
+  while (true) {
+    const int ch = in_->sbumpc();
+    if (ch == std::char_traits<char>::eof()) {
+      return !line.empty();
+    }
+    if (ch == '\n') {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      return true;
+    }
+    line.push_back(static_cast<char>(ch));
+  }
+}
+
+bool Transport::readMessage(std::string &payload) {
+  // 最小限のLSPヘッダー読み取り: Content-Length、空行、本文の順
+  size_t contentLength = 0;
+  bool sawHeader = false;
+  while (readHeaderLine(headerLine_)) {
+    sawHeader = true;
+    if (headerLine_.empty()) {
+      break; // 空行はヘッダー終了を示す
+    }
+    static constexpr std::string_view kContentLength = "Content-Length:";
+    if (headerLine_.compare(0, kContentLength.size(), kContentLength) == 0) {
+      contentLength = static_cast<size_t>(
+          std::strtoul(headerLine_.c_str() + kContentLength.size(), nullptr,
+                       10));
+    }
+  }
+
+  // ヘッダーを読み取れないかコンテント長が見つからない場合は失敗
+  if (!sawHeader || contentLength == 0) {
+    return false;
+  }
+
+  // 本文はストリームバッファから呼び出し側のバッファへ直接読む
+  payload.resize(contentLength);
+  const std::streamsize got =
+      in_->sgetn(&payload[0], static_cast<std::streamsize>(contentLength));
+  return got == static_cast<std::streamsize>(contentLength);
+}
+
+void Transport::writeMessage(std::string_view body) {
+  char header[48] = "Content-Length: ";
+  char *end = header + 16;
+  end = std::to_chars(end, header + sizeof(header) - 4, body.size()).ptr;
+  *end++ = '\r';
+  *end++ = '\n';
+  *end++ = '\r';
+  *end++ = '\n';
+
+  // 受信スレッドと解析ワーカーの双方から呼ばれる
+  std::lock_guard<std::mutex> lock(outMutex_);
+  out_.write(header, end - header);
+  out_.write(body.data(), static_cast<std::streamsize>(body.size()));
+  out_.flush();
+}
+
+void appendEscaped(std::string &out, std::string_view text) {
+  static const char kHex[] = "0123456789abcdef";
+  size_t runStart = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    const unsigned char ch = static_cast<unsigned char>(text[i]);
+    if (ch >= 0x20 && ch != '"' && ch != '\\') {
+      continue;
+    }
+    // エスケープの要らない区間はまとめて追加する
+    out.append(text.data() + runStart, i - runStart);
+    runStart = i + 1;
+    switch (ch) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\b':
+      out += "\\b";
+      break;
+    case '\f':
+      out += "\\f";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default: {
+      const char escaped[] = {'\\', 'u', '0', '0', kHex[ch >> 4], kHex[ch & 0xF]};
+      out.append(escaped, sizeof(escaped));
+      break;
+    }
+    }
+  }
+  out.append(text.data() + runStart, text.size() - runStart);
+}
+
+void JsonWriter::separate() {
+  if (needComma_) {
+    out_.push_back(',');
+  }
+}
+
+void JsonWriter::beginObject() {
+  separate();
+  out_.push_back('{');
+  needComma_ = false;
+}
+
+void JsonWriter::endObject() {
+  out_.push_back('}');
+  needComma_ = true;
+}
+
+void JsonWriter::beginArray() {
+  separate();
+  out_.push_back('[');
+  needComma_ = false;
+}
+
+void JsonWriter::endArray() {
+  out_.push_back(']');
+  needComma_ = true;
+}
+
+void JsonWriter::key(std::string_view name) {
+  separate();
+  out_.push_back('"');
+  appendEscaped(out_, name);
+  out_.append("\":", 2);
+  needComma_ = false;
+}
+
+void JsonWriter::value(std::string_view text) {
+  separate();
+  out_.push_back('"');
+  appendEscaped(out_, text);
+  out_.push_back('"');
+  needComma_ = true;
+}
+
+void JsonWriter::value(bool flag) {
+  separate();
+  out_.append(flag ? "true" : "false");
+  needComma_ = true;
+}
+
+void JsonWriter::null() {
+  separate();
+  out_.append("null", 4);
+  needComma_ = true;
+}
+
+void JsonWriter::raw(std::string_view json) {
+  separate();
+  out_.append(json.data(), json.size());
+  needComma_ = true;
+}
+
+void JsonWriter::integer(int64_t number) {
+  separate();
+  char buffer[24];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), number);
+  out_.append(buffer, result.ptr - buffer);
+  needComma_ = true;
+}
+
+void JsonWriter::unsignedInteger(uint64_t number) {
+  separate();
+  char buffer[24];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), number);
+  out_.append(buffer, result.ptr - buffer);
+  needComma_ = true;
+}
+
+} // namespace rpc
+} // namespace MoZuku
@@ -0,0 +1,144 @@
+#include "line_index.hpp"
+#include "lsp.hpp"
+#include "simd_text.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace MoZuku {
+namespace text {
+
+namespace {
+
+// この長さ以上の行にだけチェックポイントを作る
+constexpr size_t kLongLineBytes = 512;
+// チェックポイントの間隔 (バイト)
+constexpr size_t kCheckpointSpan = 256;
+
+inline size_t utf8SeqLen(unsigned char c) {
+  return (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+}
+
+// 4バイト文字はサロゲートペアで2コードユニット
+inline uint32_t utf16Units(size_t seqLen) { return seqLen == 4 ? 2 : 1; }
+
+} // namespace
+
+void LineIndex::reset(const std::string &text) {
+  lineStarts_.clear();
+  lineStarts_.push_back(0);
+  simd::appendLineStarts(text.data(), text.size(), 0, lineStarts_);
+  checkpoints_.clear();
+  checkpoints_.resize(lineStarts_.size());
+}
+
+void LineIndex::adoptLineStarts(std::vector<size_t> lineStarts) {
+  lineStarts_ = std::move(lineStarts);
+  if (lineStarts_.empty()) {
+    lineStarts_.push_back(0);
+  }
+  checkpoints_.clear();
+  checkpoints_.resize(lineStarts_.size());
+}
+
+size_t LineIndex::lineOf(size_t offset) const {
+  auto it = std::upper_bound(lineStarts_.begin(), lineStarts_.end(), offset);
+  return static_cast<size_t>(it - lineStarts_.begin()) - 1;
+}
+
+size_t LineIndex::lineEnd(const std::string &text, size_t line) const {
+  if (line + 1 < lineStarts_.size()) {
+    return lineStarts_[line + 1] - 1;
+  }
+  return text.size();
+}
+
+const LineIndex::Checkpoints &
+LineIndex::checkpoints(const std::string &text, size_t line) const {
+  std::unique_ptr<Checkpoints> &slot = checkpoints_[line];
+  if (slot) {
+    return *slot;
+  }
+
+  slot = std::make_unique<Checkpoints>();
+  const size_t start = lineStarts_[line];
+  const size_t end = std::min(lineEnd(text, line), text.size());
+  if (end - start < kLongLineBytes) {
+    return *slot;
+  }
+
+  size_t pos = start;
+  uint32_t column = 0;
+  size_t next = start + kCheckpointSpan;
+  while (pos < end) {
+    if (pos >= next) {
+      slot->push_back({static_cast<uint32_t>(pos - start), column});
+      next = pos + kCheckpointSpan;
+    }
+    size_t len = utf8SeqLen(static_cast<unsigned char>(text[pos]));
+    pos += len;
+    column += utf16Units(len);
+  }
+  return *slot;
+}
+
+size_t LineIndex::toByteOffset(const std::string &text, int line,
+                               int character) const {
+  if (line < 0 || line >= static_cast<int>(lineStarts_.size())) {
+    return text.size();
+  }
+
+  const size_t lineStart = lineStarts_[line];
+  size_t bytePos = lineStart;
+  uint32_t utf16Pos = 0;
+  const uint32_t target = character > 0 ? static_cast<uint32_t>(character) : 0;
+
+  const Checkpoints &points = checkpoints(text, static_cast<size_t>(line));
+  auto it = std::upper_bound(
+      points.begin(), points.end(), target,
+      [](uint32_t value, const Checkpoint &cp) { return value < cp.column; });
+  if (it != points.begin()) {
+    --it;
+    bytePos = lineStart + it->byte;
+    utf16Pos = it->column;
+  }
+
+  while (bytePos < text.size() && utf16Pos < target && text[bytePos] != '\n') {
+    size_t len = utf8SeqLen(static_cast<unsigned char>(text[bytePos]));
+    bytePos += len;
+    utf16Pos += utf16Units(len);
+  }
+
+  return std::min(bytePos, text.size());
+}
+
+Position LineIndex::toPosition(const std::string &text, size_t offset) const {
+  if (offset > text.size()) {
+    offset = text.size();
+  }
+
+  const size_t line = lineOf(offset);
+  const size_t lineStart = lineStarts_[line];
+  size_t pos = lineStart;
+  uint32_t column = 0;
+
+  const Checkpoints &points = checkpoints(text, line);
+  const uint32_t relative = static_cast<uint32_t>(offset - lineStart);
+  auto it = std::upper_bound(
+      points.begin(), points.end(), relative,
+      [](uint32_t value, const Checkpoint &cp) { return value < cp.byte; });
+  if (it != points.begin()) {
+    --it;
+    pos = lineStart + it->byte;
+    column = it->column;
+  }
+
+  // pos から offset までは同じ行の中にある
+  column += static_cast<uint32_t>(
+      simd::utf16Length(text.data() + pos, offset - pos));
+
+  return Position{static_cast<int>(line), static_cast<int>(column)};
+}
+
+} // namespace text
+} // namespace MoZuku
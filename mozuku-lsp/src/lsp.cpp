@@ -1,33 +1,38 @@
 #include "lsp.hpp"
+#include "analysis_scheduler.hpp"
 #include "analyzer.hpp"
+#include "batch_check.hpp"
 #include "comment_extractor.hpp"
+#include "incremental_analyzer.hpp"
+#include "mapped_file.hpp"
+#include "sentence_cache.hpp"
+#include "stats.hpp"
+#include "text_processor.hpp"
 #include "utf16.hpp"
 #include "wikipedia.hpp"
 
 #include <algorithm>
 #include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
 #include <iostream>
 #include <set>
 #include <sstream>
 #include <string>
-#include <thread>
-
-#include <tree_sitter/api.h>
 
 using nlohmann::json;
 
-static bool isDebugEnabled() {
-  static bool initialized = false;
-  static bool debug = false;
-  if (!initialized) {
-    debug = (std::getenv("MOZUKU_DEBUG") != nullptr);
-    initialized = true;
-  }
-  return debug;
-}
-
 namespace {
 
+// 未解析の文書で hover した行の前後何行を先に解析するか
+constexpr int kHoverViewportLines = 40;
+
+// workspace/diagnostic を進める依頼の識別名 (文書の uri とは重ならない)
+const char *const kWorkspaceDiagnosticJob = "mozuku:workspace/diagnostic";
+// 1回の依頼で結果を送るファイル数の上限 (解析し直すのは1件まで)
+constexpr size_t kWorkspaceDiagnosticBatch = 64;
+
 struct LocalByteRange {
   size_t startByte{0};
   size_t endByte{0};
@@ -75,23 +80,30 @@ size_t findClosingCommand(const std::string &text, size_t pos,
 
 std::string processLatexMath(const std::string &text) { return text; }
 
-std::string sanitizeLatexCommentText(const std::string &raw) {
-  if (raw.empty())
-    return raw;
+// text 上の LaTeX コメントを、先頭の % と続く空白を除いた形で out へ書き込む
+void restoreLatexComment(const std::string &text,
+                         const MoZuku::comments::CommentSegment &segment,
+                         std::string &out) {
+  const size_t docSize = std::min(text.size(), out.size());
+  if (segment.startByte >= docSize)
+    return;
+
+  const size_t end = std::min(segment.endByte, docSize);
+  std::copy(text.begin() + segment.startByte, text.begin() + end,
+            out.begin() + segment.startByte);
+  if (end == segment.startByte)
+    return;
 
-  std::string sanitized = raw;
-  sanitized[0] = ' ';
-  size_t idx = 1;
-  while (idx < sanitized.size() && sanitized[idx] == '%') {
-    sanitized[idx] = ' ';
+  out[segment.startByte] = ' ';
+  size_t idx = segment.startByte + 1;
+  while (idx < end && out[idx] == '%') {
+    out[idx] = ' ';
     ++idx;
   }
-  while (idx < sanitized.size() &&
-         (sanitized[idx] == ' ' || sanitized[idx] == '\t')) {
-    sanitized[idx] = ' ';
+  while (idx < end && (out[idx] == ' ' || out[idx] == '\t')) {
+    out[idx] = ' ';
     ++idx;
   }
-  return sanitized;
 }
 
 std::vector<MoZuku::comments::CommentSegment>
@@ -118,8 +130,6 @@ collectLatexComments(const std::string &text) {
       MoZuku::comments::CommentSegment segment;
       segment.startByte = current;
       segment.endByte = lineEnd;
-      segment.sanitized =
-          sanitizeLatexCommentText(text.substr(current, lineEnd - current));
       segments.push_back(std::move(segment));
     }
 
@@ -143,79 +153,6 @@ size_t utf8CharLen(unsigned char c) {
   return 1;
 }
 
-std::vector<LocalByteRange> collectHtmlContentRanges(const std::string &text) {
-  std::vector<LocalByteRange> ranges;
-  const TSLanguage *language = MoZuku::comments::resolveLanguage("html");
-  if (!language)
-    return ranges;
-
-  TSParser *parser = ts_parser_new();
-  if (!parser)
-    return ranges;
-
-  std::unique_ptr<TSParser, decltype(&ts_parser_delete)> parserGuard(
-      parser, &ts_parser_delete);
-  if (!ts_parser_set_language(parser, language)) {
-    return ranges;
-  }
-
-  TSTree *tree =
-      ts_parser_parse_string(parser, nullptr, text.c_str(), text.size());
-  if (!tree)
-    return ranges;
-
-  std::unique_ptr<TSTree, decltype(&ts_tree_delete)> treeGuard(tree,
-                                                               &ts_tree_delete);
-
-  TSNode root = ts_tree_root_node(tree);
-  if (ts_node_is_null(root))
-    return ranges;
-
-  std::vector<TSNode> stack;
-  stack.push_back(root);
-
-  while (!stack.empty()) {
-    TSNode node = stack.back();
-    stack.pop_back();
-
-    if (ts_node_is_null(node))
-      continue;
-
-    const char *type = ts_node_type(node);
-    if (type && std::strcmp(type, "text") == 0) {
-      size_t start = ts_node_start_byte(node);
-      size_t end = ts_node_end_byte(node);
-      if (start >= end || end > text.size())
-        continue;
-
-      size_t trimmedStart = start;
-      while (trimmedStart < end &&
-             std::isspace(static_cast<unsigned char>(text[trimmedStart]))) {
-        ++trimmedStart;
-      }
-      size_t trimmedEnd = end;
-      while (trimmedEnd > trimmedStart &&
-             std::isspace(static_cast<unsigned char>(text[trimmedEnd - 1]))) {
-        --trimmedEnd;
-      }
-      if (trimmedEnd > trimmedStart) {
-        ranges.push_back({trimmedStart, trimmedEnd});
-      }
-      continue;
-    }
-
-    uint32_t childCount = ts_node_child_count(node);
-    for (uint32_t i = 0; i < childCount; ++i) {
-      TSNode child = ts_node_child(node, i);
-      if (!ts_node_is_null(child)) {
-        stack.push_back(child);
-      }
-    }
-  }
-
-  return ranges;
-}
-
 std::vector<LocalByteRange> collectLatexContentRanges(const std::string &text) {
   std::vector<LocalByteRange> ranges;
   size_t i = 0;
@@ -292,60 +229,293 @@ std::vector<LocalByteRange> collectLatexContentRanges(const std::string &text) {
   return ranges;
 }
 
-std::vector<LocalByteRange>
-collectContentHighlightRanges(const std::string &languageId,
-                              const std::string &text) {
-  if (languageId == "html") {
-    return collectHtmlContentRanges(text);
+// 受信メッセージごとの処理時間の集計名 (知らないメソッドは数えない)
+const char *requestPhase(const std::string &method) {
+  static const std::pair<const char *, const char *> kPhases[] = {
+      {"initialize", "lsp.initialize"},
+      {"textDocument/didOpen", "lsp.didOpen"},
+      {"textDocument/didChange", "lsp.didChange"},
+      {"textDocument/didSave", "lsp.didSave"},
+      {"textDocument/didClose", "lsp.didClose"},
+      {"textDocument/semanticTokens/full", "lsp.semanticTokens.full"},
+      {"textDocument/semanticTokens/full/delta", "lsp.semanticTokens.delta"},
+      {"textDocument/semanticTokens/range", "lsp.semanticTokens.range"},
+      {"textDocument/hover", "lsp.hover"},
+      {"textDocument/diagnostic", "lsp.diagnostic"},
+      {"workspace/diagnostic", "lsp.workspaceDiagnostic"},
+  };
+  for (const auto &entry : kPhases) {
+    if (method == entry.first) {
+      return entry.second;
+    }
+  }
+  return nullptr;
+}
+
+// {"end":{...},"start":{...}} を書き出す
+void writeRange(MoZuku::rpc::JsonWriter &writer, const Position &start,
+                const Position &end) {
+  writer.beginObject();
+  writer.key("end");
+  writer.beginObject();
+  writer.key("character");
+  writer.value(end.character);
+  writer.key("line");
+  writer.value(end.line);
+  writer.endObject();
+  writer.key("start");
+  writer.beginObject();
+  writer.key("character");
+  writer.value(start.character);
+  writer.key("line");
+  writer.value(start.line);
+  writer.endObject();
+  writer.endObject();
+}
+
+void writeDiagnostics(MoZuku::rpc::JsonWriter &writer,
+                      const std::vector<Diagnostic> &diags) {
+  writer.beginArray();
+  for (const auto &diag : diags) {
+    writer.beginObject();
+    writer.key("message");
+    writer.value(diag.message);
+    writer.key("range");
+    writeRange(writer, diag.range.start, diag.range.end);
+    writer.key("severity");
+    writer.value(diag.severity);
+    writer.endObject();
   }
-  if (languageId == "latex") {
-    return collectLatexContentRanges(text);
+  writer.endArray();
+}
+
+// 診断の内容から決まる resultId。同じ診断なら再起動をまたいでも同じになる
+std::string diagnosticsResultId(const std::vector<Diagnostic> &diags) {
+  uint64_t hash = MoZuku::cache::hashBytes("diagnostics", diags.size());
+  for (const auto &diag : diags) {
+    const int32_t fields[] = {diag.range.start.line, diag.range.start.character,
+                              diag.range.end.line, diag.range.end.character,
+                              diag.severity};
+    hash = MoZuku::cache::hashBytes(
+        std::string_view(reinterpret_cast<const char *>(fields),
+                         sizeof(fields)),
+        hash);
+    hash = MoZuku::cache::hashBytes(diag.message, hash);
   }
-  return {};
+  char id[17];
+  std::snprintf(id, sizeof(id), "%016llx",
+                static_cast<unsigned long long>(hash));
+  return id;
+}
+
+// file:// の URI をパスにする (それ以外の URI なら空)
+std::string pathFromUri(const std::string &uri) {
+  const std::string scheme = "file://";
+  if (uri.compare(0, scheme.size(), scheme) != 0) {
+    return "";
+  }
+  std::string path;
+  for (size_t i = scheme.size(); i < uri.size(); ++i) {
+    if (uri[i] == '%' && i + 2 < uri.size() &&
+        std::isxdigit(static_cast<unsigned char>(uri[i + 1])) &&
+        std::isxdigit(static_cast<unsigned char>(uri[i + 2]))) {
+      path += static_cast<char>(std::stoi(uri.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    } else {
+      path += uri[i];
+    }
+  }
+  // file:///c:/... のドライブ名の前の '/' は外す
+  if (path.size() > 2 && path[0] == '/' && path[2] == ':') {
+    path.erase(0, 1);
+  }
+  return path;
+}
+
+// VS Code と同じく英数字と -._~/ 以外を符号化する
+std::string uriFromPath(const std::string &path) {
+  static const char kHex[] = "0123456789ABCDEF";
+  std::string uri = "file://";
+  if (!path.empty() && path[0] != '/') {
+    uri += '/';
+  }
+  for (size_t i = 0; i < path.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(path[i]);
+    if (c == '\\') {
+      c = '/';
+    }
+    // ドライブ名は小文字にする
+    if (i == 0 && path.size() > 1 && path[1] == ':') {
+      c = static_cast<unsigned char>(std::tolower(c));
+    }
+    if (std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~' ||
+        c == '/') {
+      uri += static_cast<char>(c);
+    } else {
+      uri += '%';
+      uri += kHex[c >> 4];
+      uri += kHex[c & 0x0F];
+    }
+  }
+  return uri;
+}
+
+// MeCab の初期化が終わる前の要求への応答。クライアントは結果を捨てる
+json notReadyError(const json &id) {
+  return json{{"jsonrpc", "2.0"},
+              {"id", id},
+              {"error",
+               {{"code", -32801}, // ContentModified
+                {"message", "MoZuku analyzer is still initializing"}}}};
+}
+
+// 範囲を開始位置の順に並べ、重なりと隣接をまとめる
+std::vector<ByteRange> mergeRanges(std::vector<ByteRange> ranges) {
+  std::sort(ranges.begin(), ranges.end(),
+            [](const ByteRange &a, const ByteRange &b) {
+              return a.startByte < b.startByte;
+            });
+  std::vector<ByteRange> merged;
+  merged.reserve(ranges.size());
+  for (const auto &range : ranges) {
+    if (range.endByte <= range.startByte) {
+      continue;
+    }
+    if (!merged.empty() && range.startByte <= merged.back().endByte) {
+      merged.back().endByte = std::max(merged.back().endByte, range.endByte);
+    } else {
+      merged.push_back(range);
+    }
+  }
+  return merged;
+}
+
+// hover を表示する範囲。本文の範囲はコメントも含むので両方をまとめる
+// (コメント用の言語では本文の範囲は空)
+std::vector<ByteRange> hoverRangesOf(const PreparedText &prepared) {
+  std::vector<ByteRange> ranges = prepared.contentRanges;
+  ranges.reserve(ranges.size() + prepared.commentSegments.size());
+  for (const auto &segment : prepared.commentSegments) {
+    ranges.push_back(ByteRange{segment.startByte, segment.endByte});
+  }
+  return mergeRanges(std::move(ranges));
+}
+
+// ranges は mergeRanges で並べたもの
+bool containsOffset(const std::vector<ByteRange> &ranges, size_t offset) {
+  const auto it = std::upper_bound(
+      ranges.begin(), ranges.end(), offset,
+      [](size_t value, const ByteRange &range) {
+        return value < range.startByte;
+      });
+  return it != ranges.begin() && offset < std::prev(it)->endByte;
 }
 
 } // namespace
 
-LSPServer::LSPServer(std::istream &in, std::ostream &out) : in_(in), out_(out) {
-  tokenTypes_ = {"noun",     "verb",   "adjective",   "adverb",
-                 "particle", "aux",    "conjunction", "symbol",
-                 "interj",   "prefix", "suffix",      "unknown"};
+struct LSPServer::WorkspaceDiagnosticRun {
+  json id;
+  json partialResultToken; // null なら最後にまとめて返す
+  std::unordered_map<std::string, std::string> previousResultIds;
+  // 以下は解析ワーカーのみが触る
+  bool collected{false};
+  std::vector<MoZuku::batch::InputFile> files;
+  size_t next{0};
+  std::vector<std::string> items; // 直列化済みの報告
+};
+
+LSPServer::LSPServer(std::istream &in, std::ostream &out)
+    : transport_(in, out) {
+  for (size_t i = 0; i < MoZuku::tokens::kTokenTypeCount; ++i) {
+    tokenTypes_.push_back(MoZuku::tokens::tokenTypeName(
+        static_cast<MoZuku::tokens::TokenType>(i)));
+  }
   tokenModifiers_ = {"proper", "numeric", "kana", "kanji"};
 
   // アナライザーを初期化
   analyzer_ = std::make_unique<MoZuku::Analyzer>();
+  scheduler_ = std::make_unique<MoZuku::scheduling::AnalysisScheduler>(
+      [this](const MoZuku::scheduling::AnalysisJob &job) {
+        runAnalysisJob(job);
+      });
 }
 
-bool LSPServer::readMessage(std::string &jsonPayload) {
-  // 最小限のLSPヘッダー読み取り: Content-Length、空行、本文の順
-  std::string line;
-  size_t contentLength = 0;
+LSPServer::~LSPServer() {
+  // 解析ワーカーは初期化の完了を待っていることがあるので先に合流する
+  if (analyzerInitThread_.joinable()) {
+    analyzerInitThread_.join();
+  }
+  scheduler_->stop();
+  MoZuku::cache::SentenceCache::getInstance().saveStore();
+  MoZuku::stats::flushTrace();
+}
 
-  // 空行までヘッダーを読み取り
-  while (std::getline(in_, line)) {
-    if (!line.empty() && line.back() == '\r')
-      line.pop_back();
-    if (line.rfind("Content-Length:", 0) == 0) {
-      contentLength = static_cast<size_t>(std::stoul(line.substr(15)));
-    }
-    if (line.empty())
-      break; // 空行はヘッダー終了を示す
+void LSPServer::requestSemanticTokensRefresh() {
+  if (!semanticTokensRefreshSupport_) {
+    return;
   }
+  // 初期化スレッドとワーカーの両方から送るので、id は連番で一意にする
+  const uint64_t sequence =
+      serverRequestSequence_.fetch_add(1, std::memory_order_relaxed);
+  reply(json{{"jsonrpc", "2.0"},
+             {"id", "mozuku/semanticTokensRefresh/" + std::to_string(sequence)},
+             {"method", "workspace/semanticTokens/refresh"}});
+}
 
-  // ヘッダーを読み取れないかコンテント長が見つからない場合は失敗
-  if (!contentLength || !in_.good())
-    return false;
+double LSPServer::millisecondsSinceStart() const {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - startTime_)
+      .count();
+}
 
-  // JSONペイロードを読み取り
-  jsonPayload.resize(contentLength);
-  in_.read(&jsonPayload[0], static_cast<std::streamsize>(contentLength));
-  return in_.gcount() == static_cast<std::streamsize>(contentLength);
+void LSPServer::startAnalyzerInit() {
+  std::call_once(analyzerInitOnce_, [this] {
+    std::packaged_task<bool()> task([this] {
+      const auto start = std::chrono::steady_clock::now();
+      const bool ok = analyzer_->initialize(config_);
+      if (ok) {
+        // 文の解析結果のキャッシュは辞書が決まってから開く
+        auto &sentences = MoZuku::cache::SentenceCache::getInstance();
+        const size_t cacheBytes =
+            static_cast<size_t>(config_.analysis.sentenceCacheMB) * 1024 * 1024;
+        const uint64_t fingerprint =
+            MoZuku::cache::fingerprintOf(config_, analyzer_->dictionaryId());
+        sentences.configure(cacheBytes, fingerprint);
+        // 係り受けの結果はトークン列より小さいので、同じ予算の 1/4 を充てる
+        MoZuku::cache::DependencyCache::getInstance().configure(cacheBytes / 4,
+                                                                fingerprint);
+        if (config_.analysis.persistSentenceCache) {
+          sentences.openStore(config_.cacheDir);
+        }
+      }
+      analyzerReady_.store(true, std::memory_order_release);
+      if (MoZuku::stats::debugEnabled()) {
+        std::cerr << "[DEBUG] Startup phase: analyzer initialize "
+                  << std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - start)
+                         .count()
+                  << " ms (" << (ok ? "ready" : "failed") << " at "
+                  << millisecondsSinceStart() << " ms)" << std::endl;
+      }
+      if (semanticTokensRefreshSupport_ &&
+          semanticTokensRejected_.exchange(false)) {
+        requestSemanticTokensRefresh();
+      }
+      return ok;
+    });
+    analyzerInit_ = task.get_future().share();
+    analyzerInitThread_ = std::thread(std::move(task));
+  });
 }
 
 void LSPServer::reply(const json &msg) {
-  std::string payload = msg.dump();
-  out_ << "Content-Length: " << payload.size() << "\r\n\r\n" << payload;
-  out_.flush();
+  std::string body;
+  {
+    MoZuku::stats::ScopedTimer timer("json.serialize");
+    body = msg.dump();
+  }
+  MoZuku::stats::ScopedTimer timer("rpc.write");
+  transport_.writeMessage(body);
 }
 
 void LSPServer::notify(const std::string &method, const json &params) {
@@ -353,10 +523,55 @@ void LSPServer::notify(const std::string &method, const json &params) {
   reply(msg);
 }
 
-void LSPServer::handle(const json &req) {
+void LSPServer::replyStreamed(
+    const json &id,
+    const std::function<void(MoZuku::rpc::JsonWriter &)> &writeResult) {
+  // スレッドごとに出力バッファを使い回す
+  thread_local std::string body;
+  {
+    MoZuku::stats::ScopedTimer timer("json.serialize");
+    body.clear();
+    MoZuku::rpc::JsonWriter writer(body);
+    writer.beginObject();
+    writer.key("id");
+    writer.raw(id.dump());
+    writer.key("jsonrpc");
+    writer.value("2.0");
+    writer.key("result");
+    writeResult(writer);
+    writer.endObject();
+  }
+  MoZuku::stats::ScopedTimer timer("rpc.write");
+  transport_.writeMessage(body);
+}
+
+void LSPServer::notifyStreamed(
+    std::string_view method,
+    const std::function<void(MoZuku::rpc::JsonWriter &)> &writeParams) {
+  thread_local std::string body;
+  {
+    MoZuku::stats::ScopedTimer timer("json.serialize");
+    body.clear();
+    MoZuku::rpc::JsonWriter writer(body);
+    writer.beginObject();
+    writer.key("jsonrpc");
+    writer.value("2.0");
+    writer.key("method");
+    writer.value(method);
+    writer.key("params");
+    writeParams(writer);
+    writer.endObject();
+  }
+  MoZuku::stats::ScopedTimer timer("rpc.write");
+  transport_.writeMessage(body);
+}
+
+void LSPServer::handle(json &req) {
   try {
     if (req.contains("method")) {
       std::string method = req["method"];
+      MoZuku::stats::ScopedTimer timer(
+          MoZuku::stats::enabled() ? requestPhase(method) : nullptr);
 
       if (method == "initialize") {
         reply(onInitialize(req["id"], req.value("params", json::object())));
@@ -368,17 +583,53 @@ void LSPServer::handle(const json &req) {
         onDidChange(req["params"]);
       } else if (method == "textDocument/didSave") {
         onDidSave(req["params"]);
+      } else if (method == "textDocument/didClose") {
+        onDidClose(req["params"]);
       } else if (method == "textDocument/semanticTokens/full") {
-        reply(onSemanticTokensFull(req["id"],
-                                   req.value("params", json::object())));
+        // 応答を直接書き出した場合と、解析完了待ちでワーカーが後で応答する
+        // 場合は null が返る
+        json response = onSemanticTokensFull(
+            req["id"], req.value("params", json::object()));
+        if (!response.is_null())
+          reply(response);
+      } else if (method == "textDocument/semanticTokens/full/delta") {
+        json response = onSemanticTokensDelta(
+            req["id"], req.value("params", json::object()));
+        if (!response.is_null())
+          reply(response);
       } else if (method == "textDocument/semanticTokens/range") {
-        reply(onSemanticTokensRange(req["id"],
-                                    req.value("params", json::object())));
+        json response = onSemanticTokensRange(
+            req["id"], req.value("params", json::object()));
+        if (!response.is_null())
+          reply(response);
       } else if (method == "textDocument/hover") {
         reply(onHover(req["id"], req.value("params", json::object())));
+      } else if (method == "textDocument/diagnostic") {
+        // 解析完了待ちならワーカーが後で応答する
+        json response = onDocumentDiagnostic(
+            req["id"], req.value("params", json::object()));
+        if (!response.is_null())
+          reply(response);
+      } else if (method == "workspace/diagnostic") {
+        json response = onWorkspaceDiagnostic(
+            req["id"], req.value("params", json::object()));
+        if (!response.is_null())
+          reply(response);
+      } else if (method == "mozuku/highlightsResync") {
+        onHighlightsResync(req.value("params", json::object()));
+      } else if (method == "$/cancelRequest") {
+        onCancelRequest(req.value("params", json::object()));
+      } else if (method == "mozuku/stats") {
+        reply(onStats(req["id"], req.value("params", json::object())));
       } else if (method == "shutdown") {
+        scheduler_->stop();
+        MoZuku::cache::SentenceCache::getInstance().saveStore();
+        MoZuku::stats::flushTrace();
         reply(json{{"jsonrpc", "2.0"}, {"id", req["id"]}, {"result", nullptr}});
       } else if (method == "exit") {
+        scheduler_->stop();
+        MoZuku::cache::SentenceCache::getInstance().saveStore();
+        MoZuku::stats::flushTrace();
         exit(0);
       }
     }
@@ -395,12 +646,16 @@ void LSPServer::handle(const json &req) {
 
 void LSPServer::run() {
   std::string jsonPayload;
-  while (readMessage(jsonPayload)) {
+  while (transport_.readMessage(jsonPayload)) {
     try {
-      json req = json::parse(jsonPayload);
+      json req;
+      {
+        MoZuku::stats::ScopedTimer timer("json.parse");
+        req = json::parse(jsonPayload);
+      }
       handle(req);
     } catch (const json::parse_error &e) {
-      if (isDebugEnabled()) {
+      if (MoZuku::stats::debugEnabled()) {
         std::cerr << "[DEBUG] JSON parse error: " << e.what() << std::endl;
       }
     }
@@ -408,9 +663,55 @@ void LSPServer::run() {
 }
 
 json LSPServer::onInitialize(const json &id, const json &params) {
+  if (MoZuku::stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Startup phase: initialize received at "
+              << millisecondsSinceStart() << " ms" << std::endl;
+  }
+
+  if (params.contains("capabilities")) {
+    const json &capabilities = params["capabilities"];
+    if (capabilities.contains("workspace") &&
+        capabilities["workspace"].contains("semanticTokens")) {
+      semanticTokensRefreshSupport_ =
+          capabilities["workspace"]["semanticTokens"].value("refreshSupport",
+                                                            false);
+    }
+    if (capabilities.contains("textDocument") &&
+        capabilities["textDocument"].contains("diagnostic")) {
+      pullDiagnosticsSupport_ = true;
+    }
+  }
+
+  // workspace/diagnostic で辿るディレクトリ
+  if (params.contains("workspaceFolders") &&
+      params["workspaceFolders"].is_array()) {
+    for (const auto &folder : params["workspaceFolders"]) {
+      if (folder.contains("uri") && folder["uri"].is_string()) {
+        std::string path = pathFromUri(folder["uri"]);
+        if (!path.empty()) {
+          workspaceFolders_.push_back(std::move(path));
+        }
+      }
+    }
+  } else if (params.contains("rootUri") && params["rootUri"].is_string()) {
+    std::string path = pathFromUri(params["rootUri"]);
+    if (!path.empty()) {
+      workspaceFolders_.push_back(std::move(path));
+    }
+  }
+
   // initializationOptionsから設定を抽出
   if (params.contains("initializationOptions")) {
     auto opts = params["initializationOptions"];
+    // VS Code 拡張は設定を mozuku の下にまとめて送る
+    if (opts.contains("mozuku") && opts["mozuku"].is_object()) {
+      opts = opts["mozuku"];
+    }
+
+    // 拡張ごとの保存領域 (検出結果や Wikipedia キャッシュを置く)
+    if (opts.contains("cacheDir") && opts["cacheDir"].is_string()) {
+      config_.cacheDir = opts["cacheDir"];
+    }
 
     // MeCab設定
     if (opts.contains("mecab")) {
@@ -423,6 +724,37 @@ json LSPServer::onInitialize(const json &id, const json &params) {
       }
     }
 
+    // Wikipedia サマリの永続キャッシュ (既定は cacheDir)
+    std::string wikipediaCacheDir = config_.cacheDir;
+    if (opts.contains("wikipedia") && opts["wikipedia"].is_object()) {
+      auto wiki = opts["wikipedia"];
+      if (wiki.contains("cacheDir") && wiki["cacheDir"].is_string()) {
+        wikipediaCacheDir = wiki["cacheDir"];
+      }
+    }
+    wikipedia::WikipediaCache::getInstance().openStore(wikipediaCacheDir);
+
+    // 独自ハイライトの通知形式 (vscode-mozuku は差分に対応する)
+    if (opts.contains("highlights") && opts["highlights"].is_object()) {
+      const auto &highlights = opts["highlights"];
+      highlightDeltas_ = highlights.contains("delta") &&
+                         highlights["delta"].is_boolean() &&
+                         highlights["delta"].get<bool>();
+    }
+
+    // 処理段ごとの計測 (mozuku/stats で取得する)
+    if (opts.contains("stats") && opts["stats"].is_object()) {
+      const auto &stats = opts["stats"];
+      const bool enabled =
+          stats.contains("enabled") && stats["enabled"].is_boolean() &&
+          stats["enabled"].get<bool>();
+      std::string traceFile;
+      if (stats.contains("traceFile") && stats["traceFile"].is_string()) {
+        traceFile = stats["traceFile"];
+      }
+      MoZuku::stats::configure(enabled, traceFile);
+    }
+
     // 解析設定
     if (opts.contains("analysis")) {
       auto analysis = opts["analysis"];
@@ -442,6 +774,36 @@ json LSPServer::onInitialize(const json &id, const json &params) {
           analysis["warningMinSeverity"].is_number()) {
         config_.analysis.warningMinSeverity = analysis["warningMinSeverity"];
       }
+      if (analysis.contains("workerThreads") &&
+          analysis["workerThreads"].is_number_integer()) {
+        config_.analysis.workerThreads =
+            std::max(0, analysis["workerThreads"].get<int>());
+      }
+      if (analysis.contains("debounceMs") &&
+          analysis["debounceMs"].is_number_integer()) {
+        config_.analysis.debounceMs =
+            std::max(0, analysis["debounceMs"].get<int>());
+      }
+      if (analysis.contains("memoryBudgetMB") &&
+          analysis["memoryBudgetMB"].is_number_integer()) {
+        config_.analysis.memoryBudgetMB =
+            std::max(0, analysis["memoryBudgetMB"].get<int>());
+      }
+      if (analysis.contains("sentenceCacheMB") &&
+          analysis["sentenceCacheMB"].is_number_integer()) {
+        config_.analysis.sentenceCacheMB =
+            std::max(0, analysis["sentenceCacheMB"].get<int>());
+      }
+      if (analysis.contains("persistSentenceCache") &&
+          analysis["persistSentenceCache"].is_boolean()) {
+        config_.analysis.persistSentenceCache =
+            analysis["persistSentenceCache"];
+      }
+      if (analysis.contains("workspaceDiagnostics") &&
+          analysis["workspaceDiagnostics"].is_boolean()) {
+        config_.analysis.workspaceDiagnostics =
+            analysis["workspaceDiagnostics"];
+      }
 
       // 警告レベル設定
       if (analysis.contains("warnings") && analysis["warnings"].is_object()) {
@@ -530,6 +892,9 @@ json LSPServer::onInitialize(const json &id, const json &params) {
     }
   }
 
+  // 辞書の読み込みをハンドシェイクの残りと重ねる
+  startAnalyzerInit();
+
   return json{{"jsonrpc", "2.0"},
               {"id", id},
               {"result",
@@ -543,7 +908,13 @@ json LSPServer::onInitialize(const json &id, const json &params) {
                      {{"tokenTypes", tokenTypes_},
                       {"tokenModifiers", tokenModifiers_}}},
                     {"range", true},
-                    {"full", true}}},
+                    {"full", {{"delta", true}}}}},
+                  {"diagnosticProvider",
+                   {{"identifier", "mozuku"},
+                    {"interFileDependencies", false},
+                    {"workspaceDiagnostics",
+                     config_.analysis.workspaceDiagnostics &&
+                         !workspaceFolders_.empty()}}},
                   {"hoverProvider", true}}}}}};
 }
 
@@ -551,55 +922,82 @@ void LSPServer::onInitialized() {
   // 初期化完了
 }
 
-void LSPServer::onDidOpen(const json &params) {
+void LSPServer::onDidOpen(json &params) {
   std::string uri = params["textDocument"]["uri"];
-  std::string text = params["textDocument"]["text"];
-  docs_[uri] = text;
+  MoZuku::text::DocumentBuffer &document = docs_[uri];
+  document.reset(params["textDocument"]["text"].get_ref<const std::string &>());
   if (params["textDocument"].contains("languageId") &&
       params["textDocument"]["languageId"].is_string()) {
     docLanguages_[uri] = params["textDocument"]["languageId"];
   }
-  analyzeAndPublish(uri, text);
+  if (params["textDocument"].contains("version") &&
+      params["textDocument"]["version"].is_number_integer()) {
+    docVersions_[uri] = params["textDocument"]["version"];
+  }
+  analyzeAndPublish(uri, document);
 }
 
-void LSPServer::onDidChange(const json &params) {
+void LSPServer::onDidChange(json &params) {
   std::string uri = params["textDocument"]["uri"];
-  auto changes = params["contentChanges"];
+  auto &changes = params["contentChanges"];
+  if (params["textDocument"].contains("version") &&
+      params["textDocument"]["version"].is_number_integer()) {
+    docVersions_[uri] = params["textDocument"]["version"];
+  }
 
-  std::string &text = docs_[uri];
-  std::string oldText = text;
+  MoZuku::text::DocumentBuffer &document = docs_[uri];
 
   // 位置を維持するため変更を逆順に適用
   for (auto it = changes.rbegin(); it != changes.rend(); ++it) {
-    auto change = *it;
+    auto &change = *it;
     if (change.contains("range")) {
       // 範囲指定のインクリメンタル変更
-      auto range = change["range"];
+      const auto &range = change["range"];
       int startLine = range["start"]["line"];
       int startChar = range["start"]["character"];
       int endLine = range["end"]["line"];
       int endChar = range["end"]["character"];
 
-      size_t startOffset = computeByteOffset(text, startLine, startChar);
-      size_t endOffset = computeByteOffset(text, endLine, endChar);
+      size_t startOffset = document.toByteOffset(startLine, startChar);
+      size_t endOffset = document.toByteOffset(endLine, endChar);
+      if (endOffset < startOffset) {
+        std::swap(startOffset, endOffset);
+      }
 
-      std::string newText = change["text"];
-      text.replace(startOffset, endOffset - startOffset, newText);
+      document.replace(startOffset, endOffset,
+                       change["text"].get_ref<const std::string &>());
     } else {
       // ドキュメント全体の変更
-      text = change["text"];
+      document.reset(change["text"].get_ref<const std::string &>());
     }
   }
 
-  // 最適化: 変更された行のみ再解析
-  analyzeChangedLines(uri, text, oldText);
+  // 最適化: 変更された文のみ再解析
+  analyzeChangedLines(uri, document);
 }
 
 void LSPServer::onDidSave(const json &params) {
   std::string uri = params["textDocument"]["uri"];
-  if (docs_.find(uri) != docs_.end()) {
-    analyzeAndPublish(uri, docs_[uri]);
+  auto docIt = docs_.find(uri);
+  if (docIt != docs_.end()) {
+    analyzeAndPublish(uri, docIt->second);
+  }
+}
+
+void LSPServer::onDidClose(const json &params) {
+  std::string uri = params["textDocument"]["uri"];
+  if (docs_.erase(uri) == 0) {
+    return;
   }
+  docLanguages_.erase(uri);
+  docVersions_.erase(uri);
+
+  // 解析結果は解析ワーカーが使っている最中かもしれないので、破棄も
+  // ワーカーに任せる。未処理・実行中の解析はこの依頼が置き換える
+  MoZuku::scheduling::AnalysisJob job;
+  job.uri = uri;
+  job.close = true;
+  scheduler_->schedule(std::move(job), std::chrono::milliseconds(0));
 }
 
 json LSPServer::onSemanticTokensFull(const json &id, const json &params) {
@@ -613,11 +1011,27 @@ json LSPServer::onSemanticTokensFull(const json &id, const json &params) {
     return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
   }
 
-  json tokens = buildSemanticTokens(uri);
-  return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", {{"data", tokens}}}};
+  if (!analyzerReady_.load(std::memory_order_acquire)) {
+    semanticTokensRejected_.store(true);
+    return notReadyError(id);
+  }
+
+  // 最後に完了した解析結果から応答し、未解析なら完了まで保留する
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  auto analysisIt = docAnalyses_.find(uri);
+  if (analysisIt == docAnalyses_.end() || !analysisIt->second->complete()) {
+    pendingTokenRequests_[uri].push_back({id});
+    reanalyzeEvicted(uri);
+    return json();
+  }
+  touchDocument(uri);
+
+  replySemanticTokens(
+      id, storeSemanticTokens(uri, encodeSemanticTokens(*analysisIt->second)));
+  return json();
 }
 
-json LSPServer::onSemanticTokensRange(const json &id, const json &params) {
+json LSPServer::onSemanticTokensDelta(const json &id, const json &params) {
   std::string uri = params["textDocument"]["uri"];
   if (docs_.find(uri) == docs_.end()) {
     return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
@@ -628,44 +1042,323 @@ json LSPServer::onSemanticTokensRange(const json &id, const json &params) {
     return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
   }
 
-  json tokens = buildSemanticTokens(uri);
-  return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", {{"data", tokens}}}};
+  if (!analyzerReady_.load(std::memory_order_acquire)) {
+    semanticTokensRejected_.store(true);
+    return notReadyError(id);
+  }
+
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  auto analysisIt = docAnalyses_.find(uri);
+  if (analysisIt == docAnalyses_.end() || !analysisIt->second->complete()) {
+    pendingTokenRequests_[uri].push_back({id});
+    reanalyzeEvicted(uri);
+    return json();
+  }
+  touchDocument(uri);
+
+  std::vector<uint32_t> data = encodeSemanticTokens(*analysisIt->second);
+
+  // 手元の結果と resultId が合わなければ全体を返す
+  auto previousIt = docSemanticTokens_.find(uri);
+  const std::string previousId = params.value("previousResultId", "");
+  if (previousIt == docSemanticTokens_.end() ||
+      previousIt->second.resultId != previousId) {
+    replySemanticTokens(id, storeSemanticTokens(uri, std::move(data)));
+    return json();
+  }
+
+  // 前後の一致するトークンを除いた区間を1つの編集として返す
+  const std::vector<uint32_t> &previous = previousIt->second.data;
+  const size_t limit = std::min(previous.size(), data.size());
+  size_t prefix = 0;
+  while (prefix < limit && previous[prefix] == data[prefix]) {
+    ++prefix;
+  }
+  prefix -= prefix % 5;
+  size_t suffix = 0;
+  while (suffix < limit - prefix &&
+         previous[previous.size() - 1 - suffix] ==
+             data[data.size() - 1 - suffix]) {
+    ++suffix;
+  }
+  suffix -= suffix % 5;
+
+  const size_t deleteCount = previous.size() - prefix - suffix;
+  const size_t insertCount = data.size() - prefix - suffix;
+  const SemanticTokensResult &stored =
+      storeSemanticTokens(uri, std::move(data));
+  replyStreamed(id, [&](MoZuku::rpc::JsonWriter &writer) {
+    writer.beginObject();
+    writer.key("edits");
+    writer.beginArray();
+    if (deleteCount > 0 || insertCount > 0) {
+      writer.beginObject();
+      writer.key("data");
+      writer.beginArray();
+      for (size_t i = prefix; i < prefix + insertCount; ++i) {
+        writer.value(stored.data[i]);
+      }
+      writer.endArray();
+      writer.key("deleteCount");
+      writer.value(deleteCount);
+      writer.key("start");
+      writer.value(prefix);
+      writer.endObject();
+    }
+    writer.endArray();
+    writer.key("resultId");
+    writer.value(stored.resultId);
+    writer.endObject();
+  });
+  return json();
 }
 
-bool isNoun(const std::string &tokenType, const std::string &feature) {
-  // tokenTypeが "noun" の場合
-  if (tokenType == "noun") {
-    return true;
+json LSPServer::onSemanticTokensRange(const json &id, const json &params) {
+  std::string uri = params["textDocument"]["uri"];
+  if (docs_.find(uri) == docs_.end()) {
+    return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
+  }
+
+  auto langIt = docLanguages_.find(uri);
+  if (langIt == docLanguages_.end() || langIt->second != "japanese") {
+    return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
+  }
+
+  if (!analyzerReady_.load(std::memory_order_acquire)) {
+    semanticTokensRejected_.store(true);
+    return notReadyError(id);
   }
 
-  // MeCabのfeature文字列から品詞を判定
-  // feature形式:
-  // "品詞,品詞細分類1,品詞細分類2,品詞細分類3,活用型,活用形,原形,読み,発音"
-  if (!feature.empty()) {
-    size_t commaPos = feature.find(',');
-    if (commaPos != std::string::npos) {
-      std::string mainPOS = feature.substr(0, commaPos);
-      return mainPOS == "名詞";
+  int startLine = 0;
+  int endLine = -1;
+  if (params.contains("range")) {
+    const auto &range = params["range"];
+    startLine = range["start"].value("line", 0);
+    endLine = range["end"].value("line", 0);
+    // 終端が行頭ならその行は含まない
+    if (range["end"].value("character", 0) == 0 && endLine > startLine) {
+      --endLine;
     }
   }
 
-  return false;
+  // 範囲外の解析待ちはしない。未解析なら範囲の文を先に解析させて保留し、
+  // 暫定の結果 (表示範囲だけを解析したもの) があればそこから応答する
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  auto analysisIt = docAnalyses_.find(uri);
+  if (analysisIt == docAnalyses_.end()) {
+    pendingTokenRequests_[uri].push_back({id, true, startLine, endLine});
+    prioritizeViewport(uri, startLine, endLine);
+    return json();
+  }
+  touchDocument(uri);
+
+  const std::vector<uint32_t> data =
+      encodeSemanticTokens(*analysisIt->second, startLine, endLine);
+  replyStreamed(id, [&](MoZuku::rpc::JsonWriter &writer) {
+    writer.beginObject();
+    writer.key("data");
+    writer.beginArray();
+    for (uint32_t value : data) {
+      writer.value(value);
+    }
+    writer.endArray();
+    writer.endObject();
+  });
+  return json();
 }
 
-json LSPServer::onHover(const json &id, const json &params) {
+json LSPServer::onDocumentDiagnostic(const json &id, const json &params) {
   std::string uri = params["textDocument"]["uri"];
-  if (docs_.find(uri) == docs_.end() ||
-      docTokens_.find(uri) == docTokens_.end()) {
-    return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
+  PendingDiagnosticRequest request;
+  request.id = id;
+  if (params.contains("previousResultId") &&
+      params["previousResultId"].is_string()) {
+    request.previousResultId = params["previousResultId"];
+  }
+
+  // 開いていない文書は解析しない (ワークスペースの診断で扱う)
+  if (docs_.find(uri) == docs_.end()) {
+    return json{{"jsonrpc", "2.0"},
+                {"id", id},
+                {"result", {{"kind", "full"}, {"items", json::array()}}}};
+  }
+  auto versionIt = docVersions_.find(uri);
+  if (versionIt != docVersions_.end()) {
+    request.version = versionIt->second;
+  }
+
+  // 最新の版の解析が済んでいれば応答し、まだなら完了まで保留する
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  auto reportIt = docDiagnostics_.find(uri);
+  if (reportIt != docDiagnostics_.end() && reportIt->second.complete &&
+      (request.version < 0 || reportIt->second.version >= request.version)) {
+    replyPendingDiagnostics({request}, reportIt->second);
+    return json();
+  }
+  pendingDiagnosticRequests_[uri].push_back(std::move(request));
+  return json();
+}
+
+json LSPServer::onWorkspaceDiagnostic(const json &id, const json &params) {
+  if (!config_.analysis.workspaceDiagnostics || workspaceFolders_.empty()) {
+    return json{{"jsonrpc", "2.0"},
+                {"id", id},
+                {"result", {{"items", json::array()}}}};
+  }
+
+  auto run = std::make_shared<WorkspaceDiagnosticRun>();
+  run->id = id;
+  if (params.contains("partialResultToken")) {
+    run->partialResultToken = params["partialResultToken"];
+  }
+  if (params.contains("previousResultIds") &&
+      params["previousResultIds"].is_array()) {
+    for (const auto &previous : params["previousResultIds"]) {
+      if (previous.contains("uri") && previous["uri"].is_string() &&
+          previous.contains("value") && previous["value"].is_string()) {
+        run->previousResultIds[previous["uri"]] = previous["value"];
+      }
+    }
+  }
+
+  // 同時に進めるのは最新の要求だけ
+  std::shared_ptr<WorkspaceDiagnosticRun> superseded;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    superseded = std::move(workspaceRun_);
+    workspaceRun_ = run;
+  }
+  if (superseded) {
+    reply(json{{"jsonrpc", "2.0"},
+               {"id", superseded->id},
+               {"error",
+                {{"code", -32802}, // ServerCancelled
+                 {"message", "Superseded by a newer workspace/diagnostic"}}}});
   }
 
+  MoZuku::scheduling::AnalysisJob job;
+  job.uri = kWorkspaceDiagnosticJob;
+  job.background = true;
+  job.workspaceDiagnostic = true;
+  scheduler_->schedule(std::move(job), std::chrono::milliseconds(0));
+  return json();
+}
+
+json LSPServer::onStats(const json &id, const json &params) {
+  const bool reset = params.contains("reset") && params["reset"].is_boolean() &&
+                     params["reset"].get<bool>();
+  MoZuku::stats::flushTrace();
+  json result = MoZuku::stats::snapshot(reset);
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    result["memory"] = {
+        {"budgetBytes",
+         static_cast<size_t>(config_.analysis.memoryBudgetMB) * 1024 * 1024},
+        {"residentBytes", residentBytes_},
+        {"residentDocuments", residentDocuments_.size()},
+        {"evictedDocuments", evictedDocuments_.size()}};
+  }
+  const auto &sentences = MoZuku::cache::SentenceCache::getInstance();
+  result["sentenceCache"] = {{"entries", sentences.size()},
+                             {"bytes", sentences.bytes()}};
+  result["dependencyCache"] = {
+      {"bytes", MoZuku::cache::DependencyCache::getInstance().bytes()}};
+  return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", result}};
+}
+
+void LSPServer::onCancelRequest(const json &params) {
+  if (!params.contains("id")) {
+    return;
+  }
+  const json &id = params["id"];
+
+  // 保留中の要求だけが取り消し対象 (それ以外は応答済み)
+  bool cancelled = false;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    for (auto &entry : pendingTokenRequests_) {
+      auto &requests = entry.second;
+      auto it = std::find_if(
+          requests.begin(), requests.end(),
+          [&](const PendingTokenRequest &request) { return request.id == id; });
+      if (it != requests.end()) {
+        requests.erase(it);
+        cancelled = true;
+        break;
+      }
+    }
+    for (auto &entry : pendingDiagnosticRequests_) {
+      if (cancelled) {
+        break;
+      }
+      auto &requests = entry.second;
+      auto it = std::find_if(requests.begin(), requests.end(),
+                             [&](const PendingDiagnosticRequest &request) {
+                               return request.id == id;
+                             });
+      if (it != requests.end()) {
+        requests.erase(it);
+        cancelled = true;
+      }
+    }
+    // ワーカーは次の区切りで打ち切られたことに気づく
+    if (!cancelled && workspaceRun_ && workspaceRun_->id == id) {
+      workspaceRun_.reset();
+      cancelled = true;
+    }
+  }
+
+  if (cancelled) {
+    reply(json{{"jsonrpc", "2.0"},
+               {"id", id},
+               {"error", {{"code", -32800}, {"message", "Request cancelled"}}}});
+  }
+}
+
+void LSPServer::onHighlightsResync(const json &params) {
+  if (!params.contains("uri") || !params["uri"].is_string()) {
+    return;
+  }
+  const std::string uri = params["uri"];
+  auto docIt = docs_.find(uri);
+  if (docIt == docs_.end()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    highlightResyncs_.insert(uri);
+  }
+  MoZuku::stats::count("highlights.resyncs");
+  analyzeAndPublish(uri, docIt->second);
+}
+
+bool isNoun(const MoZuku::tokens::FeatureEntry &entry) {
+  // セマンティックトークン種別が noun か、主品詞が名詞の場合
+  return entry.type == MoZuku::tokens::TokenType::Noun ||
+         entry.is(MoZuku::tokens::PartOfSpeech::Noun);
+}
+
+json LSPServer::onHover(const json &id, const json &params) {
+  std::string uri = params["textDocument"]["uri"];
   int line = params["position"]["line"];
   int character = params["position"]["character"];
 
-  const auto docIt = docs_.find(uri);
-  if (docIt == docs_.end()) {
+  if (docs_.find(uri) == docs_.end()) {
+    return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
+  }
+
+  // 解析器の準備中や解析中でも待たず、最後に完了した解析結果から応答する
+  if (!analyzerReady_.load(std::memory_order_acquire)) {
+    return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
+  }
+  std::unique_lock<std::mutex> lock(stateMutex_);
+  const auto analysisIt = docAnalyses_.find(uri);
+  if (analysisIt == docAnalyses_.end()) {
+    prioritizeViewport(uri, std::max(0, line - kHoverViewportLines),
+                       line + kHoverViewportLines);
     return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
   }
+  touchDocument(uri);
 
   // japanese 以外の言語では、コメント/コンテンツ範囲内でのみ hover を表示
   // (HTML: タグ内テキスト、LaTeX: タグ・数式以外のテキスト、その他: コメント内)
@@ -673,267 +1366,900 @@ json LSPServer::onHover(const json &id, const json &params) {
   bool isJapanese =
       (langIt != docLanguages_.end() && langIt->second == "japanese");
 
+  // 位置の変換も範囲もトークンも、最後に完了した解析のテキストを基準にする
+  const auto &analysis = *analysisIt->second;
   if (!isJapanese) {
-    size_t offset = computeByteOffset(docIt->second, line, character);
-    bool insideComment = false;
-    const auto segmentsIt = docCommentSegments_.find(uri);
-    if (segmentsIt != docCommentSegments_.end()) {
-      for (const auto &segment : segmentsIt->second) {
-        if (offset >= segment.startByte && offset < segment.endByte) {
-          insideComment = true;
-          break;
+    const size_t offset = analysis.byteOffsetOf(line, character);
+    const auto rangesIt = docHoverRanges_.find(uri);
+    if (rangesIt == docHoverRanges_.end() ||
+        !containsOffset(rangesIt->second, offset)) {
+      return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
+    }
+  }
+
+  // 位置にあるトークンを検索
+  size_t sentenceIndex = 0;
+  size_t foundIndex = 0;
+  if (!analysis.findToken(line, character, sentenceIndex, foundIndex)) {
+    return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
+  }
+  const auto *foundSentence = &analysis.sentences()[sentenceIndex];
+  const auto *foundStore = &foundSentence->tokens;
+
+  // 係り受けはこの文についてだけ、ロックを外してから求める
+  // (キャッシュになければ CaboCha に保持しているトークン列を渡す)
+  const bool withDependencies =
+      config_.analysis.enableCaboCha && analyzer_->isCaboChaAvailable();
+  std::string sentenceText;
+  size_t sentenceStart = 0;
+  MoZuku::tokens::TokenStore sentenceTokens;
+  if (withDependencies) {
+    const auto &boundary = foundSentence->boundary;
+    sentenceStart = boundary.start;
+    sentenceText = analysis.text().substr(boundary.start,
+                                          boundary.end - boundary.start);
+    sentenceTokens = foundSentence->tokens;
+  }
+
+  // 素性の記録は不変なので、表層形と位置だけを写してロックを外す
+  const auto token = foundStore->view(foundIndex, analysis.text());
+  const std::string surface(token.surface());
+  const MoZuku::tokens::FeatureEntry &entry = token.entry();
+  const int tokenLine = token.line();
+  const int tokenStart = token.startChar();
+  const int tokenEnd = token.endChar();
+  lock.unlock();
+
+  std::ostringstream markdown;
+  markdown << "**" << surface << "**\n";
+  markdown << "```\n";
+  markdown << entry.feature << "\n";
+  markdown << "```\n";
+  if (!entry.baseForm.empty()) {
+    markdown << "**原形**: " << entry.baseForm << "\n";
+  }
+  if (!entry.reading.empty()) {
+    markdown << "**読み**: " << entry.reading << "\n";
+  }
+  if (!entry.pronunciation.empty()) {
+    markdown << "**発音**: " << entry.pronunciation << "\n";
+  }
+
+  if (withDependencies) {
+    const auto dependencies = analyzer_->sentenceDependencies(
+        sentenceText, sentenceStart, sentenceTokens, 0, sentenceTokens.size());
+    if (dependencies) {
+      const auto &chunks = dependencies->chunks;
+      for (const auto &chunk : chunks) {
+        if (foundIndex < chunk.tokenBegin ||
+            foundIndex >= chunk.tokenBegin + chunk.tokenCount) {
+          continue;
+        }
+        markdown << "**文節**: " << chunk.text << "\n";
+        if (chunk.headId >= 0 &&
+            chunk.headId < static_cast<int>(chunks.size())) {
+          markdown << "**係り先**: " << chunks[chunk.headId].text << "\n";
         }
+        break;
       }
     }
+  }
 
-    bool insideContent = false;
-    if (langIt != docLanguages_.end() &&
-        (langIt->second == "html" || langIt->second == "latex")) {
-      const auto contentIt = docContentHighlightRanges_.find(uri);
-      if (contentIt != docContentHighlightRanges_.end()) {
-        for (const auto &range : contentIt->second) {
-          if (offset >= range.startByte && offset < range.endByte) {
-            insideContent = true;
-            break;
-          }
-        }
+  // 名詞の場合、Wikipediaサマリを追加
+  if (isNoun(entry)) {
+    std::string query = entry.baseForm.empty() ? surface : entry.baseForm;
+
+    auto &cache = wikipedia::WikipediaCache::getInstance();
+    auto cached_entry = cache.getEntry(query);
+
+    if (cached_entry) {
+      if (cached_entry->response_code == 200) {
+        markdown << "\n---\n";
+        markdown << "**Wikipedia**: " << cached_entry->content;
+      } else {
+        markdown << "\n---\n";
+        markdown << "**Wikipedia**: "
+                 << wikipedia::getJapaneseErrorMessage(
+                        cached_entry->response_code);
       }
+    } else {
+      if (MoZuku::stats::debugEnabled()) {
+        std::cerr << "[DEBUG] fetching Wikipedia: " << query << std::endl;
+      }
+
+      // 取得は共有のフェッチャスレッドが行い、結果はキャッシュに入る
+      wikipedia::fetchSummary(query);
     }
+  }
 
-    if (!insideComment && !insideContent) {
-      return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
+  return json{
+      {"jsonrpc", "2.0"},
+      {"id", id},
+      {"result",
+       {{"contents", {{"kind", "markdown"}, {"value", markdown.str()}}},
+        {"range",
+         {{"start", {{"line", tokenLine}, {"character", tokenStart}}},
+          {"end", {{"line", tokenLine}, {"character", tokenEnd}}}}}}}};
+}
+
+void LSPServer::analyzeAndPublish(
+    const std::string &uri, const MoZuku::text::DocumentBuffer &document) {
+  // 文書全体を解析し直す (didOpen/didSave)
+  scheduleAnalysis(uri, document, true, 0);
+}
+
+void LSPServer::analyzeChangedLines(
+    const std::string &uri, const MoZuku::text::DocumentBuffer &document) {
+  // 連続した編集をまとめ、前回の解析結果から編集が及んだ文のみ再解析する
+  scheduleAnalysis(uri, document, false, config_.analysis.debounceMs);
+}
+
+void LSPServer::scheduleAnalysis(const std::string &uri,
+                                 const MoZuku::text::DocumentBuffer &document,
+                                 bool fullReanalysis, int delayMs) {
+  MoZuku::scheduling::AnalysisJob job;
+  job.uri = uri;
+  // チャンクを共有するだけで、全文のコピーはワーカーが実行時に1度だけ作る
+  job.text = document.snapshot();
+  job.fullReanalysis = fullReanalysis;
+
+  auto langIt = docLanguages_.find(uri);
+  if (langIt != docLanguages_.end()) {
+    job.languageId = langIt->second;
+  }
+  auto versionIt = docVersions_.find(uri);
+  if (versionIt != docVersions_.end()) {
+    job.version = versionIt->second;
+  }
+
+  scheduler_->schedule(std::move(job), std::chrono::milliseconds(delayMs));
+}
+
+void LSPServer::runAnalysisJob(const MoZuku::scheduling::AnalysisJob &job) {
+  if (job.close || job.releaseFirst) {
+    releaseDocument(job.uri);
+    if (job.close) {
+      return;
     }
   }
 
-  // 位置にあるトークンを検索
-  const auto &tokens = docTokens_[uri];
-  for (const auto &token : tokens) {
-    if (token.line == line && character >= token.startChar &&
-        character < token.endChar) {
-      std::ostringstream markdown;
-      markdown << "**" << token.surface << "**\n";
-      markdown << "```\n";
-      markdown << token.feature << "\n";
-      markdown << "```\n";
-      if (!token.baseForm.empty()) {
-        markdown << "**原形**: " << token.baseForm << "\n";
-      }
-      if (!token.reading.empty()) {
-        markdown << "**読み**: " << token.reading << "\n";
-      }
-      if (!token.pronunciation.empty()) {
-        markdown << "**発音**: " << token.pronunciation << "\n";
+  // 解析ワーカー上で実行される。onInitialize で始めた初期化の完了を待つ
+  // (initialize より先に届いた文書ではここで始める)
+  startAnalyzerInit();
+  {
+    MoZuku::stats::ScopedTimer timer("analysis.waitInit");
+    analyzerInit_.wait();
+  }
+
+  if (job.workspaceDiagnostic) {
+    runWorkspaceDiagnosticStep(job);
+    return;
+  }
+
+  // 以降の計測はこの文書にも振り分ける
+  MoZuku::stats::DocumentScope documentScope(&job.uri);
+  MoZuku::stats::ScopedTimer jobTimer("analysis.job");
+  MoZuku::stats::count("analysis.jobs");
+
+  const std::string text = job.text.str();
+
+  // 構文木は言語ごとに保持し、言語が変わったら作り直す (LaTeX は対象外)
+  MoZuku::comments::SyntaxDocument *syntax = nullptr;
+  if (job.languageId != "latex" &&
+      MoZuku::comments::isLanguageSupported(job.languageId)) {
+    auto &document = docSyntax_[job.uri];
+    if (!document || document->languageId() != job.languageId) {
+      document =
+          std::make_unique<MoZuku::comments::SyntaxDocument>(job.languageId);
+    }
+    syntax = document.get();
+  }
+
+  PreparedText prepared;
+  {
+    MoZuku::stats::ScopedTimer timer("analysis.prepareText");
+    prepared = prepareAnalysisText(job.languageId, text, syntax,
+                                   config_.analysis.minJapaneseRatio);
+  }
+
+  // 重い解析はロックの外で行い、結果の反映だけを排他する
+  MoZuku::incremental::IncrementalAnalyzer *analysis = nullptr;
+  std::unique_ptr<MoZuku::incremental::IncrementalAnalyzer> created;
+  bool hasViewport = false;
+  LineRange viewport;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    auto analysisIt = docAnalyses_.find(job.uri);
+    if (analysisIt != docAnalyses_.end()) {
+      analysis = analysisIt->second.get();
+    }
+    auto viewportIt = docViewports_.find(job.uri);
+    if (viewportIt != docViewports_.end()) {
+      hasViewport = true;
+      viewport = viewportIt->second;
+    }
+  }
+
+  // 未解析の文書で表示範囲を要求されていれば、そこを先に済ませる
+  if (!analysis && hasViewport && !job.background &&
+      analyzeViewport(job, text, prepared, viewport)) {
+    return;
+  }
+  // 暫定の結果を全文の結果で置き換えたら、クライアントに取り直させる
+  const bool replacesPartial = analysis && !analysis->complete();
+
+  if (!analysis) {
+    created = std::make_unique<MoZuku::incremental::IncrementalAnalyzer>();
+    analysis = created.get();
+  }
+
+  MoZuku::incremental::PendingUpdate update;
+  if (!analysis->prepare(*analyzer_, prepared.text,
+                         prepared.segmented ? &prepared.analysisRanges
+                                            : nullptr,
+                         &config_, job.fullReanalysis, job.cancelled.get(),
+                         update)) {
+    MoZuku::stats::count("analysis.cancelled");
+    return;
+  }
+
+  std::vector<ByteRange> hoverRanges = hoverRangesOf(prepared);
+  std::vector<PendingTokenRequest> waitingRequests;
+  std::vector<PendingDiagnosticRequest> waitingDiagnostics;
+  bool diagnosticsChanged = false;
+  {
+    MoZuku::stats::ScopedTimer timer("analysis.commit");
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    analysis->commit(std::move(update), &config_);
+    if (created) {
+      docAnalyses_[job.uri] = std::move(created);
+    }
+    docViewports_.erase(job.uri);
+    docHoverRanges_[job.uri] = std::move(hoverRanges);
+    diagnosticsChanged = cacheDiagnostics(job.uri, job.version, true,
+                                          analysis->collectDiagnostics());
+
+    auto waitingIt = pendingTokenRequests_.find(job.uri);
+    if (waitingIt != pendingTokenRequests_.end()) {
+      waitingRequests = std::move(waitingIt->second);
+      pendingTokenRequests_.erase(waitingIt);
+    }
+    // この版より後の版を待っている要求は次の解析まで残す
+    auto diagnosticsIt = pendingDiagnosticRequests_.find(job.uri);
+    if (diagnosticsIt != pendingDiagnosticRequests_.end()) {
+      auto &requests = diagnosticsIt->second;
+      auto split = std::stable_partition(
+          requests.begin(), requests.end(),
+          [&](const PendingDiagnosticRequest &request) {
+            return job.version >= 0 && request.version > job.version;
+          });
+      waitingDiagnostics.assign(split, requests.end());
+      requests.erase(split, requests.end());
+      if (requests.empty()) {
+        pendingDiagnosticRequests_.erase(diagnosticsIt);
       }
+    }
 
-      // 名詞の場合、Wikipediaサマリを追加
-      if (isNoun(token.tokenType, token.feature)) {
-        std::string query =
-            token.baseForm.empty() ? token.surface : token.baseForm;
-
-        auto &cache = wikipedia::WikipediaCache::getInstance();
-        auto cached_entry = cache.getEntry(query);
-
-        if (cached_entry) {
-          if (cached_entry->response_code == 200) {
-            markdown << "\n---\n";
-            markdown << "**Wikipedia**: " << cached_entry->content;
-          } else {
-            markdown << "\n---\n";
-            markdown << "**Wikipedia**: "
-                     << wikipedia::getJapaneseErrorMessage(
-                            cached_entry->response_code);
-          }
-        } else {
-          if (isDebugEnabled()) {
-            std::cerr << "[DEBUG] fetching Wikipedia: " << query << std::endl;
-          }
-
-          auto future = wikipedia::fetchSummary(query);
-
-          std::thread([query, future = std::move(future)]() mutable {
-            try {
-              auto result = future.get();
-              if (isDebugEnabled()) {
-                std::cerr << "[DEBUG] Wikipedia取得完了: " << query
-                          << ", ステータス: " << result.response_code
-                          << std::endl;
-              }
-            } catch (const std::exception &e) {
-              if (isDebugEnabled()) {
-                std::cerr << "[DEBUG] Wikipedia取得失敗: " << query
-                          << ", エラー: " << e.what() << std::endl;
-              }
-            }
-          }).detach();
-        }
+    accountDocument(job.uri, syntax ? syntax->approximateBytes() : 0);
+    evictDocuments(job.uri);
+  }
+
+  // 解析結果を書き換えるのはこのワーカーだけなので、以降はロック不要
+  const DiagnosticReport &report = docDiagnostics_[job.uri];
+  if (diagnosticsChanged && !pullDiagnosticsSupport_) {
+    publishDiagnostics(job.uri, job.version, report.diagnostics);
+  }
+  replyPendingDiagnostics(waitingDiagnostics, report);
+  publishAnalysis(job.uri, text, job.languageId, *analysis, prepared);
+  replyPendingTokens(job.uri, *analysis, waitingRequests);
+  if (replacesPartial) {
+    requestSemanticTokensRefresh();
+  }
+}
+
+bool LSPServer::analyzeViewport(const MoZuku::scheduling::AnalysisJob &job,
+                                const std::string &text,
+                                const PreparedText &prepared,
+                                const LineRange &viewport) {
+  const std::vector<size_t> lineStarts = computeLineStarts(prepared.text);
+  const size_t lineCount = lineStarts.size();
+  const size_t begin =
+      static_cast<size_t>(viewport.startLine) < lineCount
+          ? lineStarts[viewport.startLine]
+          : prepared.text.size();
+  const size_t end =
+      viewport.endLine >= 0 &&
+              static_cast<size_t>(viewport.endLine) + 1 < lineCount
+          ? lineStarts[viewport.endLine + 1]
+          : prepared.text.size();
+  if (begin == 0 && end == prepared.text.size()) {
+    return false;
+  }
+
+  // 解析する範囲を表示範囲の行で切り詰める
+  std::vector<ByteRange> ranges;
+  if (prepared.segmented) {
+    for (const auto &range : prepared.analysisRanges) {
+      const size_t start = std::max(range.startByte, begin);
+      const size_t stop = std::min(range.endByte, end);
+      if (start < stop) {
+        ranges.push_back({start, stop});
       }
+    }
+  } else if (begin < end) {
+    ranges.push_back({begin, end});
+  }
 
-      return json{
-          {"jsonrpc", "2.0"},
-          {"id", id},
-          {"result",
-           {{"contents", {{"kind", "markdown"}, {"value", markdown.str()}}},
-            {"range",
-             {{"start", {{"line", token.line}, {"character", token.startChar}}},
-              {"end",
-               {{"line", token.line}, {"character", token.endChar}}}}}}}};
+  auto created = std::make_unique<MoZuku::incremental::IncrementalAnalyzer>();
+  MoZuku::incremental::PendingUpdate update;
+  {
+    MoZuku::stats::ScopedTimer timer("analysis.viewport");
+    if (!created->prepare(*analyzer_, prepared.text, &ranges, &config_, true,
+                          job.cancelled.get(), update)) {
+      MoZuku::stats::count("analysis.cancelled");
+      return true;
+    }
+  }
+  update.partial = true;
+
+  MoZuku::incremental::IncrementalAnalyzer *analysis = created.get();
+  std::vector<ByteRange> hoverRanges = hoverRangesOf(prepared);
+  std::vector<PendingTokenRequest> rangeRequests;
+  bool diagnosticsChanged = false;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    analysis->commit(std::move(update), &config_);
+    docAnalyses_[job.uri] = std::move(created);
+    docViewports_.erase(job.uri);
+    docHoverRanges_[job.uri] = std::move(hoverRanges);
+    diagnosticsChanged = cacheDiagnostics(job.uri, job.version, false,
+                                          analysis->collectDiagnostics());
+
+    // 全体の要求は全文の解析が終わるまで待たせる
+    auto waitingIt = pendingTokenRequests_.find(job.uri);
+    if (waitingIt != pendingTokenRequests_.end()) {
+      auto &requests = waitingIt->second;
+      auto split = std::stable_partition(
+          requests.begin(), requests.end(),
+          [](const PendingTokenRequest &request) { return !request.range; });
+      rangeRequests.assign(split, requests.end());
+      requests.erase(split, requests.end());
     }
+
+    accountDocument(job.uri, 0);
+    evictDocuments(job.uri);
+  }
+
+  if (MoZuku::stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Viewport analysed first: " << job.uri << " lines "
+              << viewport.startLine << "-" << viewport.endLine << " ("
+              << analysis->sentences().size() << " sentences)" << std::endl;
   }
 
-  return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", nullptr}};
+  replyPendingTokens(job.uri, *analysis, rangeRequests);
+  // pull 型の診断は全文の解析が終わってから応答する
+  if (diagnosticsChanged && !pullDiagnosticsSupport_) {
+    publishDiagnostics(job.uri, job.version,
+                       docDiagnostics_[job.uri].diagnostics);
+  }
+  publishAnalysis(job.uri, text, job.languageId, *analysis, prepared);
+
+  // 残りは他の依頼に譲りながら解析する。文の結果はキャッシュに入っている
+  // ので、表示範囲の文は解析し直さない
+  MoZuku::scheduling::AnalysisJob rest;
+  rest.uri = job.uri;
+  rest.version = job.version;
+  rest.languageId = job.languageId;
+  rest.text = job.text;
+  rest.fullReanalysis = true;
+  rest.background = true;
+  scheduler_->schedule(std::move(rest), std::chrono::milliseconds(0));
+  return true;
 }
 
-void LSPServer::analyzeAndPublish(const std::string &uri,
-                                  const std::string &text) {
-  if (!analyzer_->isInitialized()) {
-    analyzer_->initialize(config_);
+void LSPServer::replyPendingTokens(
+    const std::string &uri,
+    const MoZuku::incremental::IncrementalAnalyzer &analysis,
+    const std::vector<PendingTokenRequest> &requests) {
+  if (requests.empty()) {
+    return;
+  }
+  const bool anyFull =
+      std::any_of(requests.begin(), requests.end(),
+                  [](const PendingTokenRequest &request) {
+                    return !request.range;
+                  });
+  std::vector<uint32_t> data;
+  if (anyFull) {
+    data = encodeSemanticTokens(analysis);
   }
 
-  std::string analysisText = prepareAnalysisText(uri, text);
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  const SemanticTokensResult *stored =
+      anyFull ? &storeSemanticTokens(uri, std::move(data)) : nullptr;
+  for (const auto &request : requests) {
+    if (!request.range) {
+      replySemanticTokens(request.id, *stored);
+      continue;
+    }
+    const std::vector<uint32_t> rangeData =
+        encodeSemanticTokens(analysis, request.startLine, request.endLine);
+    replyStreamed(request.id, [&](MoZuku::rpc::JsonWriter &writer) {
+      writer.beginObject();
+      writer.key("data");
+      writer.beginArray();
+      for (uint32_t value : rangeData) {
+        writer.value(value);
+      }
+      writer.endArray();
+      writer.endObject();
+    });
+  }
+}
 
-  std::vector<TokenData> tokens = analyzer_->analyzeText(analysisText);
-  std::vector<Diagnostic> diags = analyzer_->checkGrammar(analysisText);
+void LSPServer::releaseDocument(const std::string &uri) {
+  docSyntax_.erase(uri);
+  docHighlights_.erase(uri);
+
+  std::vector<PendingTokenRequest> waitingRequests;
+  std::vector<PendingDiagnosticRequest> waitingDiagnostics;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    docAnalyses_.erase(uri);
+    docDiagnostics_.erase(uri);
+    docHoverRanges_.erase(uri);
+    docSemanticTokens_.erase(uri);
+    evictedDocuments_.erase(uri);
+    docViewports_.erase(uri);
+    highlightResyncs_.erase(uri);
+    forgetDocument(uri);
+
+    auto waitingIt = pendingTokenRequests_.find(uri);
+    if (waitingIt != pendingTokenRequests_.end()) {
+      waitingRequests = std::move(waitingIt->second);
+      pendingTokenRequests_.erase(waitingIt);
+    }
+    auto diagnosticsIt = pendingDiagnosticRequests_.find(uri);
+    if (diagnosticsIt != pendingDiagnosticRequests_.end()) {
+      waitingDiagnostics = std::move(diagnosticsIt->second);
+      pendingDiagnosticRequests_.erase(diagnosticsIt);
+    }
+  }
 
-  docTokens_[uri] = tokens;
-  cacheDiagnostics(uri, diags);
+  for (const auto &request : waitingRequests) {
+    reply(json{{"jsonrpc", "2.0"}, {"id", request.id}, {"result", nullptr}});
+  }
+  replyPendingDiagnostics(waitingDiagnostics, DiagnosticReport{});
 
-  // 診断情報を配信
-  json diagnostics = json::array();
-  for (const auto &diag : diags) {
-    diagnostics.push_back({{"range",
-                            {{"start",
-                              {{"line", diag.range.start.line},
-                               {"character", diag.range.start.character}}},
-                             {"end",
-                              {{"line", diag.range.end.line},
-                               {"character", diag.range.end.character}}}}},
-                           {"severity", diag.severity},
-                           {"message", diag.message}});
+  // 閉じた文書の診断はクライアント側から消す (pull 型ならクライアントが消す)
+  if (!pullDiagnosticsSupport_) {
+    notify("textDocument/publishDiagnostics",
+           json{{"uri", uri}, {"diagnostics", json::array()}});
   }
 
-  notify("textDocument/publishDiagnostics",
-         {{"uri", uri}, {"diagnostics", diagnostics}});
+  if (MoZuku::stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Document closed: " << uri << std::endl;
+  }
+}
 
-  // コンテンツ範囲を通知 (コメント範囲 or HTML/LaTeX のコンテンツ範囲)
-  // HTML: タグ内テキスト、LaTeX: タグ・数式以外のテキスト
-  const auto segmentsIt = docCommentSegments_.find(uri);
-  if (segmentsIt != docCommentSegments_.end()) {
-    sendCommentHighlights(uri, text, segmentsIt->second);
-  } else {
-    static const std::vector<MoZuku::comments::CommentSegment> kEmptySegments;
-    sendCommentHighlights(uri, text, kEmptySegments);
+void LSPServer::accountDocument(const std::string &uri, size_t syntaxBytes) {
+  size_t bytes = syntaxBytes;
+  auto analysisIt = docAnalyses_.find(uri);
+  if (analysisIt != docAnalyses_.end()) {
+    bytes += analysisIt->second->approximateBytes();
+  }
+  auto rangesIt = docHoverRanges_.find(uri);
+  if (rangesIt != docHoverRanges_.end()) {
+    bytes += rangesIt->second.capacity() * sizeof(ByteRange);
+  }
+  auto tokensIt = docSemanticTokens_.find(uri);
+  if (tokensIt != docSemanticTokens_.end()) {
+    bytes += tokensIt->second.data.capacity() * sizeof(uint32_t);
+  }
+  auto highlightsIt = docHighlights_.find(uri);
+  if (highlightsIt != docHighlights_.end()) {
+    bytes += highlightsIt->second.approximateBytes();
   }
 
-  const auto contentIt = docContentHighlightRanges_.find(uri);
-  if (contentIt != docContentHighlightRanges_.end()) {
-    sendContentHighlights(uri, text, contentIt->second);
+  auto residentIt = residentDocuments_.find(uri);
+  if (residentIt == residentDocuments_.end()) {
+    residentOrder_.push_front(uri);
+    residentIt = residentDocuments_
+                     .emplace(uri, ResidentDocument{residentOrder_.begin(), 0})
+                     .first;
   } else {
-    static const std::vector<ByteRange> kEmptyContent;
-    sendContentHighlights(uri, text, kEmptyContent);
+    residentOrder_.splice(residentOrder_.begin(), residentOrder_,
+                          residentIt->second.order);
   }
-
-  sendSemanticHighlights(uri, tokens);
+  residentBytes_ -= residentIt->second.bytes;
+  residentIt->second.bytes = bytes;
+  residentBytes_ += bytes;
+  evictedDocuments_.erase(uri);
 }
 
-void LSPServer::analyzeChangedLines(const std::string &uri,
-                                    const std::string &newText,
-                                    const std::string &oldText) {
-  // 変更された行を検出
-  std::set<int> changedLines = findChangedLines(oldText, newText);
+void LSPServer::evictDocuments(const std::string &keep) {
+  const size_t budget =
+      static_cast<size_t>(config_.analysis.memoryBudgetMB) * 1024 * 1024;
+  if (budget == 0) {
+    return;
+  }
 
-  // 変更行の診断情報を削除
-  removeDiagnosticsForLines(uri, changedLines);
+  while (residentBytes_ > budget && !residentOrder_.empty() &&
+         residentOrder_.back() != keep) {
+    const std::string uri = residentOrder_.back();
+    if (MoZuku::stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Evicting analysis of " << uri << " ("
+                << residentDocuments_[uri].bytes << " bytes, resident "
+                << residentBytes_ << " / " << budget << ")" << std::endl;
+    }
 
-  // 現在は文書全体を再解析
-  // TODO: パフォーマンス向上のため行単位の解析を実装
-  analyzeAndPublish(uri, newText);
+    // 本文と診断は残し、作り直せる解析結果だけを捨てる
+    docAnalyses_.erase(uri);
+    docSyntax_.erase(uri);
+    docHoverRanges_.erase(uri);
+    docSemanticTokens_.erase(uri);
+    // 送った集合を忘れるので、次はハイライトを全体で送る
+    docHighlights_.erase(uri);
+    forgetDocument(uri);
+    evictedDocuments_.insert(uri);
+    MoZuku::stats::count("memory.evictions");
+  }
 }
 
-std::string LSPServer::prepareAnalysisText(const std::string &uri,
-                                           const std::string &text) {
-  auto langIt = docLanguages_.find(uri);
-  if (langIt == docLanguages_.end()) {
-    docCommentSegments_.erase(uri);
-    docContentHighlightRanges_.erase(uri);
-    return text;
+void LSPServer::forgetDocument(const std::string &uri) {
+  auto residentIt = residentDocuments_.find(uri);
+  if (residentIt == residentDocuments_.end()) {
+    return;
+  }
+  residentBytes_ -= residentIt->second.bytes;
+  residentOrder_.erase(residentIt->second.order);
+  residentDocuments_.erase(residentIt);
+}
+
+void LSPServer::touchDocument(const std::string &uri) {
+  auto residentIt = residentDocuments_.find(uri);
+  if (residentIt != residentDocuments_.end()) {
+    residentOrder_.splice(residentOrder_.begin(), residentOrder_,
+                          residentIt->second.order);
   }
+}
 
-  const std::string &languageId = langIt->second;
-  if (languageId == "japanese") {
-    docCommentSegments_.erase(uri);
-    docContentHighlightRanges_.erase(uri);
-    return text;
+void LSPServer::reanalyzeEvicted(const std::string &uri) {
+  if (evictedDocuments_.erase(uri) == 0) {
+    return;
+  }
+  auto docIt = docs_.find(uri);
+  if (docIt != docs_.end()) {
+    MoZuku::stats::count("memory.reanalyses");
+    analyzeAndPublish(uri, docIt->second);
   }
+}
 
-  // HTML: ドキュメント本文をハイライト (<div>text</div> の text 部分)
-  if (languageId == "html") {
-    std::vector<MoZuku::comments::CommentSegment> commentSegments =
-        MoZuku::comments::extractComments(languageId, text);
-    docCommentSegments_[uri] = commentSegments;
+void LSPServer::prioritizeViewport(const std::string &uri, int startLine,
+                                   int endLine) {
+  if (endLine < startLine) {
+    reanalyzeEvicted(uri);
+    return;
+  }
+  const bool first = docViewports_.find(uri) == docViewports_.end();
+  docViewports_[uri] = {startLine, endLine};
+  if (!first) {
+    return;
+  }
+  // 実行中の全文解析は中断させ、表示範囲から始め直させる
+  // (解析済みの文はキャッシュから使われる)
+  evictedDocuments_.erase(uri);
+  auto docIt = docs_.find(uri);
+  if (docIt != docs_.end()) {
+    analyzeAndPublish(uri, docIt->second);
+  }
+}
 
-    std::vector<LocalByteRange> contentRanges = collectHtmlContentRanges(text);
-    std::vector<ByteRange> contentByteRanges;
-    contentByteRanges.reserve(contentRanges.size());
-    for (const auto &range : contentRanges) {
-      contentByteRanges.push_back(ByteRange{range.startByte, range.endByte});
-    }
-    // コメントも本文ハイライト対象に含める (クライアント側で装飾しやすくする)
-    for (const auto &segment : commentSegments) {
-      contentByteRanges.push_back(
-          ByteRange{segment.startByte, segment.endByte});
+void LSPServer::publishAnalysis(
+    const std::string &uri, const std::string &text,
+    const std::string &languageId,
+    const MoZuku::incremental::IncrementalAnalyzer &analysis,
+    const PreparedText &prepared) {
+  MoZuku::stats::ScopedTimer timer("analysis.publish");
+
+  // コンテンツ範囲を通知 (コメント範囲 or HTML/LaTeX のコンテンツ範囲)
+  // HTML: タグ内テキスト、LaTeX: タグ・数式以外のテキスト
+  bool resync = false;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    resync = highlightResyncs_.erase(uri) > 0;
+  }
+  DocumentHighlights &highlights = docHighlights_[uri];
+  // 範囲を位置へ直す行頭は解析時に求めたものを使い、テキストを走査し直さない
+  // (sanitize でバイトが除かれたときだけ元のテキストから作る)
+  MoZuku::text::LineIndex lineIndex;
+  if (!prepared.commentSegments.empty() || !prepared.contentRanges.empty()) {
+    if (analysis.text().size() == text.size()) {
+      lineIndex.adoptLineStarts(analysis.lineStarts());
+    } else {
+      lineIndex.reset(text);
     }
-    docContentHighlightRanges_[uri] = std::move(contentByteRanges);
+  }
+  sendCommentHighlights(uri, text, lineIndex, prepared.commentSegments,
+                        highlights.comments, resync);
+  sendContentHighlights(uri, text, lineIndex, prepared.contentRanges,
+                        highlights.contents, resync);
 
-    // 全体をマスクしてコンテンツ部分のみ復元
-    std::string masked = text;
-    for (char &ch : masked) {
-      if (ch != '\n' && ch != '\r') {
-        ch = ' ';
+  sendSemanticHighlights(uri, languageId, analysis, highlights.semantic,
+                         resync);
+}
+
+void LSPServer::publishDiagnostics(const std::string &uri, int version,
+                                   const std::vector<Diagnostic> &diags) {
+  MoZuku::stats::ScopedTimer timer("analysis.publishDiagnostics");
+  notifyStreamed("textDocument/publishDiagnostics",
+                 [&](MoZuku::rpc::JsonWriter &writer) {
+                   writer.beginObject();
+                   writer.key("diagnostics");
+                   writeDiagnostics(writer, diags);
+                   writer.key("uri");
+                   writer.value(uri);
+                   if (version >= 0) {
+                     writer.key("version");
+                     writer.value(version);
+                   }
+                   writer.endObject();
+                 });
+  if (!firstPublished_.exchange(true) && MoZuku::stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Startup phase: first diagnostics published at "
+              << millisecondsSinceStart() << " ms" << std::endl;
+  }
+}
+
+void LSPServer::replyPendingDiagnostics(
+    const std::vector<PendingDiagnosticRequest> &requests,
+    const DiagnosticReport &report) {
+  for (const auto &request : requests) {
+    const bool unchanged = !request.previousResultId.empty() &&
+                           request.previousResultId == report.resultId;
+    MoZuku::stats::count(unchanged ? "diagnostics.unchanged"
+                                   : "diagnostics.full");
+    replyStreamed(request.id, [&](MoZuku::rpc::JsonWriter &writer) {
+      writer.beginObject();
+      if (!unchanged) {
+        writer.key("items");
+        writeDiagnostics(writer, report.diagnostics);
+      }
+      writer.key("kind");
+      writer.value(unchanged ? "unchanged" : "full");
+      if (!report.resultId.empty()) {
+        writer.key("resultId");
+        writer.value(report.resultId);
       }
+      writer.endObject();
+    });
+  }
+}
+
+void LSPServer::runWorkspaceDiagnosticStep(
+    const MoZuku::scheduling::AnalysisJob &job) {
+  namespace fs = std::filesystem;
+  std::shared_ptr<WorkspaceDiagnosticRun> run;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    run = workspaceRun_;
+  }
+  if (!run) {
+    return;
+  }
+  if (!run->collected) {
+    MoZuku::stats::ScopedTimer timer("workspaceDiagnostic.collect");
+    run->files = MoZuku::batch::collectInputs(workspaceFolders_);
+    run->collected = true;
+    if (MoZuku::stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Workspace diagnostics over " << run->files.size()
+                << " files" << std::endl;
     }
+  }
 
-    for (const auto &range : contentRanges) {
-      if (range.startByte >= masked.size())
+  // 変わっていないファイルは stat だけで済ませ、解析し直すのは1件まで
+  std::vector<std::string> items;
+  size_t analysed = 0;
+  while (run->next < run->files.size() &&
+         items.size() < kWorkspaceDiagnosticBatch && analysed == 0) {
+    const MoZuku::batch::InputFile &input = run->files[run->next];
+    const std::string uri = uriFromPath(input.path);
+    {
+      std::lock_guard<std::mutex> lock(stateMutex_);
+      if (workspaceRun_ != run) {
+        return; // 取り消されたか、新しい要求に置き換わった
+      }
+      // 開いている文書は textDocument/diagnostic で報告する
+      if (docDiagnostics_.find(uri) != docDiagnostics_.end()) {
+        ++run->next;
         continue;
-      size_t len = std::min(range.endByte - range.startByte,
-                            masked.size() - range.startByte);
-      for (size_t i = 0; i < len; ++i) {
-        masked[range.startByte + i] = text[range.startByte + i];
       }
     }
 
-    for (const auto &segment : commentSegments) {
-      if (segment.startByte >= masked.size())
+    std::error_code ec;
+    const auto modified = fs::last_write_time(input.path, ec);
+    const uintmax_t size = ec ? 0 : fs::file_size(input.path, ec);
+    if (ec) {
+      workspaceFiles_.erase(uri);
+      ++run->next;
+      continue;
+    }
+    const int64_t modifiedTicks = modified.time_since_epoch().count();
+
+    WorkspaceFileReport &cached = workspaceFiles_[uri];
+    if (cached.resultId.empty() || cached.modified != modifiedTicks ||
+        cached.size != size) {
+      MoZuku::stats::ScopedTimer timer("workspaceDiagnostic.file");
+      MoZuku::io::MappedFile file(input.path);
+      if (!file.ok()) {
+        workspaceFiles_.erase(uri);
+        ++run->next;
         continue;
-      size_t len =
-          std::min(segment.sanitized.size(), masked.size() - segment.startByte);
-      for (size_t i = 0; i < len; ++i) {
-        masked[segment.startByte + i] = segment.sanitized[i];
       }
+      const std::string text(file.view());
+      PreparedText prepared = prepareAnalysisText(
+          input.languageId, text, nullptr, config_.analysis.minJapaneseRatio);
+
+      std::vector<Diagnostic> diags;
+      if (!prepared.segmented || !prepared.analysisRanges.empty()) {
+        MoZuku::incremental::IncrementalAnalyzer analysis;
+        MoZuku::incremental::PendingUpdate update;
+        if (!analysis.prepare(*analyzer_, prepared.text,
+                              prepared.segmented ? &prepared.analysisRanges
+                                                 : nullptr,
+                              &config_, true, job.cancelled.get(), update)) {
+          // 他の依頼に譲った。スケジューラが積み直す
+          MoZuku::stats::count("analysis.cancelled");
+          cached.resultId.clear();
+          return;
+        }
+        analysis.commit(std::move(update), &config_);
+        diags = analysis.collectDiagnostics();
+      }
+      cached.modified = modifiedTicks;
+      cached.size = size;
+      cached.resultId = diagnosticsResultId(diags);
+      cached.diagnostics = std::move(diags);
+      MoZuku::stats::count("workspaceDiagnostic.analysed");
+      ++analysed;
+    }
+
+    auto previousIt = run->previousResultIds.find(uri);
+    const bool unchanged = previousIt != run->previousResultIds.end() &&
+                           previousIt->second == cached.resultId;
+    std::string item;
+    MoZuku::rpc::JsonWriter writer(item);
+    writer.beginObject();
+    if (!unchanged) {
+      writer.key("items");
+      writeDiagnostics(writer, cached.diagnostics);
+    }
+    writer.key("kind");
+    writer.value(unchanged ? "unchanged" : "full");
+    writer.key("resultId");
+    writer.value(cached.resultId);
+    writer.key("uri");
+    writer.value(uri);
+    writer.key("version");
+    writer.null();
+    writer.endObject();
+    items.push_back(std::move(item));
+    ++run->next;
+  }
+
+  auto writeItems = [](MoZuku::rpc::JsonWriter &writer,
+                       const std::vector<std::string> &source) {
+    writer.beginObject();
+    writer.key("items");
+    writer.beginArray();
+    for (const auto &item : source) {
+      writer.raw(item);
     }
+    writer.endArray();
+    writer.endObject();
+  };
+
+  // partialResultToken があれば途中の結果を $/progress で流す
+  if (!run->partialResultToken.is_null()) {
+    if (!items.empty()) {
+      notifyStreamed("$/progress", [&](MoZuku::rpc::JsonWriter &writer) {
+        writer.beginObject();
+        writer.key("token");
+        writer.raw(run->partialResultToken.dump());
+        writer.key("value");
+        writeItems(writer, items);
+        writer.endObject();
+      });
+    }
+  } else {
+    run->items.insert(run->items.end(),
+                      std::make_move_iterator(items.begin()),
+                      std::make_move_iterator(items.end()));
+  }
+
+  if (run->next < run->files.size()) {
+    MoZuku::scheduling::AnalysisJob next;
+    next.uri = job.uri;
+    next.background = true;
+    next.workspaceDiagnostic = true;
+    scheduler_->schedule(std::move(next), std::chrono::milliseconds(0));
+    return;
+  }
 
-    return masked;
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    if (workspaceRun_ != run) {
+      return;
+    }
+    workspaceRun_.reset();
   }
+  replyStreamed(run->id, [&](MoZuku::rpc::JsonWriter &writer) {
+    writeItems(writer, run->items);
+  });
+}
 
-  // LaTeX: ドキュメント本文をハイライト (タグ・数式を除くテキスト部分)
-  if (languageId == "latex") {
-    std::vector<MoZuku::comments::CommentSegment> commentSegments =
-        collectLatexComments(text);
-    docCommentSegments_[uri] = commentSegments;
+PreparedText
+LSPServer::prepareAnalysisText(const std::string &languageId,
+                               const std::string &text,
+                               MoZuku::comments::SyntaxDocument *syntax,
+                               double minJapaneseRatio) {
+  PreparedText prepared;
+
+  // 保持している構文木がなければ、この呼び出しの間だけ使う
+  std::unique_ptr<MoZuku::comments::SyntaxDocument> transient;
+  auto parseSyntax = [&]() -> const MoZuku::comments::SyntaxDocument * {
+    if (!syntax) {
+      transient = std::make_unique<MoZuku::comments::SyntaxDocument>(languageId);
+      syntax = transient.get();
+    }
+    return syntax->update(text) ? syntax : nullptr;
+  };
+
+  if (languageId.empty() || languageId == "japanese") {
+    prepared.text = text;
+    return prepared;
+  }
 
-    std::vector<LocalByteRange> contentRanges = collectLatexContentRanges(text);
+  // 日本語の少ないコメント・本文は MeCab に渡さない
+  auto hasEnoughJapanese = [minJapaneseRatio](const std::string &source,
+                                              size_t start, size_t end) {
+    return minJapaneseRatio <= 0.0 ||
+           MoZuku::text::TextProcessor::japaneseRatio(source, start, end) >=
+               minJapaneseRatio;
+  };
+
+  // HTML/LaTeX: ドキュメント本文をハイライト
+  // (HTML: <div>text</div> の text 部分、LaTeX: タグ・数式を除くテキスト部分)
+  if (languageId == "html" || languageId == "latex") {
+    std::vector<MoZuku::comments::CommentSegment> commentSegments;
+    std::vector<LocalByteRange> contentRanges;
+    if (languageId == "html") {
+      // コメントと本文を同じ構文木から取り出す
+      if (const auto *document = parseSyntax()) {
+        commentSegments = document->comments();
+        contentRanges.reserve(document->textNodes().size());
+        for (const auto &node : document->textNodes()) {
+          contentRanges.push_back({node.startByte, node.endByte});
+        }
+      }
+    } else {
+      commentSegments = collectLatexComments(text);
+      contentRanges = collectLatexContentRanges(text);
+    }
     std::vector<ByteRange> contentByteRanges;
-    contentByteRanges.reserve(contentRanges.size());
+    contentByteRanges.reserve(contentRanges.size() + commentSegments.size());
     for (const auto &range : contentRanges) {
       contentByteRanges.push_back(ByteRange{range.startByte, range.endByte});
     }
+    // コメントも本文ハイライト対象に含める (クライアント側で装飾しやすくする)
     for (const auto &segment : commentSegments) {
       contentByteRanges.push_back(
           ByteRange{segment.startByte, segment.endByte});
     }
-    docContentHighlightRanges_[uri] = std::move(contentByteRanges);
+    prepared.contentRanges = std::move(contentByteRanges);
 
-    // 全体をマスクしてコンテンツ部分のみ復元
+    // 全体をマスクし、解析対象の部分だけを復元する。
+    // LaTeX の本文は単語単位の範囲なので比率では選別しない
     std::string masked = text;
     for (char &ch : masked) {
       if (ch != '\n' && ch != '\r') {
@@ -941,40 +2267,53 @@ std::string LSPServer::prepareAnalysisText(const std::string &uri,
       }
     }
 
+    std::vector<ByteRange> analysisRanges;
+    analysisRanges.reserve(contentRanges.size() + commentSegments.size());
     for (const auto &range : contentRanges) {
       if (range.startByte >= masked.size())
         continue;
+      if (languageId == "html" &&
+          !hasEnoughJapanese(text, range.startByte, range.endByte))
+        continue;
       size_t len = std::min(range.endByte - range.startByte,
                             masked.size() - range.startByte);
       for (size_t i = 0; i < len; ++i) {
         masked[range.startByte + i] = text[range.startByte + i];
       }
+      analysisRanges.push_back(
+          ByteRange{range.startByte, range.startByte + len});
     }
 
     for (const auto &segment : commentSegments) {
-      if (segment.startByte >= masked.size())
+      if (segment.startByte >= masked.size() ||
+          !hasEnoughJapanese(text, segment.startByte, segment.endByte))
         continue;
-      size_t len =
-          std::min(segment.sanitized.size(), masked.size() - segment.startByte);
-      for (size_t i = 0; i < len; ++i) {
-        masked[segment.startByte + i] = segment.sanitized[i];
+      if (languageId == "latex") {
+        restoreLatexComment(text, segment, masked);
+      } else {
+        MoZuku::comments::restoreSanitized(text, segment, masked);
       }
+      analysisRanges.push_back(ByteRange{
+          segment.startByte, std::min(segment.endByte, masked.size())});
     }
 
-    return masked;
+    prepared.text = std::move(masked);
+    prepared.commentSegments = std::move(commentSegments);
+    prepared.segmented = true;
+    prepared.analysisRanges = mergeRanges(std::move(analysisRanges));
+    return prepared;
   }
 
   if (!MoZuku::comments::isLanguageSupported(languageId)) {
-    docCommentSegments_.erase(uri);
-    docContentHighlightRanges_.erase(uri);
-    return text;
+    prepared.text = text;
+    return prepared;
   }
 
   // その他の言語: コメント部分をハイライト
-  std::vector<MoZuku::comments::CommentSegment> segments =
-      MoZuku::comments::extractComments(languageId, text);
-  docCommentSegments_[uri] = segments;
-  docContentHighlightRanges_.erase(uri);
+  std::vector<MoZuku::comments::CommentSegment> segments;
+  if (const auto *document = parseSyntax()) {
+    segments = document->comments();
+  }
 
   std::string masked = text;
   for (char &ch : masked) {
@@ -983,204 +2322,307 @@ std::string LSPServer::prepareAnalysisText(const std::string &uri,
     }
   }
 
-  if (segments.empty()) {
-    return masked;
-  }
-
-  const size_t docSize = masked.size();
+  std::vector<ByteRange> analysisRanges;
+  analysisRanges.reserve(segments.size());
   for (const auto &segment : segments) {
-    if (segment.startByte >= docSize) {
+    if (segment.startByte >= masked.size() ||
+        !hasEnoughJapanese(text, segment.startByte, segment.endByte))
       continue;
-    }
-    const std::string &sanitized = segment.sanitized;
-    size_t maxCopy = std::min(docSize - segment.startByte, sanitized.size());
-    for (size_t i = 0; i < maxCopy; ++i) {
-      masked[segment.startByte + i] = sanitized[i];
-    }
+    MoZuku::comments::restoreSanitized(text, segment, masked);
+    analysisRanges.push_back(ByteRange{
+        segment.startByte, std::min(segment.endByte, masked.size())});
+  }
+
+  if (MoZuku::stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Analysis segments: " << analysisRanges.size()
+              << " of " << segments.size() << " comments" << std::endl;
   }
 
-  return masked;
+  prepared.text = std::move(masked);
+  prepared.commentSegments = std::move(segments);
+  prepared.segmented = true;
+  prepared.analysisRanges = mergeRanges(std::move(analysisRanges));
+  return prepared;
 }
 
-void LSPServer::sendCommentHighlights(
-    const std::string &uri, const std::string &text,
-    const std::vector<MoZuku::comments::CommentSegment> &segments) {
-  json ranges = json::array();
+namespace {
 
-  std::vector<size_t> lineStarts = computeLineStarts(text);
-  for (const auto &segment : segments) {
-    Position start = byteOffsetToPosition(text, lineStarts, segment.startByte);
-    Position end = byteOffsetToPosition(text, lineStarts, segment.endByte);
+// バイト範囲を (行, 開始列, 行数, 終了列) の組にする
+void appendRange(MoZuku::highlights::HighlightSet &set, const std::string &text,
+                 const MoZuku::text::LineIndex &lineIndex, size_t startByte,
+                 size_t endByte) {
+  const Position start = lineIndex.toPosition(text, startByte);
+  const Position end = lineIndex.toPosition(text, endByte);
+  set.values.push_back(static_cast<uint32_t>(start.line));
+  set.values.push_back(static_cast<uint32_t>(start.character));
+  set.values.push_back(static_cast<uint32_t>(end.line - start.line));
+  set.values.push_back(static_cast<uint32_t>(end.character));
+}
 
-    json range = {
-        {"start", {{"line", start.line}, {"character", start.character}}},
-        {"end", {{"line", end.line}, {"character", end.character}}}};
-    ranges.push_back(std::move(range));
-  }
+} // namespace
 
-  notify("mozuku/commentHighlights", {{"uri", uri}, {"ranges", ranges}});
+size_t LSPServer::DocumentHighlights::approximateBytes() const {
+  return (comments.sent.values.capacity() + contents.sent.values.capacity() +
+          semantic.sent.values.capacity()) *
+         sizeof(uint32_t);
 }
 
-void LSPServer::sendContentHighlights(const std::string &uri,
-                                      const std::string &text,
-                                      const std::vector<ByteRange> &ranges) {
-  json lspRanges = json::array();
+void LSPServer::sendCommentHighlights(
+    const std::string &uri, const std::string &text,
+    const MoZuku::text::LineIndex &lineIndex,
+    const std::vector<MoZuku::comments::CommentSegment> &segments,
+    MoZuku::highlights::HighlightChannel &channel, bool resync) {
+  std::vector<std::pair<size_t, size_t>> ranges;
+  ranges.reserve(segments.size());
+  for (const auto &segment : segments) {
+    ranges.emplace_back(segment.startByte, segment.endByte);
+  }
+  MoZuku::highlights::mergeAdjacent(text, ranges);
 
-  std::vector<size_t> lineStarts = computeLineStarts(text);
+  MoZuku::highlights::HighlightSet set;
+  set.values.reserve(ranges.size() * set.stride);
   for (const auto &range : ranges) {
-    Position start = byteOffsetToPosition(text, lineStarts, range.startByte);
-    Position end = byteOffsetToPosition(text, lineStarts, range.endByte);
+    appendRange(set, text, lineIndex, range.first, range.second);
+  }
+  sendHighlights("mozuku/commentHighlights", uri, channel, std::move(set),
+                 resync);
+}
 
-    lspRanges.push_back(
-        {{"start", {{"line", start.line}, {"character", start.character}}},
-         {"end", {{"line", end.line}, {"character", end.character}}}});
+void LSPServer::sendContentHighlights(
+    const std::string &uri, const std::string &text,
+    const MoZuku::text::LineIndex &lineIndex,
+    const std::vector<ByteRange> &ranges,
+    MoZuku::highlights::HighlightChannel &channel, bool resync) {
+  // LaTeX は単語ごとの範囲になるので、同じ行で続くものはまとめる
+  std::vector<std::pair<size_t, size_t>> merged;
+  merged.reserve(ranges.size());
+  for (const auto &range : ranges) {
+    merged.emplace_back(range.startByte, range.endByte);
   }
+  MoZuku::highlights::mergeAdjacent(text, merged);
 
-  notify("mozuku/contentHighlights", {{"uri", uri}, {"ranges", lspRanges}});
+  MoZuku::highlights::HighlightSet set;
+  set.values.reserve(merged.size() * set.stride);
+  for (const auto &range : merged) {
+    appendRange(set, text, lineIndex, range.first, range.second);
+  }
+  sendHighlights("mozuku/contentHighlights", uri, channel, std::move(set),
+                 resync);
 }
 
-void LSPServer::sendSemanticHighlights(const std::string &uri,
-                                       const std::vector<TokenData> &tokens) {
-  auto langIt = docLanguages_.find(uri);
-  bool isJapanese =
-      (langIt != docLanguages_.end() && langIt->second == "japanese");
+void LSPServer::sendSemanticHighlights(
+    const std::string &uri, const std::string &languageId,
+    const MoZuku::incremental::IncrementalAnalyzer &analysis,
+    MoZuku::highlights::HighlightChannel &channel, bool resync) {
+  bool isJapanese = (languageId == "japanese");
 
   // japanese の場合のみセマンティックハイライトを無効化
   // (.ja.txt, .ja.md は LSP 側のセマンティックトークンを使用)
   // HTML/LaTeX など他の言語は VS Code 拡張側の上塗りハイライトを使用
-  if (isJapanese) {
-    notify("mozuku/semanticHighlights",
-           {{"uri", uri}, {"tokens", json::array()}});
-    return;
-  }
-
-  json tokenEntries = json::array();
-  for (const auto &token : tokens) {
-    tokenEntries.push_back(
-        {{"range",
-          {{"start", {{"line", token.line}, {"character", token.startChar}}},
-           {"end", {{"line", token.line}, {"character", token.endChar}}}}},
-         {"type", token.tokenType},
-         {"modifiers", token.tokenModifiers}});
+  MoZuku::highlights::HighlightSet set;
+  set.stride = 5;
+  if (!isJapanese) {
+    for (const auto &sentence : analysis.sentences()) {
+      const auto &tokens = sentence.tokens;
+      for (size_t i = 0; i < tokens.size(); ++i) {
+        const int startChar = tokens.startChar(i);
+        set.values.push_back(static_cast<uint32_t>(tokens.line(i)));
+        set.values.push_back(static_cast<uint32_t>(startChar));
+        set.values.push_back(
+            static_cast<uint32_t>(tokens.endChar(i) - startChar));
+        set.values.push_back(static_cast<uint32_t>(tokens.type(i)));
+        set.values.push_back(tokens.modifiers(i));
+      }
+    }
   }
-
-  notify("mozuku/semanticHighlights", {{"uri", uri}, {"tokens", tokenEntries}});
+  sendHighlights("mozuku/semanticHighlights", uri, channel, std::move(set),
+                 resync);
 }
 
-json LSPServer::buildSemanticTokens(const std::string &uri) {
-  auto docIt = docs_.find(uri);
-  if (docIt == docs_.end()) {
-    return json::array();
-  }
-
-  auto cached = docTokens_.find(uri);
-  if (cached != docTokens_.end()) {
-    return buildSemanticTokensFromTokens(cached->second);
+void LSPServer::sendHighlights(std::string_view method, const std::string &uri,
+                               MoZuku::highlights::HighlightChannel &channel,
+                               MoZuku::highlights::HighlightSet next,
+                               bool resync) {
+  next.sort();
+  if (!resync && next == channel.sent) {
+    MoZuku::stats::count("highlights.unchanged");
+    return;
   }
-
-  if (!analyzer_->isInitialized()) {
-    analyzer_->initialize(config_);
+  const bool tokens = next.stride == 5;
+  ++channel.version;
+
+  if (!highlightDeltas_) {
+    // 従来の形式: 範囲 (とトークンの種別) を入れ子のオブジェクトで並べる
+    notifyStreamed(method, [&](MoZuku::rpc::JsonWriter &writer) {
+      writer.beginObject();
+      writer.key(tokens ? "tokens" : "ranges");
+      writer.beginArray();
+      for (size_t i = 0; i < next.values.size(); i += next.stride) {
+        const int line = static_cast<int>(next.values[i]);
+        const int startChar = static_cast<int>(next.values[i + 1]);
+        if (!tokens) {
+          writeRange(writer, Position{line, startChar},
+                     Position{line + static_cast<int>(next.values[i + 2]),
+                              static_cast<int>(next.values[i + 3])});
+          continue;
+        }
+        writer.beginObject();
+        writer.key("modifiers");
+        writer.value(next.values[i + 4]);
+        writer.key("range");
+        writeRange(writer, Position{line, startChar},
+                   Position{line, startChar +
+                                      static_cast<int>(next.values[i + 2])});
+        writer.key("type");
+        writer.value(tokenTypes_[next.values[i + 3]]);
+        writer.endObject();
+      }
+      writer.endArray();
+      writer.key("uri");
+      writer.value(uri);
+      writer.endObject();
+    });
+    channel.sent = std::move(next);
+    return;
   }
 
-  std::string analysisText = prepareAnalysisText(uri, docIt->second);
-  std::vector<TokenData> tokens = analyzer_->analyzeText(analysisText);
-  docTokens_[uri] = tokens;
-
-  return buildSemanticTokensFromTokens(tokens);
-}
-
-json LSPServer::buildSemanticTokensFromTokens(
-    const std::vector<TokenData> &tokens) {
-  json data = json::array();
-
-  int prevLine = 0, prevChar = 0;
-
-  for (const auto &token : tokens) {
-    int deltaLine = token.line - prevLine;
-    int deltaChar =
-        (deltaLine == 0) ? token.startChar - prevChar : token.startChar;
-
-    auto typeIt =
-        std::find(tokenTypes_.begin(), tokenTypes_.end(), token.tokenType);
-    int typeIndex =
-        (typeIt != tokenTypes_.end())
-            ? static_cast<int>(std::distance(tokenTypes_.begin(), typeIt))
-            : 0;
-
-    data.push_back(deltaLine);
-    data.push_back(deltaChar);
-    data.push_back(token.endChar - token.startChar);
-    data.push_back(typeIndex);
-    data.push_back(token.tokenModifiers);
+  auto writeData = [](MoZuku::rpc::JsonWriter &writer,
+                      const std::vector<uint32_t> &data) {
+    writer.beginArray();
+    for (uint32_t value : data) {
+      writer.value(value);
+    }
+    writer.endArray();
+  };
 
-    prevLine = token.line;
-    prevChar = token.startChar;
+  // 差分は前回送った版に対して作る。全体より大きくなるなら全体を送る
+  MoZuku::highlights::HighlightDelta delta;
+  if (!resync) {
+    delta = MoZuku::highlights::diff(channel.sent, next);
   }
-
-  return data;
+  const bool useDelta =
+      !resync && delta.removed.size() + delta.inserted.size() <
+                     next.values.size();
+  MoZuku::stats::count(useDelta ? "highlights.deltas" : "highlights.full");
+  notifyStreamed(method, [&](MoZuku::rpc::JsonWriter &writer) {
+    writer.beginObject();
+    if (useDelta) {
+      writer.key("base");
+      writer.value(channel.version - 1);
+      writer.key("inserted");
+      writeData(writer, MoZuku::highlights::encodeRelative(delta.inserted,
+                                                           next.stride));
+      writer.key("removed");
+      writeData(writer,
+                MoZuku::highlights::encodeRelative(delta.removed, next.stride));
+    } else {
+      writer.key("data");
+      writeData(writer,
+                MoZuku::highlights::encodeRelative(next.values, next.stride));
+    }
+    writer.key("uri");
+    writer.value(uri);
+    writer.key("version");
+    writer.value(channel.version);
+    writer.endObject();
+  });
+  channel.sent = std::move(next);
 }
 
-void LSPServer::cacheDiagnostics(const std::string &uri,
-                                 const std::vector<Diagnostic> &diags) {
-  docDiagnostics_[uri].clear();
-
-  for (const auto &diag : diags) {
-    int line = diag.range.start.line;
-    docDiagnostics_[uri][line].push_back(diag);
+std::vector<uint32_t> LSPServer::encodeSemanticTokens(
+    const MoZuku::incremental::IncrementalAnalyzer &analysis, int startLine,
+    int endLine) {
+  std::vector<uint32_t> data;
+  const auto &sentences = analysis.sentences();
+  const auto &lineStarts = analysis.lineStarts();
+
+  // 行の範囲をバイト範囲に直し、重なる文だけを見る
+  auto sentenceIt = sentences.begin();
+  size_t endByte = analysis.text().size();
+  if (startLine > 0 && static_cast<size_t>(startLine) < lineStarts.size()) {
+    const size_t startByte = lineStarts[startLine];
+    sentenceIt = std::partition_point(
+        sentences.begin(), sentences.end(),
+        [startByte](const MoZuku::incremental::SentenceResult &sentence) {
+          return sentence.boundary.end <= startByte;
+        });
+  } else if (startLine > 0) {
+    sentenceIt = sentences.end();
   }
-}
-
-void LSPServer::removeDiagnosticsForLines(const std::string &uri,
-                                          const std::set<int> &lines) {
-  if (docDiagnostics_.find(uri) == docDiagnostics_.end())
-    return;
-
-  auto &uriDiags = docDiagnostics_[uri];
-  for (int line : lines) {
-    uriDiags.erase(line);
+  if (endLine >= 0 && static_cast<size_t>(endLine) + 1 < lineStarts.size()) {
+    endByte = lineStarts[endLine + 1];
   }
-}
 
-std::vector<Diagnostic>
-LSPServer::getAllDiagnostics(const std::string &uri) const {
-  std::vector<Diagnostic> allDiags;
-
-  auto uriIt = docDiagnostics_.find(uri);
-  if (uriIt != docDiagnostics_.end()) {
-    for (const auto &linePair : uriIt->second) {
-      for (const auto &diag : linePair.second) {
-        allDiags.push_back(diag);
+  int prevLine = 0, prevChar = 0;
+  for (; sentenceIt != sentences.end() && sentenceIt->boundary.start < endByte;
+       ++sentenceIt) {
+    const auto &tokens = sentenceIt->tokens;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+      const int line = tokens.line(i);
+      if (line < startLine || (endLine >= 0 && line > endLine)) {
+        continue;
       }
+      const int startChar = tokens.startChar(i);
+      int deltaLine = line - prevLine;
+      int deltaChar = (deltaLine == 0) ? startChar - prevChar : startChar;
+
+      // TokenType は凡例 (tokenTypes_) と同じ順序で定義している
+      data.push_back(static_cast<uint32_t>(deltaLine));
+      data.push_back(static_cast<uint32_t>(deltaChar));
+      data.push_back(static_cast<uint32_t>(tokens.endChar(i) - startChar));
+      data.push_back(static_cast<uint32_t>(tokens.type(i)));
+      data.push_back(tokens.modifiers(i));
+
+      prevLine = line;
+      prevChar = startChar;
     }
   }
 
-  return allDiags;
+  return data;
 }
 
-std::set<int> LSPServer::findChangedLines(const std::string &oldText,
-                                          const std::string &newText) const {
-  std::set<int> changedLines;
-
-  // シンプルな行単位の比較
-  std::vector<std::string> oldLines, newLines;
-
-  // 行に分割
-  std::istringstream oldStream(oldText), newStream(newText);
-  std::string line;
-  while (std::getline(oldStream, line))
-    oldLines.push_back(line);
-  while (std::getline(newStream, line))
-    newLines.push_back(line);
-
-  size_t maxLines = std::max(oldLines.size(), newLines.size());
-  for (size_t i = 0; i < maxLines; ++i) {
-    bool oldExists = i < oldLines.size();
-    bool newExists = i < newLines.size();
+const SemanticTokensResult &
+LSPServer::storeSemanticTokens(const std::string &uri,
+                               std::vector<uint32_t> data) {
+  auto &stored = docSemanticTokens_[uri];
+  const size_t previousBytes = stored.data.capacity() * sizeof(uint32_t);
+  stored.resultId = std::to_string(++nextResultId_);
+  stored.data = std::move(data);
+
+  auto residentIt = residentDocuments_.find(uri);
+  if (residentIt != residentDocuments_.end()) {
+    const size_t bytes = stored.data.capacity() * sizeof(uint32_t);
+    // 前の結果は計上済みなので差し替える
+    residentIt->second.bytes = residentIt->second.bytes + bytes - previousBytes;
+    residentBytes_ = residentBytes_ + bytes - previousBytes;
+  }
+  return stored;
+}
 
-    if (!oldExists || !newExists || oldLines[i] != newLines[i]) {
-      changedLines.insert(static_cast<int>(i));
+void LSPServer::replySemanticTokens(const json &id,
+                                    const SemanticTokensResult &result) {
+  replyStreamed(id, [&](MoZuku::rpc::JsonWriter &writer) {
+    writer.beginObject();
+    writer.key("data");
+    writer.beginArray();
+    for (uint32_t value : result.data) {
+      writer.value(value);
     }
-  }
+    writer.endArray();
+    writer.key("resultId");
+    writer.value(result.resultId);
+    writer.endObject();
+  });
+}
 
-  return changedLines;
+bool LSPServer::cacheDiagnostics(const std::string &uri, int version,
+                                 bool complete, std::vector<Diagnostic> diags) {
+  DiagnosticReport &report = docDiagnostics_[uri];
+  std::string resultId = diagnosticsResultId(diags);
+  const bool changed = report.resultId != resultId;
+  report.resultId = std::move(resultId);
+  report.version = version;
+  report.complete = complete;
+  report.diagnostics = std::move(diags);
+  return changed;
 }
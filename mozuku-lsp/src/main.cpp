@@ -1,7 +1,19 @@
+#include "batch_check.hpp"
 #include "lsp.hpp"
 #include <iostream>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv) {
+  // 標準入出力を C stdio と同期させず、ストリーム側でバッファリングする
+  std::ios::sync_with_stdio(false);
+
+  // --check: LSP を起動せずにファイルを一括で検査する
+  if (argc > 1 && std::string(argv[1]) == "--check") {
+    return MoZuku::batch::runCheck(
+        std::vector<std::string>(argv + 2, argv + argc));
+  }
 
-int main() {
   LSPServer server(std::cin, std::cout);
   server.run();
   return 0;
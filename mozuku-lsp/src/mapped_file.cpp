@@ -0,0 +1,60 @@
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace MoZuku {
+namespace io {
+
+MappedFile::MappedFile(const std::string &path, bool sequential) {
+#ifdef _WIN32
+  (void)sequential;
+  std::ifstream in(path, std::ios::binary);
+  if (in) {
+    buffer_.assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+    ok_ = true;
+  }
+#else
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat info;
+  if (::fstat(fd, &info) == 0) {
+    size_ = static_cast<size_t>(info.st_size);
+    if (size_ == 0) {
+      ok_ = true;
+    } else {
+      void *mapped = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        ::madvise(mapped, size_, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        mapping_ = mapped;
+        data_ = static_cast<const char *>(mapped);
+        ok_ = true;
+      }
+    }
+  }
+  ::close(fd);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+  if (mapping_) {
+    ::munmap(mapping_, size_);
+  }
+#endif
+}
+
+} // namespace io
+} // namespace MoZuku
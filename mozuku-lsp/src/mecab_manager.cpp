@@ -1,9 +1,13 @@
 #include "mecab_manager.hpp"
+#include "stats.hpp"
 #include <cabocha.h>
-#include <cstdlib>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
 #include <mecab.h>
+#include <nlohmann/json.hpp>
+#include <sys/stat.h>
 
 // Windows MSVC: popen/pclose は _popen/_pclose
 #ifdef _MSC_VER
@@ -14,22 +18,74 @@
 namespace MoZuku {
 namespace mecab {
 
-static bool isDebugEnabled() {
-  static bool initialized = false;
-  static bool debug = false;
-  if (!initialized) {
-    debug = (std::getenv("MOZUKU_DEBUG") != nullptr);
-    initialized = true;
+namespace {
+
+constexpr const char *kDetectCacheFileName = "mecab-detect.json";
+// 記録の形式を変えたら上げる
+constexpr int kDetectCacheVersion = 1;
+
+double elapsedMs(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - since)
+      .count();
+}
+
+bool fileExists(const std::string &path) {
+  struct stat info;
+  return ::stat(path.c_str(), &info) == 0;
+}
+
+// 保存済みの検出結果を読む。辞書が消えているなど使えなければ false
+bool loadDetectCache(const std::string &path, SystemLibInfo &mecabInfo,
+                     bool &cabochaAvailable) {
+  std::ifstream in(path);
+  if (!in.is_open()) {
+    return false;
+  }
+  try {
+    nlohmann::json record = nlohmann::json::parse(in);
+    if (record.at("version").get<int>() != kDetectCacheVersion) {
+      return false;
+    }
+    mecabInfo.dicPath = record.at("dicdir").get<std::string>();
+    mecabInfo.charset = record.at("charset").get<std::string>();
+    cabochaAvailable = record.at("cabocha").get<bool>();
+  } catch (const std::exception &) {
+    return false;
   }
-  return debug;
+  mecabInfo.isAvailable = !mecabInfo.dicPath.empty();
+  return mecabInfo.isAvailable && fileExists(mecabInfo.dicPath + "/ipadic");
 }
 
+void saveDetectCache(const std::string &path, const SystemLibInfo &mecabInfo,
+                     bool cabochaAvailable) {
+  const nlohmann::json record = {{"version", kDetectCacheVersion},
+                                 {"dicdir", mecabInfo.dicPath},
+                                 {"charset", mecabInfo.charset},
+                                 {"cabocha", cabochaAvailable}};
+  // 書きかけのファイルを読まないよう、一時ファイルから置き換える
+  const std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::trunc);
+    if (!out.is_open()) {
+      return;
+    }
+    out << record.dump() << '\n';
+    if (!out.good()) {
+      return;
+    }
+  }
+  std::rename(temporary.c_str(), path.c_str());
+}
+
+} // namespace
+
 MeCabManager::MeCabManager(bool enableCaboCha)
-    : mecab_tagger_(nullptr), cabocha_parser_(nullptr),
+    : mecab_model_(nullptr), mecab_tagger_(nullptr), cabocha_parser_(nullptr),
       system_charset_("UTF-8"), cabocha_available_(false),
       enable_cabocha_(enableCaboCha) {
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] MeCabManager created with CaboCha "
               << (enableCaboCha ? "enabled" : "disabled") << std::endl;
   }
@@ -40,17 +96,87 @@ MeCabManager::~MeCabManager() {
     cabocha_destroy(cabocha_parser_);
     cabocha_parser_ = nullptr;
   }
+  for (MeCab::Lattice *lattice : lattices_) {
+    delete lattice;
+  }
+  lattices_.clear();
+  free_lattices_.clear();
   if (mecab_tagger_) {
     delete mecab_tagger_;
     mecab_tagger_ = nullptr;
   }
+  if (mecab_model_) {
+    delete mecab_model_;
+    mecab_model_ = nullptr;
+  }
+}
+
+MeCab::Lattice *MeCabManager::acquireLattice() {
+  std::lock_guard<std::mutex> lock(lattice_mutex_);
+  if (!free_lattices_.empty()) {
+    MeCab::Lattice *lattice = free_lattices_.back();
+    free_lattices_.pop_back();
+    return lattice;
+  }
+  if (!mecab_model_) {
+    return nullptr;
+  }
+
+  MeCab::Lattice *lattice = mecab_model_->createLattice();
+  if (lattice) {
+    lattices_.push_back(lattice);
+    if (stats::debugEnabled()) {
+      std::cerr << "[DEBUG] MeCab lattice created (total: " << lattices_.size()
+                << ")" << std::endl;
+    }
+  }
+  return lattice;
+}
+
+void MeCabManager::releaseLattice(MeCab::Lattice *lattice) {
+  if (!lattice) {
+    return;
+  }
+  lattice->clear();
+  std::lock_guard<std::mutex> lock(lattice_mutex_);
+  free_lattices_.push_back(lattice);
+}
+
+void MeCabManager::detectWithCache(const std::string &cacheDir,
+                                   SystemLibInfo &mecabInfo,
+                                   bool &cabochaAvailable) {
+  const std::string path =
+      cacheDir.empty() ? "" : cacheDir + "/" + kDetectCacheFileName;
+  if (!path.empty() && loadDetectCache(path, mecabInfo, cabochaAvailable)) {
+    if (stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Using cached MeCab detection: " << path
+                << std::endl;
+    }
+    return;
+  }
+
+  mecabInfo = detectSystemMeCab();
+  cabochaAvailable = detectSystemCaboCha(&mecabInfo).isAvailable;
+  // 見つからなかった結果は残さず、次回も検出し直す
+  if (!path.empty() && mecabInfo.isAvailable) {
+    saveDetectCache(path, mecabInfo, cabochaAvailable);
+  }
 }
 
 bool MeCabManager::initialize(const std::string &mecabDicPath,
-                              const std::string &mecabCharset) {
-  SystemLibInfo systemMeCab = detectSystemMeCab();
+                              const std::string &mecabCharset,
+                              const std::string &cacheDir) {
+  auto phaseStart = std::chrono::steady_clock::now();
+  SystemLibInfo systemMeCab;
+  bool systemCaboCha = false;
+  detectWithCache(cacheDir, systemMeCab, systemCaboCha);
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Startup phase: library detection "
+              << elapsedMs(phaseStart) << " ms" << std::endl;
+  }
+
   if (!systemMeCab.isAvailable) {
-    if (isDebugEnabled()) {
+    if (stats::debugEnabled()) {
       std::cerr << "[ERROR] System MeCab not detected" << std::endl;
     }
     return false;
@@ -64,38 +190,44 @@ bool MeCabManager::initialize(const std::string &mecabDicPath,
 
   std::string mecab_args;
   if (!mecabDicPath.empty()) {
-    mecab_args = "-d " + mecabDicPath;
+    dictionary_path_ = mecabDicPath;
   } else if (!systemMeCab.dicPath.empty()) {
-    mecab_args = "-d " + systemMeCab.dicPath + "/ipadic";
-    if (isDebugEnabled()) {
+    dictionary_path_ = systemMeCab.dicPath + "/ipadic";
+    if (stats::debugEnabled()) {
       std::cerr << "[DEBUG] Using detected MeCab dicdir: "
                 << systemMeCab.dicPath << "/ipadic" << std::endl;
     }
   }
+  if (!dictionary_path_.empty()) {
+    mecab_args = "-d " + dictionary_path_;
+  }
 
-  if (isDebugEnabled() && !mecab_args.empty()) {
+  if (stats::debugEnabled() && !mecab_args.empty()) {
     std::cerr << "[DEBUG] MeCab args: " << mecab_args << std::endl;
   }
 
-  mecab_tagger_ = MeCab::createTagger(mecab_args.c_str());
-  if (!mecab_tagger_) {
-    std::string error = MeCab::getTaggerError() ? MeCab::getTaggerError()
-                                                : "Unknown MeCab error";
-    if (isDebugEnabled()) {
+  // 辞書は Model として1度だけ読み込み、タガーとラティスはそこから作る
+  phaseStart = std::chrono::steady_clock::now();
+  mecab_model_ = MeCab::createModel(mecab_args.c_str());
+  if (!mecab_model_) {
+    std::string error = MeCab::getLastError() ? MeCab::getLastError()
+                                              : "Unknown MeCab error";
+    if (stats::debugEnabled()) {
       std::cerr << "[ERROR] MeCab initialization failed with args '"
                 << mecab_args << "': " << error << std::endl;
     }
 
     if (!mecab_args.empty()) {
-      if (isDebugEnabled()) {
+      if (stats::debugEnabled()) {
         std::cerr << "[DEBUG] Trying MeCab without explicit dictionary path..."
                   << std::endl;
       }
-      mecab_tagger_ = MeCab::createTagger("");
-      if (!mecab_tagger_) {
-        error = MeCab::getTaggerError() ? MeCab::getTaggerError()
-                                        : "Unknown MeCab error";
-        if (isDebugEnabled()) {
+      dictionary_path_.clear();
+      mecab_model_ = MeCab::createModel("");
+      if (!mecab_model_) {
+        error = MeCab::getLastError() ? MeCab::getLastError()
+                                      : "Unknown MeCab error";
+        if (stats::debugEnabled()) {
           std::cerr << "[ERROR] MeCab fallback initialization also failed: "
                     << error << std::endl;
         }
@@ -106,35 +238,48 @@ bool MeCabManager::initialize(const std::string &mecabDicPath,
     }
   }
 
+  mecab_tagger_ = mecab_model_->createTagger();
+  if (!mecab_tagger_) {
+    std::cerr << "[ERROR] Failed to create MeCab tagger from model"
+              << std::endl;
+    return false;
+  }
+
   system_charset_ = testMeCabCharset(mecab_tagger_, system_charset_);
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Startup phase: MeCab model " << elapsedMs(phaseStart)
+              << " ms" << std::endl;
     std::cerr << "[DEBUG] MeCab successfully initialized with charset: "
               << system_charset_ << std::endl;
   }
 
   if (enable_cabocha_) {
-    SystemLibInfo systemCabocha = detectSystemCaboCha();
-    if (systemCabocha.isAvailable) {
-      cabocha_parser_ = cabocha_new2("");
+    if (systemCaboCha) {
+      phaseStart = std::chrono::steady_clock::now();
+      // 入力は MeCab のトークン列 (-I1) で渡すので、CaboCha 側では
+      // 形態素解析器を読み込まない
+      cabocha_parser_ = cabocha_new2("-I1");
       if (cabocha_parser_) {
         cabocha_available_ = true;
-        if (isDebugEnabled()) {
+        if (stats::debugEnabled()) {
+          std::cerr << "[DEBUG] Startup phase: CaboCha parser "
+                    << elapsedMs(phaseStart) << " ms" << std::endl;
           std::cerr << "[DEBUG] CaboCha successfully initialized" << std::endl;
         }
       } else {
         const char *error = cabocha_strerror(nullptr);
-        if (isDebugEnabled()) {
+        if (stats::debugEnabled()) {
           std::cerr << "[DEBUG] CaboCha initialization failed: "
                     << (error ? error : "Unknown error") << std::endl;
         }
       }
-    } else if (isDebugEnabled()) {
+    } else if (stats::debugEnabled()) {
       std::cerr << "[DEBUG] CaboCha not available on system" << std::endl;
     }
   }
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] MeCabManager initialized - MeCab: "
               << (mecab_tagger_ ? "OK" : "FAIL")
               << ", CaboCha: " << (cabocha_available_ ? "OK" : "N/A")
@@ -147,7 +292,7 @@ bool MeCabManager::initialize(const std::string &mecabDicPath,
 SystemLibInfo MeCabManager::detectSystemMeCab() {
   SystemLibInfo info;
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] Detecting system MeCab installation..." << std::endl;
   }
 
@@ -164,7 +309,7 @@ SystemLibInfo MeCabManager::detectSystemMeCab() {
       }
       info.dicPath = dicdir;
 
-      if (isDebugEnabled()) {
+      if (stats::debugEnabled()) {
         std::cerr << "[DEBUG] mecab-config --dicdir: " << dicdir << std::endl;
       }
     }
@@ -187,7 +332,7 @@ SystemLibInfo MeCabManager::detectSystemMeCab() {
             charset.erase(charset.find_last_not_of(" \t") + 1);
             info.charset = charset;
 
-            if (isDebugEnabled()) {
+            if (stats::debugEnabled()) {
               std::cerr << "[DEBUG] Found charset in dicrc: " << charset
                         << std::endl;
             }
@@ -200,12 +345,12 @@ SystemLibInfo MeCabManager::detectSystemMeCab() {
 
   if (info.charset.empty()) {
     info.charset = "UTF-8";
-    if (isDebugEnabled()) {
+    if (stats::debugEnabled()) {
       std::cerr << "[DEBUG] Using default charset: UTF-8" << std::endl;
     }
   } else if (info.charset != "UTF-8") {
     // Test if MeCab actually works with UTF-8 despite dicrc settings
-    if (isDebugEnabled()) {
+    if (stats::debugEnabled()) {
       std::cerr << "[DEBUG] dicrc says charset: " << info.charset
                 << ", testing actual behavior..." << std::endl;
     }
@@ -228,7 +373,7 @@ SystemLibInfo MeCabManager::detectSystemMeCab() {
         if (surface == testUtf8 &&
             surface.size() == 6) { // "誤解" is 6 bytes in UTF-8
           utf8Works = true;
-          if (isDebugEnabled()) {
+          if (stats::debugEnabled()) {
             std::cerr << "[DEBUG] MeCab actually works with UTF-8 input, "
                          "overriding dicrc charset from "
                       << info.charset << " to UTF-8" << std::endl;
@@ -246,7 +391,7 @@ SystemLibInfo MeCabManager::detectSystemMeCab() {
 
   info.isAvailable = !info.dicPath.empty();
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] System MeCab detection result - Available: "
               << (info.isAvailable ? "yes" : "no")
               << ", DicPath: " << info.dicPath << ", Charset: " << info.charset
@@ -256,10 +401,11 @@ SystemLibInfo MeCabManager::detectSystemMeCab() {
   return info;
 }
 
-SystemLibInfo MeCabManager::detectSystemCaboCha() {
+SystemLibInfo
+MeCabManager::detectSystemCaboCha(const SystemLibInfo *mecabInfo) {
   SystemLibInfo info;
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] Detecting system CaboCha installation..."
               << std::endl;
   }
@@ -271,7 +417,7 @@ SystemLibInfo MeCabManager::detectSystemCaboCha() {
     char buffer[256];
     if (fgets(buffer, sizeof(buffer), pipe)) {
       info.isAvailable = true;
-      if (isDebugEnabled()) {
+      if (stats::debugEnabled()) {
         std::cerr << "[DEBUG] cabocha-config found, system CaboCha available"
                   << std::endl;
       }
@@ -279,10 +425,9 @@ SystemLibInfo MeCabManager::detectSystemCaboCha() {
     pclose(pipe);
   }
 
-  SystemLibInfo mecabInfo = detectSystemMeCab();
-  info.charset = mecabInfo.charset;
+  info.charset = mecabInfo ? mecabInfo->charset : detectSystemMeCab().charset;
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] System CaboCha detection result - Available: "
               << (info.isAvailable ? "yes" : "no")
               << ", Charset: " << info.charset << std::endl;
@@ -310,7 +455,7 @@ std::string MeCabManager::testMeCabCharset(MeCab::Tagger *tagger,
 
     // If we get back the same UTF-8 text, MeCab is working in UTF-8 mode
     if (surface == testUtf8 && surface.size() == 6) {
-      if (isDebugEnabled()) {
+      if (stats::debugEnabled()) {
         std::cerr << "[DEBUG] MeCab accepts UTF-8 input directly, using UTF-8"
                   << std::endl;
       }
@@ -318,7 +463,7 @@ std::string MeCabManager::testMeCabCharset(MeCab::Tagger *tagger,
     }
   }
 
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] MeCab requires " << originalCharset << " encoding"
               << std::endl;
   }
@@ -1,5 +1,5 @@
 #include "pos_analyzer.hpp"
-#include "encoding_utils.hpp"
+#include "simd_text.hpp"
 #include "text_processor.hpp"
 
 namespace MoZuku {
@@ -9,9 +9,15 @@ std::string POSAnalyzer::mapPosToType(const char *feature) {
   if (!feature)
     return "unknown";
 
-  std::string f = text::TextProcessor::sanitizeUTF8(std::string(feature));
+  // 辞書の素性はほぼ常に妥当なので、その場合は複製しない
+  std::string_view f(feature);
+  std::string repaired;
+  if (simd::cleanPrefixLength(f.data(), f.size()) != f.size()) {
+    repaired = text::TextProcessor::sanitizeUTF8(std::string(f));
+    f = repaired;
+  }
   auto p = f.find(',');
-  std::string pos = (p == std::string::npos) ? f : f.substr(0, p);
+  std::string_view pos = (p == std::string_view::npos) ? f : f.substr(0, p);
 
   if (pos.find("名詞") != std::string::npos)
     return "noun";
@@ -39,72 +45,6 @@ std::string POSAnalyzer::mapPosToType(const char *feature) {
   return "unknown";
 }
 
-void POSAnalyzer::parseFeatureDetails(const char *feature,
-                                      std::string &baseForm,
-                                      std::string &reading,
-                                      std::string &pronunciation,
-                                      const std::string &systemCharset,
-                                      bool skipConversion) {
-  if (!feature)
-    return;
-
-  std::string f(feature);
-  std::vector<std::string> fields = splitFeature(f);
-
-  // IPAdic format:
-  // 品詞,品詞細分類1,品詞細分類2,品詞細分類3,活用型,活用形,原形,読み,発音
-  if (fields.size() >= 7 && fields[6] != "*") {
-    baseForm = skipConversion
-                   ? fields[6]
-                   : encoding::systemToUtf8(fields[6], systemCharset);
-  }
-  if (fields.size() >= 8 && fields[7] != "*") {
-    reading = skipConversion ? fields[7]
-                             : encoding::systemToUtf8(fields[7], systemCharset);
-  }
-  if (fields.size() >= 9 && fields[8] != "*") {
-    pronunciation = skipConversion
-                        ? fields[8]
-                        : encoding::systemToUtf8(fields[8], systemCharset);
-  }
-}
-
-DetailedPOS POSAnalyzer::parseDetailedPOS(const char *feature,
-                                          const std::string &systemCharset) {
-  DetailedPOS pos;
-  if (!feature)
-    return pos;
-
-  std::string f =
-      (systemCharset == "UTF-8")
-          ? std::string(feature)
-          : encoding::systemToUtf8(std::string(feature), systemCharset);
-
-  std::vector<std::string> fields = splitFeature(f);
-
-  // Fill in the detailed POS structure
-  if (fields.size() > 0)
-    pos.mainPOS = fields[0];
-  if (fields.size() > 1)
-    pos.subPOS1 = fields[1];
-  if (fields.size() > 2)
-    pos.subPOS2 = fields[2];
-  if (fields.size() > 3)
-    pos.subPOS3 = fields[3];
-  if (fields.size() > 4)
-    pos.inflection = fields[4];
-  if (fields.size() > 5)
-    pos.conjugation = fields[5];
-  if (fields.size() > 6 && fields[6] != "*")
-    pos.baseForm = fields[6];
-  if (fields.size() > 7 && fields[7] != "*")
-    pos.reading = fields[7];
-  if (fields.size() > 8 && fields[8] != "*")
-    pos.pronunciation = fields[8];
-
-  return pos;
-}
-
 unsigned POSAnalyzer::computeModifiers(const std::string &text, size_t start,
                                        size_t length, const char *feature) {
   unsigned mods = 0;
@@ -134,21 +74,98 @@ unsigned POSAnalyzer::computeModifiers(const std::string &text, size_t start,
   return mods;
 }
 
-std::vector<std::string> POSAnalyzer::splitFeature(const std::string &feature) {
-  std::vector<std::string> fields;
-  size_t pos = 0;
+namespace {
+
+tokens::PartOfSpeech classifyMainPOS(std::string_view pos) {
+  using tokens::PartOfSpeech;
+  if (pos == "名詞")
+    return PartOfSpeech::Noun;
+  if (pos == "動詞")
+    return PartOfSpeech::Verb;
+  if (pos == "形容詞")
+    return PartOfSpeech::Adjective;
+  if (pos == "副詞")
+    return PartOfSpeech::Adverb;
+  if (pos == "助詞")
+    return PartOfSpeech::Particle;
+  if (pos == "助動詞")
+    return PartOfSpeech::AuxVerb;
+  if (pos == "接続詞")
+    return PartOfSpeech::Conjunction;
+  if (pos == "記号")
+    return PartOfSpeech::Symbol;
+  if (pos == "感動詞")
+    return PartOfSpeech::Interjection;
+  if (pos == "接頭詞")
+    return PartOfSpeech::Prefix;
+  if (pos == "連体詞")
+    return PartOfSpeech::Adnominal;
+  if (pos == "フィラー")
+    return PartOfSpeech::Filler;
+  return PartOfSpeech::Other;
+}
+
+uint16_t classifySubPOS1(std::string_view sub) {
+  if (sub == "自立")
+    return tokens::kSubIndependent;
+  if (sub == "非自立")
+    return tokens::kSubNonIndependent;
+  if (sub == "接尾")
+    return tokens::kSubSuffix;
+  if (sub == "格助詞")
+    return tokens::kSubCaseParticle;
+  if (sub == "接続助詞")
+    return tokens::kSubConjunctiveParticle;
+  if (sub == "係助詞")
+    return tokens::kSubBindingParticle;
+  if (sub == "副助詞")
+    return tokens::kSubAdverbialParticle;
+  return 0;
+}
+
+} // namespace
 
-  while (pos < feature.size()) {
-    size_t nextComma = feature.find(',', pos);
-    if (nextComma == std::string::npos) {
-      fields.push_back(feature.substr(pos));
+void POSAnalyzer::parseFeatureEntry(tokens::FeatureEntry &entry) {
+  const std::string &f = entry.feature;
+
+  // IPAdic format:
+  // 品詞,品詞細分類1,品詞細分類2,品詞細分類3,活用型,活用形,原形,読み,発音
+  std::string_view fields[9];
+  size_t fieldCount = 0;
+  size_t pos = 0;
+  while (pos < f.size() && fieldCount < 9) {
+    size_t nextComma = f.find(',', pos);
+    size_t end = (nextComma == std::string::npos) ? f.size() : nextComma;
+    fields[fieldCount++] = std::string_view(f).substr(pos, end - pos);
+    if (nextComma == std::string::npos)
       break;
-    }
-    fields.push_back(feature.substr(pos, nextComma - pos));
     pos = nextComma + 1;
   }
 
-  return fields;
+  if (fieldCount > 0)
+    entry.pos = classifyMainPOS(fields[0]);
+  if (fieldCount > 1)
+    entry.posFlags |= classifySubPOS1(fields[1]);
+  for (size_t i = 1; i < 4 && i < fieldCount; ++i) {
+    if (fields[i] == "固有名詞")
+      entry.posFlags |= tokens::kSubProperNoun;
+  }
+  if (fieldCount > 4 && fields[4] == "一段")
+    entry.posFlags |= tokens::kInflectionIchidan;
+  if (fieldCount > 5 && fields[5] == "未然形")
+    entry.posFlags |= tokens::kConjugationMizen;
+
+  if (fieldCount > 6 && fields[6] != "*")
+    entry.baseForm.assign(fields[6].data(), fields[6].size());
+  if (fieldCount > 7 && fields[7] != "*")
+    entry.reading.assign(fields[7].data(), fields[7].size());
+  if (fieldCount > 8 && fields[8] != "*")
+    entry.pronunciation.assign(fields[8].data(), fields[8].size());
+
+  // セマンティックトークンの種別と修飾子は従来どおり部分一致で決める
+  entry.type = tokens::tokenTypeFromName(mapPosToType(f.c_str()));
+  entry.modifiers =
+      static_cast<uint8_t>(computeModifiers(std::string(), 0, 0, f.c_str()));
 }
 
 void POSAnalyzer::analyzeCharacterTypes(const std::string &text, size_t start,
@@ -0,0 +1,647 @@
+#include "sentence_cache.hpp"
+#include "analyzer.hpp"
+#include "mapped_file.hpp"
+#include "stats.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+
+namespace MoZuku {
+namespace cache {
+
+namespace {
+
+constexpr size_t kEntryOverhead = 128; // 1記録あたりのおおよその管理領域
+const char *const kStoreFileName = "sentence-cache.bin";
+constexpr char kMagic[4] = {'M', 'Z', 'S', 'C'};
+// 保存形式や解析結果の作り方が変わったら上げる
+constexpr uint32_t kFormatVersion = 1;
+// トークン1つの保存サイズ (4 * 5 + 素性番号 4 + 修飾子 1)
+constexpr size_t kTokenRecordBytes = 25;
+constexpr size_t kDiagnosticFixedBytes = 20;
+
+uint64_t mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+size_t diagnosticsBytes(const std::vector<Diagnostic> &diags) {
+  size_t bytes = diags.capacity() * sizeof(Diagnostic);
+  for (const auto &diag : diags) {
+    bytes += diag.message.capacity();
+  }
+  return bytes;
+}
+
+size_t entryBytes(const CachedSentence &entry) {
+  return entry.text.capacity() + entry.tokens.approximateBytes() +
+         entry.conjunctions.capacity() * sizeof(size_t) +
+         diagnosticsBytes(entry.diagnostics) + kEntryOverhead;
+}
+
+size_t entryBytes(const CachedDependencies &entry) {
+  size_t bytes = entry.text.capacity() +
+                 entry.chunks.capacity() * sizeof(DependencyInfo) +
+                 kEntryOverhead;
+  for (const auto &chunk : entry.chunks) {
+    bytes += chunk.text.capacity();
+  }
+  return bytes;
+}
+
+template <typename T> void put(std::string &out, T value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void putBytes(std::string &out, std::string_view bytes) {
+  put<uint32_t>(out, static_cast<uint32_t>(bytes.size()));
+  out.append(bytes.data(), bytes.size());
+}
+
+// 保存ファイルの読み出し。範囲外を読もうとしたら以降はすべて失敗する
+class Reader {
+public:
+  Reader(std::string_view data, size_t pos = 0) : data_(data), pos_(pos) {}
+
+  template <typename T> bool read(T &value) {
+    if (!ok_ || data_.size() - pos_ < sizeof(T)) {
+      ok_ = false;
+      return false;
+    }
+    std::memcpy(&value, data_.data() + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return true;
+  }
+
+  bool bytes(std::string_view &out) {
+    uint32_t length = 0;
+    if (!read(length) || data_.size() - pos_ < length) {
+      ok_ = false;
+      return false;
+    }
+    out = data_.substr(pos_, length);
+    pos_ += length;
+    return true;
+  }
+
+  bool skip(size_t count) {
+    if (!ok_ || data_.size() - pos_ < count) {
+      ok_ = false;
+      return false;
+    }
+    pos_ += count;
+    return true;
+  }
+
+  size_t position() const { return pos_; }
+  bool atEnd() const { return pos_ == data_.size(); }
+
+private:
+  std::string_view data_;
+  size_t pos_;
+  bool ok_{true};
+};
+
+void writeEntry(std::string &out, uint64_t key, const CachedSentence &entry,
+                std::unordered_map<const tokens::FeatureEntry *, uint32_t>
+                    &featureIds,
+                std::vector<const tokens::FeatureEntry *> &features) {
+  put<uint64_t>(out, key);
+  putBytes(out, entry.text);
+
+  const tokens::TokenStore &store = entry.tokens;
+  put<uint32_t>(out, static_cast<uint32_t>(store.size()));
+  for (size_t i = 0; i < store.size(); ++i) {
+    const tokens::FeatureEntry *feature = &store.feature(i);
+    auto idIt = featureIds.find(feature);
+    if (idIt == featureIds.end()) {
+      idIt = featureIds
+                 .emplace(feature, static_cast<uint32_t>(features.size()))
+                 .first;
+      features.push_back(feature);
+    }
+    put<uint32_t>(out, static_cast<uint32_t>(store.byteStart(i)));
+    put<uint32_t>(out, static_cast<uint32_t>(store.byteLength(i)));
+    put<int32_t>(out, store.line(i));
+    put<int32_t>(out, store.startChar(i));
+    put<int32_t>(out, store.endChar(i));
+    put<uint32_t>(out, idIt->second);
+    put<uint8_t>(out, static_cast<uint8_t>(store.modifiers(i)));
+  }
+
+  put<uint32_t>(out, static_cast<uint32_t>(entry.conjunctions.size()));
+  for (size_t index : entry.conjunctions) {
+    put<uint32_t>(out, static_cast<uint32_t>(index));
+  }
+
+  put<uint32_t>(out, static_cast<uint32_t>(entry.diagnostics.size()));
+  for (const auto &diag : entry.diagnostics) {
+    put<int32_t>(out, diag.range.start.line);
+    put<int32_t>(out, diag.range.start.character);
+    put<int32_t>(out, diag.range.end.line);
+    put<int32_t>(out, diag.range.end.character);
+    put<int32_t>(out, diag.severity);
+    putBytes(out, diag.message);
+  }
+}
+
+// 記録を読み飛ばして次の記録の位置へ進める
+bool skipEntry(Reader &reader, uint64_t &key) {
+  std::string_view text;
+  uint32_t tokenCount = 0;
+  uint32_t conjunctionCount = 0;
+  uint32_t diagnosticCount = 0;
+  if (!reader.read(key) || !reader.bytes(text) || !reader.read(tokenCount) ||
+      !reader.skip(static_cast<size_t>(tokenCount) * kTokenRecordBytes) ||
+      !reader.read(conjunctionCount) ||
+      !reader.skip(static_cast<size_t>(conjunctionCount) * 4) ||
+      !reader.read(diagnosticCount)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < diagnosticCount; ++i) {
+    std::string_view message;
+    if (!reader.skip(kDiagnosticFixedBytes) || !reader.bytes(message)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+uint64_t hashBytes(std::string_view data, uint64_t seed) {
+  uint64_t h = mix(seed ^ (data.size() * 0x9e3779b97f4a7c15ULL));
+  size_t i = 0;
+  for (; i + 8 <= data.size(); i += 8) {
+    uint64_t block;
+    std::memcpy(&block, data.data() + i, 8);
+    h = mix(h ^ block) + 0x9e3779b97f4a7c15ULL;
+  }
+  if (i < data.size()) {
+    uint64_t block = 0;
+    std::memcpy(&block, data.data() + i, data.size() - i);
+    h = mix(h ^ block);
+  }
+  return mix(h);
+}
+
+uint64_t fingerprintOf(const MoZukuConfig &config,
+                       const std::string &dictionary) {
+  // 文単位の結果を左右するのは辞書と文法チェックの設定だけ
+  // (文構造のルールは係り受けも使う)
+  const AnalysisConfig &analysis = config.analysis;
+  const auto &rules = analysis.rules;
+  const auto &warnings = analysis.warnings;
+  std::ostringstream key;
+  key << kFormatVersion << '|' << dictionary << '|' << analysis.grammarCheck
+      << analysis.warningMinSeverity << analysis.enableCaboCha << '|'
+      << rules.commaLimit
+      << rules.adversativeGa << rules.duplicateParticleSurface
+      << rules.adjacentParticles << rules.conjunctionRepeat << rules.raDropping
+      << '|' << rules.commaLimitMax << ',' << rules.adversativeGaMax << ','
+      << rules.duplicateParticleSurfaceMaxRepeat << ','
+      << rules.adjacentParticlesMaxRepeat << ',' << rules.conjunctionRepeatMax
+      << '|' << warnings.particleDuplicate << warnings.particleSequence
+      << warnings.particleMismatch << warnings.sentenceStructure
+      << warnings.styleConsistency << warnings.redundancy;
+  return hashBytes(key.str());
+}
+
+struct SentenceCache::Store {
+  std::string path;
+  uint64_t fingerprint{0};
+  std::unique_ptr<io::MappedFile> file;
+  std::string_view data;
+  std::vector<std::string_view> featureNames;
+  std::vector<const tokens::FeatureEntry *> features; // 初めて使うときに登録
+  std::unordered_map<uint64_t, size_t> offsets;       // キー -> 記録の位置
+
+  // offset の記録を読み出す。壊れていれば nullptr
+  std::shared_ptr<CachedSentence> decode(size_t offset) {
+    Reader reader(data, offset);
+    auto entry = std::make_shared<CachedSentence>();
+    uint64_t key = 0;
+    std::string_view text;
+    uint32_t tokenCount = 0;
+    if (!reader.read(key) || !reader.bytes(text) || !reader.read(tokenCount)) {
+      return nullptr;
+    }
+    entry->text.assign(text.data(), text.size());
+
+    entry->tokens.reserve(tokenCount);
+    for (uint32_t i = 0; i < tokenCount; ++i) {
+      uint32_t byteStart = 0;
+      uint32_t byteLength = 0;
+      int32_t line = 0;
+      int32_t startChar = 0;
+      int32_t endChar = 0;
+      uint32_t featureId = 0;
+      uint8_t modifiers = 0;
+      if (!reader.read(byteStart) || !reader.read(byteLength) ||
+          !reader.read(line) || !reader.read(startChar) ||
+          !reader.read(endChar) || !reader.read(featureId) ||
+          !reader.read(modifiers) || featureId >= featureNames.size()) {
+        return nullptr;
+      }
+      if (!features[featureId]) {
+        features[featureId] =
+            tokens::FeatureTable::getInstance().intern(featureNames[featureId]);
+      }
+      entry->tokens.append(byteStart, byteLength, line, startChar, endChar,
+                           features[featureId], modifiers);
+    }
+
+    uint32_t conjunctionCount = 0;
+    if (!reader.read(conjunctionCount)) {
+      return nullptr;
+    }
+    entry->conjunctions.reserve(conjunctionCount);
+    for (uint32_t i = 0; i < conjunctionCount; ++i) {
+      uint32_t index = 0;
+      if (!reader.read(index) || index >= tokenCount) {
+        return nullptr;
+      }
+      entry->conjunctions.push_back(index);
+    }
+
+    uint32_t diagnosticCount = 0;
+    if (!reader.read(diagnosticCount)) {
+      return nullptr;
+    }
+    entry->diagnostics.reserve(diagnosticCount);
+    for (uint32_t i = 0; i < diagnosticCount; ++i) {
+      Diagnostic diag;
+      std::string_view message;
+      if (!reader.read(diag.range.start.line) ||
+          !reader.read(diag.range.start.character) ||
+          !reader.read(diag.range.end.line) ||
+          !reader.read(diag.range.end.character) ||
+          !reader.read(diag.severity) || !reader.bytes(message)) {
+        return nullptr;
+      }
+      diag.message.assign(message.data(), message.size());
+      entry->diagnostics.push_back(std::move(diag));
+    }
+    return entry;
+  }
+};
+
+SentenceCache &SentenceCache::getInstance() {
+  static SentenceCache instance;
+  return instance;
+}
+
+SentenceCache::SentenceCache() = default;
+SentenceCache::~SentenceCache() = default;
+
+SentenceCache::Shard &SentenceCache::shardFor(uint64_t key) {
+  return shards_[key % kShardCount];
+}
+
+void SentenceCache::configure(size_t maxBytes, uint64_t fingerprint) {
+  max_bytes_.store(maxBytes);
+  if (fingerprint_.exchange(fingerprint) != fingerprint) {
+    clear();
+    std::lock_guard<std::mutex> lock(store_mutex_);
+    if (store_ && store_->fingerprint != fingerprint) {
+      store_->offsets.clear();
+    }
+  }
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Sentence cache: " << maxBytes << " bytes, fingerprint "
+              << std::hex << fingerprint << std::dec << std::endl;
+  }
+}
+
+bool SentenceCache::enabled() const {
+  return max_bytes_.load(std::memory_order_relaxed) > 0;
+}
+
+std::shared_ptr<const CachedSentence>
+SentenceCache::find(std::string_view sentence) {
+  if (!enabled()) {
+    return nullptr;
+  }
+  // 指紋を種にして、辞書や設定が違う結果とはキーから分ける
+  const uint64_t key =
+      hashBytes(sentence, fingerprint_.load(std::memory_order_relaxed));
+  {
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end() && it->second->second->text == sentence) {
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+      stats::count("sentenceCache.hits");
+      return it->second->second;
+    }
+  }
+
+  auto entry = loadFromStore(key, sentence);
+  if (!entry) {
+    stats::count("sentenceCache.misses");
+    return nullptr;
+  }
+  stats::count("sentenceCache.storeHits");
+  insertKeyed(key, entry);
+  return entry;
+}
+
+void SentenceCache::insert(std::shared_ptr<const CachedSentence> entry) {
+  if (!enabled()) {
+    return;
+  }
+  const uint64_t key =
+      hashBytes(entry->text, fingerprint_.load(std::memory_order_relaxed));
+  insertKeyed(key, std::move(entry));
+  dirty_.store(true, std::memory_order_relaxed);
+}
+
+void SentenceCache::insertKeyed(uint64_t key,
+                                std::shared_ptr<const CachedSentence> entry) {
+  Shard &shard = shardFor(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    shard.bytes -= entryBytes(*it->second->second);
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+  }
+
+  shard.bytes += entryBytes(*entry);
+  shard.lru.emplace_front(key, std::move(entry));
+  shard.index.emplace(key, shard.lru.begin());
+
+  // 容量を超えたら最も使われていない記録から捨てる
+  const size_t limit = max_bytes_.load(std::memory_order_relaxed) / kShardCount;
+  while (shard.bytes > limit && shard.lru.size() > 1) {
+    auto &victim = shard.lru.back();
+    shard.bytes -= entryBytes(*victim.second);
+    shard.index.erase(victim.first);
+    shard.lru.pop_back();
+  }
+}
+
+std::shared_ptr<const CachedSentence>
+SentenceCache::loadFromStore(uint64_t key, std::string_view sentence) {
+  std::lock_guard<std::mutex> lock(store_mutex_);
+  if (!store_) {
+    return nullptr;
+  }
+  auto offsetIt = store_->offsets.find(key);
+  if (offsetIt == store_->offsets.end()) {
+    return nullptr;
+  }
+  auto entry = store_->decode(offsetIt->second);
+  if (!entry || entry->text != sentence) {
+    return nullptr;
+  }
+  return entry;
+}
+
+void SentenceCache::clear() {
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.lru.clear();
+    shard.index.clear();
+    shard.bytes = 0;
+  }
+}
+
+size_t SentenceCache::size() const {
+  size_t total = 0;
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    total += shard.index.size();
+  }
+  return total;
+}
+
+size_t SentenceCache::bytes() const {
+  size_t total = 0;
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    total += shard.bytes;
+  }
+  return total;
+}
+
+bool SentenceCache::openStore(const std::string &directory) {
+  if (directory.empty() || !enabled()) {
+    return false;
+  }
+
+  auto store = std::make_unique<Store>();
+  store->path = directory + "/" + kStoreFileName;
+  store->fingerprint = fingerprint_.load();
+
+  // 索引だけを作り、記録は使うときにマップから読み出す
+  auto file = std::make_unique<io::MappedFile>(store->path, false);
+  if (file->ok()) {
+    Reader reader(file->view());
+    char magic[4] = {};
+    uint32_t version = 0;
+    uint64_t fingerprint = 0;
+    uint32_t featureCount = 0;
+    uint32_t entryCount = 0;
+    if (reader.read(magic) && std::memcmp(magic, kMagic, 4) == 0 &&
+        reader.read(version) && version == kFormatVersion &&
+        reader.read(fingerprint) && fingerprint == store->fingerprint &&
+        reader.read(featureCount) && reader.read(entryCount)) {
+      store->featureNames.reserve(featureCount);
+      for (uint32_t i = 0; i < featureCount; ++i) {
+        std::string_view name;
+        if (!reader.bytes(name)) {
+          break;
+        }
+        store->featureNames.push_back(name);
+      }
+      if (store->featureNames.size() == featureCount) {
+        store->features.assign(featureCount, nullptr);
+        store->offsets.reserve(entryCount);
+        for (uint32_t i = 0; i < entryCount; ++i) {
+          const size_t offset = reader.position();
+          uint64_t key = 0;
+          // 書きかけなどで壊れた記録より後ろは使わない
+          if (!skipEntry(reader, key)) {
+            break;
+          }
+          store->offsets.emplace(key, offset);
+        }
+      }
+    } else if (stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Sentence cache store ignored (format or "
+                   "dictionary/config changed): "
+                << store->path << std::endl;
+    }
+    store->data = file->view();
+    store->file = std::move(file);
+  }
+
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Sentence cache store: " << store->path << ", "
+              << store->offsets.size() << " entries" << std::endl;
+  }
+
+  std::lock_guard<std::mutex> lock(store_mutex_);
+  store_ = std::move(store);
+  return true;
+}
+
+bool SentenceCache::saveStore() {
+  std::lock_guard<std::mutex> lock(store_mutex_);
+  if (!store_ || !dirty_.exchange(false)) {
+    return false;
+  }
+  stats::ScopedTimer timer("sentenceCache.save");
+
+  // メモリ上の記録を優先し、残りの容量にまだ読まれていない保存済みの
+  // 記録を詰める
+  std::vector<std::pair<uint64_t, std::shared_ptr<const CachedSentence>>>
+      entries;
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> shardLock(shard.mutex);
+    entries.insert(entries.end(), shard.lru.begin(), shard.lru.end());
+  }
+  const size_t limit = max_bytes_.load();
+  size_t total = 0;
+  std::unordered_set<uint64_t> written;
+  for (const auto &entry : entries) {
+    total += entryBytes(*entry.second);
+    written.insert(entry.first);
+  }
+  for (const auto &offset : store_->offsets) {
+    if (total >= limit) {
+      break;
+    }
+    if (written.count(offset.first)) {
+      continue;
+    }
+    auto entry = store_->decode(offset.second);
+    if (entry) {
+      total += entryBytes(*entry);
+      written.insert(offset.first);
+      entries.emplace_back(offset.first, std::move(entry));
+    }
+  }
+
+  std::unordered_map<const tokens::FeatureEntry *, uint32_t> featureIds;
+  std::vector<const tokens::FeatureEntry *> features;
+  std::string body;
+  for (const auto &entry : entries) {
+    writeEntry(body, entry.first, *entry.second, featureIds, features);
+  }
+
+  std::string header(kMagic, sizeof(kMagic));
+  put<uint32_t>(header, kFormatVersion);
+  put<uint64_t>(header, store_->fingerprint);
+  put<uint32_t>(header, static_cast<uint32_t>(features.size()));
+  put<uint32_t>(header, static_cast<uint32_t>(entries.size()));
+  for (const auto *feature : features) {
+    putBytes(header, feature->feature);
+  }
+
+  // 読み込み中のマップはそのまま使えるよう、別名で書いてから置き換える
+  const std::string temporary = store_->path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out.write(header.data(), static_cast<std::streamsize>(header.size()));
+    out.write(body.data(), static_cast<std::streamsize>(body.size()));
+    if (!out) {
+      std::cerr << "[ERROR] Failed to write sentence cache: " << temporary
+                << std::endl;
+      std::remove(temporary.c_str());
+      return false;
+    }
+  }
+#ifdef _WIN32
+  std::remove(store_->path.c_str());
+#endif
+  std::rename(temporary.c_str(), store_->path.c_str());
+
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Sentence cache saved: " << store_->path << ", "
+              << entries.size() << " entries, "
+              << header.size() + body.size() << " bytes" << std::endl;
+  }
+  return true;
+}
+
+DependencyCache &DependencyCache::getInstance() {
+  static DependencyCache instance;
+  return instance;
+}
+
+void DependencyCache::configure(size_t maxBytes, uint64_t fingerprint) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_bytes_ = maxBytes;
+  if (fingerprint_ != fingerprint || maxBytes == 0) {
+    lru_.clear();
+    index_.clear();
+    bytes_ = 0;
+  }
+  fingerprint_ = fingerprint;
+}
+
+std::shared_ptr<const CachedDependencies>
+DependencyCache::find(std::string_view sentence) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (max_bytes_ == 0) {
+    return nullptr;
+  }
+  auto it = index_.find(hashBytes(sentence, fingerprint_));
+  if (it == index_.end() || it->second->second->text != sentence) {
+    stats::count("dependencyCache.misses");
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  stats::count("dependencyCache.hits");
+  return it->second->second;
+}
+
+void DependencyCache::insert(std::shared_ptr<const CachedDependencies> entry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (max_bytes_ == 0) {
+    return;
+  }
+  const uint64_t key = hashBytes(entry->text, fingerprint_);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    bytes_ -= entryBytes(*it->second->second);
+    lru_.erase(it->second);
+    index_.erase(it);
+  }
+
+  bytes_ += entryBytes(*entry);
+  lru_.emplace_front(key, std::move(entry));
+  index_.emplace(key, lru_.begin());
+
+  while (bytes_ > max_bytes_ && lru_.size() > 1) {
+    auto &victim = lru_.back();
+    bytes_ -= entryBytes(*victim.second);
+    index_.erase(victim.first);
+    lru_.pop_back();
+  }
+}
+
+void DependencyCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  lru_.clear();
+  index_.clear();
+  bytes_ = 0;
+}
+
+size_t DependencyCache::bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_;
+}
+
+} // namespace cache
+} // namespace MoZuku
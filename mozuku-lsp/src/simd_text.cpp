@@ -0,0 +1,579 @@
+#include "simd_text.hpp"
+#include "stats.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define MOZUKU_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define MOZUKU_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+// AVX2 版だけを AVX2 有効でコンパイルし、実行時に CPU を見て選ぶ
+#if defined(MOZUKU_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define MOZUKU_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define MOZUKU_TARGET_AVX2
+#endif
+
+namespace MoZuku {
+namespace simd {
+
+namespace {
+
+// タブ・改行・復帰以外の C0 制御文字は sanitize で取り除く
+inline bool isRemovedControl(unsigned char c) {
+  return c < 0x20 && c != 0x09 && c != 0x0A && c != 0x0D;
+}
+
+// 厳密な UTF-8 として妥当な1文字のバイト数。不正なら 0
+size_t validSequenceLength(const unsigned char *p, size_t remaining) {
+  const unsigned char c = p[0];
+  if (c < 0x80) {
+    return isRemovedControl(c) ? 0 : 1;
+  }
+
+  size_t len = 0;
+  unsigned char lo = 0x80;
+  unsigned char hi = 0xBF;
+  if (c >= 0xC2 && c <= 0xDF) {
+    len = 2;
+  } else if (c == 0xE0) {
+    len = 3;
+    lo = 0xA0; // 冗長な3バイト表現
+  } else if (c == 0xED) {
+    len = 3;
+    hi = 0x9F; // サロゲート
+  } else if (c >= 0xE1 && c <= 0xEF) {
+    len = 3;
+  } else if (c == 0xF0) {
+    len = 4;
+    lo = 0x90; // 冗長な4バイト表現
+  } else if (c >= 0xF1 && c <= 0xF3) {
+    len = 4;
+  } else if (c == 0xF4) {
+    len = 4;
+    hi = 0x8F; // U+10FFFF 超
+  } else {
+    return 0;
+  }
+
+  if (remaining < len || p[1] < lo || p[1] > hi) {
+    return 0;
+  }
+  for (size_t j = 2; j < len; ++j) {
+    if ((p[j] & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+  return len;
+}
+
+// pos から1文字ずつ検査し、end 以上に達するか不正な文字で止まった位置を返す
+size_t scanCleanUntil(const unsigned char *data, size_t size, size_t pos,
+                      size_t end) {
+  if (end > size) {
+    end = size;
+  }
+  while (pos < end) {
+    size_t len = validSequenceLength(data + pos, size - pos);
+    if (len == 0) {
+      break;
+    }
+    pos += len;
+  }
+  return pos;
+}
+
+// 妥当な区間の末尾 pos が文字の途中なら、その文字の先頭まで戻す
+size_t charBoundary(const unsigned char *data, size_t pos) {
+  for (size_t back = 1; back <= 3 && back <= pos; ++back) {
+    const unsigned char c = data[pos - back];
+    if ((c & 0xC0) != 0x80) {
+      size_t len = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+      return len > back ? pos - back : pos;
+    }
+  }
+  return pos;
+}
+
+inline unsigned popcount32(uint32_t v) {
+  v = v - ((v >> 1) & 0x55555555u);
+  v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+  return (((v + (v >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+}
+
+inline unsigned countTrailingZeros(uint64_t v) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanForward64(&index, v);
+  return static_cast<unsigned>(index);
+#else
+  return static_cast<unsigned>(__builtin_ctzll(v));
+#endif
+}
+
+// 継続バイト以外を1、4バイト文字の先頭をもう1つ数える
+inline size_t utf16UnitsOf(unsigned char c) {
+  return ((c & 0xC0) != 0x80 ? 1 : 0) + (c >= 0xF0 ? 1 : 0);
+}
+
+#if !defined(MOZUKU_SIMD_X86) && !defined(MOZUKU_SIMD_NEON)
+size_t cleanPrefixScalar(const char *data, size_t size) {
+  return scanCleanUntil(reinterpret_cast<const unsigned char *>(data), size, 0,
+                        size);
+}
+#endif
+
+void appendLineStartsScalar(const char *data, size_t size, size_t base,
+                            std::vector<size_t> &out) {
+  for (size_t i = 0; i < size; ++i) {
+    if (data[i] == '\n') {
+      out.push_back(base + i + 1);
+    }
+  }
+}
+
+size_t utf16LengthScalar(const char *data, size_t size) {
+  size_t units = 0;
+  for (size_t i = 0; i < size; ++i) {
+    units += utf16UnitsOf(static_cast<unsigned char>(data[i]));
+  }
+  return units;
+}
+
+#if defined(MOZUKU_SIMD_X86) || defined(MOZUKU_SIMD_NEON)
+// UTF-8 検証の表引き (Keiser & Lemire, "Validating UTF-8 In Less Than One
+// Instruction Per Byte")。直前バイトの上位/下位4ビットと現バイトの上位4ビットで
+// 引いた3つの値の AND が、その2バイトの組で起こりうる誤りになる
+constexpr uint8_t kTooShort = 1 << 0;
+constexpr uint8_t kTooLong = 1 << 1;
+constexpr uint8_t kOverlong3 = 1 << 2;
+constexpr uint8_t kTooLarge = 1 << 3;
+constexpr uint8_t kSurrogate = 1 << 4;
+constexpr uint8_t kOverlong2 = 1 << 5;
+constexpr uint8_t kTooLarge1000 = 1 << 6;
+constexpr uint8_t kOverlong4 = 1 << 6;
+constexpr uint8_t kTwoConts = 1 << 7;
+constexpr uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+
+alignas(16) const uint8_t kByte1High[16] = {
+    kTooLong,   kTooLong,   kTooLong,   kTooLong,   kTooLong,
+    kTooLong,   kTooLong,   kTooLong,   kTwoConts,  kTwoConts,
+    kTwoConts,  kTwoConts,  kTooShort | kOverlong2, kTooShort,
+    kTooShort | kOverlong3 | kSurrogate,
+    kTooShort | kTooLarge | kTooLarge1000 | kOverlong4};
+
+alignas(16) const uint8_t kByte1Low[16] = {
+    kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+    kCarry | kOverlong2,
+    kCarry,
+    kCarry,
+    kCarry | kTooLarge,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+    kCarry | kTooLarge | kTooLarge1000,
+    kCarry | kTooLarge | kTooLarge1000};
+
+alignas(16) const uint8_t kByte2High[16] = {
+    kTooShort,
+    kTooShort,
+    kTooShort,
+    kTooShort,
+    kTooShort,
+    kTooShort,
+    kTooShort,
+    kTooShort,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 |
+        kOverlong4,
+    kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+    kTooShort,
+    kTooShort,
+    kTooShort,
+    kTooShort};
+#endif
+
+#if defined(MOZUKU_SIMD_X86)
+// ---- SSE2 (x86_64 の基準命令セット): ASCII だけのブロックを読み飛ばす ----
+
+// ASCII の表示文字とタブ・改行・復帰以外のバイトのビットマスク
+inline uint32_t sse2DirtyMask(__m128i v) {
+  __m128i printable = _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F));
+  __m128i allowed =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x09)),
+                                _mm_cmpeq_epi8(v, _mm_set1_epi8(0x0A))),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8(0x0D)));
+  return ~static_cast<uint32_t>(
+             _mm_movemask_epi8(_mm_or_si128(printable, allowed))) &
+         0xFFFFu;
+}
+
+size_t cleanPrefixSse2(const char *data, size_t size) {
+  const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+  size_t pos = 0;
+  while (pos + 16 <= size) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+    if (sse2DirtyMask(v) == 0) {
+      pos += 16;
+      continue;
+    }
+    // 非 ASCII を含むブロックは1文字ずつ検査する
+    const size_t end = pos + 16;
+    pos = scanCleanUntil(bytes, size, pos, end);
+    if (pos < end) {
+      return pos;
+    }
+  }
+  return scanCleanUntil(bytes, size, pos, size);
+}
+
+void appendLineStartsSse2(const char *data, size_t size, size_t base,
+                          std::vector<size_t> &out) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    uint32_t mask =
+        static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)));
+    while (mask != 0) {
+      out.push_back(base + i + countTrailingZeros(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  appendLineStartsScalar(data + i, size - i, base + i, out);
+}
+
+size_t utf16LengthSse2(const char *data, size_t size) {
+  // 符号付きで 0xBF (-65) より大きい = 継続バイト以外
+  const __m128i contLimit = _mm_set1_epi8(static_cast<char>(0xBF));
+  const __m128i fourByteLead = _mm_set1_epi8(static_cast<char>(0xF0));
+  size_t units = 0;
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    uint32_t lead =
+        static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpgt_epi8(v, contLimit)));
+    uint32_t four = static_cast<uint32_t>(_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_max_epu8(v, fourByteLead), v)));
+    units += popcount32(lead) + popcount32(four);
+  }
+  return units + utf16LengthScalar(data + i, size - i);
+}
+
+// ---- AVX2: 32バイトずつ表引きで UTF-8 を検証する ----
+
+MOZUKU_TARGET_AVX2 inline __m256i avx2Table(const uint8_t *table) {
+  return _mm256_broadcastsi128_si256(
+      _mm_load_si128(reinterpret_cast<const __m128i *>(table)));
+}
+
+// input の各バイトの N バイト前 (前ブロックにまたがる)
+template <int N>
+MOZUKU_TARGET_AVX2 inline __m256i avx2Prev(__m256i input, __m256i previous) {
+  return _mm256_alignr_epi8(
+      input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+}
+
+MOZUKU_TARGET_AVX2 inline __m256i avx2Utf8Errors(__m256i input,
+                                                 __m256i previous) {
+  const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+  __m256i prev1 = avx2Prev<1>(input, previous);
+  __m256i byte1High = _mm256_shuffle_epi8(
+      avx2Table(kByte1High),
+      _mm256_and_si256(_mm256_srli_epi16(prev1, 4), lowNibble));
+  __m256i byte1Low = _mm256_shuffle_epi8(avx2Table(kByte1Low),
+                                         _mm256_and_si256(prev1, lowNibble));
+  __m256i byte2High = _mm256_shuffle_epi8(
+      avx2Table(kByte2High),
+      _mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibble));
+  __m256i special =
+      _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+  // 3・4バイト文字の2つ目以降の継続バイトは表引きでは見えないので別に確かめる
+  __m256i third = _mm256_subs_epu8(avx2Prev<2>(input, previous),
+                                   _mm256_set1_epi8(0xE0 - 0x80));
+  __m256i fourth = _mm256_subs_epu8(avx2Prev<3>(input, previous),
+                                    _mm256_set1_epi8(0xF0 - 0x80));
+  __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                    _mm256_set1_epi8(static_cast<char>(0x80)));
+  return _mm256_xor_si256(must23, special);
+}
+
+MOZUKU_TARGET_AVX2 inline __m256i avx2RemovedControls(__m256i v) {
+  __m256i low =
+      _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1F)), v);
+  __m256i allowed = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x09)),
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x0A))),
+      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x0D)));
+  return _mm256_andnot_si256(allowed, low);
+}
+
+MOZUKU_TARGET_AVX2 size_t cleanPrefixAvx2(const char *data, size_t size) {
+  const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+  // ブロック末尾で文字が終わっていないバイトを検出する上限値
+  const __m256i incompleteMax = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, static_cast<char>(0xF0 - 1),
+      static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+
+  __m256i previous = _mm256_setzero_si256();
+  __m256i incomplete = _mm256_setzero_si256();
+  size_t pos = 0;
+  while (pos + 32 <= size) {
+    __m256i input =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos));
+    __m256i error = avx2RemovedControls(input);
+    if (_mm256_movemask_epi8(input) == 0) {
+      error = _mm256_or_si256(error, incomplete);
+    } else {
+      error = _mm256_or_si256(error, avx2Utf8Errors(input, previous));
+    }
+
+    if (!_mm256_testz_si256(error, error)) {
+      // 誤りのあるブロックだけスカラーで正確な位置を求める
+      const size_t end = pos + 32;
+      pos = scanCleanUntil(bytes, size, charBoundary(bytes, pos), end);
+      if (pos < end) {
+        return pos;
+      }
+      previous = _mm256_setzero_si256();
+      incomplete = _mm256_setzero_si256();
+      continue;
+    }
+
+    incomplete = _mm256_subs_epu8(input, incompleteMax);
+    previous = input;
+    pos += 32;
+  }
+  return scanCleanUntil(bytes, size, charBoundary(bytes, pos), size);
+}
+
+MOZUKU_TARGET_AVX2 void appendLineStartsAvx2(const char *data, size_t size,
+                                             size_t base,
+                                             std::vector<size_t> &out) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    uint32_t mask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)));
+    while (mask != 0) {
+      out.push_back(base + i + countTrailingZeros(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  appendLineStartsScalar(data + i, size - i, base + i, out);
+}
+
+MOZUKU_TARGET_AVX2 size_t utf16LengthAvx2(const char *data, size_t size) {
+  const __m256i contLimit = _mm256_set1_epi8(static_cast<char>(0xBF));
+  const __m256i fourByteLead = _mm256_set1_epi8(static_cast<char>(0xF0));
+  size_t units = 0;
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    uint32_t lead = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, contLimit)));
+    uint32_t four = static_cast<uint32_t>(_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_max_epu8(v, fourByteLead), v)));
+    units += popcount32(lead) + popcount32(four);
+  }
+  return units + utf16LengthScalar(data + i, size - i);
+}
+
+bool cpuHasAvx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  __cpuid(info, 1);
+  const bool osxsave = (info[2] & (1 << 27)) != 0;
+  const bool avx = (info[2] & (1 << 28)) != 0;
+  // OS が YMM レジスタを保存しない環境では使えない
+  if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif // MOZUKU_SIMD_X86
+
+#if defined(MOZUKU_SIMD_NEON)
+// ---- NEON (aarch64 では常に使える) ----
+
+// 比較結果を1バイトあたり4ビットのマスクに詰める
+inline uint64_t neonMask(uint8x16_t cmp) {
+  return vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4)), 0);
+}
+
+inline uint8x16_t neonUtf8Errors(uint8x16_t input, uint8x16_t previous) {
+  const uint8x16_t lowNibble = vdupq_n_u8(0x0F);
+  uint8x16_t prev1 = vextq_u8(previous, input, 15);
+  uint8x16_t byte1High = vqtbl1q_u8(vld1q_u8(kByte1High), vshrq_n_u8(prev1, 4));
+  uint8x16_t byte1Low =
+      vqtbl1q_u8(vld1q_u8(kByte1Low), vandq_u8(prev1, lowNibble));
+  uint8x16_t byte2High = vqtbl1q_u8(vld1q_u8(kByte2High), vshrq_n_u8(input, 4));
+  uint8x16_t special = vandq_u8(vandq_u8(byte1High, byte1Low), byte2High);
+
+  uint8x16_t third =
+      vqsubq_u8(vextq_u8(previous, input, 14), vdupq_n_u8(0xE0 - 0x80));
+  uint8x16_t fourth =
+      vqsubq_u8(vextq_u8(previous, input, 13), vdupq_n_u8(0xF0 - 0x80));
+  uint8x16_t must23 = vandq_u8(vorrq_u8(third, fourth), vdupq_n_u8(0x80));
+  return veorq_u8(must23, special);
+}
+
+inline uint8x16_t neonRemovedControls(uint8x16_t v) {
+  uint8x16_t low = vcltq_u8(v, vdupq_n_u8(0x20));
+  uint8x16_t allowed = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(0x09)),
+                                         vceqq_u8(v, vdupq_n_u8(0x0A))),
+                                vceqq_u8(v, vdupq_n_u8(0x0D)));
+  return vbicq_u8(low, allowed);
+}
+
+size_t cleanPrefixNeon(const char *data, size_t size) {
+  const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+  alignas(16) static const uint8_t kIncompleteMax[16] = {
+      0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,       0xFF,
+      0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1};
+  const uint8x16_t incompleteMax = vld1q_u8(kIncompleteMax);
+
+  uint8x16_t previous = vdupq_n_u8(0);
+  uint8x16_t incomplete = vdupq_n_u8(0);
+  size_t pos = 0;
+  while (pos + 16 <= size) {
+    uint8x16_t input = vld1q_u8(bytes + pos);
+    uint8x16_t error = neonRemovedControls(input);
+    if (vmaxvq_u8(input) < 0x80) {
+      error = vorrq_u8(error, incomplete);
+    } else {
+      error = vorrq_u8(error, neonUtf8Errors(input, previous));
+    }
+
+    if (vmaxvq_u8(error) != 0) {
+      const size_t end = pos + 16;
+      pos = scanCleanUntil(bytes, size, charBoundary(bytes, pos), end);
+      if (pos < end) {
+        return pos;
+      }
+      previous = vdupq_n_u8(0);
+      incomplete = vdupq_n_u8(0);
+      continue;
+    }
+
+    incomplete = vqsubq_u8(input, incompleteMax);
+    previous = input;
+    pos += 16;
+  }
+  return scanCleanUntil(bytes, size, charBoundary(bytes, pos), size);
+}
+
+void appendLineStartsNeon(const char *data, size_t size, size_t base,
+                          std::vector<size_t> &out) {
+  const auto *bytes = reinterpret_cast<const uint8_t *>(data);
+  const uint8x16_t newline = vdupq_n_u8('\n');
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    // 各バイトの4ビットのうち最上位だけを残す
+    uint64_t mask = neonMask(vceqq_u8(vld1q_u8(bytes + i), newline)) &
+                    0x8888888888888888ull;
+    while (mask != 0) {
+      out.push_back(base + i + (countTrailingZeros(mask) >> 2) + 1);
+      mask &= mask - 1;
+    }
+  }
+  appendLineStartsScalar(data + i, size - i, base + i, out);
+}
+
+size_t utf16LengthNeon(const char *data, size_t size) {
+  const auto *bytes = reinterpret_cast<const uint8_t *>(data);
+  const int8x16_t contLimit = vdupq_n_s8(static_cast<int8_t>(0xBF));
+  const uint8x16_t fourByteLead = vdupq_n_u8(0xF0);
+  const uint8x16_t one = vdupq_n_u8(1);
+  size_t units = 0;
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t v = vld1q_u8(bytes + i);
+    uint8x16_t lead = vcgtq_s8(vreinterpretq_s8_u8(v), contLimit);
+    uint8x16_t four = vcgeq_u8(v, fourByteLead);
+    units += vaddvq_u8(vandq_u8(lead, one)) + vaddvq_u8(vandq_u8(four, one));
+  }
+  return units + utf16LengthScalar(data + i, size - i);
+}
+#endif // MOZUKU_SIMD_NEON
+
+struct Kernels {
+  const char *name;
+  size_t (*cleanPrefix)(const char *, size_t);
+  void (*lineStarts)(const char *, size_t, size_t, std::vector<size_t> &);
+  size_t (*utf16)(const char *, size_t);
+};
+
+Kernels selectKernels() {
+#if defined(MOZUKU_SIMD_X86)
+  if (cpuHasAvx2()) {
+    return {"avx2", cleanPrefixAvx2, appendLineStartsAvx2, utf16LengthAvx2};
+  }
+  return {"sse2", cleanPrefixSse2, appendLineStartsSse2, utf16LengthSse2};
+#elif defined(MOZUKU_SIMD_NEON)
+  return {"neon", cleanPrefixNeon, appendLineStartsNeon, utf16LengthNeon};
+#else
+  return {"scalar", cleanPrefixScalar, appendLineStartsScalar,
+          utf16LengthScalar};
+#endif
+}
+
+const Kernels &kernels() {
+  static const Kernels selected = []() {
+    Kernels k = selectKernels();
+    if (stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Text kernels: " << k.name << std::endl;
+    }
+    return k;
+  }();
+  return selected;
+}
+
+} // namespace
+
+size_t cleanPrefixLength(const char *data, size_t size) {
+  return kernels().cleanPrefix(data, size);
+}
+
+void appendLineStarts(const char *data, size_t size, size_t base,
+                      std::vector<size_t> &out) {
+  kernels().lineStarts(data, size, base, out);
+}
+
+size_t utf16Length(const char *data, size_t size) {
+  return kernels().utf16(data, size);
+}
+
+const char *kernelName() { return kernels().name; }
+
+} // namespace simd
+} // namespace MoZuku
@@ -0,0 +1,391 @@
+#include "stats.hpp"
+#include "json_rpc.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace MoZuku {
+namespace stats {
+
+bool debugEnabled() {
+  static const bool debug = std::getenv("MOZUKU_DEBUG") != nullptr;
+  return debug;
+}
+
+std::atomic<bool> gEnabled{false};
+
+namespace {
+
+// マイクロ秒の対数目盛。4 未満はそのまま、以降は2の冪ごとに4分割する
+constexpr size_t kBuckets = 160;
+
+size_t bucketFor(uint64_t micros) {
+  if (micros < 4) {
+    return static_cast<size_t>(micros);
+  }
+  size_t msb = 0;
+  for (uint64_t v = micros; v > 1; v >>= 1) {
+    ++msb;
+  }
+  const size_t index = (msb - 1) * 4 + ((micros >> (msb - 2)) & 3);
+  return std::min(index, kBuckets - 1);
+}
+
+// 目盛の区間の中央 (マイクロ秒)
+double bucketMidpoint(size_t index) {
+  if (index < 4) {
+    return static_cast<double>(index) + 0.5;
+  }
+  const size_t msb = index / 4 + 1;
+  const double width = static_cast<double>(uint64_t{1} << (msb - 2));
+  return (4 + index % 4) * width + width / 2.0;
+}
+
+struct Histogram {
+  uint64_t count{0};
+  uint64_t totalNs{0};
+  uint64_t maxNs{0};
+  std::array<uint32_t, kBuckets> buckets{};
+
+  void add(uint64_t ns) {
+    ++count;
+    totalNs += ns;
+    maxNs = std::max(maxNs, ns);
+    ++buckets[bucketFor(ns / 1000)];
+  }
+
+  void merge(const Histogram &other) {
+    count += other.count;
+    totalNs += other.totalNs;
+    maxNs = std::max(maxNs, other.maxNs);
+    for (size_t i = 0; i < kBuckets; ++i) {
+      buckets[i] += other.buckets[i];
+    }
+  }
+
+  double percentileMs(double p) const {
+    const double maxMs = maxNs / 1e6;
+    const uint64_t rank = std::max<uint64_t>(
+        1, static_cast<uint64_t>(std::ceil(p * static_cast<double>(count))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return std::min(bucketMidpoint(i) / 1000.0, maxMs);
+      }
+    }
+    return maxMs;
+  }
+
+  nlohmann::json toJson() const {
+    if (count == 0) {
+      return {{"count", 0}};
+    }
+    return {{"count", count},
+            {"totalMs", totalNs / 1e6},
+            {"meanMs", totalNs / 1e6 / count},
+            {"p50Ms", percentileMs(0.50)},
+            {"p90Ms", percentileMs(0.90)},
+            {"p99Ms", percentileMs(0.99)},
+            {"maxMs", maxNs / 1e6}};
+  }
+};
+
+// スレッドごとの集計。記録するスレッドと取得側しか触らないので
+// ロックはほぼ競合しない。キーは文字列リテラルのポインタ
+struct Shard {
+  std::mutex mutex;
+  uint32_t threadId{0};
+  std::unordered_map<const char *, Histogram> phases;
+  std::unordered_map<const char *, uint64_t> counters;
+  std::unordered_map<std::string,
+                     std::unordered_map<const char *, Histogram>>
+      documents;
+
+  // mutex は呼び出し側が持つ
+  void mergeInto(Shard &target) const {
+    for (const auto &entry : phases) {
+      target.phases[entry.first].merge(entry.second);
+    }
+    for (const auto &entry : counters) {
+      target.counters[entry.first] += entry.second;
+    }
+    for (const auto &document : documents) {
+      auto &phasesOfDocument = target.documents[document.first];
+      for (const auto &entry : document.second) {
+        phasesOfDocument[entry.first].merge(entry.second);
+      }
+    }
+  }
+
+  void clear() {
+    phases.clear();
+    counters.clear();
+    documents.clear();
+  }
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<Shard>> shards;
+  Shard retired; // 終了したスレッドの分
+  uint32_t nextThreadId{1};
+};
+
+// 終了処理中に他のスレッドが記録しても壊れないよう破棄しない
+Registry &registry() {
+  static Registry *instance = new Registry();
+  return *instance;
+}
+
+void retire(const std::shared_ptr<Shard> &shard) {
+  Registry &reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mutex);
+  {
+    std::lock_guard<std::mutex> shardLock(shard->mutex);
+    std::lock_guard<std::mutex> retiredLock(reg.retired.mutex);
+    shard->mergeInto(reg.retired);
+  }
+  reg.shards.erase(std::remove(reg.shards.begin(), reg.shards.end(), shard),
+                   reg.shards.end());
+}
+
+struct ThreadShard {
+  std::shared_ptr<Shard> shard;
+  ~ThreadShard() {
+    if (shard) {
+      retire(shard);
+    }
+  }
+};
+
+Shard &localShard() {
+  thread_local ThreadShard local;
+  if (!local.shard) {
+    auto shard = std::make_shared<Shard>();
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    shard->threadId = reg.nextThreadId++;
+    reg.shards.push_back(shard);
+    local.shard = std::move(shard);
+  }
+  return *local.shard;
+}
+
+thread_local const std::string *tCurrentDocument = nullptr;
+
+// トレースの時刻の起点 (プロセス開始時)
+const Clock::time_point gOrigin = Clock::now();
+
+// Chrome のトレースイベント (JSON 配列形式)。配列の閉じ括弧は省略できる
+// 形式なので、途中で終了しても読み込める
+struct TraceWriter {
+  std::mutex mutex;
+  std::ofstream file;
+  std::string buffer;
+  bool first{true};
+
+  static constexpr size_t kFlushBytes = 64 * 1024;
+
+  void writeBuffer() {
+    file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    file.flush();
+    buffer.clear();
+  }
+};
+
+std::atomic<bool> gTracing{false};
+
+TraceWriter &traceWriter() {
+  static TraceWriter *instance = new TraceWriter();
+  return *instance;
+}
+
+void appendTraceEvent(const char *phase, uint32_t threadId,
+                      Clock::time_point start, uint64_t ns,
+                      const std::string *uri) {
+  const auto ts = std::chrono::duration_cast<std::chrono::microseconds>(
+                      start - gOrigin)
+                      .count();
+
+  TraceWriter &trace = traceWriter();
+  std::lock_guard<std::mutex> lock(trace.mutex);
+  if (!trace.file.is_open()) {
+    return;
+  }
+  if (!trace.first) {
+    trace.buffer += ",\n";
+  }
+  trace.first = false;
+
+  rpc::JsonWriter writer(trace.buffer);
+  writer.beginObject();
+  writer.key("name");
+  writer.value(phase);
+  writer.key("cat");
+  writer.value("mozuku");
+  writer.key("ph");
+  writer.value("X");
+  writer.key("pid");
+  writer.value(1);
+  writer.key("tid");
+  writer.value(threadId);
+  writer.key("ts");
+  writer.value(static_cast<int64_t>(ts));
+  writer.key("dur");
+  writer.value(ns / 1000);
+  if (uri) {
+    writer.key("args");
+    writer.beginObject();
+    writer.key("uri");
+    writer.value(*uri);
+    writer.endObject();
+  }
+  writer.endObject();
+
+  if (trace.buffer.size() >= TraceWriter::kFlushBytes) {
+    trace.writeBuffer();
+  }
+}
+
+} // namespace
+
+void configure(bool enable, const std::string &traceFile) {
+  if (!traceFile.empty()) {
+    TraceWriter &trace = traceWriter();
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    trace.file.open(traceFile, std::ios::out | std::ios::trunc);
+    if (trace.file.is_open()) {
+      trace.file << "[\n";
+      trace.first = true;
+      gTracing.store(true, std::memory_order_relaxed);
+    } else {
+      std::cerr << "[ERROR] Failed to open trace file: " << traceFile
+                << std::endl;
+    }
+  }
+
+  // トレースは集計と同じ計測点を使う
+  const bool tracing = gTracing.load(std::memory_order_relaxed);
+  gEnabled.store(enable || tracing, std::memory_order_relaxed);
+
+  if (debugEnabled()) {
+    std::cerr << "[DEBUG] Stats "
+              << (enable || tracing ? "enabled" : "disabled")
+              << (tracing ? ", tracing to " + traceFile : std::string())
+              << std::endl;
+  }
+}
+
+void record(const char *phase, Clock::time_point start, Clock::time_point end) {
+  const uint64_t ns = end > start ? static_cast<uint64_t>(
+                                        std::chrono::duration_cast<
+                                            std::chrono::nanoseconds>(end -
+                                                                      start)
+                                            .count())
+                                  : 0;
+  Shard &shard = localShard();
+  const std::string *uri = tCurrentDocument;
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.phases[phase].add(ns);
+    if (uri) {
+      shard.documents[*uri][phase].add(ns);
+    }
+  }
+  if (gTracing.load(std::memory_order_relaxed)) {
+    appendTraceEvent(phase, shard.threadId, start, ns, uri);
+  }
+}
+
+void add(const char *counter, uint64_t delta) {
+  Shard &shard = localShard();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  shard.counters[counter] += delta;
+}
+
+DocumentScope::DocumentScope(const std::string *uri)
+    : previous_(tCurrentDocument) {
+  tCurrentDocument = uri;
+}
+
+DocumentScope::~DocumentScope() { tCurrentDocument = previous_; }
+
+const std::string *DocumentScope::current() { return tCurrentDocument; }
+
+nlohmann::json snapshot(bool reset) {
+  // 同じ名前でも翻訳単位ごとにリテラルのアドレスが違うので、内容でまとめる
+  std::map<std::string, Histogram> phases;
+  std::map<std::string, uint64_t> counters;
+  std::map<std::string, std::map<std::string, Histogram>> documents;
+
+  auto collect = [&](Shard &shard) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (const auto &entry : shard.phases) {
+      phases[entry.first].merge(entry.second);
+    }
+    for (const auto &entry : shard.counters) {
+      counters[entry.first] += entry.second;
+    }
+    for (const auto &document : shard.documents) {
+      auto &phasesOfDocument = documents[document.first];
+      for (const auto &entry : document.second) {
+        phasesOfDocument[entry.first].merge(entry.second);
+      }
+    }
+    if (reset) {
+      shard.clear();
+    }
+  };
+
+  {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    collect(reg.retired);
+    for (const auto &shard : reg.shards) {
+      collect(*shard);
+    }
+  }
+
+  nlohmann::json result = {{"enabled", enabled()},
+                           {"tracing", gTracing.load()},
+                           {"phases", nlohmann::json::object()},
+                           {"counters", nlohmann::json::object()},
+                           {"documents", nlohmann::json::object()}};
+  for (const auto &entry : phases) {
+    result["phases"][entry.first] = entry.second.toJson();
+  }
+  for (const auto &entry : counters) {
+    result["counters"][entry.first] = entry.second;
+  }
+  for (const auto &document : documents) {
+    auto &target = result["documents"][document.first];
+    for (const auto &entry : document.second) {
+      target[entry.first] = entry.second.toJson();
+    }
+  }
+  return result;
+}
+
+void flushTrace() {
+  if (!gTracing.load(std::memory_order_relaxed)) {
+    return;
+  }
+  TraceWriter &trace = traceWriter();
+  std::lock_guard<std::mutex> lock(trace.mutex);
+  if (trace.file.is_open()) {
+    trace.writeBuffer();
+  }
+}
+
+} // namespace stats
+} // namespace MoZuku
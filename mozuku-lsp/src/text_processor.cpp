@@ -1,189 +1,183 @@
 #include "text_processor.hpp"
+#include "simd_text.hpp"
+#include "stats.hpp"
 #include <algorithm>
-#include <cstdlib>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 
 namespace MoZuku {
 namespace text {
 
-static bool isDebugEnabled() {
-  static bool initialized = false;
-  static bool debug = false;
-  if (!initialized) {
-    debug = (std::getenv("MOZUKU_DEBUG") != nullptr);
-    initialized = true;
-  }
-  return debug;
-}
-
 std::string TextProcessor::sanitizeUTF8(const std::string &input) {
-  if (input.empty())
-    return input;
+  std::string result(input);
+  sanitizeUTF8InPlace(result);
+  return result;
+}
 
-  std::string result;
-  result.reserve(input.size());
+bool TextProcessor::sanitizeUTF8InPlace(std::string &text) {
+  const size_t size = text.size();
+  size_t read = simd::cleanPrefixLength(text.data(), size);
+  if (read == size) {
+    return false;
+  }
 
-  for (size_t i = 0; i < input.size(); ++i) {
-    unsigned char c = static_cast<unsigned char>(input[i]);
+  // 不正な箇所だけを1文字ずつ直し、間の妥当な区間はまとめて前に詰める
+  char *data = &text[0];
+  size_t write = read;
+  while (read < size) {
+    unsigned char c = static_cast<unsigned char>(data[read]);
 
-    // ASCII characters (0x00-0x7F) are safe
     if (c < 0x80) {
-      // Skip control characters except tab, newline, carriage return
+      // タブ・改行・復帰以外の制御文字は落とす
       if (c >= 0x20 || c == 0x09 || c == 0x0A || c == 0x0D) {
-        result += static_cast<char>(c);
+        data[write++] = static_cast<char>(c);
+      }
+      ++read;
+    } else {
+      size_t seqLen = 0;
+      if ((c & 0xE0) == 0xC0)
+        seqLen = 2; // 110xxxxx (2-byte)
+      else if ((c & 0xF0) == 0xE0)
+        seqLen = 3; // 1110xxxx (3-byte)
+      else if ((c & 0xF8) == 0xF0)
+        seqLen = 4; // 11110xxx (4-byte)
+
+      if (seqLen == 0) {
+        // Invalid UTF-8 start byte, skip it
+        ++read;
+      } else if (read + seqLen > size) {
+        break; // Incomplete sequence at end of string
+      } else if (isValidUtf8Sequence(text, read, seqLen)) {
+        std::memmove(data + write, data + read, seqLen);
+        write += seqLen;
+        read += seqLen;
+      } else {
+        // Invalid sequence, skip start byte (continuation bytes will be handled
+        // in next iterations)
+        ++read;
       }
-      continue;
-    }
-
-    // Handle multi-byte UTF-8 sequences
-    size_t seqLen = 0;
-    if ((c & 0xE0) == 0xC0)
-      seqLen = 2; // 110xxxxx (2-byte)
-    else if ((c & 0xF0) == 0xE0)
-      seqLen = 3; // 1110xxxx (3-byte)
-    else if ((c & 0xF8) == 0xF0)
-      seqLen = 4; // 11110xxx (4-byte)
-    else {
-      // Invalid UTF-8 start byte, skip it
-      continue;
     }
 
-    // Check if we have enough bytes for the sequence
-    if (i + seqLen > input.size()) {
-      break; // Incomplete sequence at end of string
-    }
-
-    // Validate all continuation bytes
-    if (isValidUtf8Sequence(input, i, seqLen)) {
-      // Valid sequence, copy it
-      for (size_t j = 0; j < seqLen; ++j) {
-        result += input[i + j];
-      }
-      i += seqLen - 1; // -1 because loop will increment i
-    } else {
-      // Invalid sequence, skip start byte (continuation bytes will be handled
-      // in next iterations)
-      continue;
+    size_t clean = simd::cleanPrefixLength(data + read, size - read);
+    if (clean > 0) {
+      std::memmove(data + write, data + read, clean);
+      write += clean;
+      read += clean;
     }
   }
 
-  return result;
+  text.resize(write);
+  return true;
 }
 
 std::vector<SentenceBoundary>
 TextProcessor::splitIntoSentences(const std::string &text) {
-  if (isDebugEnabled()) {
+  if (stats::debugEnabled()) {
     std::cerr << "[DEBUG] splitIntoSentences called with text length: "
               << text.size() << std::endl;
   }
 
   std::vector<SentenceBoundary> sentences;
   if (text.empty()) {
-    if (isDebugEnabled()) {
+    if (stats::debugEnabled()) {
       std::cerr << "[DEBUG] Empty text, returning empty sentences" << std::endl;
     }
     return sentences;
   }
 
-  // Multi-stage approach: 1. newlines, 2. tabs, 3. periods
   size_t start = 0;
   int sentenceId = 0;
 
   while (start < text.size()) {
-    size_t end = start;
-    bool foundBoundary = false;
+    SentenceBoundary sentence;
+    size_t next = scanSentence(text, start, sentence);
+    sentence.sentenceId = sentenceId++;
+
+    if (!sentence.text.empty()) {
+      if (stats::debugEnabled()) {
+        std::cerr << "[DEBUG] Created sentence " << sentence.sentenceId
+                  << ": length=" << sentence.text.size()
+                  << ", start=" << sentence.start << ", end=" << sentence.end
+                  << std::endl;
+      }
+      sentences.push_back(std::move(sentence));
+    }
 
-    // Find next sentence boundary - limit search to avoid infinite loops
-    size_t maxSearch = std::min(text.size(), start + 10000); // Safety limit
+    start = next;
+  }
 
-    while (end < maxSearch) {
-      char c = text[end];
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] splitIntoSentences completed: created "
+              << sentences.size() << " sentences" << std::endl;
+  }
 
-      // Priority 1: Check for newline first
-      if (c == '\n') {
-        foundBoundary = true;
-        end++; // Include the boundary character
-        break;
-      }
+  return sentences;
+}
 
-      // Priority 2: Check for tab
-      if (c == '\t') {
-        foundBoundary = true;
-        end++; // Include the boundary character
-        break;
-      }
+size_t TextProcessor::scanSentence(const std::string &text, size_t start,
+                                   SentenceBoundary &sentence) {
+  // Multi-stage approach: 1. newlines, 2. tabs, 3. periods
+  size_t end = start;
 
-      // Priority 3: Check for Japanese period (。)
-      if (isJapanesePunctuation(text, end)) {
-        foundBoundary = true;
-        end += 3; // Japanese punctuation is 3 bytes in UTF-8
-        break;
-      }
+  // Find next sentence boundary - limit search to avoid infinite loops
+  size_t maxSearch = std::min(text.size(), start + 10000); // Safety limit
 
-      end++;
-    }
+  while (end < maxSearch) {
+    char c = text[end];
 
-    // Safety check - if we hit the limit, just end at text size
-    if (end >= maxSearch && end < text.size()) {
-      end = text.size();
-      foundBoundary = true;
+    // Priority 1: Check for newline first
+    if (c == '\n') {
+      end++; // Include the boundary character
+      break;
     }
 
-    // Create sentence boundary
-    if (end > start) {
-      SentenceBoundary sentence;
-      sentence.start = start;
-      sentence.end = end;
-      sentence.sentenceId = sentenceId++;
-      sentence.text = text.substr(start, end - start);
-
-      // Trim leading tabs and whitespace from sentence text for analysis
-      size_t textStart = 0;
-      while (textStart < sentence.text.size() &&
-             (sentence.text[textStart] == ' ' ||
-              sentence.text[textStart] == '\t' ||
-              sentence.text[textStart] == '\r')) {
-        textStart++;
-      }
+    // Priority 2: Check for tab
+    if (c == '\t') {
+      end++; // Include the boundary character
+      break;
+    }
 
-      size_t textEnd = sentence.text.size();
-      while (textEnd > textStart && (sentence.text[textEnd - 1] == ' ' ||
-                                     sentence.text[textEnd - 1] == '\t' ||
-                                     sentence.text[textEnd - 1] == '\r' ||
-                                     sentence.text[textEnd - 1] == '\n')) {
-        textEnd--;
-      }
+    // Priority 3: Check for Japanese period (。)
+    if (isJapanesePunctuation(text, end)) {
+      end += 3; // Japanese punctuation is 3 bytes in UTF-8
+      break;
+    }
 
-      if (textEnd > textStart) {
-        sentence.text = sentence.text.substr(textStart, textEnd - textStart);
-        sentences.push_back(sentence);
+    end++;
+  }
 
-        if (isDebugEnabled()) {
-          std::cerr << "[DEBUG] Created sentence " << sentenceId - 1
-                    << ": length=" << sentence.text.size()
-                    << ", start=" << sentence.start << ", end=" << sentence.end
-                    << std::endl;
-        }
-      }
-    }
+  // Safety check - if we hit the limit, just end at text size
+  if (end >= maxSearch && end < text.size()) {
+    end = text.size();
+  }
 
-    start = end;
+  sentence.start = start;
+  sentence.end = end;
+  sentence.text.clear();
 
-    // Skip multiple whitespace after boundaries (with safety limit)
-    start = skipWhitespace(text, start);
+  // Trim leading tabs and whitespace from sentence text for analysis
+  size_t textStart = start;
+  while (textStart < end && (text[textStart] == ' ' ||
+                             text[textStart] == '\t' ||
+                             text[textStart] == '\r')) {
+    textStart++;
+  }
 
-    // Safety check to prevent infinite loop
-    if (start >= text.size()) {
-      break;
-    }
+  size_t textEnd = end;
+  while (textEnd > textStart &&
+         (text[textEnd - 1] == ' ' || text[textEnd - 1] == '\t' ||
+          text[textEnd - 1] == '\r' || text[textEnd - 1] == '\n')) {
+    textEnd--;
   }
 
-  if (isDebugEnabled()) {
-    std::cerr << "[DEBUG] splitIntoSentences completed: created "
-              << sentences.size() << " sentences" << std::endl;
+  if (textEnd > textStart) {
+    sentence.text = text.substr(textStart, textEnd - textStart);
   }
 
-  return sentences;
+  // Skip multiple whitespace after boundaries (with safety limit)
+  return skipWhitespace(text, end);
 }
 
 bool TextProcessor::isJapanesePunctuation(const std::string &text, size_t pos) {
@@ -224,6 +218,52 @@ size_t TextProcessor::skipWhitespace(const std::string &text, size_t pos) {
   return pos;
 }
 
+double TextProcessor::japaneseRatio(const std::string &text, size_t start,
+                                    size_t end) {
+  end = std::min(end, text.size());
+  size_t counted = 0;
+  size_t japanese = 0;
+  size_t pos = start;
+  while (pos < end) {
+    const unsigned char lead = static_cast<unsigned char>(text[pos]);
+    if (lead < 0x80) {
+      if (std::isalnum(lead)) {
+        ++counted;
+      }
+      ++pos;
+      continue;
+    }
+
+    size_t length = (lead & 0xE0) == 0xC0   ? 2
+                    : (lead & 0xF0) == 0xE0 ? 3
+                    : (lead & 0xF8) == 0xF0 ? 4
+                                            : 1;
+    if (pos + length > end) {
+      break;
+    }
+    uint32_t cp = length == 2   ? lead & 0x1F
+                  : length == 3 ? lead & 0x0F
+                                : lead & 0x07;
+    for (size_t i = 1; i < length; ++i) {
+      cp = (cp << 6) | (static_cast<unsigned char>(text[pos + i]) & 0x3F);
+    }
+    pos += length;
+
+    ++counted;
+    if ((cp >= 0x3000 && cp <= 0x30FF) || // 記号・ひらがな・カタカナ
+        (cp >= 0x31F0 && cp <= 0x31FF) || // カタカナ拡張
+        (cp >= 0x3400 && cp <= 0x9FFF) || // 漢字
+        (cp >= 0xF900 && cp <= 0xFAFF) || // 互換漢字
+        (cp >= 0xFF00 && cp <= 0xFFEF) || // 全角英数・半角カナ
+        (cp >= 0x20000 && cp <= 0x2FFFF)) {
+      ++japanese;
+    }
+  }
+  return counted == 0 ? 0.0
+                      : static_cast<double>(japanese) /
+                            static_cast<double>(counted);
+}
+
 bool TextProcessor::isValidUtf8Sequence(const std::string &input, size_t pos,
                                         size_t seqLen) {
   if (pos + seqLen > input.size())
@@ -0,0 +1,157 @@
+#include "thread_pool.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+namespace MoZuku {
+namespace concurrency {
+
+WorkStealingPool::WorkStealingPool(size_t threads) {
+  if (threads == 0) {
+    unsigned int hardware = std::thread::hardware_concurrency();
+    threads = hardware > 1 ? hardware - 1 : 0;
+  }
+
+  for (size_t i = 0; i < threads + 1; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  workers_.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back([this, i]() { workerLoop(i); });
+  }
+
+  if (stats::debugEnabled()) {
+    std::cerr << "[DEBUG] WorkStealingPool started with " << threads
+              << " workers" << std::endl;
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    std::lock_guard<std::mutex> lock(wakeMutex_);
+    stopping_ = true;
+  }
+  wakeCv_.notify_all();
+  for (auto &worker : workers_) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+}
+
+void WorkStealingPool::parallelFor(size_t count,
+                                   const std::function<void(size_t)> &fn) {
+  if (count == 0) {
+    return;
+  }
+  if (workers_.empty() || count == 1) {
+    for (size_t i = 0; i < count; ++i) {
+      fn(i);
+    }
+    return;
+  }
+
+  auto batch = std::make_shared<Batch>();
+  batch->remaining = count;
+
+  // 取り出し側が先に減算しないよう、積む前に件数を加算しておく
+  {
+    std::lock_guard<std::mutex> lock(wakeMutex_);
+    queued_ += count;
+  }
+
+  // 連続した区間ごとに各キューへ配り、偏りは盗み合いでならす
+  const size_t queueCount = queues_.size();
+  const size_t chunk = (count + queueCount - 1) / queueCount;
+  for (size_t q = 0; q < queueCount; ++q) {
+    size_t begin = q * chunk;
+    size_t end = std::min(count, begin + chunk);
+    if (begin >= end) {
+      break;
+    }
+    std::lock_guard<std::mutex> lock(queues_[q]->mutex);
+    for (size_t i = begin; i < end; ++i) {
+      queues_[q]->tasks.push_back(Task{&fn, i, batch});
+    }
+  }
+  wakeCv_.notify_all();
+
+  // 呼び出しスレッドも自分の区間から処理し、終われば他から盗む
+  const size_t self = queueCount - 1;
+  Task task;
+  while (batch->remaining.load() > 0 &&
+         (popLocal(self, task) || steal(self, task))) {
+    runTask(task);
+  }
+
+  std::unique_lock<std::mutex> lock(batch->mutex);
+  batch->done.wait(lock, [&]() { return batch->remaining.load() == 0; });
+  if (batch->error) {
+    std::rethrow_exception(batch->error);
+  }
+}
+
+bool WorkStealingPool::popLocal(size_t queue, Task &task) {
+  Queue &q = *queues_[queue];
+  std::lock_guard<std::mutex> lock(q.mutex);
+  if (q.tasks.empty()) {
+    return false;
+  }
+  task = std::move(q.tasks.front());
+  q.tasks.pop_front();
+  --queued_;
+  return true;
+}
+
+bool WorkStealingPool::steal(size_t thief, Task &task) {
+  const size_t queueCount = queues_.size();
+  for (size_t offset = 1; offset < queueCount; ++offset) {
+    Queue &q = *queues_[(thief + offset) % queueCount];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty()) {
+      continue;
+    }
+    task = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    --queued_;
+    return true;
+  }
+  return false;
+}
+
+void WorkStealingPool::runTask(Task &task) {
+  std::shared_ptr<Batch> batch = std::move(task.batch);
+  try {
+    (*task.fn)(task.index);
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    if (!batch->error) {
+      batch->error = std::current_exception();
+    }
+  }
+
+  if (batch->remaining.fetch_sub(1) == 1) {
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    batch->done.notify_all();
+  }
+}
+
+void WorkStealingPool::workerLoop(size_t queue) {
+  while (true) {
+    Task task;
+    if (popLocal(queue, task) || steal(queue, task)) {
+      runTask(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(wakeMutex_);
+    wakeCv_.wait(lock, [&]() { return stopping_ || queued_.load() > 0; });
+    if (stopping_ && queued_.load() == 0) {
+      return;
+    }
+  }
+}
+
+} // namespace concurrency
+} // namespace MoZuku
@@ -0,0 +1,142 @@
+#include "token_store.hpp"
+#include "pos_analyzer.hpp"
+
+#include <mutex>
+
+namespace MoZuku {
+namespace tokens {
+
+namespace {
+
+const char *const kTokenTypeNames[kTokenTypeCount] = {
+    "noun",     "verb",   "adjective",   "adverb",
+    "particle", "aux",    "conjunction", "symbol",
+    "interj",   "prefix", "suffix",      "unknown"};
+
+// "助詞,格助詞,一般,..." -> "助詞,格助詞"
+std::string posKeyOf(const std::string &feature) {
+  size_t firstComma = feature.find(',');
+  if (firstComma == std::string::npos) {
+    return feature;
+  }
+  size_t secondComma = feature.find(',', firstComma + 1);
+  if (secondComma == std::string::npos) {
+    return feature.substr(0, firstComma);
+  }
+  return feature.substr(0, secondComma);
+}
+
+} // namespace
+
+const char *tokenTypeName(TokenType type) {
+  size_t index = static_cast<size_t>(type);
+  return index < kTokenTypeCount ? kTokenTypeNames[index] : "unknown";
+}
+
+TokenType tokenTypeFromName(const std::string &name) {
+  for (size_t i = 0; i < kTokenTypeCount; ++i) {
+    if (name == kTokenTypeNames[i]) {
+      return static_cast<TokenType>(i);
+    }
+  }
+  return TokenType::Unknown;
+}
+
+FeatureTable &FeatureTable::getInstance() {
+  static FeatureTable instance;
+  return instance;
+}
+
+const FeatureEntry *FeatureTable::intern(std::string_view feature) {
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = entries_.find(feature);
+    if (it != entries_.end()) {
+      return it->second.get();
+    }
+  }
+
+  // 初出の素性だけを分解して登録する
+  auto entry = std::make_unique<FeatureEntry>();
+  entry->feature.assign(feature.data(), feature.size());
+  pos::POSAnalyzer::parseFeatureEntry(*entry);
+
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  auto it = entries_.find(feature);
+  if (it != entries_.end()) {
+    return it->second.get();
+  }
+  auto keyIt = posKeys_
+                   .emplace(posKeyOf(entry->feature),
+                            static_cast<uint32_t>(posKeys_.size()))
+                   .first;
+  entry->posKey = keyIt->second;
+
+  const FeatureEntry *result = entry.get();
+  std::string_view key(result->feature);
+  entries_.emplace(key, std::move(entry));
+  return result;
+}
+
+size_t FeatureTable::size() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return entries_.size();
+}
+
+void TokenStore::reserve(size_t count) {
+  byteStart_.reserve(count);
+  byteLength_.reserve(count);
+  line_.reserve(count);
+  startChar_.reserve(count);
+  endChar_.reserve(count);
+  features_.reserve(count);
+  modifiers_.reserve(count);
+}
+
+void TokenStore::clear() {
+  byteStart_.clear();
+  byteLength_.clear();
+  line_.clear();
+  startChar_.clear();
+  endChar_.clear();
+  features_.clear();
+  modifiers_.clear();
+}
+
+size_t TokenStore::approximateBytes() const {
+  return byteStart_.capacity() * sizeof(uint32_t) +
+         byteLength_.capacity() * sizeof(uint32_t) +
+         line_.capacity() * sizeof(int32_t) +
+         startChar_.capacity() * sizeof(int32_t) +
+         endChar_.capacity() * sizeof(int32_t) +
+         features_.capacity() * sizeof(const FeatureEntry *) +
+         modifiers_.capacity() * sizeof(uint8_t);
+}
+
+void TokenStore::append(size_t byteStart, size_t byteLength, int line,
+                        int startChar, int endChar,
+                        const FeatureEntry *feature, unsigned modifiers) {
+  byteStart_.push_back(static_cast<uint32_t>(byteStart));
+  byteLength_.push_back(static_cast<uint32_t>(byteLength));
+  line_.push_back(line);
+  startChar_.push_back(startChar);
+  endChar_.push_back(endChar);
+  features_.push_back(feature);
+  modifiers_.push_back(static_cast<uint8_t>(modifiers));
+}
+
+void TokenStore::shift(int anchorLine, int charDelta, int lineDelta,
+                       std::ptrdiff_t byteDelta) {
+  for (size_t i = 0; i < byteStart_.size(); ++i) {
+    byteStart_[i] = static_cast<uint32_t>(
+        static_cast<std::ptrdiff_t>(byteStart_[i]) + byteDelta);
+    if (line_[i] == anchorLine) {
+      startChar_[i] += charDelta;
+      endChar_[i] += charDelta;
+    }
+    line_[i] += lineDelta;
+  }
+}
+
+} // namespace tokens
+} // namespace MoZuku
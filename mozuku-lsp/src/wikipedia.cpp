@@ -1,13 +1,30 @@
 #include "wikipedia.hpp"
+#include "stats.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <curl/curl.h>
+#include <fstream>
 #include <future>
+#include <iostream>
 #include <memory>
 #include <nlohmann/json.hpp>
+#include <optional>
 #include <string>
 #include <thread>
+#include <vector>
+
+namespace {
+
+// 同時に走らせる転送数と、1回に問い合わせる見出し語の上限
+// (exintro 付きの extracts は1回に20件まで返す)
+constexpr size_t kMaxTransfers = 2;
+constexpr size_t kMaxBatchTitles = 20;
+
+} // namespace
 
 std::string URLEncode(const std::string &value) {
   CURL *curl = curl_easy_init();
@@ -32,43 +49,93 @@ size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
   return totalSize;
 }
 
-struct AsyncRequest {
-  CURL *easy_handle;
+struct Transfer {
+  CURL *easy_handle{nullptr};
   std::string response_buffer;
-  std::promise<wikipedia::FetchResult> promise;
+  std::vector<std::string> titles;
+  std::chrono::steady_clock::time_point started{
+      std::chrono::steady_clock::now()};
 
-  AsyncRequest() : easy_handle(nullptr) {}
-  ~AsyncRequest() {
+  ~Transfer() {
     if (easy_handle) {
       curl_easy_cleanup(easy_handle);
     }
   }
 };
 
-std::string parseWikipediaResponse(const std::string &response) {
+// 応答本文を解釈できなかったときの内部用レスポンスコード
+constexpr long kParseErrorCode = -2;
+
+// titles の各見出し語に対応する要約を返す。正規化とリダイレクトを
+// たどってページを探し、見つからなければ空にする。本文が壊れていれば
+// nullopt を返す
+std::optional<std::vector<std::optional<std::string>>>
+parseWikipediaResponse(const std::string &response,
+                       const std::vector<std::string> &titles) {
+  std::vector<std::optional<std::string>> summaries(titles.size());
   try {
     nlohmann::json jsonResponse = nlohmann::json::parse(response);
-    if (jsonResponse.contains("query")) {
-      const auto &queryData = jsonResponse["query"];
-      if (queryData.contains("pages")) {
-        const auto &pages = queryData["pages"];
-        for (const auto &page : pages) {
-          if (page.contains("extract")) {
-            return page["extract"];
+    if (!jsonResponse.contains("query")) {
+      return summaries;
+    }
+    const auto &queryData = jsonResponse["query"];
+
+    auto collect = [&](const char *key) {
+      std::unordered_map<std::string, std::string> mapping;
+      if (queryData.contains(key)) {
+        for (const auto &item : queryData[key]) {
+          if (item.contains("from") && item.contains("to")) {
+            mapping[item["from"].get<std::string>()] =
+                item["to"].get<std::string>();
           }
         }
       }
+      return mapping;
+    };
+    const auto normalized = collect("normalized");
+    const auto redirects = collect("redirects");
+
+    std::unordered_map<std::string, std::string> extracts;
+    if (queryData.contains("pages")) {
+      for (const auto &page : queryData["pages"]) {
+        if (page.contains("title") && page.contains("extract")) {
+          extracts[page["title"].get<std::string>()] =
+              page["extract"].get<std::string>();
+        }
+      }
+    }
+
+    for (size_t i = 0; i < titles.size(); ++i) {
+      std::string title = titles[i];
+      auto normalizedIt = normalized.find(title);
+      if (normalizedIt != normalized.end()) {
+        title = normalizedIt->second;
+      }
+      auto redirectIt = redirects.find(title);
+      if (redirectIt != redirects.end()) {
+        title = redirectIt->second;
+      }
+      auto extractIt = extracts.find(title);
+      if (extractIt != extracts.end()) {
+        summaries[i] = extractIt->second;
+      }
     }
   } catch (const std::exception &e) {
-    return "Error parsing response: " + std::string(e.what());
+    if (MoZuku::stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Error parsing Wikipedia response: " << e.what()
+                << std::endl;
+    }
+    return std::nullopt;
   }
-  return "No summary available.";
+  return summaries;
 }
 
 std::string getErrorMessage(long response_code) {
   switch (response_code) {
   case -1:
     return "Network connection error";
+  case kParseErrorCode:
+    return "Invalid response";
   case 404:
     return "Page not found";
   case 403:
@@ -86,131 +153,262 @@ std::string getErrorMessage(long response_code) {
   }
 }
 
-std::future<wikipedia::FetchResult>
-performAsyncRequest(const std::string &url) {
-  auto request = std::make_shared<AsyncRequest>();
-  auto future = request->promise.get_future();
-
-  // 別スレッドで非同期リクエストを実行
-  std::thread([request, url]() {
-    CURLM *multi_handle = curl_multi_init();
-    if (!multi_handle) {
-      request->promise.set_value(
-          wikipedia::FetchResult(-1, "Failed to initialize curl multi handle"));
-      return;
-    }
+bool setupTransfer(Transfer &transfer) {
+  transfer.easy_handle = curl_easy_init();
+  if (!transfer.easy_handle) {
+    return false;
+  }
 
-    request->easy_handle = curl_easy_init();
-    if (!request->easy_handle) {
-      curl_multi_cleanup(multi_handle);
-      request->promise.set_value(
-          wikipedia::FetchResult(-1, "Failed to initialize curl easy handle"));
-      return;
+  std::string titles;
+  for (const auto &title : transfer.titles) {
+    if (!titles.empty()) {
+      titles += "%7C";
     }
+    titles += URLEncode(title);
+  }
+  std::string url = "https://ja.wikipedia.org/w/"
+                    "api.php?format=json&action=query&prop=extracts&exintro&"
+                    "explaintext&exlimit=max&redirects=1&titles=" +
+                    titles;
+
+  // cURLオプションの設定
+  CURL *easy = transfer.easy_handle;
+  curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, WriteCallback);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, &transfer.response_buffer);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT, 5L);
+  curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 3L);
+  curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(
+      easy, CURLOPT_USERAGENT,
+      "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/537.36 "
+      "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36");
+  return true;
+}
 
-    // cURLオプションの設定
-    curl_easy_setopt(request->easy_handle, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(request->easy_handle, CURLOPT_WRITEFUNCTION,
-                     WriteCallback);
-    curl_easy_setopt(request->easy_handle, CURLOPT_WRITEDATA,
-                     &request->response_buffer);
-    curl_easy_setopt(request->easy_handle, CURLOPT_TIMEOUT, 5L);
-    curl_easy_setopt(request->easy_handle, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(request->easy_handle, CURLOPT_CONNECTTIMEOUT, 3L);
-    curl_easy_setopt(
-        request->easy_handle, CURLOPT_USERAGENT,
-        "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/537.36 "
-        "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36");
-
-    curl_multi_add_handle(multi_handle, request->easy_handle);
+namespace wikipedia {
 
-    int still_running = 0;
-    do {
-      CURLMcode mc = curl_multi_perform(multi_handle, &still_running);
-      if (mc != CURLM_OK) {
-        request->promise.set_value(
-            wikipedia::FetchResult(-1, "curl_multi_perform failed"));
-        break;
-      }
+// WikipediaCache implementation
+namespace {
+
+constexpr size_t kCacheMaxBytes = 16 * 1024 * 1024;
+constexpr size_t kEntryOverhead = 96; // 1記録あたりのおおよその管理領域
+constexpr int64_t kHitTtl = 7 * 24 * 60 * 60;
+constexpr int64_t kNotFoundTtl = 24 * 60 * 60;
+constexpr int64_t kErrorTtl = 5 * 60;
+const char *const kStoreFileName = "wikipedia-cache.jsonl";
+
+int64_t nowSeconds() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
 
-      if (still_running) {
-        // 100msの短い待機
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      }
-    } while (still_running > 0);
-
-    // レスポンスコードをチェック
-    long response_code;
-    curl_easy_getinfo(request->easy_handle, CURLINFO_RESPONSE_CODE,
-                      &response_code);
-
-    // ネットワーク接続エラーやタイムアウトをチェック
-    CURLcode curl_code;
-    curl_code = curl_easy_getinfo(request->easy_handle, CURLINFO_RESPONSE_CODE,
-                                  &response_code);
-
-    // ネットワーク接続に関するエラーをチェック
-    if (response_code == 0) {
-      // レスポンスコードが0の場合はネットワーク接続エラーの可能性
-      response_code = -1;
-    }
+int64_t ttlFor(long response_code) {
+  if (response_code == 200) {
+    return kHitTtl;
+  }
+  if (response_code == 404) {
+    return kNotFoundTtl;
+  }
+  return kErrorTtl;
+}
 
-    curl_multi_remove_handle(multi_handle, request->easy_handle);
-    curl_multi_cleanup(multi_handle);
-
-    if (response_code == 200) {
-      std::string summary = parseWikipediaResponse(request->response_buffer);
-      request->promise.set_value(
-          wikipedia::FetchResult(response_code, summary));
-    } else if (response_code == -1) {
-      request->promise.set_value(
-          wikipedia::FetchResult(response_code, "Network connection error"));
-    } else {
-      std::string errorMsg = getErrorMessage(response_code);
-      request->promise.set_value(
-          wikipedia::FetchResult(response_code, errorMsg));
-    }
-  }).detach();
+bool isExpired(const CacheEntry &entry, int64_t now) {
+  return now - entry.fetched_at >= ttlFor(entry.response_code);
+}
 
-  return future;
+// 再起動後も使う価値があるのは成功と該当なしだけ
+bool isPersistent(long response_code) {
+  return response_code == 200 || response_code == 404;
 }
 
-namespace wikipedia {
+size_t entryBytes(const std::string &query, const CacheEntry &entry) {
+  return query.size() + entry.content.size() + kEntryOverhead;
+}
+
+} // namespace
 
-// WikipediaCache implementation
 WikipediaCache &WikipediaCache::getInstance() {
   static WikipediaCache instance;
   return instance;
 }
 
-std::unique_ptr<CacheEntry> WikipediaCache::getEntry(const std::string &query) {
-  std::lock_guard<std::mutex> lock(cache_mutex_);
-  auto it = cache_.find(query);
-  if (it != cache_.end()) {
-    return std::make_unique<CacheEntry>(it->second);
+WikipediaCache::Shard &WikipediaCache::shardFor(const std::string &query) {
+  return shards_[std::hash<std::string>{}(query) % kShardCount];
+}
+
+std::shared_ptr<const CacheEntry>
+WikipediaCache::getEntry(const std::string &query) {
+  Shard &shard = shardFor(query);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.index.find(query);
+  if (it == shard.index.end()) {
+    return nullptr;
+  }
+  if (isExpired(*it->second->second, nowSeconds())) {
+    shard.bytes -= entryBytes(query, *it->second->second);
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+    return nullptr;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  return it->second->second;
+}
+
+void WikipediaCache::insert(const std::string &query,
+                            std::shared_ptr<const CacheEntry> entry) {
+  Shard &shard = shardFor(query);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.index.find(query);
+  if (it != shard.index.end()) {
+    shard.bytes -= entryBytes(query, *it->second->second);
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+  }
+
+  shard.bytes += entryBytes(query, *entry);
+  shard.lru.emplace_front(query, std::move(entry));
+  shard.index.emplace(query, shard.lru.begin());
+
+  // 容量を超えたら最も使われていない記録から捨てる
+  const size_t limit = kCacheMaxBytes / kShardCount;
+  while (shard.bytes > limit && shard.lru.size() > 1) {
+    auto &victim = shard.lru.back();
+    shard.bytes -= entryBytes(victim.first, *victim.second);
+    shard.index.erase(victim.first);
+    shard.lru.pop_back();
   }
-  return nullptr;
 }
 
 void WikipediaCache::setEntry(const std::string &query, long response_code,
                               const std::string &content, bool is_error) {
-  std::lock_guard<std::mutex> lock(cache_mutex_);
-  cache_[query] = CacheEntry(response_code, content, is_error);
+  auto entry = std::make_shared<const CacheEntry>(response_code, content,
+                                                  is_error, nowSeconds());
+  if (isPersistent(response_code)) {
+    appendToStore(query, *entry);
+  }
+  insert(query, std::move(entry));
 }
 
 void WikipediaCache::clear() {
-  std::lock_guard<std::mutex> lock(cache_mutex_);
-  cache_.clear();
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.lru.clear();
+    shard.index.clear();
+    shard.bytes = 0;
+  }
 }
 
 size_t WikipediaCache::size() const {
-  std::lock_guard<std::mutex> lock(cache_mutex_);
-  return cache_.size();
+  size_t total = 0;
+  for (const auto &shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    total += shard.index.size();
+  }
+  return total;
+}
+
+bool WikipediaCache::openStore(const std::string &directory) {
+  if (directory.empty()) {
+    return false;
+  }
+  const std::string path = directory + "/" + kStoreFileName;
+
+  // 1行1記録の JSON。同じ見出し語は後の行が優先する
+  std::unordered_map<std::string, CacheEntry> loaded;
+  size_t lines = 0;
+  {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+      ++lines;
+      try {
+        nlohmann::json record = nlohmann::json::parse(line);
+        const long code = record.at("code").get<long>();
+        loaded[record.at("query").get<std::string>()] =
+            CacheEntry(code, record.at("content").get<std::string>(),
+                       code != 200, record.at("time").get<int64_t>());
+      } catch (const std::exception &) {
+        // 書きかけの行などは読み飛ばす
+      }
+    }
+  }
+
+  const int64_t now = nowSeconds();
+  std::vector<std::pair<std::string, CacheEntry>> live;
+  live.reserve(loaded.size());
+  for (auto &item : loaded) {
+    if (!isExpired(item.second, now)) {
+      live.emplace_back(item.first, std::move(item.second));
+    }
+  }
+  // 古い順に入れて、新しい記録ほど LRU の先頭に来るようにする
+  std::sort(live.begin(), live.end(), [](const auto &a, const auto &b) {
+    return a.second.fetched_at < b.second.fetched_at;
+  });
+  for (const auto &item : live) {
+    insert(item.first, std::make_shared<const CacheEntry>(item.second));
+  }
+
+  std::lock_guard<std::mutex> lock(store_mutex_);
+  if (store_.is_open()) {
+    store_.close();
+  }
+  // 無効な行が生きている記録より多くなったら書き直して詰める
+  if (lines > 2 * live.size() + 64) {
+    const std::string temporary = path + ".tmp";
+    {
+      std::ofstream out(temporary, std::ios::trunc);
+      for (const auto &item : live) {
+        out << nlohmann::json{{"query", item.first},
+                              {"code", item.second.response_code},
+                              {"time", item.second.fetched_at},
+                              {"content", item.second.content}}
+                   .dump()
+            << '\n';
+      }
+    }
+    std::rename(temporary.c_str(), path.c_str());
+  }
+  store_.open(path, std::ios::app);
+  if (MoZuku::stats::debugEnabled()) {
+    std::cerr << "[DEBUG] Wikipedia cache store: " << path << ", "
+              << live.size() << " entries" << std::endl;
+  }
+  return store_.is_open();
+}
+
+void WikipediaCache::appendToStore(const std::string &query,
+                                   const CacheEntry &entry) {
+  std::lock_guard<std::mutex> lock(store_mutex_);
+  if (!store_.is_open()) {
+    return;
+  }
+  try {
+    store_ << nlohmann::json{{"query", query},
+                             {"code", entry.response_code},
+                             {"time", entry.fetched_at},
+                             {"content", entry.content}}
+                  .dump()
+           << '\n';
+    store_.flush();
+  } catch (const std::exception &e) {
+    // 不正な UTF-8 などで書けない記録はメモリ上にだけ残す
+    if (MoZuku::stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Wikipedia cache store write failed: " << e.what()
+                << std::endl;
+    }
+  }
 }
 
 std::string getJapaneseErrorMessage(long response_code) {
   switch (response_code) {
   case -1:
+  case kParseErrorCode:
     return "Wikipediaからのサマリ取得に失敗しました";
   case 404:
     return "該当するサマリは存在しません";
@@ -229,36 +427,220 @@ std::string getJapaneseErrorMessage(long response_code) {
   }
 }
 
-std::future<FetchResult> fetchSummary(const std::string &query) {
-  auto &cache = WikipediaCache::getInstance();
-  auto cached_entry = cache.getEntry(query);
+WikipediaFetcher &WikipediaFetcher::getInstance() {
+  static WikipediaFetcher instance;
+  return instance;
+}
+
+WikipediaFetcher::~WikipediaFetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  if (multi_) {
+    curl_multi_wakeup(multi_);
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  if (multi_) {
+    curl_multi_cleanup(multi_);
+  }
+  for (auto &entry : inFlight_) {
+    entry.second.promise.set_value(
+        FetchResult(-1, "Network connection error"));
+  }
+}
+
+bool WikipediaFetcher::ensureStarted() {
+  if (multi_) {
+    return true;
+  }
+  multi_ = curl_multi_init();
+  if (!multi_) {
+    return false;
+  }
+  // 同じホストへの接続は multi ハンドルが保持して使い回す
+  curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    static_cast<long>(kMaxTransfers));
+  thread_ = std::thread(&WikipediaFetcher::run, this);
+  return true;
+}
 
-  if (cached_entry) {
+std::shared_future<FetchResult>
+WikipediaFetcher::fetch(const std::string &query) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = inFlight_.find(query);
+  if (it != inFlight_.end()) {
+    MoZuku::stats::count("wikipedia.inFlightJoins");
+    return it->second.future;
+  }
+
+  // 転送中の登録はキャッシュへの書き込みの後に消すので、ここで見れば取りこぼさない
+  if (auto cached = WikipediaCache::getInstance().getEntry(query)) {
+    MoZuku::stats::count("wikipedia.cacheHits");
+    std::promise<FetchResult> promise;
+    promise.set_value(FetchResult(cached->response_code, cached->content));
+    return promise.get_future().share();
+  }
+
+  if (!ensureStarted()) {
     std::promise<FetchResult> promise;
-    auto future = promise.get_future();
     promise.set_value(
-        FetchResult(cached_entry->response_code, cached_entry->content));
-    return future;
+        FetchResult(-1, "Failed to initialize curl multi handle"));
+    return promise.get_future().share();
   }
 
-  std::string encodedQuery = URLEncode(query);
-  std::string url = "https://ja.wikipedia.org/w/"
-                    "api.php?format=json&action=query&prop=extracts&exintro&"
-                    "explaintext&redirects=1&titles=" +
-                    encodedQuery;
+  MoZuku::stats::count("wikipedia.cacheMisses");
+  InFlight &entry = inFlight_[query];
+  entry.future = entry.promise.get_future().share();
+  auto future = entry.future;
+  pending_.push_back(query);
+  lock.unlock();
+
+  curl_multi_wakeup(multi_);
+  return future;
+}
+
+void WikipediaFetcher::run() {
+  std::unordered_map<CURL *, std::unique_ptr<Transfer>> active;
+
+  while (true) {
+    std::vector<std::unique_ptr<Transfer>> failed;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stop_) {
+        break;
+      }
+      // 空いている転送枠に、待っている見出し語をまとめて載せる
+      while (active.size() < kMaxTransfers && !pending_.empty()) {
+        auto transfer = std::make_unique<Transfer>();
+        while (!pending_.empty() &&
+               transfer->titles.size() < kMaxBatchTitles) {
+          transfer->titles.push_back(std::move(pending_.front()));
+          pending_.pop_front();
+        }
+        if (!setupTransfer(*transfer)) {
+          failed.push_back(std::move(transfer));
+          continue;
+        }
+        curl_multi_add_handle(multi_, transfer->easy_handle);
+        CURL *easy = transfer->easy_handle;
+        active.emplace(easy, std::move(transfer));
+      }
+    }
+    for (const auto &transfer : failed) {
+      complete(transfer->titles, -1, "");
+    }
+
+    int still_running = 0;
+    CURLMcode mc = curl_multi_perform(multi_, &still_running);
+
+    int queued = 0;
+    while (CURLMsg *message = curl_multi_info_read(multi_, &queued)) {
+      if (message->msg != CURLMSG_DONE) {
+        continue;
+      }
+      auto it = active.find(message->easy_handle);
+      if (it == active.end()) {
+        continue;
+      }
+
+      long response_code = 0;
+      if (message->data.result == CURLE_OK) {
+        curl_easy_getinfo(message->easy_handle, CURLINFO_RESPONSE_CODE,
+                          &response_code);
+      }
+      // レスポンスコードが0の場合はネットワーク接続エラー
+      if (response_code == 0) {
+        response_code = -1;
+      }
+
+      curl_multi_remove_handle(multi_, message->easy_handle);
+      std::unique_ptr<Transfer> transfer = std::move(it->second);
+      active.erase(it);
+      if (MoZuku::stats::enabled()) {
+        MoZuku::stats::record("wikipedia.transfer", transfer->started,
+                              std::chrono::steady_clock::now());
+      }
+      complete(transfer->titles, response_code, transfer->response_buffer);
+    }
+
+    if (mc != CURLM_OK) {
+      // multi ハンドルが壊れたら転送中のものをすべて失敗にする
+      for (auto &entry : active) {
+        curl_multi_remove_handle(multi_, entry.first);
+        complete(entry.second->titles, -1, "");
+      }
+      active.clear();
+    }
+
+    // 転送の進行か curl_multi_wakeup まで待つ
+    curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+  }
 
-  auto future = performAsyncRequest(url);
+  for (auto &entry : active) {
+    curl_multi_remove_handle(multi_, entry.first);
+  }
+}
 
-  return std::async(
-      std::launch::async, [query, future = std::move(future)]() mutable {
-        auto result = future.get();
+void WikipediaFetcher::complete(const std::vector<std::string> &titles,
+                                long response_code, const std::string &body) {
+  std::vector<long> codes(titles.size(), response_code);
+  std::vector<std::string> contents;
+  std::optional<std::vector<std::optional<std::string>>> summaries;
+  if (response_code == 200) {
+    MoZuku::stats::ScopedTimer timer("wikipedia.parse");
+    summaries = parseWikipediaResponse(body, titles);
+    if (!summaries) {
+      // 解釈できない本文は通信失敗と同じく短い期限で捨て、保存もしない
+      response_code = kParseErrorCode;
+      codes.assign(titles.size(), response_code);
+    }
+  }
+
+  if (summaries) {
+    // ページが存在しない見出し語は該当なし (404) として期限を短くする
+    contents.reserve(titles.size());
+    for (size_t i = 0; i < titles.size(); ++i) {
+      if ((*summaries)[i]) {
+        contents.push_back(std::move(*(*summaries)[i]));
+      } else {
+        codes[i] = 404;
+        contents.push_back(getErrorMessage(404));
+      }
+    }
+  } else {
+    contents.assign(titles.size(), response_code == -1
+                                       ? "Network connection error"
+                                       : getErrorMessage(response_code));
+  }
 
-        auto &cache = WikipediaCache::getInstance();
-        bool is_error = (result.response_code != 200);
-        cache.setEntry(query, result.response_code, result.content, is_error);
+  auto &cache = WikipediaCache::getInstance();
+  for (size_t i = 0; i < titles.size(); ++i) {
+    cache.setEntry(titles[i], codes[i], contents[i], codes[i] != 200);
+    if (MoZuku::stats::debugEnabled()) {
+      std::cerr << "[DEBUG] Wikipedia取得完了: " << titles[i]
+                << ", ステータス: " << codes[i] << std::endl;
+    }
+
+    std::promise<FetchResult> promise;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = inFlight_.find(titles[i]);
+      if (it == inFlight_.end()) {
+        continue;
+      }
+      promise = std::move(it->second.promise);
+      inFlight_.erase(it);
+    }
+    promise.set_value(FetchResult(codes[i], contents[i]));
+  }
+}
 
-        return result;
-      });
+std::shared_future<FetchResult> fetchSummary(const std::string &query) {
+  return WikipediaFetcher::getInstance().fetch(query);
 }
 
 } // namespace wikipedia
@@ -9,32 +9,39 @@ import {
   State,
 } from 'vscode-languageclient/node';
 
-type CommentHighlightMessage = {
+// mozuku/commentHighlights, contentHighlights, semanticHighlights の共通形式。
+// 範囲は (行, 開始列, 行数, 終了列)、トークンは (行, 開始列, 長さ, 種別, 修飾子)
+// の組を、セマンティックトークンと同じく行と開始列を直前からの差にして並べる
+type HighlightMessage = {
   uri: string;
-  ranges: Array<{
-    start: { line: number; character: number };
-    end: { line: number; character: number };
-  }>;
+  version: number;
+  // 全体を送り直すとき
+  data?: number[];
+  // base の版からの差分のとき
+  base?: number;
+  removed?: number[];
+  inserted?: number[];
 };
 
-type ContentHighlightMessage = {
-  uri: string;
-  ranges: Array<{
-    start: { line: number; character: number };
-    end: { line: number; character: number };
-  }>;
+type HighlightState = {
+  version: number;
+  tuples: number[][];
 };
 
-type SemanticHighlightMessage = {
-  uri: string;
-  tokens: Array<{
-    range: {
-      start: { line: number; character: number };
-      end: { line: number; character: number };
-    };
-    type: string;
-    modifiers: number;
-  }>;
+const rangeStride = 4;
+const tokenStride = 5;
+
+const decodeHighlights = (data: number[], stride: number): number[][] => {
+  const tuples: number[][] = [];
+  let line = 0;
+  let character = 0;
+  for (let i = 0; i + stride <= data.length; i += stride) {
+    const deltaLine = data[i];
+    line += deltaLine;
+    character = deltaLine === 0 ? character + data[i + 1] : data[i + 1];
+    tuples.push([line, character, ...data.slice(i + 2, i + stride)]);
+  }
+  return tuples;
 };
 
 const supportedLanguages = [
@@ -82,16 +89,30 @@ export async function startClient(
   };
 
   const config = vscode.workspace.getConfiguration('mozuku');
+  // MeCab の検出結果と Wikipedia サマリの永続キャッシュ置き場
+  const cacheDir = ctx.globalStorageUri.fsPath;
+  try {
+    fs.mkdirSync(cacheDir, { recursive: true });
+  } catch (e) {
+    console.error('[MoZuku] キャッシュディレクトリを作成できません:', e);
+  }
   const initOptions = {
     mozuku: {
       mecab: {
         dicdir: config.get<string>('mecab.dicdir', ''),
         charset: config.get<string>('mecab.charset', 'UTF-8')
       },
+      cacheDir,
       analysis: {
         enableCaboCha: config.get<boolean>('analysis.enableCaboCha', true),
         grammarCheck: config.get<boolean>('analysis.grammarCheck', true),
         minJapaneseRatio: config.get<number>('analysis.minJapaneseRatio', 0.1),
+        debounceMs: config.get<number>('analysis.debounceMs', 200),
+        workerThreads: config.get<number>('analysis.workerThreads', 0),
+        memoryBudgetMB: config.get<number>('analysis.memoryBudgetMB', 256),
+        sentenceCacheMB: config.get<number>('analysis.sentenceCacheMB', 64),
+        persistSentenceCache: config.get<boolean>('analysis.persistSentenceCache', true),
+        workspaceDiagnostics: config.get<boolean>('analysis.workspaceDiagnostics', false),
         warningMinSeverity: config.get<number>('analysis.warningMinSeverity', 2),
         warnings: {
           particleDuplicate: config.get<boolean>('analysis.warnings.particleDuplicate', true),
@@ -114,6 +135,14 @@ export async function startClient(
           adjacentParticlesMaxRepeat: config.get<number>('analysis.rules.adjacentParticlesMaxRepeat', 1),
           conjunctionRepeatMax: config.get<number>('analysis.rules.conjunctionRepeatMax', 1),
         }
+      },
+      stats: {
+        enabled: config.get<boolean>('stats.enabled', false),
+        traceFile: config.get<string>('stats.traceFile', '')
+      },
+      // ハイライトは版付きの差分で受け取る
+      highlights: {
+        delta: true
       }
     }
   };
@@ -147,6 +176,56 @@ export async function startClient(
   const semanticHighlights = new Map<string, Map<string, vscode.Range[]>>();
   const commentHighlights = new Map<string, vscode.Range[]>();
   const contentHighlights = new Map<string, vscode.Range[]>();
+  // 通知ごとに、文書ごとの受け取り済みの版と組
+  const highlightStates = {
+    comment: new Map<string, HighlightState>(),
+    content: new Map<string, HighlightState>(),
+    semantic: new Map<string, HighlightState>(),
+  };
+
+  // 差分を当てて現在の組を返す。版が合わなければ全体を取り直す
+  const applyHighlightMessage = (
+    states: Map<string, HighlightState>,
+    payload: HighlightMessage,
+    stride: number
+  ): number[][] | undefined => {
+    const { uri } = payload;
+    const state = states.get(uri) ?? { version: 0, tuples: [] };
+    if (payload.data) {
+      state.tuples = decodeHighlights(payload.data, stride);
+    } else {
+      if (payload.base !== state.version) {
+        console.warn('[MoZuku] ハイライトの版が一致しないため取り直します:', uri);
+        states.delete(uri);
+        void client.sendNotification('mozuku/highlightsResync', { uri });
+        return undefined;
+      }
+      const removed = new Map<string, number>();
+      for (const tuple of decodeHighlights(payload.removed ?? [], stride)) {
+        const key = tuple.join(',');
+        removed.set(key, (removed.get(key) ?? 0) + 1);
+      }
+      state.tuples = state.tuples.filter((tuple) => {
+        const key = tuple.join(',');
+        const count = removed.get(key) ?? 0;
+        if (count > 0) {
+          removed.set(key, count - 1);
+          return false;
+        }
+        return true;
+      });
+      for (const tuple of decodeHighlights(payload.inserted ?? [], stride)) {
+        state.tuples.push(tuple);
+      }
+    }
+    state.version = payload.version;
+    states.set(uri, state);
+    return state.tuples;
+  };
+
+  const toRanges = (tuples: number[][]) =>
+    tuples.map(([line, character, lineSpan, endCharacter]) =>
+      new vscode.Range(line, character, line + lineSpan, endCharacter));
 
   const semanticColors: Record<string, string> = {
     noun: '#c8c8c8',
@@ -240,57 +319,57 @@ export async function startClient(
     }
   });
 
-  client.onNotification('mozuku/commentHighlights', (payload: CommentHighlightMessage) => {
-    const { uri, ranges = [] } = payload;
-    const vsRanges = ranges.map((r) => {
-      const start = new vscode.Position(r.start.line, r.start.character);
-      const end = new vscode.Position(r.end.line, r.end.character);
-      return new vscode.Range(start, end);
-    });
-    if (vsRanges.length === 0) {
+  client.onNotification('mozuku/commentHighlights', (payload: HighlightMessage) => {
+    const tuples = applyHighlightMessage(highlightStates.comment, payload, rangeStride);
+    if (!tuples) {
+      return;
+    }
+    const { uri } = payload;
+    if (tuples.length === 0) {
       commentHighlights.delete(uri);
     } else {
-      commentHighlights.set(uri, vsRanges);
+      commentHighlights.set(uri, toRanges(tuples));
     }
     applyDecorationsForUri(uri);
   });
 
-  client.onNotification('mozuku/contentHighlights', (payload: ContentHighlightMessage) => {
-    const { uri, ranges = [] } = payload;
-    const vsRanges = ranges.map((r) => {
-      const start = new vscode.Position(r.start.line, r.start.character);
-      const end = new vscode.Position(r.end.line, r.end.character);
-      return new vscode.Range(start, end);
-    });
-    if (vsRanges.length === 0) {
+  client.onNotification('mozuku/contentHighlights', (payload: HighlightMessage) => {
+    const tuples = applyHighlightMessage(highlightStates.content, payload, rangeStride);
+    if (!tuples) {
+      return;
+    }
+    const { uri } = payload;
+    if (tuples.length === 0) {
       contentHighlights.delete(uri);
     } else {
-      contentHighlights.set(uri, vsRanges);
+      contentHighlights.set(uri, toRanges(tuples));
     }
     applyDecorationsForUri(uri);
   });
 
-  client.onNotification('mozuku/semanticHighlights', (payload: SemanticHighlightMessage) => {
-    const { uri, tokens = [] } = payload;
-    if (tokens.length === 0) {
+  client.onNotification('mozuku/semanticHighlights', (payload: HighlightMessage) => {
+    const tuples = applyHighlightMessage(highlightStates.semantic, payload, tokenStride);
+    if (!tuples) {
+      return;
+    }
+    const { uri } = payload;
+    if (tuples.length === 0) {
       semanticHighlights.delete(uri);
       applyDecorationsForUri(uri);
       return;
     }
 
+    // 種別はセマンティックトークンの凡例の番号で届く
+    const tokenTypes =
+      client.initializeResult?.capabilities.semanticTokensProvider?.legend.tokenTypes ?? [];
     const perType = new Map<string, vscode.Range[]>();
-    for (const token of tokens) {
-      const start = new vscode.Position(token.range.start.line, token.range.start.character);
-      const end = new vscode.Position(token.range.end.line, token.range.end.character);
-      const range = new vscode.Range(start, end);
-
-      const decoration = getSemanticDecorationType(token.type);
-      if (!perType.has(token.type)) {
-        perType.set(token.type, []);
+    for (const [line, character, length, typeIndex] of tuples) {
+      const tokenType = tokenTypes[typeIndex] ?? 'unknown';
+      const range = new vscode.Range(line, character, line, character + length);
+      if (!perType.has(tokenType)) {
+        perType.set(tokenType, []);
       }
-      perType.get(token.type)!.push(range);
-
-      void decoration;
+      perType.get(tokenType)!.push(range);
     }
 
     semanticHighlights.set(uri, perType);
@@ -341,6 +420,10 @@ export async function startClient(
       semanticHighlights.delete(uri);
       commentHighlights.delete(uri);
       contentHighlights.delete(uri);
+      // サーバーも閉じた文書の版を忘れる
+      for (const states of Object.values(highlightStates)) {
+        states.delete(uri);
+      }
       applyDecorationsForUri(uri);
     });
 